@@ -48,11 +48,15 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Number of +CRSM commands sent on a single command line */
+#define CRSM_MAX_BATCH 8
+
 struct sim_data {
 	GAtChat *chat;
 	unsigned int vendor;
 	guint passwd_type_mask;
 	struct at_util_sim_state_query *sim_state_query;
+	gboolean crsm_no_batch;
 };
 
 static const char *crsm_prefix[] = { "+CRSM:", NULL };
@@ -313,6 +317,102 @@ static void at_sim_read_record(struct ofono_sim *sim, int fileid,
 	CALLBACK_WITH_FAILURE(cb, NULL, 0, data);
 }
 
+static void at_crsm_read_multi_cb(gboolean ok, GAtResult *result,
+					gpointer user_data)
+{
+	struct cb_data *cbd = user_data;
+	struct sim_data *sd = cbd->user;
+	GAtResultIter iter;
+	ofono_sim_read_cb_t cb = cbd->cb;
+	struct ofono_error error;
+	GByteArray *records;
+	const guint8 *response;
+	gint sw1, sw2, len;
+
+	decode_at_error(&error, g_at_result_final_response(result));
+
+	g_at_result_iter_init(&iter, result);
+
+	if (!ok) {
+		/*
+		 * Any error before the first response, be it a plain ERROR
+		 * or a +CME ERROR, means the modem might not take several
+		 * commands on a line.  If some records were read, only a
+		 * later one failed.
+		 */
+		if (!g_at_result_iter_next(&iter, "+CRSM:"))
+			sd->crsm_no_batch = TRUE;
+
+		cb(&error, NULL, 0, cbd->data);
+		return;
+	}
+
+	records = g_byte_array_new();
+
+	while (g_at_result_iter_next(&iter, "+CRSM:")) {
+		g_at_result_iter_next_number(&iter, &sw1);
+		g_at_result_iter_next_number(&iter, &sw2);
+
+		if ((sw1 != 0x90 && sw1 != 0x91 && sw1 != 0x92 &&
+				sw1 != 0x9f) || (sw1 == 0x90 && sw2 != 0x00))
+			break;
+
+		if (!g_at_result_iter_next_hexstring(&iter, &response, &len))
+			break;
+
+		g_byte_array_append(records, response, len);
+	}
+
+	DBG("crsm_read_multi_cb: %u bytes", records->len);
+
+	if (records->len == 0)
+		CALLBACK_WITH_FAILURE(cb, NULL, 0, cbd->data);
+	else
+		cb(&error, records->data, records->len, cbd->data);
+
+	g_byte_array_free(records, TRUE);
+}
+
+static void at_sim_read_records(struct ofono_sim *sim, int fileid,
+				int record, int count, int length,
+				const unsigned char *path,
+				unsigned int path_len,
+				ofono_sim_read_cb_t cb, void *data)
+{
+	struct sim_data *sd = ofono_sim_get_data(sim);
+	struct cb_data *cbd = cb_data_new(cb, data);
+	char buf[CRSM_MAX_BATCH * 64];
+	unsigned int len = 0;
+	int i;
+
+	if (sd->crsm_no_batch)
+		count = 1;
+
+	count = MIN(count, CRSM_MAX_BATCH);
+
+	/* Read the records with one command line, as in AT+CRSM=..;+CRSM=.. */
+	for (i = 0; i < count; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"%s+CRSM=178,%i,%i,4,%i", i ? ";" : "AT",
+				fileid, record + i, length);
+
+		append_file_path(buf + len, path, path_len);
+		len += strlen(buf + len);
+	}
+
+	cbd->user = sd;
+
+	if (g_at_chat_send(sd->chat, buf, crsm_prefix,
+				count > 1 ? at_crsm_read_multi_cb :
+						at_crsm_read_cb,
+				cbd, g_free) > 0)
+		return;
+
+	g_free(cbd);
+
+	CALLBACK_WITH_FAILURE(cb, NULL, 0, data);
+}
+
 static void at_crsm_update_cb(gboolean ok, GAtResult *result,
 				gpointer user_data)
 {
@@ -1916,6 +2016,7 @@ static struct ofono_sim_driver driver = {
 	.read_file_info		= at_sim_read_info,
 	.read_file_transparent	= at_sim_read_binary,
 	.read_file_linear	= at_sim_read_record,
+	.read_file_linear_multi	= at_sim_read_records,
 	.read_file_cyclic	= at_sim_read_record,
 	.write_file_transparent	= at_sim_update_binary,
 	.write_file_linear	= at_sim_update_record,
@@ -102,11 +102,30 @@ static const char *setup_rawip(struct ofono_gprs_context *gc)
 	if (getenv("OFONO_IP_DEBUG"))
 		g_at_rawip_set_debug(gcd->rawip, rawip_debug, "IP");
 
+	g_at_rawip_set_batched(gcd->rawip, TRUE);
 	g_at_rawip_open(gcd->rawip);
 
 	return g_at_rawip_get_interface(gcd->rawip);
 }
 
+static void release_rawip(struct gprs_context_data *gcd)
+{
+	GAtRawIPCounters uplink, downlink;
+
+	if (g_at_rawip_get_counters(gcd->rawip, &uplink, &downlink)) {
+		DBG("uplink: %" G_GUINT64_FORMAT " packets, %" G_GUINT64_FORMAT
+			" bytes, %" G_GUINT64_FORMAT " wakeups",
+			uplink.packets, uplink.bytes, uplink.wakeups);
+		DBG("downlink: %" G_GUINT64_FORMAT " packets, %"
+			G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+			" wakeups", downlink.packets, downlink.bytes,
+			downlink.wakeups);
+	}
+
+	g_at_rawip_unref(gcd->rawip);
+	gcd->rawip = NULL;
+}
+
 static void failed_setup(struct ofono_gprs_context *gc,
 				GAtResult *result, gboolean deactivate)
 {
@@ -505,8 +524,7 @@ static void deactivate_cb(gboolean ok, GAtResult *result, gpointer user_data)
 
 	DBG("ok %d", ok);
 
-	g_at_rawip_unref(gcd->rawip);
-	gcd->rawip = NULL;
+	release_rawip(gcd);
 
 	gcd->active_context = 0;
 	gcd->state = STATE_IDLE;
@@ -588,8 +606,7 @@ static void cgev_notify(GAtResult *result, gpointer user_data)
 	if (gcd->state != STATE_IDLE && gcd->rawip) {
 		g_at_rawip_shutdown(gcd->rawip);
 
-		g_at_rawip_unref(gcd->rawip);
-		gcd->rawip = NULL;
+		release_rawip(gcd);
 		g_at_chat_resume(gcd->chat);
 	}
 
@@ -642,7 +659,7 @@ static void ifx_gprs_context_remove(struct ofono_gprs_context *gc)
 	DBG("");
 
 	if (gcd->state != STATE_IDLE && gcd->rawip) {
-		g_at_rawip_unref(gcd->rawip);
+		release_rawip(gcd);
 		g_at_chat_resume(gcd->chat);
 	}
 
@@ -317,6 +317,126 @@ error:
 	g_free(cbd);
 }
 
+struct read_records_data {
+	ofono_sim_read_cb_t cb;
+	void *data;
+	uint16_t length;
+	uint16_t count;
+};
+
+/*
+ * The first record comes in TLV 0x11, the others back to back in TLV 0x12
+ * after their total length.  Anything that does not add up to whole
+ * records of the requested length fails the request, which makes the core
+ * read the records one at a time instead.
+ */
+static void read_records_cb(struct qmi_result *result, void *user_data)
+{
+	struct read_records_data *rd = user_data;
+	const unsigned char *content;
+	const unsigned char *additional;
+	unsigned char *records;
+	uint16_t len;
+	uint16_t total;
+
+	DBG("");
+
+	if (qmi_result_set_error(result, NULL))
+		goto error;
+
+	content = qmi_result_get(result, 0x11, &len);
+	if (!content || len != rd->length + 2)
+		goto error;
+
+	additional = qmi_result_get(result, 0x12, &len);
+	if (!additional) {
+		CALLBACK_WITH_SUCCESS(rd->cb, content + 2, rd->length,
+					rd->data);
+		return;
+	}
+
+	if (len < 2)
+		goto error;
+
+	total = additional[0] | (additional[1] << 8);
+
+	if (total != len - 2 || total % rd->length ||
+			total / rd->length > rd->count - 1u)
+		goto error;
+
+	records = g_malloc(rd->length + total);
+	memcpy(records, content + 2, rd->length);
+	memcpy(records + rd->length, additional + 2, total);
+
+	CALLBACK_WITH_SUCCESS(rd->cb, records, rd->length + total, rd->data);
+
+	g_free(records);
+	return;
+
+error:
+	CALLBACK_WITH_FAILURE(rd->cb, NULL, 0, rd->data);
+}
+
+static void qmi_read_records(struct ofono_sim *sim,
+				int fileid, int record, int count, int length,
+				const unsigned char *path,
+				unsigned int path_len,
+				ofono_sim_read_cb_t cb, void *user_data)
+{
+	struct sim_data *data = ofono_sim_get_data(sim);
+	struct read_records_data *rd;
+	unsigned char aid_data[2] = { 0x00, 0x00 };
+	unsigned char read_data[4];
+	unsigned char last_data[2];
+	unsigned char fileid_data[9];
+	int fileid_len;
+	int last = record + count - 1;
+	struct qmi_param *param;
+
+	DBG("file id 0x%04x records %d-%d", fileid, record, last);
+
+	if (length <= 0 || count <= 0)
+		goto error;
+
+	fileid_len = create_fileid_data(data->app_type, fileid,
+						path, path_len, fileid_data);
+	if (fileid_len < 0)
+		goto error;
+
+	read_data[0] = record & 0xff;
+	read_data[1] = (record & 0xff00) >> 8;
+	read_data[2] = length & 0xff;
+	read_data[3] = (length & 0xff00) >> 8;
+
+	last_data[0] = last & 0xff;
+	last_data[1] = (last & 0xff00) >> 8;
+
+	param = qmi_param_new();
+	if (!param)
+		goto error;
+
+	qmi_param_append(param, 0x01, sizeof(aid_data), aid_data);
+	qmi_param_append(param, 0x02, fileid_len, fileid_data);
+	qmi_param_append(param, 0x03, sizeof(read_data), read_data);
+	qmi_param_append(param, 0x10, sizeof(last_data), last_data);
+
+	rd = g_new0(struct read_records_data, 1);
+	rd->cb = cb;
+	rd->data = user_data;
+	rd->length = length;
+	rd->count = count;
+
+	if (qmi_service_send(data->uim, QMI_UIM_READ_RECORD, param,
+					read_records_cb, rd, g_free) > 0)
+		return;
+
+	g_free(rd);
+	qmi_param_free(param);
+
+error:
+	CALLBACK_WITH_FAILURE(cb, NULL, 0, user_data);
+}
+
 static void write_generic_cb(struct qmi_result *result, void *user_data)
 {
 	struct cb_data *cbd = user_data;
@@ -783,6 +903,8 @@ static void get_card_status_cb(struct qmi_result *result, void *user_data)
 		data->app_type = sim_stat.app_type;
 	}
 
+	/* Every UIM request is a transaction of its own */
+	ofono_sim_set_max_pending_reads(sim, 4);
 	ofono_sim_register(sim);
 
 	switch (sim_stat.card_state) {
@@ -918,6 +1040,7 @@ static struct ofono_sim_driver driver = {
 	.read_file_info		= qmi_read_attributes,
 	.read_file_transparent	= qmi_read_transparent,
 	.read_file_linear	= qmi_read_record,
+	.read_file_linear_multi	= qmi_read_records,
 	.read_file_cyclic	= qmi_read_record,
 	.write_file_transparent = qmi_write_transparent,
 	.write_file_linear	= qmi_write_linear,
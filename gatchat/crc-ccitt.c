@@ -59,3 +59,50 @@ const guint16 crc_ccitt_table[256] = {
 	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
 	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
 };
+
+/*
+ * crc_ccitt_slice[k - 1][c] is the CRC of byte c followed by k zero bytes,
+ * built from crc_ccitt_table on first use
+ */
+static guint16 crc_ccitt_slice[7][256];
+static gboolean crc_ccitt_slice_ready;
+
+static void crc_ccitt_slice_init(void)
+{
+	const guint16 *prev = crc_ccitt_table;
+	int i, k;
+
+	for (k = 0; k < 7; k++) {
+		for (i = 0; i < 256; i++)
+			crc_ccitt_slice[k][i] = crc_ccitt_byte(prev[i], 0);
+
+		prev = crc_ccitt_slice[k];
+	}
+
+	crc_ccitt_slice_ready = TRUE;
+}
+
+guint16 crc_ccitt_update(guint16 crc, const guint8 *data, gsize len)
+{
+	if (len >= 8 && crc_ccitt_slice_ready == FALSE)
+		crc_ccitt_slice_init();
+
+	while (len >= 8) {
+		crc = crc_ccitt_slice[6][(data[0] ^ crc) & 0xff] ^
+			crc_ccitt_slice[5][(data[1] ^ (crc >> 8)) & 0xff] ^
+			crc_ccitt_slice[4][data[2]] ^
+			crc_ccitt_slice[3][data[3]] ^
+			crc_ccitt_slice[2][data[4]] ^
+			crc_ccitt_slice[1][data[5]] ^
+			crc_ccitt_slice[0][data[6]] ^
+			crc_ccitt_table[data[7]];
+
+		data += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc_ccitt_byte(crc, *data++);
+
+	return crc;
+}
@@ -31,3 +31,9 @@ static inline guint16 crc_ccitt_byte(guint16 crc, const guint8 c)
 {
 	return (crc >> 8) ^ crc_ccitt_table[(crc ^ c) & 0xff];
 }
+
+/*
+ * Same as calling crc_ccitt_byte for every byte of data, but processes
+ * eight bytes per step using slicing-by-8 tables
+ */
+guint16 crc_ccitt_update(guint16 crc, const guint8 *data, gsize len);
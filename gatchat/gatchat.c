@@ -35,11 +35,16 @@
 #include "ringbuffer.h"
 #include "gatchat.h"
 #include "gatio.h"
+#include "gatutil.h"
 
 /* #define WRITE_SCHEDULER_DEBUG 1 */
 
 #define COMMAND_FLAG_EXPECT_PDU			0x1
 #define COMMAND_FLAG_EXPECT_SHORT_PROMPT	0x2
+#define COMMAND_FLAG_NO_CONCAT			0x4
+
+#define LINE_ARENA_MIN_SIZE	256
+#define LINE_ARENA_KEEP_SIZE	4096
 
 struct at_chat;
 static void chat_wakeup_writer(struct at_chat *chat);
@@ -56,6 +61,9 @@ struct at_command {
 	GAtNotifyFunc listing;
 	gpointer user_data;
 	GDestroyNotify notify;
+	struct at_command *batch;		/* Concatenated commands */
+	struct at_command *next;		/* Next command in the batch */
+	guint lines;				/* Response lines of the command */
 };
 
 struct at_notify_node {
@@ -75,6 +83,18 @@ struct at_notify {
 	gboolean pdu;
 };
 
+/*
+ * Registered notification prefixes are indexed by a character trie so that
+ * matching an incoming line costs one step per character of the longest
+ * matching prefix, no matter how many notifications are registered.
+ */
+struct notify_trie {
+	char c;
+	struct at_notify *notify;		/* Set if a prefix ends here */
+	struct notify_trie *child;
+	struct notify_trie *sibling;
+};
+
 struct at_chat {
 	gint ref_count;				/* Ref count */
 	guint next_cmd_id;			/* Next command id */
@@ -84,6 +104,7 @@ struct at_chat {
 	GQueue *command_queue;			/* Command queue */
 	guint cmd_bytes_written;		/* bytes written from cmd */
 	GHashTable *notify_list;		/* List of notification reg */
+	struct notify_trie *notify_trie;	/* Prefix index of notify_list */
 	GAtDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
 	guint read_so_far;			/* Number of bytes processed */
@@ -91,7 +112,18 @@ struct at_chat {
 	GAtDebugFunc debugf;			/* debugging output function */
 	gpointer debug_data;			/* Data to pass to debug func */
 	char *pdu_notify;			/* Unsolicited Resp w/ PDU */
-	GSList *response_lines;			/* char * lines of the response */
+	char *pdu_notify_buf;			/* Storage for pdu_notify */
+	gsize pdu_notify_size;			/* Size of pdu_notify_buf */
+	char *line_arena;			/* Response lines + current line */
+	gsize line_arena_len;			/* Bytes used by response lines */
+	gsize line_arena_size;			/* Size of line_arena */
+	guint response_lines;			/* Lines stored in line_arena */
+	GSList *line_nodes;			/* GSList cells for the result */
+	guint line_nodes_size;			/* Number of line_nodes */
+	guint line_arena_pins;			/* Lines being dispatched */
+	gboolean line_arena_pinned;		/* Arena holds such lines */
+	GSList *line_arena_retired;		/* Arenas held for dispatch */
+	guint reads;				/* new_bytes calls so far */
 	char *wakeup;				/* command sent to wakeup modem */
 	gint timeout_source;
 	gdouble inactivity_time;		/* Period of inactivity */
@@ -103,6 +135,8 @@ struct at_chat {
 	gboolean in_notify;
 	GSList *terminator_list;		/* Non-standard terminator */
 	guint16 terminator_blacklist;		/* Blacklisted terinators */
+	guint concat_length;			/* Max concatenated cmd length */
+	struct at_command *batch_cur;		/* Batch command responding */
 };
 
 struct _GAtChat {
@@ -156,6 +190,89 @@ static void at_notify_destroy(gpointer user_data)
 	g_free(notify);
 }
 
+static struct notify_trie *notify_trie_child(struct notify_trie *node,
+						char c)
+{
+	struct notify_trie *child;
+
+	for (child = node->child; child; child = child->sibling)
+		if (child->c == c)
+			return child;
+
+	return NULL;
+}
+
+static gboolean notify_trie_insert(struct notify_trie *root,
+					const char *prefix,
+					struct at_notify *notify)
+{
+	struct notify_trie *node = root;
+	struct notify_trie *child;
+
+	for (; *prefix; prefix++) {
+		child = notify_trie_child(node, *prefix);
+
+		if (child == NULL) {
+			child = g_try_new0(struct notify_trie, 1);
+			if (child == NULL)
+				return FALSE;
+
+			child->c = *prefix;
+			child->sibling = node->child;
+			node->child = child;
+		}
+
+		node = child;
+	}
+
+	node->notify = notify;
+
+	return TRUE;
+}
+
+/*
+ * Drops the notify entry stored for prefix, pruning the nodes which no
+ * longer lead to any registered prefix.  Returns TRUE if node became empty.
+ */
+static gboolean notify_trie_remove(struct notify_trie *node,
+					const char *prefix)
+{
+	struct notify_trie *child;
+	struct notify_trie **link;
+
+	if (*prefix == '\0') {
+		node->notify = NULL;
+		return node->child == NULL;
+	}
+
+	for (link = &node->child; *link; link = &(*link)->sibling)
+		if ((*link)->c == *prefix)
+			break;
+
+	child = *link;
+	if (child == NULL)
+		return FALSE;
+
+	if (notify_trie_remove(child, prefix + 1) == TRUE) {
+		*link = child->sibling;
+		g_free(child);
+	}
+
+	return node->notify == NULL && node->child == NULL;
+}
+
+static void notify_trie_free(struct notify_trie *node)
+{
+	struct notify_trie *sibling;
+
+	while (node) {
+		sibling = node->sibling;
+		notify_trie_free(node->child);
+		g_free(node);
+		node = sibling;
+	}
+}
+
 static gint at_command_compare_by_id(gconstpointer a, gconstpointer b)
 {
 	const struct at_command *command = a;
@@ -222,8 +339,10 @@ static gboolean at_chat_unregister_all(struct at_chat *chat,
 			g_slist_free_1(t);
 		}
 
-		if (notify->nodes == NULL)
+		if (notify->nodes == NULL) {
+			notify_trie_remove(chat->notify_trie, key);
 			g_hash_table_iter_remove(&iter);
+		}
 	}
 
 	return TRUE;
@@ -284,6 +403,9 @@ static struct at_command *at_command_create(guint gid, const char *cmd,
 
 	c->cmd[len] = '\0';
 
+	if (wakeup == TRUE)
+		flags |= COMMAND_FLAG_NO_CONCAT;
+
 	c->gid = gid;
 	c->flags = flags;
 	c->prefixes = prefixes;
@@ -297,6 +419,13 @@ static struct at_command *at_command_create(guint gid, const char *cmd,
 
 static void at_command_destroy(struct at_command *cmd)
 {
+	while (cmd->batch) {
+		struct at_command *c = cmd->batch;
+
+		cmd->batch = c->next;
+		at_command_destroy(c);
+	}
+
 	if (cmd->notify)
 		cmd->notify(cmd->user_data);
 
@@ -314,6 +443,167 @@ static void free_terminator(gpointer pointer)
 	info = NULL;
 }
 
+/*
+ * Lines read from the modem are extracted into the line arena right after
+ * the response lines kept so far for the current command.  A line which is
+ * not kept is only valid until the next line is extracted, so response
+ * lines are collected without a heap allocation per line.
+ *
+ * While a line is being dispatched the arena is pinned.  Should a callback
+ * make the chat read more lines, those go to a new arena and the pinned one
+ * is only freed once the dispatch is over.
+ */
+static void line_arena_pin(struct at_chat *chat)
+{
+	chat->line_arena_pins += 1;
+	chat->line_arena_pinned = TRUE;
+}
+
+static void line_arena_unpin(struct at_chat *chat)
+{
+	if (--chat->line_arena_pins > 0)
+		return;
+
+	chat->line_arena_pinned = FALSE;
+
+	g_slist_free_full(chat->line_arena_retired, g_free);
+	chat->line_arena_retired = NULL;
+}
+
+/* Moves the kept lines to a new arena, leaving the pinned one alone */
+static char *line_arena_retire(struct at_chat *chat, gsize size)
+{
+	char *arena = g_try_malloc(size);
+
+	if (arena == NULL)
+		return NULL;
+
+	if (chat->line_arena_len > 0)
+		memcpy(arena, chat->line_arena, chat->line_arena_len);
+
+	chat->line_arena_retired = g_slist_prepend(chat->line_arena_retired,
+							chat->line_arena);
+	chat->line_arena_retired = g_slist_prepend(chat->line_arena_retired,
+							chat->line_nodes);
+
+	chat->line_arena = arena;
+	chat->line_arena_size = size;
+	chat->line_nodes = NULL;
+	chat->line_nodes_size = 0;
+	chat->line_arena_pinned = FALSE;
+
+	return chat->line_arena + chat->line_arena_len;
+}
+
+static char *line_arena_reserve(struct at_chat *chat, gsize len)
+{
+	gsize size = chat->line_arena_size;
+	char *arena;
+
+	/* Give back the memory of an unusually long response */
+	if (chat->line_arena_pinned == FALSE && chat->line_arena_len == 0 &&
+			size > LINE_ARENA_KEEP_SIZE &&
+			len <= LINE_ARENA_KEEP_SIZE) {
+		g_free(chat->line_arena);
+		chat->line_arena = NULL;
+		chat->line_arena_size = 0;
+		size = 0;
+	}
+
+	if (chat->line_arena_pinned == FALSE &&
+			chat->line_arena_len + len <= size)
+		return chat->line_arena + chat->line_arena_len;
+
+	if (size < LINE_ARENA_MIN_SIZE)
+		size = LINE_ARENA_MIN_SIZE;
+
+	while (size < chat->line_arena_len + len)
+		size *= 2;
+
+	if (chat->line_arena_pinned)
+		return line_arena_retire(chat, size);
+
+	arena = g_try_realloc(chat->line_arena, size);
+	if (arena == NULL)
+		return NULL;
+
+	chat->line_arena = arena;
+	chat->line_arena_size = size;
+
+	return chat->line_arena + chat->line_arena_len;
+}
+
+/* Keeps the line last extracted into the arena as a response line */
+static void line_arena_keep(struct at_chat *chat, const char *line)
+{
+	chat->line_arena_len += strlen(line) + 1;
+	chat->response_lines += 1;
+}
+
+/* Returns the kept response lines as a list and empties the arena */
+static GSList *line_arena_take(struct at_chat *chat)
+{
+	guint n = chat->response_lines;
+	const char *line = chat->line_arena;
+	guint i;
+
+	chat->line_arena_len = 0;
+	chat->response_lines = 0;
+
+	if (n == 0)
+		return NULL;
+
+	if (n > chat->line_nodes_size) {
+		GSList *nodes = g_try_renew(GSList, chat->line_nodes, n);
+
+		if (nodes == NULL)
+			return NULL;
+
+		chat->line_nodes = nodes;
+		chat->line_nodes_size = n;
+	}
+
+	for (i = 0; i < n; i++) {
+		chat->line_nodes[i].data = (char *) line;
+		chat->line_nodes[i].next = i + 1 < n ?
+						&chat->line_nodes[i + 1] : NULL;
+		line += strlen(line) + 1;
+	}
+
+	return chat->line_nodes;
+}
+
+static gboolean at_chat_set_pdu_notify(struct at_chat *chat, const char *line)
+{
+	gsize len = strlen(line) + 1;
+
+	if (len > chat->pdu_notify_size) {
+		char *buf = g_try_realloc(chat->pdu_notify_buf, len);
+
+		if (buf == NULL) {
+			chat->pdu_notify = NULL;
+			return FALSE;
+		}
+
+		chat->pdu_notify_buf = buf;
+		chat->pdu_notify_size = len;
+	}
+
+	memcpy(chat->pdu_notify_buf, line, len);
+	chat->pdu_notify = chat->pdu_notify_buf;
+
+	return TRUE;
+}
+
+static void chat_free(struct at_chat *chat)
+{
+	g_slist_free_full(chat->line_arena_retired, g_free);
+	g_free(chat->line_arena);
+	g_free(chat->line_nodes);
+	g_free(chat->pdu_notify_buf);
+	g_free(chat);
+}
+
 static void chat_cleanup(struct at_chat *chat)
 {
 	struct at_command *c;
@@ -325,18 +615,19 @@ static void chat_cleanup(struct at_chat *chat)
 	g_queue_free(chat->command_queue);
 	chat->command_queue = NULL;
 
-	/* Cleanup any response lines we have pending */
-	g_slist_free_full(chat->response_lines, g_free);
-	chat->response_lines = NULL;
+	/* Drop any response lines we have pending */
+	chat->line_arena_len = 0;
+	chat->response_lines = 0;
+	chat->batch_cur = NULL;
 
 	/* Cleanup registered notifications */
 	g_hash_table_destroy(chat->notify_list);
 	chat->notify_list = NULL;
 
-	if (chat->pdu_notify) {
-		g_free(chat->pdu_notify);
-		chat->pdu_notify = NULL;
-	}
+	notify_trie_free(chat->notify_trie);
+	chat->notify_trie = NULL;
+
+	chat->pdu_notify = NULL;
 
 	if (chat->wakeup) {
 		g_free(chat->wakeup);
@@ -384,36 +675,48 @@ static void at_notify_call_callback(gpointer data, gpointer user_data)
 
 static gboolean at_chat_match_notify(struct at_chat *chat, char *line)
 {
-	GHashTableIter iter;
+	struct notify_trie *node = chat->notify_trie;
 	struct at_notify *notify;
-	gpointer key, value;
 	gboolean ret = FALSE;
+	GSList cell = { line, NULL };
 	GAtResult result;
+	const char *c;
 
-	g_hash_table_iter_init(&iter, chat->notify_list);
-	result.lines = 0;
+	result.lines = &cell;
 	result.final_or_pdu = 0;
 
 	chat->in_notify = TRUE;
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		notify = value;
-
-		if (!g_str_has_prefix(line, key))
+	/*
+	 * Walk down the trie following the line, every node carrying a
+	 * notify along the way is a registered prefix of the line.  Nodes
+	 * are never freed while in_notify is set, so callbacks registering
+	 * new notifications cannot invalidate the walk.
+	 */
+	for (c = line; *c && node; c++) {
+		node = notify_trie_child(node, *c);
+		if (node == NULL || node->notify == NULL)
 			continue;
 
+		notify = node->notify;
+
 		if (notify->pdu) {
-			chat->pdu_notify = line;
+			at_chat_set_pdu_notify(chat, line);
 
 			if (chat->syntax->set_hint)
 				chat->syntax->set_hint(chat->syntax,
 							G_AT_SYNTAX_EXPECT_PDU);
+
+			chat->in_notify = FALSE;
+
+			if (ret)
+				at_chat_unregister_all(chat, FALSE,
+							node_is_destroyed,
+							NULL);
+
 			return TRUE;
 		}
 
-		if (result.lines == NULL)
-			result.lines = g_slist_prepend(NULL, line);
-
 		g_slist_foreach(notify->nodes, at_notify_call_callback,
 					&result);
 		ret = TRUE;
@@ -421,20 +724,104 @@ static gboolean at_chat_match_notify(struct at_chat *chat, char *line)
 
 	chat->in_notify = FALSE;
 
-	if (ret) {
-		g_slist_free(result.lines);
-		g_free(line);
-
+	if (ret)
 		at_chat_unregister_all(chat, FALSE, node_is_destroyed, NULL);
-	}
 
 	return ret;
 }
 
+/*
+ * A batch shares a single final response.  On success every command of the
+ * batch gets called with the response lines attributed to it.  V.250 stops
+ * executing a command line at the first failing command, so on failure the
+ * commands before the one that responded last have completed and get called
+ * as successful.  The rest are put back at the front of the queue to be
+ * sent one by one.
+ */
+static void at_chat_finish_batch(struct at_chat *p, struct at_command *batch,
+					gboolean ok, char *final)
+{
+	struct at_command *failed = ok ? NULL : p->batch_cur;
+	struct at_command *requeue = NULL;
+	struct at_command *cmd;
+	GSList *lines;
+	GSList *last;
+	gboolean in_read_handler;
+	GAtResult result;
+	char ok_final[] = "OK";
+	guint i;
+
+	p->batch_cur = NULL;
+
+	if (failed || g_queue_peek_head(p->command_queue))
+		chat_wakeup_writer(p);
+
+	lines = line_arena_take(p);
+
+	in_read_handler = p->in_read_handler;
+	p->in_read_handler = TRUE;
+
+	while ((cmd = batch->batch) && cmd != failed) {
+		/* Commands not reported yet can still be cancelled */
+		batch->batch = cmd->next;
+		p->batch_cur = cmd->next;
+
+		result.final_or_pdu = ok ? final : ok_final;
+		result.lines = cmd->lines ? lines : NULL;
+
+		/* Cut the lines of this command off the list */
+		for (i = 0, last = NULL; i < cmd->lines; i++) {
+			last = lines;
+			lines = lines->next;
+		}
+
+		if (last)
+			last->next = NULL;
+
+		if (cmd->callback && p->destroyed == FALSE)
+			cmd->callback(TRUE, &result, cmd->user_data);
+
+		at_command_destroy(cmd);
+	}
+
+	p->batch_cur = NULL;
+
+	/* Reverse the rest of the batch so it can be pushed back in order */
+	while ((cmd = batch->batch)) {
+		batch->batch = cmd->next;
+		cmd->next = requeue;
+		requeue = cmd;
+	}
+
+	for (cmd = requeue; cmd; cmd = requeue) {
+		requeue = cmd->next;
+		cmd->next = NULL;
+
+		if (p->command_queue == NULL) {
+			at_command_destroy(cmd);
+			continue;
+		}
+
+		cmd->lines = 0;
+		cmd->flags |= COMMAND_FLAG_NO_CONCAT;
+		g_queue_push_head(p->command_queue, cmd);
+	}
+
+	at_command_destroy(batch);
+
+	if (in_read_handler == FALSE) {
+		p->in_read_handler = FALSE;
+
+		if (p->destroyed)
+			chat_free(p);
+	}
+}
+
 static void at_chat_finish_command(struct at_chat *p, gboolean ok, char *final)
 {
 	struct at_command *cmd = g_queue_pop_head(p->command_queue);
 	GSList *response_lines;
+	gboolean in_read_handler;
 
 	/* Cannot happen, but lets be paranoid */
 	if (cmd == NULL)
@@ -442,26 +829,39 @@ static void at_chat_finish_command(struct at_chat *p, gboolean ok, char *final)
 
 	p->cmd_bytes_written = 0;
 
+	if (cmd->batch) {
+		at_chat_finish_batch(p, cmd, ok, final);
+		return;
+	}
+
 	if (g_queue_peek_head(p->command_queue))
 		chat_wakeup_writer(p);
 
-	response_lines = p->response_lines;
-	p->response_lines = NULL;
+	response_lines = line_arena_take(p);
 
 	if (cmd->callback) {
 		GAtResult result;
 
-		response_lines = g_slist_reverse(response_lines);
-
 		result.final_or_pdu = final;
 		result.lines = response_lines;
 
+		/*
+		 * The result lines live in the chat, so do not let the
+		 * callback free it from underneath them
+		 */
+		in_read_handler = p->in_read_handler;
+		p->in_read_handler = TRUE;
+
 		cmd->callback(ok, &result, cmd->user_data);
-	}
 
-	g_slist_free_full(response_lines, g_free);
+		if (in_read_handler == FALSE) {
+			p->in_read_handler = FALSE;
+
+			if (p->destroyed)
+				chat_free(p);
+		}
+	}
 
-	g_free(final);
 	at_command_destroy(cmd);
 }
 
@@ -531,6 +931,33 @@ static gboolean at_chat_handle_command_response(struct at_chat *p,
 		}
 	}
 
+	/*
+	 * Concatenated commands are executed in order, so a response line
+	 * belongs to the first command from the one currently responding
+	 * onwards that expects it
+	 */
+	if (cmd->batch) {
+		struct at_command *c;
+		int n;
+
+		for (c = p->batch_cur; c; c = c->next) {
+			for (n = 0; c->prefixes[n]; n++)
+				if (g_str_has_prefix(line, c->prefixes[n]))
+					break;
+
+			if (c->prefixes[n])
+				break;
+		}
+
+		if (c == NULL)
+			return FALSE;
+
+		p->batch_cur = c;
+		c->lines += 1;
+		cmd = c;
+		goto out;
+	}
+
 	if (cmd->prefixes) {
 		int n;
 
@@ -551,22 +978,20 @@ out:
 		p->syntax->set_hint(p->syntax, hint);
 
 	if (cmd->listing && (cmd->flags & COMMAND_FLAG_EXPECT_PDU)) {
-		p->pdu_notify = line;
+		at_chat_set_pdu_notify(p, line);
 		return TRUE;
 	}
 
 	if (cmd->listing) {
+		GSList cell = { line, NULL };
 		GAtResult result;
 
-		result.lines = g_slist_prepend(NULL, line);
+		result.lines = &cell;
 		result.final_or_pdu = NULL;
 
 		cmd->listing(&result, cmd->user_data);
-
-		g_slist_free(result.lines);
-		g_free(line);
 	} else
-		p->response_lines = g_slist_prepend(p->response_lines, line);
+		line_arena_keep(p, line);
 
 	return TRUE;
 }
@@ -581,7 +1006,7 @@ static void have_line(struct at_chat *p, char *str)
 
 	/* Check for echo, this should not happen, but lets be paranoid */
 	if (!strncmp(str, "AT", 2))
-		goto done;
+		return;
 
 	cmd = g_queue_peek_head(p->command_queue);
 
@@ -601,33 +1026,26 @@ static void have_line(struct at_chat *p, char *str)
 			return;
 	}
 
-	if (at_chat_match_notify(p, str) == TRUE)
-		return;
-
-done:
 	/* No matches & no commands active, ignore line */
-	g_free(str);
+	at_chat_match_notify(p, str);
 }
 
 static void have_notify_pdu(struct at_chat *p, char *pdu, GAtResult *result)
 {
-	GHashTableIter iter;
+	struct notify_trie *node = p->notify_trie;
 	struct at_notify *notify;
-	char *prefix;
-	gpointer key, value;
 	gboolean called = FALSE;
+	const char *c;
 
 	p->in_notify = TRUE;
 
-	g_hash_table_iter_init(&iter, p->notify_list);
-
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		prefix = key;
-		notify = value;
-
-		if (!g_str_has_prefix(p->pdu_notify, prefix))
+	for (c = p->pdu_notify; *c && node; c++) {
+		node = notify_trie_child(node, *c);
+		if (node == NULL || node->notify == NULL)
 			continue;
 
+		notify = node->notify;
+
 		if (!notify->pdu)
 			continue;
 
@@ -644,13 +1062,14 @@ static void have_notify_pdu(struct at_chat *p, char *pdu, GAtResult *result)
 static void have_pdu(struct at_chat *p, char *pdu)
 {
 	struct at_command *cmd;
+	GSList cell = { p->pdu_notify, NULL };
 	GAtResult result;
 	gboolean listing_pdu = FALSE;
 
-	if (pdu == NULL)
+	if (pdu == NULL || p->pdu_notify == NULL)
 		goto error;
 
-	result.lines = g_slist_prepend(NULL, p->pdu_notify);
+	result.lines = &cell;
 	result.final_or_pdu = pdu;
 
 	cmd = g_queue_peek_head(p->command_queue);
@@ -672,47 +1091,70 @@ static void have_pdu(struct at_chat *p, char *pdu)
 	} else
 		have_notify_pdu(p, pdu, &result);
 
-	g_slist_free(result.lines);
-
 error:
-	g_free(p->pdu_notify);
 	p->pdu_notify = NULL;
+}
+
+/*
+ * Scans len bytes of a possibly wrapped line.  Leading CR / LF bytes are
+ * counted in strip_front, the line ends at the first CR / LF outside of a
+ * quoted string.  Returns TRUE once the end of the line has been found.
+ */
+static gboolean scan_line(const unsigned char *buf, unsigned int len,
+				gboolean *in_string, int *strip_front,
+				int *line_length)
+{
+	const unsigned char *end = buf + len;
+	const unsigned char *stop;
+
+	while (buf < end) {
+		if (*line_length == 0 && (*buf == '\r' || *buf == '\n')) {
+			*strip_front += 1;
+			buf += 1;
+			continue;
+		}
+
+		if (*in_string)
+			stop = memchr(buf, '"', end - buf);
+		else
+			stop = g_at_util_memchr3(buf, end - buf,
+							'\r', '\n', '"');
+
+		if (stop == NULL) {
+			*line_length += end - buf;
+			return FALSE;
+		}
+
+		*line_length += stop - buf;
 
-	if (pdu)
-		g_free(pdu);
+		if (*stop != '"')
+			return TRUE;
+
+		*in_string = !*in_string;
+		*line_length += 1;
+		buf = stop + 1;
+	}
+
+	return FALSE;
 }
 
 static char *extract_line(struct at_chat *p, struct ring_buffer *rbuf)
 {
 	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
-	unsigned int pos = 0;
-	unsigned char *buf = ring_buffer_read_ptr(rbuf, pos);
 	gboolean in_string = FALSE;
 	int strip_front = 0;
 	int line_length = 0;
 	char *line;
 
-	while (pos < p->read_so_far) {
-		if (in_string == FALSE && (*buf == '\r' || *buf == '\n')) {
-			if (!line_length)
-				strip_front += 1;
-			else
-				break;
-		} else {
-			if (*buf == '"')
-				in_string = !in_string;
-
-			line_length += 1;
-		}
-
-		buf += 1;
-		pos += 1;
+	if (scan_line(ring_buffer_read_ptr(rbuf, 0),
+				MIN(wrap, p->read_so_far), &in_string,
+				&strip_front, &line_length) == FALSE &&
+			p->read_so_far > wrap)
+		scan_line(ring_buffer_read_ptr(rbuf, wrap),
+				p->read_so_far - wrap, &in_string,
+				&strip_front, &line_length);
 
-		if (pos == wrap)
-			buf = ring_buffer_read_ptr(rbuf, pos);
-	}
-
-	line = g_try_new(char, line_length + 1);
+	line = line_arena_reserve(p, line_length + 1);
 	if (line == NULL) {
 		ring_buffer_drain(rbuf, p->read_so_far);
 		return NULL;
@@ -734,12 +1176,16 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
 	unsigned char *buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
 
+	gboolean in_read_handler = p->in_read_handler;
+	guint reads = ++p->reads;
 	GAtSyntaxResult result;
 
 	p->in_read_handler = TRUE;
 
 	while (p->suspended == FALSE && (p->read_so_far < len)) {
 		gsize rbytes = MIN(len - p->read_so_far, wrap - p->read_so_far);
+		char *line = NULL;
+
 		result = p->syntax->feed(p->syntax, (char *)buf, &rbytes);
 
 		buf += rbytes;
@@ -756,11 +1202,8 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 		switch (result) {
 		case G_AT_SYNTAX_RESULT_LINE:
 		case G_AT_SYNTAX_RESULT_MULTILINE:
-			have_line(p, extract_line(p, rbuf));
-			break;
-
 		case G_AT_SYNTAX_RESULT_PDU:
-			have_pdu(p, extract_line(p, rbuf));
+			line = extract_line(p, rbuf);
 			break;
 
 		case G_AT_SYNTAX_RESULT_PROMPT:
@@ -776,12 +1219,33 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 		len -= p->read_so_far;
 		wrap -= p->read_so_far;
 		p->read_so_far = 0;
+
+		if (result != G_AT_SYNTAX_RESULT_LINE &&
+				result != G_AT_SYNTAX_RESULT_MULTILINE &&
+				result != G_AT_SYNTAX_RESULT_PDU)
+			continue;
+
+		line_arena_pin(p);
+
+		if (result == G_AT_SYNTAX_RESULT_PDU)
+			have_pdu(p, line);
+		else
+			have_line(p, line);
+
+		line_arena_unpin(p);
+
+		/* A callback had the rest of the buffer read already */
+		if (p->reads != reads)
+			break;
 	}
 
+	if (in_read_handler)
+		return;
+
 	p->in_read_handler = FALSE;
 
 	if (p->destroyed)
-		g_free(p);
+		chat_free(p);
 }
 
 static void wakeup_cb(gboolean ok, GAtResult *result, gpointer user_data)
@@ -823,6 +1287,139 @@ static gboolean wakeup_no_response(gpointer user_data)
 	return TRUE;
 }
 
+/*
+ * Only extended read and test commands, e.g. AT+CMD? or AT+CMD=?, with an
+ * explicit list of expected responses are concatenated.  Those can safely
+ * be sent again, and their response lines can be told apart.
+ */
+static gboolean at_command_can_concat(struct at_command *cmd)
+{
+	const char *c = cmd->cmd;
+	gsize len = strlen(c);
+
+	if (cmd->flags || cmd->listing || cmd->prefixes == NULL)
+		return FALSE;
+
+	if (g_ascii_strncasecmp(c, "AT", 2) || strchr("+^#$%*", c[2]) == NULL)
+		return FALSE;
+
+	/* No prompts and no compound commands */
+	if (strchr(c, ';') || strchr(c, '\r') != c + len - 1)
+		return FALSE;
+
+	/* Ends in '?' just before the '\r', '=?' is covered as well */
+	if (len < 5 || c[len - 2] != '?')
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Whether a response line could belong to either command.  Lines of a batch
+ * go to the first command expecting them, so such commands are never put
+ * in the same batch.
+ */
+static gboolean at_command_prefixes_overlap(struct at_command *a,
+						struct at_command *b)
+{
+	int i, j;
+
+	for (i = 0; a->prefixes[i]; i++)
+		for (j = 0; b->prefixes[j]; j++)
+			if (g_str_has_prefix(a->prefixes[i], b->prefixes[j]) ||
+					g_str_has_prefix(b->prefixes[j],
+							a->prefixes[i]))
+				return TRUE;
+
+	return FALSE;
+}
+
+/*
+ * Replaces the commands at the head of the queue that can be concatenated
+ * as per V.250, e.g. AT+CMD1;+CMD2, by a batch command
+ */
+static void at_chat_concat_commands(struct at_chat *chat)
+{
+	struct at_command *head = g_queue_peek_head(chat->command_queue);
+	struct at_command *batch;
+	struct at_command **tail;
+	GList *l;
+	gsize len;
+	guint n = 1;
+	char *p;
+
+	if (head == NULL || at_command_can_concat(head) == FALSE)
+		return;
+
+	/* Length of the command line without the trailing '\r' */
+	len = strlen(head->cmd) - 1;
+
+	for (l = g_queue_peek_head_link(chat->command_queue)->next; l;
+							l = l->next) {
+		struct at_command *c = l->data;
+		GList *prev;
+		gsize clen;
+
+		if (at_command_can_concat(c) == FALSE)
+			break;
+
+		for (prev = l->prev; prev; prev = prev->prev)
+			if (at_command_prefixes_overlap(prev->data, c))
+				break;
+
+		if (prev)
+			break;
+
+		/* Drop the AT, but add the ';' separator */
+		clen = strlen(c->cmd) - 2;
+
+		if (len + clen > chat->concat_length)
+			break;
+
+		len += clen;
+		n += 1;
+	}
+
+	if (n < 2)
+		return;
+
+	batch = g_try_new0(struct at_command, 1);
+	if (batch == NULL)
+		return;
+
+	batch->cmd = g_try_new(char, len + 2);
+	if (batch->cmd == NULL) {
+		g_free(batch);
+		return;
+	}
+
+	tail = &batch->batch;
+	p = batch->cmd;
+
+	while (n--) {
+		struct at_command *c = g_queue_pop_head(chat->command_queue);
+		gsize clen = strlen(c->cmd) - 1;
+
+		if (p == batch->cmd) {
+			memcpy(p, c->cmd, clen);
+			p += clen;
+		} else {
+			*p++ = ';';
+			memcpy(p, c->cmd + 2, clen - 2);
+			p += clen - 2;
+		}
+
+		*tail = c;
+		tail = &c->next;
+	}
+
+	*p++ = '\r';
+	*p = '\0';
+
+	g_queue_push_head(chat->command_queue, batch);
+	chat->batch_cur = batch->batch;
+}
+
 static gboolean can_write_data(gpointer data)
 {
 	struct at_chat *chat = data;
@@ -845,6 +1442,11 @@ static gboolean can_write_data(gpointer data)
 	if (cmd == NULL)
 		return FALSE;
 
+	if (chat->cmd_bytes_written == 0 && chat->concat_length > 0) {
+		at_chat_concat_commands(chat);
+		cmd = g_queue_peek_head(chat->command_queue);
+	}
+
 	len = strlen(cmd->cmd);
 
 	/* For some reason write watcher fired, but we've already
@@ -977,7 +1579,7 @@ static void at_chat_unref(struct at_chat *chat)
 	if (chat->in_read_handler)
 		chat->destroyed = TRUE;
 	else
-		g_free(chat);
+		chat_free(chat);
 }
 
 static gboolean at_chat_set_disconnect_function(struct at_chat *chat,
@@ -1066,11 +1668,48 @@ static struct at_notify *at_notify_create(struct at_chat *chat,
 
 	notify->pdu = pdu;
 
+	if (notify_trie_insert(chat->notify_trie, prefix, notify) == FALSE) {
+		g_free(notify);
+		g_free(key);
+		return 0;
+	}
+
 	g_hash_table_insert(chat->notify_list, key, notify);
 
 	return notify;
 }
 
+/*
+ * Looks for a command which has been concatenated into a batch, either one
+ * still in the queue or one whose results are being reported
+ */
+static struct at_command *at_chat_find_batched(struct at_chat *chat, guint id)
+{
+	GList *l;
+	struct at_command *c;
+
+	for (c = chat->batch_cur; c; c = c->next)
+		if (c->id == id)
+			return c;
+
+	for (l = g_queue_peek_head_link(chat->command_queue); l; l = l->next) {
+		struct at_command *batch = l->data;
+
+		for (c = batch->batch; c; c = c->next)
+			if (c->id == id)
+				return c;
+	}
+
+	return NULL;
+}
+
+static gboolean at_chat_set_concat_length(struct at_chat *chat, guint length)
+{
+	chat->concat_length = length;
+
+	return TRUE;
+}
+
 static gboolean at_chat_cancel(struct at_chat *chat, guint group, guint id)
 {
 	GList *l;
@@ -1082,8 +1721,15 @@ static gboolean at_chat_cancel(struct at_chat *chat, guint group, guint id)
 	l = g_queue_find_custom(chat->command_queue, GUINT_TO_POINTER(id),
 				at_command_compare_by_id);
 
-	if (l == NULL)
-		return FALSE;
+	if (l == NULL) {
+		/* Part of a batch, which is as good as in progress */
+		c = at_chat_find_batched(chat, id);
+		if (c == NULL || c->gid != group)
+			return FALSE;
+
+		c->callback = NULL;
+		return TRUE;
+	}
 
 	c = l->data;
 
@@ -1113,7 +1759,17 @@ static gboolean at_chat_cancel_group(struct at_chat *chat, guint group)
 	if (chat->command_queue == NULL)
 		return FALSE;
 
+	for (c = chat->batch_cur; c; c = c->next)
+		if (c->gid == group)
+			c->callback = NULL;
+
 	while ((c = g_queue_peek_nth(chat->command_queue, n)) != NULL) {
+		struct at_command *b;
+
+		for (b = c->batch; b; b = b->next)
+			if (b->gid == group)
+				b->callback = NULL;
+
 		if (c->id == 0 || c->gid != group) {
 			n += 1;
 			continue;
@@ -1144,10 +1800,13 @@ static gpointer at_chat_get_userdata(struct at_chat *chat,
 	l = g_queue_find_custom(chat->command_queue, GUINT_TO_POINTER(id),
 				at_command_compare_by_id);
 
-	if (l == NULL)
-		return NULL;
+	if (l)
+		c = l->data;
+	else
+		c = at_chat_find_batched(chat, id);
 
-	c = l->data;
+	if (c == NULL)
+		return NULL;
 
 	if (c->gid != group)
 		return NULL;
@@ -1231,8 +1890,10 @@ static gboolean at_chat_unregister(struct at_chat *chat, gboolean mark_only,
 		at_notify_node_destroy(node, NULL);
 		notify->nodes = g_slist_remove(notify->nodes, node);
 
-		if (notify->nodes == NULL)
+		if (notify->nodes == NULL) {
+			notify_trie_remove(chat->notify_trie, key);
 			g_hash_table_iter_remove(&iter);
+		}
 
 		return TRUE;
 	}
@@ -1288,6 +1949,10 @@ static struct at_chat *create_chat(GIOChannel *channel, GIOFlags flags,
 	chat->notify_list = g_hash_table_new_full(g_str_hash, g_str_equal,
 						g_free, at_notify_destroy);
 
+	chat->notify_trie = g_try_new0(struct notify_trie, 1);
+	if (chat->notify_trie == NULL)
+		goto error;
+
 	g_at_io_set_read_handler(chat->io, new_bytes, chat);
 
 	chat->syntax = g_at_syntax_ref(syntax);
@@ -1495,6 +2160,14 @@ gboolean g_at_chat_set_wakeup_command(GAtChat *chat, const char *cmd,
 	return at_chat_set_wakeup_command(chat->parent, cmd, timeout, msec);
 }
 
+gboolean g_at_chat_set_concat_length(GAtChat *chat, guint length)
+{
+	if (chat == NULL || chat->group != 0)
+		return FALSE;
+
+	return at_chat_set_concat_length(chat->parent, length);
+}
+
 guint g_at_chat_send(GAtChat *chat, const char *cmd,
 			const char **prefix_list, GAtResultFunc func,
 			gpointer user_data, GDestroyNotify notify)
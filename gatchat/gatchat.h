@@ -162,6 +162,17 @@ gboolean g_at_chat_unregister_all(GAtChat *chat);
 gboolean g_at_chat_set_wakeup_command(GAtChat *chat, const char *cmd,
 					guint timeout, guint msec);
 
+/*!
+ * Allows consecutive extended read and test commands in the queue to be
+ * sent to the modem as a single command line, e.g. AT+CMD1?;+CMD2=?, of at
+ * most length characters.  Only commands sent with g_at_chat_send and a
+ * non-NULL valid_resp are concatenated, response lines are handed to the
+ * first command in the line expecting them.  If the modem does not report
+ * success, the commands that had not completed are sent again one at a
+ * time.  A length of 0, the default, disables concatenation.
+ */
+gboolean g_at_chat_set_concat_length(GAtChat *chat, guint length);
+
 void g_at_chat_add_terminator(GAtChat *chat, char *terminator,
 				int len, gboolean success);
 void g_at_chat_blacklist_terminator(GAtChat *chat,
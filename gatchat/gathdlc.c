@@ -27,8 +27,10 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <glib.h>
 
@@ -40,6 +42,7 @@
 
 #define BUFFER_SIZE	(2 * 2048)
 #define MAX_BUFFERS	64	/* Maximum number of in-flight write buffers */
+#define MAX_WRITE_IOV	16	/* Maximum number of regions per write */
 #define HDLC_OVERHEAD	256	/* Rough estimate of HDLC protocol overhead */
 
 #define HDLC_FLAG	0x7e	/* Flag sequence */
@@ -51,6 +54,12 @@
 
 #define HDLC_FCS(fcs, c) crc_ccitt_byte(fcs, c)
 
+/* Classes of received bytes, see decode_table */
+#define HDLC_DECODE_DATA	0
+#define HDLC_DECODE_DROP	1
+#define HDLC_DECODE_ESCAPE	2
+#define HDLC_DECODE_FLAG	3
+
 #define GUARD_TIMEOUT	1000	/* Pause time before and after '+++' sequence */
 
 struct _GAtHDLC {
@@ -61,6 +70,8 @@ struct _GAtHDLC {
 	guint decode_offset;
 	guint16 decode_fcs;
 	gboolean decode_escape;
+	gboolean decode_overflow;	/* Frame too long, drop it */
+	guint8 decode_table[256];	/* Class of every received byte */
 	guint32 xmit_accm[8];
 	guint32 recv_accm;
 	GAtReceiveFunc receive_func;
@@ -143,12 +154,25 @@ void g_at_hdlc_set_recording(GAtHDLC *hdlc, const char *filename)
 					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 }
 
+static void hdlc_update_decode_table(GAtHDLC *hdlc)
+{
+	int i;
+
+	for (i = 0; i < 0x20; i++)
+		hdlc->decode_table[i] = (hdlc->recv_accm & (1 << i)) ?
+					HDLC_DECODE_DROP : HDLC_DECODE_DATA;
+
+	hdlc->decode_table[HDLC_ESCAPE] = HDLC_DECODE_ESCAPE;
+	hdlc->decode_table[HDLC_FLAG] = HDLC_DECODE_FLAG;
+}
+
 void g_at_hdlc_set_recv_accm(GAtHDLC *hdlc, guint32 accm)
 {
 	if (hdlc == NULL)
 		return;
 
 	hdlc->recv_accm = accm;
+	hdlc_update_decode_table(hdlc);
 }
 
 guint32 g_at_hdlc_get_recv_accm(GAtHDLC *hdlc)
@@ -242,36 +266,51 @@ static gboolean check_escape(GAtHDLC *hdlc, struct ring_buffer *rbuf)
 	return TRUE;
 }
 
-static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
+/* Returns the number of bytes at the start of data to be taken as is */
+static gsize hdlc_data_run(GAtHDLC *hdlc, const guint8 *data, gsize len)
 {
-	GAtHDLC *hdlc = user_data;
-	unsigned int len = ring_buffer_len(rbuf);
-	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
-	unsigned char *buf = ring_buffer_read_ptr(rbuf, 0);
-	unsigned int pos = 0;
+	const guint8 *stop;
+	gsize i = 0;
 
-	/*
-	 * We delete the the paused_timeout_cb or hdlc_suspend as soons as
-	 * we read a data.
-	 */
-	if (hdlc->suspend_source > 0) {
-		g_source_remove(hdlc->suspend_source);
-		hdlc->suspend_source = 0;
-		g_timer_start(hdlc->timer);
-	} else if (hdlc->timer) {
-		gboolean escaping = check_escape(hdlc, rbuf);
+	/* The usual case once LCP has negotiated a receive ACCM of 0 */
+	if (hdlc->recv_accm == 0) {
+		stop = g_at_util_memchr3(data, len, HDLC_FLAG, HDLC_ESCAPE,
+								HDLC_ESCAPE);
 
-		g_timer_start(hdlc->timer);
+		return stop ? (gsize) (stop - data) : len;
+	}
 
-		if (escaping)
-			return;
+	while (i < len && hdlc->decode_table[data[i]] == HDLC_DECODE_DATA)
+		i++;
+
+	return i;
+}
+
+static void hdlc_decode_append(GAtHDLC *hdlc, const guint8 *data, gsize len)
+{
+	if (len > BUFFER_SIZE - hdlc->decode_offset) {
+		hdlc->decode_overflow = TRUE;
+		return;
 	}
 
-	hdlc_record(hdlc, TRUE, buf, wrap);
+	memcpy(hdlc->decode_buffer + hdlc->decode_offset, data, len);
+	hdlc->decode_offset += len;
+	hdlc->decode_fcs = crc_ccitt_update(hdlc->decode_fcs, data, len);
+}
 
-	hdlc->in_read_handler = TRUE;
+/*
+ * Decodes len contiguous bytes of the read buffer.  Runs of bytes that need
+ * no unescaping are found in one go and copied as a block.  Returns the
+ * number of bytes consumed, which is less than len if decoding had to stop.
+ */
+static gsize hdlc_decode(GAtHDLC *hdlc, const guint8 *buf, gsize len)
+{
+	const guint8 *p = buf;
+	const guint8 *end = buf + len;
+	guint8 val;
+	gsize run;
 
-	while (pos < len) {
+	while (p < end) {
 		/*
 		 * We try to detect NO CARRIER conditions here.  We
 		 * (ab) use the fact that a HDLC_FLAG must be followed
@@ -279,47 +318,98 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 		 * ACFC is enabled.
 		 */
 		if (hdlc->no_carrier_detect &&
-				hdlc->decode_offset == 0 && *buf == '\r')
+				hdlc->decode_offset == 0 && *p == '\r')
 			break;
 
 		if (hdlc->decode_escape == TRUE) {
-			unsigned char val = *buf ^ HDLC_TRANS;
+			val = *p++ ^ HDLC_TRANS;
+			hdlc_decode_append(hdlc, &val, 1);
+			hdlc->decode_escape = FALSE;
+			continue;
+		}
 
-			hdlc->decode_buffer[hdlc->decode_offset++] = val;
-			hdlc->decode_fcs = HDLC_FCS(hdlc->decode_fcs, val);
+		switch (hdlc->decode_table[*p]) {
+		case HDLC_DECODE_DATA:
+			run = hdlc_data_run(hdlc, p, end - p);
+			hdlc_decode_append(hdlc, p, run);
+			p += run;
+			break;
 
-			hdlc->decode_escape = FALSE;
-		} else if (*buf == HDLC_ESCAPE) {
+		case HDLC_DECODE_DROP:
+			p++;
+			break;
+
+		case HDLC_DECODE_ESCAPE:
 			hdlc->decode_escape = TRUE;
-		} else if (*buf == HDLC_FLAG) {
+			p++;
+			break;
+
+		case HDLC_DECODE_FLAG:
 			if (hdlc->receive_func && hdlc->decode_offset > 2 &&
+					hdlc->decode_overflow == FALSE &&
 					hdlc->decode_fcs == HDLC_GOODFCS) {
 				hdlc->receive_func(hdlc->decode_buffer,
 							hdlc->decode_offset - 2,
 							hdlc->receive_data);
 
 				if (hdlc->destroyed)
-					goto out;
+					return p - buf;
 			}
 
 			hdlc->decode_fcs = HDLC_INITFCS;
 			hdlc->decode_offset = 0;
-		} else if (*buf >= 0x20 ||
-					(hdlc->recv_accm & (1 << *buf)) == 0) {
-			hdlc->decode_buffer[hdlc->decode_offset++] = *buf;
-			hdlc->decode_fcs = HDLC_FCS(hdlc->decode_fcs, *buf);
+			hdlc->decode_overflow = FALSE;
+			p++;
+			break;
 		}
+	}
 
-		buf++;
-		pos++;
+	return p - buf;
+}
 
-		if (pos == wrap) {
-			buf = ring_buffer_read_ptr(rbuf, pos);
-			hdlc_record(hdlc, TRUE, buf, len - wrap);
-		}
+static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
+{
+	GAtHDLC *hdlc = user_data;
+	unsigned int len = ring_buffer_len(rbuf);
+	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
+	unsigned char *buf;
+	unsigned int pos = 0;
+	unsigned int n;
+	unsigned int done;
+
+	/*
+	 * We delete the the paused_timeout_cb or hdlc_suspend as soons as
+	 * we read a data.
+	 */
+	if (hdlc->suspend_source > 0) {
+		g_source_remove(hdlc->suspend_source);
+		hdlc->suspend_source = 0;
+		g_timer_start(hdlc->timer);
+	} else if (hdlc->timer) {
+		gboolean escaping = check_escape(hdlc, rbuf);
+
+		g_timer_start(hdlc->timer);
+
+		if (escaping)
+			return;
+	}
+
+	hdlc->in_read_handler = TRUE;
+
+	/* Decode the two contiguous parts of the buffer in turn */
+	while (pos < len) {
+		buf = ring_buffer_read_ptr(rbuf, pos);
+		n = pos < wrap ? wrap - pos : len - pos;
+
+		hdlc_record(hdlc, TRUE, buf, n);
+
+		done = hdlc_decode(hdlc, buf, n);
+		pos += done;
+
+		if (hdlc->destroyed || done < n)
+			break;
 	}
 
-out:
 	ring_buffer_drain(rbuf, pos);
 
 	hdlc->in_read_handler = FALSE;
@@ -348,6 +438,7 @@ GAtHDLC *g_at_hdlc_new_from_io(GAtIO *io)
 	hdlc->xmit_accm[0] = ~0U;
 	hdlc->xmit_accm[3] = 0x60000000; /* 0x7d, 0x7e */
 	hdlc->recv_accm = ~0U;
+	hdlc_update_decode_table(hdlc);
 
 	write_buffer = ring_buffer_new(BUFFER_SIZE);
 	if (!write_buffer)
@@ -440,7 +531,8 @@ void g_at_hdlc_unref(GAtHDLC *hdlc)
 
 	g_free(hdlc->decode_buffer);
 
-	g_timer_destroy(hdlc->timer);
+	if (hdlc->timer)
+		g_timer_destroy(hdlc->timer);
 
 	if (hdlc->in_read_handler)
 		hdlc->destroyed = TRUE;
@@ -470,38 +562,52 @@ void g_at_hdlc_set_receive(GAtHDLC *hdlc, GAtReceiveFunc func,
 static gboolean can_write_data(gpointer data)
 {
 	GAtHDLC *hdlc = data;
-	unsigned int len;
-	unsigned char *buf;
+	struct iovec iov[MAX_WRITE_IOV];
 	gsize bytes_written;
+	gsize left;
+	gsize len;
 	struct ring_buffer* write_buffer;
+	GList *l;
+	int n = 0;
+	int i;
+
+	/*
+	 * Write data out from the head of the queue, frames queued in
+	 * several buffers go out with a single write
+	 */
+	for (l = g_queue_peek_head_link(hdlc->write_queue);
+				l && n + 2 <= MAX_WRITE_IOV; l = l->next)
+		n += ring_buffer_read_iov(l->data, iov + n);
+
+	bytes_written = g_at_io_writev(hdlc->io, iov, n);
+
+	for (i = 0, left = bytes_written; left > 0; i++) {
+		len = MIN(left, iov[i].iov_len);
+		hdlc_record(hdlc, FALSE, iov[i].iov_base, len);
+		left -= len;
+	}
 
-	/* Write data out from the head of the queue */
 	write_buffer = g_queue_peek_head(hdlc->write_queue);
+	left = bytes_written;
 
-	len = ring_buffer_len_no_wrap(write_buffer);
-	buf = ring_buffer_read_ptr(write_buffer, 0);
+	while (TRUE) {
+		len = MIN(left, (gsize) ring_buffer_len(write_buffer));
+		ring_buffer_drain(write_buffer, len);
+		left -= len;
 
-	bytes_written = g_at_io_write(hdlc->io, (gchar *) buf, len);
-	hdlc_record(hdlc, FALSE, buf, bytes_written);
-	ring_buffer_drain(write_buffer, bytes_written);
+		if (ring_buffer_len(write_buffer) > 0)
+			return TRUE;
 
-	if (ring_buffer_len(write_buffer) > 0)
-		return TRUE;
+		/* All data in current buffer is written, free it
+		 * unless it's the last buffer in the queue.
+		 */
+		if (g_queue_get_length(hdlc->write_queue) == 1)
+			return FALSE;
 
-	/* All data in current buffer is written, free it
-	 * unless it's the last buffer in the queue.
-	 */
-	if ((ring_buffer_len(write_buffer) == 0) &&
-			(g_queue_get_length(hdlc->write_queue) > 1)) {
 		write_buffer = g_queue_pop_head(hdlc->write_queue);
 		ring_buffer_free(write_buffer);
 		write_buffer = g_queue_peek_head(hdlc->write_queue);
 	}
-
-	if (ring_buffer_len(write_buffer) > 0)
-		return TRUE;
-
-	return FALSE;
 }
 
 void g_at_hdlc_set_xmit_accm(GAtHDLC *hdlc, guint32 accm)
@@ -530,18 +636,83 @@ GAtIO *g_at_hdlc_get_io(GAtHDLC *hdlc)
 
 #define NEED_ESCAPE(xmit_accm, c) xmit_accm[c >> 5] & (1 << (c & 0x1f))
 
+/* Returns the number of bytes at the start of data not needing an escape */
+static gsize hdlc_escape_run(const guint32 *xmit_accm, const guint8 *data,
+								gsize len)
+{
+	const guint8 *stop;
+	gsize i = 0;
+
+	/* The usual case once LCP has negotiated a transmit ACCM of 0 */
+	if (xmit_accm[0] == 0 && xmit_accm[1] == 0 && xmit_accm[2] == 0 &&
+			xmit_accm[3] == 0x60000000 && xmit_accm[4] == 0 &&
+			xmit_accm[5] == 0 && xmit_accm[6] == 0 &&
+			xmit_accm[7] == 0) {
+		stop = g_at_util_memchr3(data, len, HDLC_FLAG, HDLC_ESCAPE,
+								HDLC_ESCAPE);
+
+		return stop ? (gsize) (stop - data) : len;
+	}
+
+	while (i < len && !(NEED_ESCAPE(xmit_accm, data[i])))
+		i++;
+
+	return i;
+}
+
+/*
+ * Copies len bytes to offset *pos past the write position of the buffer,
+ * wrapping around as needed.  The buffer is only advanced once the whole
+ * frame has been written.
+ */
+static gboolean hdlc_put(struct ring_buffer *buf, unsigned int *pos,
+				unsigned int avail, const guint8 *data,
+				unsigned int len)
+{
+	unsigned int wrap = ring_buffer_avail_no_wrap(buf);
+	unsigned int n;
+
+	if (len > avail - *pos)
+		return FALSE;
+
+	if (*pos < wrap) {
+		n = MIN(len, wrap - *pos);
+		memcpy(ring_buffer_write_ptr(buf, *pos), data, n);
+		*pos += n;
+		data += n;
+		len -= n;
+	}
+
+	if (len > 0) {
+		memcpy(ring_buffer_write_ptr(buf, *pos), data, len);
+		*pos += len;
+	}
+
+	return TRUE;
+}
+
+static gboolean hdlc_put_escaped(GAtHDLC *hdlc, struct ring_buffer *buf,
+					unsigned int *pos, unsigned int avail,
+					guint8 c)
+{
+	guint8 escaped[2] = { HDLC_ESCAPE, c ^ HDLC_TRANS };
+
+	if (NEED_ESCAPE(hdlc->xmit_accm, c))
+		return hdlc_put(buf, pos, avail, escaped, 2);
+
+	return hdlc_put(buf, pos, avail, &c, 1);
+}
+
 gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size)
 {
 	struct ring_buffer* write_buffer = g_queue_peek_tail(hdlc->write_queue);
 
 	unsigned int avail = ring_buffer_avail(write_buffer);
-	unsigned int wrap = ring_buffer_avail_no_wrap(write_buffer);
-	unsigned char *buf;
-	unsigned char tail[2];
-	unsigned int i = 0;
+	guint8 flag = HDLC_FLAG;
 	guint16 fcs = HDLC_INITFCS;
-	gboolean escape = FALSE;
-	gsize pos = 0;
+	unsigned int pos = 0;
+	gsize i = 0;
+	gsize run;
 
 	if (avail < size + HDLC_OVERHEAD) {
 		if (g_queue_get_length(hdlc->write_queue) > MAX_BUFFERS)
@@ -554,86 +725,54 @@ gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size)
 		g_queue_push_tail(hdlc->write_queue, write_buffer);
 
 		avail = ring_buffer_avail(write_buffer);
-		wrap = ring_buffer_avail_no_wrap(write_buffer);
 	}
 
-	i = 0;
-	buf = ring_buffer_write_ptr(write_buffer, 0);
-
 	if (hdlc->start_frame_marker == TRUE) {
 		/* Protocol requires 0x7e as start marker */
-		if (pos + 1 > avail)
+		if (hdlc_put(write_buffer, &pos, avail, &flag, 1) == FALSE)
 			return FALSE;
-
-		*buf++ = HDLC_FLAG;
-		pos++;
-
-		if (pos == wrap)
-			buf = ring_buffer_write_ptr(write_buffer, pos);
 	} else if (hdlc->wakeup_sent == FALSE) {
 		/* Write an initial 0x7e as wakeup character */
-		*buf++ = HDLC_FLAG;
-		pos++;
+		hdlc_put(write_buffer, &pos, avail, &flag, 1);
 
 		hdlc->wakeup_sent = TRUE;
 	}
 
-	while (pos < avail && i < size) {
-		if (escape == TRUE) {
-			fcs = HDLC_FCS(fcs, data[i]);
-			*buf = data[i++] ^ HDLC_TRANS;
-			escape = FALSE;
-		} else if (NEED_ESCAPE(hdlc->xmit_accm, data[i])) {
-			*buf = HDLC_ESCAPE;
-			escape = TRUE;
-		} else {
-			fcs = HDLC_FCS(fcs, data[i]);
-			*buf = data[i++];
-		}
-
-		buf++;
-		pos++;
-
-		if (pos == wrap)
-			buf = ring_buffer_write_ptr(write_buffer, pos);
-	}
+	/* Copy runs of bytes that need no escaping as a block */
+	while (i < size) {
+		run = hdlc_escape_run(hdlc->xmit_accm, data + i, size - i);
 
-	if (i < size)
-		return FALSE;
+		if (run > 0) {
+			if (hdlc_put(write_buffer, &pos, avail,
+						data + i, run) == FALSE)
+				return FALSE;
 
-	fcs ^= HDLC_INITFCS;
-	tail[0] = fcs & 0xff;
-	tail[1] = fcs >> 8;
-
-	i = 0;
-
-	while (pos < avail && i < sizeof(tail)) {
-		if (escape == TRUE) {
-			*buf = tail[i++] ^ HDLC_TRANS;
-			escape = FALSE;
-		} else if (NEED_ESCAPE(hdlc->xmit_accm, tail[i])) {
-			*buf = HDLC_ESCAPE;
-			escape = TRUE;
-		} else {
-			*buf = tail[i++];
+			fcs = crc_ccitt_update(fcs, data + i, run);
+			i += run;
+			continue;
 		}
 
-		buf++;
-		pos++;
+		if (hdlc_put_escaped(hdlc, write_buffer, &pos, avail,
+							data[i]) == FALSE)
+			return FALSE;
 
-		if (pos == wrap)
-			buf = ring_buffer_write_ptr(write_buffer, pos);
+		fcs = HDLC_FCS(fcs, data[i]);
+		i += 1;
 	}
 
-	if (i < sizeof(tail))
+	fcs ^= HDLC_INITFCS;
+
+	if (hdlc_put_escaped(hdlc, write_buffer, &pos, avail,
+						fcs & 0xff) == FALSE)
 		return FALSE;
 
-	if (pos + 1 > avail)
+	if (hdlc_put_escaped(hdlc, write_buffer, &pos, avail,
+						fcs >> 8) == FALSE)
 		return FALSE;
 
 	/* Add 0x7e as end marker */
-	*buf = HDLC_FLAG;
-	pos++;
+	if (hdlc_put(write_buffer, &pos, avail, &flag, 1) == FALSE)
+		return FALSE;
 
 	ring_buffer_write_advance(write_buffer, pos);
 
@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
@@ -41,20 +42,24 @@ struct _GAtIO {
 	guint read_watch;			/* GSource read id, 0 if no */
 	guint write_watch;			/* GSource write id, 0 if no */
 	GIOChannel *channel;			/* comms channel */
+	int fd;					/* fd used directly or -1 */
 	GAtDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
 	struct ring_buffer *buf;		/* Current read buffer */
 	guint max_read_attempts;		/* max reads / select */
+	guint min_read_space;			/* space needed to read again */
 	GAtIOReadFunc read_handler;		/* Read callback */
 	gpointer read_data;			/* Read callback userdata */
 	gboolean use_write_watch;		/* Use write select */
 	GAtIOWriteFunc write_handler;		/* Write callback */
 	gpointer write_data;			/* Write callback userdata */
+	gboolean write_blocked;			/* Last write hit EAGAIN */
 	GAtDebugFunc debugf;			/* debugging output function */
 	gpointer debug_data;			/* Data to pass to debug func */
 	GAtDisconnectFunc write_done_func;	/* tx empty notifier */
 	gpointer write_done_data;		/* tx empty data */
 	gboolean destroyed;			/* Re-entrancy guard */
+	GAtIOStats stats;			/* System call counters */
 };
 
 static void read_watcher_destroy_notify(gpointer user_data)
@@ -79,14 +84,58 @@ static void read_watcher_destroy_notify(gpointer user_data)
 		io->user_disconnect(io->user_disconnect_data);
 }
 
+static GIOStatus read_fd(GAtIO *io, gsize *rbytes)
+{
+	struct iovec iov[2];
+	gsize len;
+	ssize_t ret;
+	int n;
+
+	n = ring_buffer_avail_iov(io->buf, iov);
+
+	do {
+		ret = readv(io->fd, iov, n);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return errno == EAGAIN ? G_IO_STATUS_AGAIN : G_IO_STATUS_ERROR;
+
+	if (ret == 0)
+		return G_IO_STATUS_EOF;
+
+	*rbytes = ret;
+
+	len = MIN((gsize) ret, iov[0].iov_len);
+	g_at_util_debug_chat(TRUE, iov[0].iov_base, len,
+				io->debugf, io->debug_data);
+
+	if ((gsize) ret > len)
+		g_at_util_debug_chat(TRUE, iov[1].iov_base, ret - len,
+					io->debugf, io->debug_data);
+
+	return G_IO_STATUS_NORMAL;
+}
+
+static GIOStatus read_channel(GAtIO *io, gsize *rbytes)
+{
+	unsigned char *buf = ring_buffer_write_ptr(io->buf, 0);
+	gsize toread = ring_buffer_avail_no_wrap(io->buf);
+	GIOStatus status;
+
+	status = g_io_channel_read_chars(io->channel, (char *) buf,
+						toread, rbytes, NULL);
+	g_at_util_debug_chat(TRUE, (char *)buf, *rbytes,
+				io->debugf, io->debug_data);
+
+	return status;
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 				gpointer data)
 {
-	unsigned char *buf;
 	GAtIO *io = data;
 	GIOStatus status;
 	gsize rbytes;
-	gsize toread;
 	gsize total_read = 0;
 	guint read_count = 0;
 
@@ -95,23 +144,27 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 	/* Regardless of condition, try to read all the data available */
 	do {
-		toread = ring_buffer_avail_no_wrap(io->buf);
+		if (ring_buffer_avail(io->buf) == 0)
+			break;
 
-		if (toread == 0)
+		if (read_count > 0 && (guint) ring_buffer_avail(io->buf) <
+							io->min_read_space)
 			break;
 
 		rbytes = 0;
-		buf = ring_buffer_write_ptr(io->buf, 0);
 
-		status = g_io_channel_read_chars(channel, (char *) buf,
-							toread, &rbytes, NULL);
-		g_at_util_debug_chat(TRUE, (char *)buf, rbytes,
-					io->debugf, io->debug_data);
+		if (io->fd >= 0)
+			status = read_fd(io, &rbytes);
+		else
+			status = read_channel(io, &rbytes);
 
 		read_count++;
 
 		total_read += rbytes;
 
+		io->stats.read_calls += 1;
+		io->stats.bytes_read += rbytes;
+
 		if (rbytes > 0)
 			ring_buffer_write_advance(io->buf, rbytes);
 
@@ -138,21 +191,120 @@ gsize g_at_io_write(GAtIO *io, const gchar *data, gsize count)
 {
 	GIOStatus status;
 	gsize bytes_written;
+	struct iovec iov;
+
+	if (io->fd >= 0) {
+		iov.iov_base = (gchar *) data;
+		iov.iov_len = count;
+
+		return g_at_io_writev(io, &iov, 1);
+	}
 
 	status = g_io_channel_write_chars(io->channel, data,
 						count, &bytes_written, NULL);
 
+	io->stats.write_calls += 1;
+
+	if (status == G_IO_STATUS_AGAIN) {
+		io->write_blocked = TRUE;
+		return 0;
+	}
+
 	if (status != G_IO_STATUS_NORMAL) {
 		g_source_remove(io->read_watch);
 		return 0;
 	}
 
+	io->stats.bytes_written += bytes_written;
+
 	g_at_util_debug_chat(FALSE, data, bytes_written,
 				io->debugf, io->debug_data);
 
 	return bytes_written;
 }
 
+/*
+ * Writes the iovcnt buffers described by iov with a single system call if
+ * the channel allows for it.  Returns the number of bytes written, 0 if
+ * the channel is full or on error in which case the channel is shut down
+ * as with g_at_io_write.
+ */
+gsize g_at_io_writev(GAtIO *io, const struct iovec *iov, int iovcnt)
+{
+	gsize bytes_written = 0;
+	gsize left = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		left += iov[i].iov_len;
+
+	if (left == 0)
+		return 0;
+
+	if (io->fd < 0) {
+		for (i = 0; i < iovcnt; i++) {
+			gsize written = g_at_io_write(io, iov[i].iov_base,
+							iov[i].iov_len);
+
+			bytes_written += written;
+
+			if (written < iov[i].iov_len)
+				break;
+		}
+
+		return bytes_written;
+	}
+
+	do {
+		ret = writev(io->fd, iov, iovcnt);
+	} while (ret < 0 && errno == EINTR);
+
+	io->stats.write_calls += 1;
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		io->write_blocked = TRUE;
+		return 0;
+	}
+
+	if (ret <= 0) {
+		g_source_remove(io->read_watch);
+		return 0;
+	}
+
+	io->stats.bytes_written += ret;
+
+	for (i = 0, left = ret; left > 0; i++) {
+		gsize len = MIN(left, iov[i].iov_len);
+
+		g_at_util_debug_chat(FALSE, iov[i].iov_base, len,
+					io->debugf, io->debug_data);
+		left -= len;
+	}
+
+	return ret;
+}
+
+/*
+ * Writes as much of the data queued in buf as possible and drains what
+ * was written.  Returns the number of bytes written.
+ */
+gsize g_at_io_write_ring_buffer(GAtIO *io, struct ring_buffer *buf)
+{
+	struct iovec iov[2];
+	gsize bytes_written;
+	int n;
+
+	n = ring_buffer_read_iov(buf, iov);
+	if (n == 0)
+		return 0;
+
+	bytes_written = g_at_io_writev(io, iov, n);
+	ring_buffer_drain(buf, bytes_written);
+
+	return bytes_written;
+}
+
 static void write_watcher_destroy_notify(gpointer user_data)
 {
 	GAtIO *io = user_data;
@@ -179,7 +331,16 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 	if (io->write_handler == NULL)
 		return FALSE;
 
-	return io->write_handler(io->write_data);
+	io->write_blocked = FALSE;
+
+	if (io->write_handler(io->write_data) == TRUE)
+		return TRUE;
+
+	/*
+	 * A handler that could not write anything because the channel is
+	 * full still has data pending, keep waiting until there is room
+	 */
+	return io->write_blocked;
 }
 
 static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
@@ -213,6 +374,7 @@ static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
 		goto error;
 
 	io->channel = channel;
+	io->fd = -1;
 	io->read_watch = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT,
 				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
 				received_data, io,
@@ -388,6 +550,46 @@ void g_at_io_set_write_done(GAtIO *io, GAtDisconnectFunc func,
 	io->write_done_data = user_data;
 }
 
+gboolean g_at_io_set_max_read_attempts(GAtIO *io, guint attempts)
+{
+	if (io == NULL || attempts == 0)
+		return FALSE;
+
+	io->max_read_attempts = attempts;
+
+	return TRUE;
+}
+
+gboolean g_at_io_set_min_read_space(GAtIO *io, guint bytes)
+{
+	if (io == NULL)
+		return FALSE;
+
+	io->min_read_space = bytes;
+
+	return TRUE;
+}
+
+gboolean g_at_io_set_fd(GAtIO *io, int fd)
+{
+	if (io == NULL)
+		return FALSE;
+
+	io->fd = fd;
+
+	return TRUE;
+}
+
+gboolean g_at_io_get_stats(GAtIO *io, GAtIOStats *stats)
+{
+	if (io == NULL || stats == NULL)
+		return FALSE;
+
+	*stats = io->stats;
+
+	return TRUE;
+}
+
 void g_at_io_drain_ring_buffer(GAtIO *io, guint len)
 {
 	ring_buffer_drain(io->buf, len);
@@ -33,6 +33,16 @@ struct _GAtIO;
 typedef struct _GAtIO GAtIO;
 
 struct ring_buffer;
+struct iovec;
+
+struct _GAtIOStats {
+	guint64 read_calls;			/* read system calls */
+	guint64 bytes_read;
+	guint64 write_calls;			/* write system calls */
+	guint64 bytes_written;
+};
+
+typedef struct _GAtIOStats GAtIOStats;
 
 typedef void (*GAtIOReadFunc)(struct ring_buffer *buffer, gpointer user_data);
 typedef gboolean (*GAtIOWriteFunc)(gpointer user_data);
@@ -55,6 +65,31 @@ void g_at_io_set_write_done(GAtIO *io, GAtDisconnectFunc func,
 void g_at_io_drain_ring_buffer(GAtIO *io, guint len);
 
 gsize g_at_io_write(GAtIO *io, const gchar *data, gsize count);
+gsize g_at_io_writev(GAtIO *io, const struct iovec *iov, int iovcnt);
+gsize g_at_io_write_ring_buffer(GAtIO *io, struct ring_buffer *buf);
+
+gboolean g_at_io_get_stats(GAtIO *io, GAtIOStats *stats);
+
+/*!
+ * Sets how many times the channel is read from per wakeup before the read
+ * handler gets called.  Only useful for non-blocking channels.
+ */
+gboolean g_at_io_set_max_read_attempts(GAtIO *io, guint attempts);
+
+/*!
+ * Stops reading more data within one wakeup once less than bytes are free
+ * in the read buffer.  Lets datagram channels read several packets per
+ * wakeup without truncating any of them.
+ */
+gboolean g_at_io_set_min_read_space(GAtIO *io, guint bytes);
+
+/*!
+ * Declares the fd behind the channel, which then gets read and written
+ * directly, covering both halves of a wrapped ring buffer with a single
+ * readv / writev.  Only channels created by g_io_channel_unix_new qualify,
+ * a fd of -1 goes back to the GIOChannel functions.
+ */
+gboolean g_at_io_set_fd(GAtIO *io, int fd);
 
 gboolean g_at_io_set_disconnect_function(GAtIO *io,
 			GAtDisconnectFunc disconnect, gpointer user_data);
@@ -49,10 +49,19 @@ typedef void (*GAtMuxWriteFrame)(GAtMux *mux, guint8 dlc, guint8 control,
  * Refer to Section 5.6 in 27.007
  */
 #define MAX_CHANNELS 61
-#define BITMAP_SIZE 8
 #define MUX_CHANNEL_BUFFER_SIZE 4096
 #define MUX_BUFFER_SIZE 4096
 
+/*
+ * Every time the serial port becomes writable at most MUX_WRITE_BUDGET bytes
+ * of DLC payload are framed and written out, so that data queued behind it
+ * on another DLC never waits for more than that.  Within the budget DLCs are
+ * served by deficit round robin, each one getting MUX_SCHED_QUANTUM bytes
+ * per unit of weight and round.
+ */
+#define MUX_WRITE_BUDGET 1024
+#define MUX_SCHED_QUANTUM 128
+
 struct _GAtMuxChannel
 {
 	GIOChannel channel;
@@ -62,6 +71,11 @@ struct _GAtMuxChannel
 	GSList *sources;
 	gboolean throttled;
 	guint dlc;
+	gboolean newdata;			/* Listed in mux->newdata */
+	struct ring_buffer *tx_buffer;		/* Data waiting to be framed */
+	guint weight;				/* Round robin weight */
+	gboolean control;			/* Control DLC, see scheduler */
+	int deficit;				/* Bytes left in this round */
 };
 
 struct _GAtMuxWatch
@@ -81,11 +95,15 @@ struct _GAtMux {
 	GAtDebugFunc debugf;			/* debugging output function */
 	gpointer debug_data;			/* Data to pass to debug func */
 	GAtMuxChannel *dlcs[MAX_CHANNELS];	/* DLCs opened by the MUX */
-	guint8 newdata[BITMAP_SIZE];		/* Channels that got new data */
+	guint8 newdata[MAX_CHANNELS];		/* Channels that got new data */
+	int num_newdata;			/* Entries used in newdata */
 	const GAtMuxDriver *driver;		/* Driver functions */
 	void *driver_data;			/* Driver data */
-	char buf[MUX_BUFFER_SIZE];		/* Buffer on the main mux */
-	int buf_used;				/* Bytes of buf being used */
+	struct ring_buffer *buf;		/* Buffer on the main mux */
+	guint8 stitch[MUX_BUFFER_SIZE];		/* Frames wrapping around buf */
+	GAtMuxScheduler scheduler;		/* How DLC writes are ordered */
+	int sched_next;				/* Next DLC index to serve */
+	gboolean sched_resume;			/* sched_next has deficit left */
 	gboolean shutdown;
 };
 
@@ -221,49 +239,94 @@ static void dispatch_sources(GAtMuxChannel *channel, GIOCondition condition)
 	g_slist_free_full(refs, (GDestroyNotify) g_source_unref);
 }
 
+/*
+ * Hands the frames in the receive buffer to the driver right where they are.
+ * Only a frame wrapping around the end of the buffer gets copied, along with
+ * as little of what follows it as it takes to complete the frame.
+ */
+static void feed_buffer(GAtMux *mux)
+{
+	int len;
+
+	while ((len = ring_buffer_len(mux->buf)) > 0) {
+		int tail = ring_buffer_len_no_wrap(mux->buf);
+		int want;
+		int used;
+		int nread;
+
+		nread = mux->driver->feed_data(mux,
+					ring_buffer_read_ptr(mux->buf, 0), tail);
+
+		for (want = tail, used = 0; nread == 0 && want < len; ) {
+			if (used == 0) {
+				memcpy(mux->stitch,
+					ring_buffer_read_ptr(mux->buf, 0), tail);
+				used = tail;
+			}
+
+			want = MIN(want * 2, len);
+			memcpy(mux->stitch + used,
+				ring_buffer_read_ptr(mux->buf, used),
+				want - used);
+			used = want;
+
+			nread = mux->driver->feed_data(mux, mux->stitch, want);
+		}
+
+		if (nread == 0)
+			break;
+
+		ring_buffer_drain(mux->buf, nread);
+	}
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 							gpointer data)
 {
 	GAtMux *mux = data;
 	int i;
-	GIOStatus status;
+	GIOStatus status = G_IO_STATUS_NORMAL;
 	gsize bytes_read;
+	gsize total_read = 0;
+	gsize toread;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
 
 	debug(mux, "received data");
 
-	bytes_read = 0;
-	status = g_io_channel_read_chars(mux->channel, mux->buf + mux->buf_used,
-					sizeof(mux->buf) - mux->buf_used,
-					&bytes_read, NULL);
+	/* Read into the second part of the buffer if the first one fills */
+	while ((toread = ring_buffer_avail_no_wrap(mux->buf)) > 0) {
+		bytes_read = 0;
+		status = g_io_channel_read_chars(mux->channel,
+				(gchar *) ring_buffer_write_ptr(mux->buf, 0),
+				toread, &bytes_read, NULL);
 
-	mux->buf_used += bytes_read;
+		ring_buffer_write_advance(mux->buf, bytes_read);
+		total_read += bytes_read;
 
-	if (bytes_read > 0 && mux->driver->feed_data) {
-		int nread;
-
-		memset(mux->newdata, 0, BITMAP_SIZE);
-
-		nread = mux->driver->feed_data(mux, mux->buf, mux->buf_used);
-		mux->buf_used -= nread;
+		if (status != G_IO_STATUS_NORMAL || bytes_read < toread)
+			break;
+	}
 
-		if (mux->buf_used > 0)
-			memmove(mux->buf, mux->buf + nread, mux->buf_used);
+	if (total_read > 0 && mux->driver->feed_data) {
+		feed_buffer(mux);
 
-		for (i = 1; i <= MAX_CHANNELS; i++) {
-			int offset = i / 8;
-			int bit = i % 8;
+		for (i = 0; i < mux->num_newdata; i++) {
+			GAtMuxChannel *dlc = mux->dlcs[mux->newdata[i] - 1];
 
-			if (!(mux->newdata[offset] & (1 << bit)))
+			/* Might have been closed by an earlier callback */
+			if (dlc == NULL)
 				continue;
 
-			debug(mux, "dispatching sources for channel: %p",
-				mux->dlcs[i-1]);
+			dlc->newdata = FALSE;
+
+			debug(mux, "dispatching sources for channel: %p", dlc);
 
-			dispatch_sources(mux->dlcs[i-1], G_IO_IN);
+			dispatch_sources(dlc, G_IO_IN);
 		}
+
+		mux->num_newdata = 0;
 	}
 
 	if (cond & (G_IO_HUP | G_IO_ERR))
@@ -272,7 +335,7 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN)
 		return FALSE;
 
-	if (mux->buf_used == sizeof(mux->buf))
+	if (ring_buffer_avail(mux->buf) == 0)
 		return FALSE;
 
 	return TRUE;
@@ -285,6 +348,100 @@ static void write_watcher_destroy_notify(gpointer user_data)
 	mux->write_watch = 0;
 }
 
+static gboolean channel_can_send(GAtMuxChannel *channel)
+{
+	if (channel == NULL || channel->throttled)
+		return FALSE;
+
+	return ring_buffer_len(channel->tx_buffer) > 0;
+}
+
+/* Frames and writes out at most max bytes queued on the DLC */
+static int channel_send(GAtMux *mux, GAtMuxChannel *channel, int max)
+{
+	int sent = 0;
+
+	while (sent < max) {
+		int len = ring_buffer_len_no_wrap(channel->tx_buffer);
+		unsigned char *buf;
+
+		if (len == 0)
+			break;
+
+		if (len > max - sent)
+			len = max - sent;
+
+		buf = ring_buffer_read_ptr(channel->tx_buffer, 0);
+
+		if (mux->driver->write)
+			mux->driver->write(mux, channel->dlc, buf, len);
+
+		ring_buffer_drain(channel->tx_buffer, len);
+		sent += len;
+	}
+
+	return sent;
+}
+
+static void schedule_writes(GAtMux *mux)
+{
+	gboolean priority = mux->scheduler == G_AT_MUX_SCHEDULER_PRIORITY;
+	int budget = MUX_WRITE_BUDGET;
+	int idle = 0;
+	int i;
+
+	/*
+	 * With strict priority, whatever the control DLCs have queued goes
+	 * out first and is not accounted against the budget
+	 */
+	for (i = 0; priority && i < MAX_CHANNELS; i++) {
+		GAtMuxChannel *channel = mux->dlcs[i];
+
+		if (!channel_can_send(channel) || channel->control == FALSE)
+			continue;
+
+		channel_send(mux, channel, ring_buffer_len(channel->tx_buffer));
+	}
+
+	/* Stop once a full pass found nothing to send */
+	while (budget > 0 && idle < MAX_CHANNELS) {
+		GAtMuxChannel *channel = mux->dlcs[mux->sched_next];
+		int sent;
+
+		if (!channel_can_send(channel) ||
+				(priority && channel->control)) {
+			if (channel)
+				channel->deficit = 0;
+
+			mux->sched_resume = FALSE;
+			mux->sched_next = (mux->sched_next + 1) % MAX_CHANNELS;
+			idle += 1;
+			continue;
+		}
+
+		idle = 0;
+
+		if (mux->sched_resume == FALSE)
+			channel->deficit += channel->weight * MUX_SCHED_QUANTUM;
+
+		sent = channel_send(mux, channel, MIN(channel->deficit, budget));
+		channel->deficit -= sent;
+		budget -= sent;
+
+		if (ring_buffer_len(channel->tx_buffer) == 0)
+			channel->deficit = 0;
+
+		/* Out of budget, carry on with this DLC on the next wakeup */
+		if (channel->deficit > 0) {
+			mux->sched_resume = TRUE;
+			break;
+		}
+
+		mux->sched_resume = FALSE;
+		mux->sched_next = (mux->sched_next + 1) % MAX_CHANNELS;
+	}
+}
+
 static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
@@ -296,6 +453,7 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 
 	debug(mux, "can write data");
 
+	/* Let the writers refill the queues that have room left */
 	for (dlc = 0; dlc < MAX_CHANNELS; dlc += 1) {
 		GAtMuxChannel *channel = mux->dlcs[dlc];
 
@@ -307,11 +465,16 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 		if (channel->throttled)
 			continue;
 
+		if (ring_buffer_avail(channel->tx_buffer) == 0)
+			continue;
+
 		debug(mux, "dispatching write sources: %p", channel);
 
 		dispatch_sources(channel, G_IO_OUT);
 	}
 
+	schedule_writes(mux);
+
 	for (dlc = 0; dlc < MAX_CHANNELS; dlc += 1) {
 		GAtMuxChannel *channel = mux->dlcs[dlc];
 		GSList *l;
@@ -323,6 +486,9 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 		if (channel->throttled)
 			continue;
 
+		if (ring_buffer_len(channel->tx_buffer) > 0)
+			return TRUE;
+
 		for (l = channel->sources; l; l = l->next) {
 			source = l->data;
 
@@ -365,8 +531,6 @@ void g_at_mux_feed_dlc_data(GAtMux *mux, guint8 dlc,
 	GAtMuxChannel *channel;
 
 	int written;
-	int offset;
-	int bit;
 
 	debug(mux, "deliver_data: dlc: %hu", dlc);
 
@@ -383,10 +547,11 @@ void g_at_mux_feed_dlc_data(GAtMux *mux, guint8 dlc,
 	if (written < 0)
 		return;
 
-	offset = dlc / 8;
-	bit = dlc % 8;
+	if (channel->newdata == FALSE) {
+		channel->newdata = TRUE;
+		mux->newdata[mux->num_newdata++] = dlc;
+	}
 
-	mux->newdata[offset] |= 1 << bit;
 	channel->condition |= G_IO_IN;
 }
 
@@ -409,6 +574,9 @@ void g_at_mux_set_dlc_status(GAtMux *mux, guint8 dlc, int status)
 		mux->dlcs[dlc-1]->throttled = FALSE;
 		debug(mux, "setting throttled to FALSE");
 
+		if (ring_buffer_len(channel->tx_buffer) > 0)
+			wakeup_writer(mux);
+
 		for (l = mux->dlcs[dlc-1]->sources; l; l = l->next) {
 			GAtMuxWatch *source = l->data;
 
@@ -499,11 +667,15 @@ static GIOStatus channel_write(GIOChannel *channel, const gchar *buf,
 				gsize count, gsize *bytes_written, GError **err)
 {
 	GAtMuxChannel *mux_channel = (GAtMuxChannel *) channel;
-	GAtMux *mux = mux_channel->mux;
 
-	if (mux->driver->write)
-		mux->driver->write(mux, mux_channel->dlc, buf, count);
-	*bytes_written = count;
+	/* Frames are sent by the scheduler once the serial port is ready */
+	*bytes_written = ring_buffer_write(mux_channel->tx_buffer, buf, count);
+
+	if (*bytes_written == 0)
+		return G_IO_STATUS_AGAIN;
+
+	if (mux_channel->throttled == FALSE)
+		wakeup_writer(mux_channel->mux);
 
 	return G_IO_STATUS_NORMAL;
 }
@@ -523,6 +695,9 @@ static GIOStatus channel_close(GIOChannel *channel, GError **err)
 
 	dispatch_sources(mux_channel, G_IO_NVAL);
 
+	/* Don't lose what was written before the close */
+	channel_send(mux, mux_channel, ring_buffer_len(mux_channel->tx_buffer));
+
 	if (mux->driver->close_dlc)
 		mux->driver->close_dlc(mux, mux_channel->dlc);
 
@@ -536,6 +711,7 @@ static void channel_free(GIOChannel *channel)
 	GAtMuxChannel *mux_channel = (GAtMuxChannel *) channel;
 
 	ring_buffer_free(mux_channel->buffer);
+	ring_buffer_free(mux_channel->tx_buffer);
 
 	g_free(channel);
 }
@@ -604,6 +780,12 @@ GAtMux *g_at_mux_new(GIOChannel *channel, const GAtMuxDriver *driver)
 	if (mux == NULL)
 		return NULL;
 
+	mux->buf = ring_buffer_new(MUX_BUFFER_SIZE);
+	if (mux->buf == NULL) {
+		g_free(mux);
+		return NULL;
+	}
+
 	mux->ref_count = 1;
 	mux->driver = driver;
 	mux->shutdown = TRUE;
@@ -639,6 +821,7 @@ void g_at_mux_unref(GAtMux *mux)
 		if (mux->driver->remove)
 			mux->driver->remove(mux);
 
+		ring_buffer_free(mux->buf);
 		g_free(mux);
 	}
 }
@@ -762,6 +945,8 @@ GIOChannel *g_at_mux_create_channel(GAtMux *mux)
 	mux_channel->dlc = i+1;
 	mux_channel->buffer = ring_buffer_new(MUX_CHANNEL_BUFFER_SIZE);
 	mux_channel->throttled = FALSE;
+	mux_channel->tx_buffer = ring_buffer_new(MUX_CHANNEL_BUFFER_SIZE);
+	mux_channel->weight = 1;
 
 	mux->dlcs[i] = mux_channel;
 
@@ -770,6 +955,66 @@ GIOChannel *g_at_mux_create_channel(GAtMux *mux)
 	return channel;
 }
 
+static GAtMuxChannel *mux_channel_lookup(GAtMux *mux, GIOChannel *channel)
+{
+	GAtMuxChannel *mux_channel = (GAtMuxChannel *) channel;
+
+	if (mux == NULL || channel == NULL)
+		return NULL;
+
+	if (channel->funcs != &channel_funcs || mux_channel->mux != mux)
+		return NULL;
+
+	return mux_channel;
+}
+
+gboolean g_at_mux_set_scheduler(GAtMux *mux, GAtMuxScheduler scheduler)
+{
+	if (mux == NULL)
+		return FALSE;
+
+	switch (scheduler) {
+	case G_AT_MUX_SCHEDULER_ROUND_ROBIN:
+	case G_AT_MUX_SCHEDULER_PRIORITY:
+		break;
+	default:
+		return FALSE;
+	}
+
+	mux->scheduler = scheduler;
+
+	return TRUE;
+}
+
+gboolean g_at_mux_set_channel_weight(GAtMux *mux, GIOChannel *channel,
+					guint weight)
+{
+	GAtMuxChannel *mux_channel = mux_channel_lookup(mux, channel);
+
+	if (mux_channel == NULL)
+		return FALSE;
+
+	if (weight == 0 || weight > MUX_BUFFER_SIZE / MUX_SCHED_QUANTUM)
+		return FALSE;
+
+	mux_channel->weight = weight;
+
+	return TRUE;
+}
+
+gboolean g_at_mux_set_channel_control(GAtMux *mux, GIOChannel *channel,
+					gboolean control)
+{
+	GAtMuxChannel *mux_channel = mux_channel_lookup(mux, channel);
+
+	if (mux_channel == NULL)
+		return FALSE;
+
+	mux_channel->control = control;
+
+	return TRUE;
+}
+
 static void msd_free(gpointer user_data)
 {
 	struct mux_setup_data *msd = user_data;
@@ -34,6 +34,7 @@ struct _GAtMux;
 typedef struct _GAtMux GAtMux;
 typedef struct _GAtMuxDriver GAtMuxDriver;
 typedef enum _GAtMuxChannelStatus GAtMuxChannelStatus;
+typedef enum _GAtMuxScheduler GAtMuxScheduler;
 typedef void (*GAtMuxSetupFunc)(GAtMux *mux, gpointer user_data);
 
 enum _GAtMuxDlcStatus {
@@ -43,6 +44,11 @@ enum _GAtMuxDlcStatus {
 	G_AT_MUX_DLC_STATUS_DV = 0x80,
 };
 
+enum _GAtMuxScheduler {
+	G_AT_MUX_SCHEDULER_ROUND_ROBIN = 0,
+	G_AT_MUX_SCHEDULER_PRIORITY,
+};
+
 struct _GAtMuxDriver {
 	void (*remove)(GAtMux *mux);
 	gboolean (*startup)(GAtMux *mux);
@@ -71,6 +77,21 @@ gboolean g_at_mux_set_debug(GAtMux *mux, GAtDebugFunc func, gpointer user_data);
 
 GIOChannel *g_at_mux_create_channel(GAtMux *mux);
 
+/*!
+ * Writes to the DLCs are queued and sent out by a scheduler, a bounded
+ * amount each time the serial port becomes writable.  With the default
+ * G_AT_MUX_SCHEDULER_ROUND_ROBIN, DLCs get a share of the port proportional
+ * to their weight (1 by default).  With G_AT_MUX_SCHEDULER_PRIORITY,
+ * channels flagged as control channels are always served first and the
+ * remaining ones share the rest by weight.  This keeps AT command and URC
+ * latency bounded while a data channel is busy.
+ */
+gboolean g_at_mux_set_scheduler(GAtMux *mux, GAtMuxScheduler scheduler);
+gboolean g_at_mux_set_channel_weight(GAtMux *mux, GIOChannel *channel,
+					guint weight);
+gboolean g_at_mux_set_channel_control(GAtMux *mux, GIOChannel *channel,
+					gboolean control);
+
 /*!
  * Multiplexer driver integration functions
  */
@@ -29,12 +29,24 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
 #include "ringbuffer.h"
 #include "gatrawip.h"
 
+/* Reads from the modem per wakeup in batched mode */
+#define BATCH_READS		16
+
+/*
+ * Reads from the network interface per wakeup in batched mode, each read
+ * returns one packet and packets of the usual MTU of 1500 need to fit into
+ * the GAtIO read buffer
+ */
+#define BATCH_TUN_READS		5
+#define TUN_MTU			1500
+
 struct _GAtRawIP {
 	gint ref_count;
 	GAtIO *io;
@@ -44,6 +56,11 @@ struct _GAtRawIP {
 	struct ring_buffer *tun_write_buffer;
 	GAtDebugFunc debugf;
 	gpointer debug_data;
+	gboolean batched;
+	GAtRawIPCounters uplink;
+	GAtRawIPCounters downlink;
+	unsigned int uplink_counted;	/* Bytes of uplink packets counted */
+	unsigned int downlink_counted;	/* Bytes of downlink packets counted */
 };
 
 GAtRawIP *g_at_rawip_new(GIOChannel *channel)
@@ -109,21 +126,79 @@ void g_at_rawip_unref(GAtRawIP *rawip)
 	g_free(rawip);
 }
 
+/*
+ * Returns the length of the IP packet starting at offset bytes into rbuf
+ * as given by its header, 0 if the header is incomplete or -1 if the data
+ * does not look like an IP packet
+ */
+static int ip_packet_len(struct ring_buffer *rbuf, unsigned int offset)
+{
+	unsigned char hdr[6];
+	unsigned int i;
+
+	if (ring_buffer_len(rbuf) < offset + sizeof(hdr))
+		return 0;
+
+	for (i = 0; i < sizeof(hdr); i++)
+		hdr[i] = *ring_buffer_read_ptr(rbuf, offset + i);
+
+	switch (hdr[0] >> 4) {
+	case 4:
+		if (((hdr[2] << 8) | hdr[3]) < 20)
+			return -1;
+
+		return (hdr[2] << 8) | hdr[3];
+	case 6:
+		return ((hdr[4] << 8) | hdr[5]) + 40;
+	}
+
+	return -1;
+}
+
+/* Counts the complete packets not counted yet */
+static void count_packets(struct ring_buffer *rbuf, unsigned int *counted,
+				GAtRawIPCounters *counters)
+{
+	unsigned int len = ring_buffer_len(rbuf);
+	int plen;
+
+	while (*counted < len) {
+		plen = ip_packet_len(rbuf, *counted);
+
+		/* Lost track of the packet boundaries */
+		if (plen < 0) {
+			*counted = len;
+			break;
+		}
+
+		if (plen == 0 || *counted + plen > len)
+			break;
+
+		counters->packets += 1;
+		*counted += plen;
+	}
+}
+
+static void account_written(unsigned int *counted,
+				GAtRawIPCounters *counters,
+				gsize bytes_written)
+{
+	counters->bytes += bytes_written;
+	*counted -= MIN(*counted, bytes_written);
+}
+
 static gboolean can_write_data(gpointer data)
 {
 	GAtRawIP *rawip = data;
-	unsigned int len;
-	unsigned char *buf;
 	gsize bytes_written;
 
 	if (rawip->write_buffer == NULL)
 		return FALSE;
 
-	len = ring_buffer_len_no_wrap(rawip->write_buffer);
-	buf = ring_buffer_read_ptr(rawip->write_buffer, 0);
-
-	bytes_written = g_at_io_write(rawip->io, (gchar *) buf, len);
-	ring_buffer_drain(rawip->write_buffer, bytes_written);
+	bytes_written = g_at_io_write_ring_buffer(rawip->io,
+							rawip->write_buffer);
+	account_written(&rawip->uplink_counted, &rawip->uplink,
+							bytes_written);
 
 	if (ring_buffer_len(rawip->write_buffer) > 0)
 		return TRUE;
@@ -136,18 +211,15 @@ static gboolean can_write_data(gpointer data)
 static gboolean tun_write_data(gpointer data)
 {
 	GAtRawIP *rawip = data;
-	unsigned int len;
-	unsigned char *buf;
 	gsize bytes_written;
 
 	if (rawip->tun_write_buffer == NULL)
 		return FALSE;
 
-	len = ring_buffer_len_no_wrap(rawip->tun_write_buffer);
-	buf = ring_buffer_read_ptr(rawip->tun_write_buffer, 0);
-
-	bytes_written = g_at_io_write(rawip->tun_io, (gchar *) buf, len);
-	ring_buffer_drain(rawip->tun_write_buffer, bytes_written);
+	bytes_written = g_at_io_write_ring_buffer(rawip->tun_io,
+						rawip->tun_write_buffer);
+	account_written(&rawip->downlink_counted, &rawip->downlink,
+							bytes_written);
 
 	if (ring_buffer_len(rawip->tun_write_buffer) > 0)
 		return TRUE;
@@ -157,10 +229,90 @@ static gboolean tun_write_data(gpointer data)
 	return FALSE;
 }
 
+/*
+ * The network interface takes one packet per write, so write out every
+ * complete packet on its own and keep a partial one for the next wakeup.
+ * Such writes never complete partially.  Returns FALSE if the interface
+ * could not take all the complete packets.
+ */
+static gboolean write_packets(GAtRawIP *rawip, struct ring_buffer *rbuf)
+{
+	struct iovec iov[2];
+	gsize bytes_written;
+	int plen;
+	int n;
+
+	while ((plen = ip_packet_len(rbuf, 0)) > 0) {
+		if (plen > ring_buffer_len(rbuf)) {
+			/* Cannot ever fit into the buffer, resynchronize */
+			if (plen > ring_buffer_capacity(rbuf))
+				plen = -1;
+
+			break;
+		}
+
+		n = ring_buffer_read_iov(rbuf, iov);
+
+		if ((int) iov[0].iov_len >= plen) {
+			iov[0].iov_len = plen;
+			n = 1;
+		} else
+			iov[1].iov_len = plen - iov[0].iov_len;
+
+		bytes_written = g_at_io_writev(rawip->tun_io, iov, n);
+		if (bytes_written == 0)
+			return FALSE;
+
+		ring_buffer_drain(rbuf, plen);
+
+		rawip->downlink.packets += 1;
+		rawip->downlink.bytes += plen;
+	}
+
+	if (plen < 0)
+		ring_buffer_drain(rbuf, ring_buffer_len(rbuf));
+
+	return TRUE;
+}
+
+static gboolean tun_write_packets(gpointer data)
+{
+	GAtRawIP *rawip = data;
+
+	if (rawip->tun_write_buffer == NULL)
+		return FALSE;
+
+	if (write_packets(rawip, rawip->tun_write_buffer) == FALSE)
+		return TRUE;
+
+	rawip->tun_write_buffer = NULL;
+
+	return FALSE;
+}
+
 static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
 	GAtRawIP *rawip = user_data;
 
+	rawip->downlink.wakeups += 1;
+
+	if (rawip->batched) {
+		/* Still waiting for the interface to take earlier packets */
+		if (rawip->tun_write_buffer)
+			return;
+
+		if (write_packets(rawip, rbuf) == TRUE)
+			return;
+
+		rawip->tun_write_buffer = rbuf;
+
+		g_at_io_set_write_handler(rawip->tun_io, tun_write_packets,
+						rawip);
+		return;
+	}
+
+	count_packets(rbuf, &rawip->downlink_counted, &rawip->downlink);
+
 	rawip->tun_write_buffer = rbuf;
 
 	g_at_io_set_write_handler(rawip->tun_io, tun_write_data, rawip);
@@ -169,6 +321,21 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 static void tun_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
 	GAtRawIP *rawip = user_data;
+	gsize bytes_written;
+
+	rawip->uplink.wakeups += 1;
+
+	count_packets(rbuf, &rawip->uplink_counted, &rawip->uplink);
+
+	/* Write out all the packets read with a single write */
+	if (rawip->batched && rawip->write_buffer == NULL) {
+		bytes_written = g_at_io_write_ring_buffer(rawip->io, rbuf);
+		account_written(&rawip->uplink_counted, &rawip->uplink,
+							bytes_written);
+
+		if (ring_buffer_len(rbuf) == 0)
+			return;
+	}
 
 	rawip->write_buffer = rbuf;
 
@@ -204,6 +371,7 @@ static void create_tun(GAtRawIP *rawip)
 	}
 
 	rawip->tun_io = g_at_io_new(channel);
+	g_at_io_set_fd(rawip->tun_io, fd);
 
 	g_io_channel_unref(channel);
 }
@@ -218,6 +386,12 @@ void g_at_rawip_open(GAtRawIP *rawip)
 	if (rawip->tun_io == NULL)
 		return;
 
+	if (rawip->batched) {
+		g_at_io_set_max_read_attempts(rawip->io, BATCH_READS);
+		g_at_io_set_max_read_attempts(rawip->tun_io, BATCH_TUN_READS);
+		g_at_io_set_min_read_space(rawip->tun_io, TUN_MTU);
+	}
+
 	g_at_io_set_read_handler(rawip->io, new_bytes, rawip);
 	g_at_io_set_read_handler(rawip->tun_io, tun_bytes, rawip);
 }
@@ -235,6 +409,8 @@ void g_at_rawip_shutdown(GAtRawIP *rawip)
 
 	rawip->write_buffer = NULL;
 	rawip->tun_write_buffer = NULL;
+	rawip->uplink_counted = 0;
+	rawip->downlink_counted = 0;
 
 	g_at_io_unref(rawip->tun_io);
 	rawip->tun_io = NULL;
@@ -257,3 +433,26 @@ void g_at_rawip_set_debug(GAtRawIP *rawip, GAtDebugFunc func,
 	rawip->debugf = func;
 	rawip->debug_data = user_data;
 }
+
+void g_at_rawip_set_batched(GAtRawIP *rawip, gboolean batched)
+{
+	if (rawip == NULL)
+		return;
+
+	rawip->batched = batched;
+}
+
+gboolean g_at_rawip_get_counters(GAtRawIP *rawip, GAtRawIPCounters *uplink,
+					GAtRawIPCounters *downlink)
+{
+	if (rawip == NULL)
+		return FALSE;
+
+	if (uplink)
+		*uplink = rawip->uplink;
+
+	if (downlink)
+		*downlink = rawip->downlink;
+
+	return TRUE;
+}
@@ -33,6 +33,14 @@ struct _GAtRawIP;
 
 typedef struct _GAtRawIP GAtRawIP;
 
+struct _GAtRawIPCounters {
+	guint64 packets;		/* Complete IP packets */
+	guint64 bytes;			/* Bytes written out */
+	guint64 wakeups;		/* Read handler invocations */
+};
+
+typedef struct _GAtRawIPCounters GAtRawIPCounters;
+
 GAtRawIP *g_at_rawip_new(GIOChannel *channel);
 GAtRawIP *g_at_rawip_new_from_io(GAtIO *io);
 
@@ -47,6 +55,21 @@ const char *g_at_rawip_get_interface(GAtRawIP *rawip);
 void g_at_rawip_set_debug(GAtRawIP *rawip, GAtDebugFunc func,
 						gpointer user_data);
 
+/*!
+ * In batched mode all complete packets read during a wakeup are passed on
+ * right away, one write per packet towards the network interface and a
+ * single write for all of them towards the modem.  Should be set before
+ * g_at_rawip_open.
+ */
+void g_at_rawip_set_batched(GAtRawIP *rawip, gboolean batched);
+
+/*!
+ * Returns the counters for packets going from the network interface to
+ * the modem in uplink and for the other direction in downlink
+ */
+gboolean g_at_rawip_get_counters(GAtRawIP *rawip, GAtRawIPCounters *uplink,
+					GAtRawIPCounters *downlink);
+
 #ifdef __cplusplus
 }
 #endif
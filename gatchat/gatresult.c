@@ -242,7 +242,8 @@ gboolean g_at_result_iter_next_hexstring(GAtResultIter *iter,
 	*length = (end - pos) / 2;
 
 	for (; pos < end; pos += 2)
-		sscanf(line + pos, "%02hhx", bufpos++);
+		*bufpos++ = g_ascii_xdigit_value(line[pos]) << 4 |
+				g_ascii_xdigit_value(line[pos + 1]);
 
 	if (line[end] == '"')
 		end += 1;
@@ -23,9 +23,12 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
 #include <glib.h>
 
 #include "gatsyntax.h"
+#include "gatutil.h"
 
 enum GSMV1_STATE {
 	GSMV1_STATE_IDLE = 0,
@@ -71,6 +74,23 @@ enum GSM_TELIT_STATE {
 	GSM_TELIT_STATE_PPP_DATA,
 };
 
+/*
+ * Returns the index of the first byte at or after i which is a or b, or len
+ * if there is none.  Used to skip runs of payload bytes, e.g. long hex PDUs,
+ * which cannot change the state of the parser.
+ */
+static inline gsize skip_to(const char *bytes, gsize i, gsize len,
+				char a, char b)
+{
+	const char *p;
+
+	if (a == b)
+		p = memchr(bytes + i, a, len - i);
+	else
+		p = g_at_util_memchr3(bytes + i, len - i, a, b, b);
+
+	return p ? (gsize) (p - bytes) : len;
+}
 
 static void gsmv1_hint(GAtSyntax *syntax, GAtSyntaxExpectHint hint)
 {
@@ -134,11 +154,19 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 				syntax->state = GSMV1_STATE_TERMINATOR_CR;
 			else if (byte == '"')
 				syntax->state = GSMV1_STATE_RESPONSE_STRING;
+			else {
+				i = skip_to(bytes, i, *len, '\r', '"');
+				continue;
+			}
 			break;
 
 		case GSMV1_STATE_RESPONSE_STRING:
 			if (byte == '"')
 				syntax->state = GSMV1_STATE_RESPONSE;
+			else {
+				i = skip_to(bytes, i, *len, '"', '"');
+				continue;
+			}
 			break;
 
 		case GSMV1_STATE_TERMINATOR_CR:
@@ -162,6 +190,10 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 		case GSMV1_STATE_MULTILINE_RESPONSE:
 			if (byte == '\r')
 				syntax->state = GSMV1_STATE_MULTILINE_TERMINATOR_CR;
+			else {
+				i = skip_to(bytes, i, *len, '\r', '\r');
+				continue;
+			}
 			break;
 
 		case GSMV1_STATE_MULTILINE_TERMINATOR_CR:
@@ -199,6 +231,10 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 		case GSMV1_STATE_PDU:
 			if (byte == '\r')
 				syntax->state = GSMV1_STATE_PDU_CR;
+			else {
+				i = skip_to(bytes, i, *len, '\r', '\r');
+				continue;
+			}
 			break;
 
 		case GSMV1_STATE_PDU_CR:
@@ -234,7 +270,8 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 				goto out;
 			}
 
-			break;
+			i = skip_to(bytes, i, *len, 26, '\r');
+			continue;
 
 		case GSMV1_STATE_PPP_DATA:
 			if (byte == '~') {
@@ -244,7 +281,8 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 				goto out;
 			}
 
-			break;
+			i = skip_to(bytes, i, *len, '~', '~');
+			continue;
 
 		case GSMV1_STATE_SHORT_PROMPT:
 			if (byte == '\r')
@@ -317,6 +355,10 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 			} else if (byte == '"')
 				syntax->state =
 					GSM_PERMISSIVE_STATE_RESPONSE_STRING;
+			else {
+				i = skip_to(bytes, i, *len, '\r', '"');
+				continue;
+			}
 			break;
 
 		case GSM_PERMISSIVE_STATE_RESPONSE_STRING:
@@ -327,6 +369,9 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 				i += 1;
 				res = G_AT_SYNTAX_RESULT_LINE;
 				goto out;
+			} else {
+				i = skip_to(bytes, i, *len, '"', '\r');
+				continue;
 			}
 			break;
 
@@ -343,7 +388,9 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 				res = G_AT_SYNTAX_RESULT_PDU;
 				goto out;
 			}
-			break;
+
+			i = skip_to(bytes, i, *len, '\r', '\r');
+			continue;
 
 		case GSM_PERMISSIVE_STATE_PROMPT:
 			if (byte == ' ') {
@@ -429,11 +476,19 @@ static GAtSyntaxResult gsm_telit_feed(GAtSyntax *syntax,
 				goto out;
 			} else if (byte == '"')
 				syntax->state = GSM_TELIT_STATE_RESPONSE_STRING;
+			else {
+				i = skip_to(bytes, i, *len, '\r', '"');
+				continue;
+			}
 			break;
 
 		case GSM_TELIT_STATE_RESPONSE_STRING:
 			if (byte == '"')
 				syntax->state = GSM_TELIT_STATE_RESPONSE;
+			else {
+				i = skip_to(bytes, i, *len, '"', '"');
+				continue;
+			}
 			break;
 
 		case GSM_TELIT_STATE_GUESS_PDU:
@@ -449,7 +504,9 @@ static GAtSyntaxResult gsm_telit_feed(GAtSyntax *syntax,
 				res = G_AT_SYNTAX_RESULT_PDU;
 				goto out;
 			}
-			break;
+
+			i = skip_to(bytes, i, *len, '\r', '\r');
+			continue;
 
 		case GSM_TELIT_STATE_PROMPT:
 			if (byte == ' ') {
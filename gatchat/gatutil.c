@@ -27,6 +27,10 @@
 #include <ctype.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <glib.h>
 
 #include "gatutil.h"
@@ -198,3 +202,60 @@ gboolean g_at_util_setup_io(GIOChannel *io, GIOFlags flags)
 
 	return TRUE;
 }
+
+#define ONES_64		0x0101010101010101ULL
+#define HIGHS_64	0x8080808080808080ULL
+
+/* Non-zero if any byte of the word is zero */
+#define HAS_ZERO_BYTE(w)	(((w) - ONES_64) & ~(w) & HIGHS_64)
+
+/*
+ * Like memchr, but looks for the first occurrence of any of three bytes.
+ * Runs of other bytes are skipped a whole vector (or machine word) at a
+ * time, pass the same byte more than once to look for fewer values.
+ */
+const void *g_at_util_memchr3(const void *buf, gsize len, guint8 c1,
+					guint8 c2, guint8 c3)
+{
+	const guint8 *p = buf;
+	const guint8 *end = p + len;
+	guint64 m1 = c1 * ONES_64;
+	guint64 m2 = c2 * ONES_64;
+	guint64 m3 = c3 * ONES_64;
+	guint64 w;
+
+#ifdef __SSE2__
+	__m128i v1 = _mm_set1_epi8(c1);
+	__m128i v2 = _mm_set1_epi8(c2);
+	__m128i v3 = _mm_set1_epi8(c3);
+
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, v1),
+				_mm_or_si128(_mm_cmpeq_epi8(v, v2),
+						_mm_cmpeq_epi8(v, v3)));
+		int mask = _mm_movemask_epi8(eq);
+
+		if (mask)
+			return p + __builtin_ctz(mask);
+
+		p += 16;
+	}
+#endif
+
+	while (end - p >= 8) {
+		memcpy(&w, p, sizeof(w));
+
+		if (HAS_ZERO_BYTE(w ^ m1) || HAS_ZERO_BYTE(w ^ m2) ||
+				HAS_ZERO_BYTE(w ^ m3))
+			break;
+
+		p += 8;
+	}
+
+	for (; p < end; p++)
+		if (*p == c1 || *p == c2 || *p == c3)
+			return p;
+
+	return NULL;
+}
@@ -39,6 +39,9 @@ void g_at_util_debug_hexdump(gboolean in, const unsigned char *buf, gsize len,
 
 gboolean g_at_util_setup_io(GIOChannel *io, GIOFlags flags);
 
+const void *g_at_util_memchr3(const void *buf, gsize len, guint8 c1,
+					guint8 c2, guint8 c3);
+
 #ifdef __cplusplus
 }
 #endif
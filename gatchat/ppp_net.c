@@ -40,6 +40,9 @@
 
 #define MAX_PACKET 1500
 
+/* Maximum number of packets taken off the tun device per wakeup */
+#define MAX_PACKETS_PER_WAKEUP 16
+
 struct ppp_net {
 	GAtPPP *ppp;
 	char *if_name;
@@ -99,7 +102,10 @@ void ppp_net_process_packet(struct ppp_net *net, const guint8 *packet,
 
 /*
  * packets received by the tun interface need to be written to
- * the modem.  So, just read a packet, write out to the modem
+ * the modem.  So, read the packets queued on the tun device and
+ * write them out to the modem.  The frames get encoded into the
+ * HDLC write buffers, which are flushed with a single write once
+ * we return to the main loop.
  */
 static gboolean ppp_net_callback(GIOChannel *channel, GIOCondition cond,
 				gpointer userdata)
@@ -108,11 +114,15 @@ static gboolean ppp_net_callback(GIOChannel *channel, GIOCondition cond,
 	GIOStatus status;
 	gsize bytes_read;
 	gchar *buf = (gchar *) net->ppp_packet->info;
+	int i;
 
 	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
 		return FALSE;
 
-	if (cond & G_IO_IN) {
+	if (!(cond & G_IO_IN))
+		return TRUE;
+
+	for (i = 0; i < MAX_PACKETS_PER_WAKEUP; i++) {
 		/* leave space to add PPP protocol field */
 		status = g_io_channel_read_chars(channel, buf, net->mtu,
 							&bytes_read, NULL);
@@ -120,9 +130,13 @@ static gboolean ppp_net_callback(GIOChannel *channel, GIOCondition cond,
 			ppp_transmit(net->ppp, (guint8 *) net->ppp_packet,
 					bytes_read);
 
-		if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN)
+		if (status == G_IO_STATUS_AGAIN)
+			break;
+
+		if (status != G_IO_STATUS_NORMAL)
 			return FALSE;
 	}
+
 	return TRUE;
 }
 
@@ -181,7 +195,8 @@ struct ppp_net *ppp_net_new(GAtPPP *ppp, int fd)
 	if (channel == NULL)
 		goto error;
 
-	if (!g_at_util_setup_io(channel, 0))
+	/* Non-blocking, so that the tun device can be drained */
+	if (!g_at_util_setup_io(channel, G_IO_FLAG_NONBLOCK))
 		goto error;
 
 	g_io_channel_set_buffered(channel, FALSE);
@@ -24,6 +24,7 @@
 #endif
 
 #include <string.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
@@ -106,6 +107,27 @@ int ring_buffer_avail_no_wrap(struct ring_buffer *buf)
 	return MIN(len, buf->size - offset);
 }
 
+int ring_buffer_avail_iov(struct ring_buffer *buf, struct iovec *iov)
+{
+	unsigned int offset = buf->in & buf->mask;
+	unsigned int len = buf->size - buf->in + buf->out;
+	unsigned int end = MIN(len, buf->size - offset);
+
+	if (len == 0)
+		return 0;
+
+	iov[0].iov_base = buf->buffer + offset;
+	iov[0].iov_len = end;
+
+	if (end == len)
+		return 1;
+
+	iov[1].iov_base = buf->buffer;
+	iov[1].iov_len = len - end;
+
+	return 2;
+}
+
 int ring_buffer_write_advance(struct ring_buffer *buf, unsigned int len)
 {
 	len = MIN(len, buf->size - buf->in + buf->out);
@@ -158,6 +180,27 @@ int ring_buffer_len_no_wrap(struct ring_buffer *buf)
 	return MIN(len, buf->size - offset);
 }
 
+int ring_buffer_read_iov(struct ring_buffer *buf, struct iovec *iov)
+{
+	unsigned int offset = buf->out & buf->mask;
+	unsigned int len = buf->in - buf->out;
+	unsigned int end = MIN(len, buf->size - offset);
+
+	if (len == 0)
+		return 0;
+
+	iov[0].iov_base = buf->buffer + offset;
+	iov[0].iov_len = end;
+
+	if (end == len)
+		return 1;
+
+	iov[1].iov_base = buf->buffer;
+	iov[1].iov_len = len - end;
+
+	return 2;
+}
+
 unsigned char *ring_buffer_read_ptr(struct ring_buffer *buf,
 					unsigned int offset)
 {
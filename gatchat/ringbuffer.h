@@ -20,6 +20,7 @@
  */
 
 struct ring_buffer;
+struct iovec;
 
 /*!
  * Creates a new ring buffer with capacity size
@@ -73,6 +74,13 @@ int ring_buffer_avail(struct ring_buffer *buf);
  */
 int ring_buffer_avail_no_wrap(struct ring_buffer *buf);
 
+/*!
+ * Fills iov with up to two regions describing the free space of the buffer,
+ * in order.  Returns the number of regions filled in.  Meant to be used with
+ * readv and the ring_buffer_write_advance function.
+ */
+int ring_buffer_avail_iov(struct ring_buffer *buf, struct iovec *iov);
+
 /*!
  * Reads data from the ring buffer buf into memory region pointed to by data.
  * A maximum of len bytes will be read.  Returns -1 if the read failed or
@@ -89,6 +97,13 @@ int ring_buffer_read(struct ring_buffer *buf, void *data,
 unsigned char *ring_buffer_read_ptr(struct ring_buffer *buf,
 					unsigned int offset);
 
+/*!
+ * Fills iov with up to two regions describing the data available to be read,
+ * in order.  Returns the number of regions filled in.  Meant to be used with
+ * writev and the ring_buffer_drain function.
+ */
+int ring_buffer_read_iov(struct ring_buffer *buf, struct iovec *iov);
+
 /*!
  * Returns the number of bytes currently available to be read in the buffer
  */
@@ -147,6 +147,15 @@ struct ofono_sim_driver {
 			int record, int length,
 			const unsigned char *path, unsigned int path_len,
 			ofono_sim_read_cb_t cb, void *data);
+	/*
+	 * Optional, reads count records of a linear fixed EF starting with
+	 * record.  The records are returned one after the other, the driver
+	 * may return fewer records than asked for but at least one.
+	 */
+	void (*read_file_linear_multi)(struct ofono_sim *sim, int fileid,
+			int record, int count, int length,
+			const unsigned char *path, unsigned int path_len,
+			ofono_sim_read_cb_t cb, void *data);
 	void (*read_file_cyclic)(struct ofono_sim *sim, int fileid,
 			int record, int length,
 			const unsigned char *path, unsigned int path_len,
@@ -220,6 +229,13 @@ void ofono_sim_remove(struct ofono_sim *sim);
 void ofono_sim_set_data(struct ofono_sim *sim, void *data);
 void *ofono_sim_get_data(struct ofono_sim *sim);
 
+/*
+ * Lets the driver take several reads of different EFs at once, by default
+ * the SIM filesystem is accessed one request at a time
+ */
+void ofono_sim_set_max_pending_reads(struct ofono_sim *sim,
+					unsigned int count);
+
 const char *ofono_sim_get_imsi(struct ofono_sim *sim);
 const char *ofono_sim_get_mcc(struct ofono_sim *sim);
 const char *ofono_sim_get_mnc(struct ofono_sim *sim);
@@ -71,6 +71,9 @@
 #define CFUN_STATE_OFF 4
 #define CFUN_SWITCH_DELAY 3000000
 
+/* V.250 guarantees the DCE accepts command lines of at least 40 chars */
+#define AUX_CONCAT_LENGTH 40
+
 static const char *none_prefix[] = { NULL };
 static const char *qss_prefix[] = { "#QSS:", NULL };
 static const char *cfun_prefix[] = { "+CFUN:", NULL };
@@ -335,6 +338,7 @@ static int le910v2_enable(struct ofono_modem *modem)
 	}
 
 	g_at_chat_set_slave(data->modem, data->chat);
+	g_at_chat_set_concat_length(data->chat, AUX_CONCAT_LENGTH);
 
 	/*
 	 * Disable command echo and
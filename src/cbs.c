@@ -68,6 +68,7 @@ struct ofono_cbs {
 	GSList *efcbmir_contents;
 	unsigned short efcbmid_length;
 	GSList *efcbmid_contents;
+	struct cbs_topic_bitmap *efcbmid_topics;
 	gboolean efcbmid_update;
 	guint reset_source;
 	int lac;
@@ -186,12 +187,18 @@ void ofono_cbs_notify(struct ofono_cbs *cbs, const unsigned char *pdu,
 	if (cbs->assembly == NULL)
 		return;
 
+	/* Pages are broadcast repeatedly, drop the ones already handled */
+	if (cbs_assembly_is_duplicate(cbs->assembly, pdu, pdu_len))
+		return;
+
 	if (!cbs_decode(pdu, pdu_len, &c)) {
 		ofono_error("Unable to decode CBS PDU");
 		return;
 	}
 
-	if (cbs_topic_in_range(c.message_identifier, cbs->efcbmid_contents)) {
+	if (cbs->efcbmid_topics &&
+			cbs_topic_bitmap_test(cbs->efcbmid_topics,
+						c.message_identifier)) {
 		if (cbs->sim == NULL)
 			return;
 
@@ -307,22 +314,22 @@ static DBusMessage *cbs_get_properties(DBusConnection *conn,
 
 static char *cbs_topics_to_str(struct ofono_cbs *cbs, GSList *user_topics)
 {
-	GSList *topics = NULL;
+	struct cbs_topic_bitmap *bitmap;
+	GSList *topics;
 	char *topic_str;
 	struct cbs_topic_range etws_range = { 4352, 4356 };
+	GSList etws = { &etws_range, NULL };
 
-	if (user_topics != NULL)
-		topics = g_slist_concat(topics,
-					g_slist_copy(user_topics));
-
-	if (cbs->efcbmid_contents != NULL)
-		topics = g_slist_concat(topics,
-					g_slist_copy(cbs->efcbmid_contents));
+	/* Merge the topics so that overlapping ones are only sent once */
+	bitmap = cbs_topic_bitmap_new(user_topics);
+	cbs_topic_bitmap_add(bitmap, cbs->efcbmid_contents);
+	cbs_topic_bitmap_add(bitmap, &etws);
 
-	topics = g_slist_append(topics, &etws_range);
+	topics = cbs_topic_bitmap_to_ranges(bitmap, 65535);
+	g_free(bitmap);
 
 	topic_str = cbs_topic_ranges_to_string(topics);
-	g_slist_free(topics);
+	g_slist_free_full(topics, g_free);
 
 	return topic_str;
 }
@@ -600,6 +607,8 @@ static void cbs_unregister(struct ofono_atom *atom)
 		cbs->efcbmid_length = 0;
 		g_slist_free_full(cbs->efcbmid_contents, g_free);
 		cbs->efcbmid_contents = NULL;
+		g_free(cbs->efcbmid_topics);
+		cbs->efcbmid_topics = NULL;
 	}
 
 	if (cbs->sim_context) {
@@ -874,6 +883,7 @@ static void sim_cbmid_read_cb(int ok, int length, int record,
 		goto done;
 
 	cbs->efcbmid_contents = g_slist_reverse(contents);
+	cbs->efcbmid_topics = cbs_topic_bitmap_new(cbs->efcbmid_contents);
 
 	str = cbs_topic_ranges_to_string(cbs->efcbmid_contents);
 	DBG("Got cbmid: %s", str);
@@ -901,6 +911,8 @@ static void cbs_efcbmid_changed(int id, void *userdata)
 		cbs->efcbmid_length = 0;
 		g_slist_free_full(cbs->efcbmid_contents, g_free);
 		cbs->efcbmid_contents = NULL;
+		g_free(cbs->efcbmid_topics);
+		cbs->efcbmid_topics = NULL;
 	}
 
 	cbs->efcbmid_update = TRUE;
@@ -0,0 +1,767 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "storage.h"
+#include "journal.h"
+
+/*
+ * A journal is an append-only file of checksummed entries, each of which
+ * either stores the data for a key or removes the key.  The latest entry
+ * for each key is kept in memory, so reads never touch the file.  Once the
+ * file holds more stale entries than live ones it is compacted by writing
+ * out the live entries to a new file which then replaces the old one.
+ *
+ * A torn write at the end of the file, e.g. due to a power failure, is
+ * detected by the checksum and cut off the next time the file is opened.
+ *
+ * Changes made between journal_begin() and journal_commit() are collected
+ * in memory and appended to the file with a single write.
+ */
+
+#define JOURNAL_MODE		0600
+#define JOURNAL_MAGIC		"OFJ1"
+#define JOURNAL_MAGIC_LEN	4
+#define JOURNAL_REMOVED		0xffffffff
+#define JOURNAL_MAX_KEY		1024
+#define JOURNAL_MAX_DATA	65536
+#define JOURNAL_COMPACT_MIN	(32 * 1024)
+
+struct journal_entry_header {
+	guint32 crc;		/* CRC-32 of the rest of the entry */
+	guint64 ts;
+	guint32 len;		/* Or JOURNAL_REMOVED */
+	guint16 key_len;
+} __attribute__((packed));
+
+struct journal_record {
+	time_t ts;
+	size_t len;
+	unsigned char data[];
+};
+
+struct journal {
+	int ref_count;
+	char *path;
+	int fd;
+	GHashTable *records;
+	size_t file_size;
+	size_t live_size;
+	unsigned int batch;	/* Nesting depth of journal_begin() */
+	GByteArray *pending;	/* Entries not yet written while batching */
+	size_t batch_start;	/* File size when the batch was started */
+};
+
+static GHashTable *journals;
+
+static guint32 crc32_table[256];
+
+static guint32 crc32_update(guint32 crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (crc32_table[1] == 0) {
+		unsigned int i, j;
+
+		for (i = 0; i < 256; i++) {
+			guint32 c = i;
+
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+
+			crc32_table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static size_t entry_size(size_t key_len, size_t len)
+{
+	return sizeof(struct journal_entry_header) + key_len + len;
+}
+
+static void entry_header_init(struct journal_entry_header *hdr,
+				const char *key, size_t key_len,
+				const unsigned char *data, guint32 len,
+				time_t ts)
+{
+	guint32 crc;
+
+	hdr->ts = GUINT64_TO_LE((guint64) ts);
+	hdr->len = GUINT32_TO_LE(len);
+	hdr->key_len = GUINT16_TO_LE(key_len);
+
+	crc = crc32_update(0, &hdr->ts, sizeof(*hdr) - sizeof(hdr->crc));
+	crc = crc32_update(crc, key, key_len);
+
+	if (len != JOURNAL_REMOVED)
+		crc = crc32_update(crc, data, len);
+
+	hdr->crc = GUINT32_TO_LE(crc);
+}
+
+static gboolean write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len) {
+		ssize_t r = TFR(write(fd, p, len));
+
+		if (r <= 0)
+			return FALSE;
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+static void entry_append(GByteArray *buf, const char *key,
+				const unsigned char *data, guint32 len,
+				time_t ts)
+{
+	struct journal_entry_header hdr;
+	size_t key_len = strlen(key);
+	size_t data_len = len == JOURNAL_REMOVED ? 0 : len;
+
+	entry_header_init(&hdr, key, key_len, data, len, ts);
+
+	g_byte_array_append(buf, (const guint8 *) &hdr, sizeof(hdr));
+	g_byte_array_append(buf, (const guint8 *) key, key_len);
+	g_byte_array_append(buf, data, data_len);
+}
+
+static gboolean write_entry(int fd, const char *key,
+				const unsigned char *data, guint32 len,
+				time_t ts)
+{
+	GByteArray *buf = g_byte_array_new();
+	gboolean ret;
+
+	/* A single write keeps a partial entry confined to the tail */
+	entry_append(buf, key, data, len, ts);
+	ret = write_all(fd, buf->data, buf->len);
+	g_byte_array_free(buf, TRUE);
+
+	return ret;
+}
+
+/*
+ * Drops whatever part of a failed write made it to the file, so that the
+ * next entry follows the last complete one.  If even that fails, nothing
+ * more is appended as later entries would be lost behind the torn one.
+ */
+static void journal_write_failed(struct journal *journal, size_t valid)
+{
+	if (ftruncate(journal->fd, valid) == 0) {
+		journal->file_size = valid;
+		return;
+	}
+
+	TFR(close(journal->fd));
+	journal->fd = -1;
+}
+
+static gboolean journal_write(struct journal *journal, const char *key,
+				const unsigned char *data, guint32 len,
+				time_t ts)
+{
+	if (journal->pending) {
+		entry_append(journal->pending, key, data, len, ts);
+		return TRUE;
+	}
+
+	if (journal->fd < 0)
+		return FALSE;
+
+	if (write_entry(journal->fd, key, data, len, ts))
+		return TRUE;
+
+	journal_write_failed(journal, journal->file_size);
+
+	return FALSE;
+}
+
+static void record_set(struct journal *journal, const char *key,
+			size_t key_len, const unsigned char *data, size_t len,
+			time_t ts)
+{
+	struct journal_record *old;
+	struct journal_record *record;
+
+	old = g_hash_table_lookup(journal->records, key);
+	if (old)
+		journal->live_size -= entry_size(key_len, old->len);
+
+	record = g_malloc(sizeof(*record) + len);
+	record->ts = ts;
+	record->len = len;
+	memcpy(record->data, data, len);
+
+	g_hash_table_replace(journal->records, g_strdup(key), record);
+	journal->live_size += entry_size(key_len, len);
+}
+
+static void record_remove(struct journal *journal, const char *key,
+				size_t key_len)
+{
+	struct journal_record *old;
+
+	old = g_hash_table_lookup(journal->records, key);
+	if (old == NULL)
+		return;
+
+	journal->live_size -= entry_size(key_len, old->len);
+	g_hash_table_remove(journal->records, key);
+}
+
+/* Returns the length of the valid part of the file */
+static size_t journal_replay(struct journal *journal, const char *contents,
+				size_t length)
+{
+	size_t pos = JOURNAL_MAGIC_LEN;
+
+	if (length < JOURNAL_MAGIC_LEN ||
+			memcmp(contents, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN))
+		return 0;
+
+	while (pos + sizeof(struct journal_entry_header) <= length) {
+		struct journal_entry_header hdr;
+		const char *key = contents + pos + sizeof(hdr);
+		guint32 crc;
+		guint32 len;
+		size_t data_len;
+		size_t key_len;
+		char *keystr;
+
+		memcpy(&hdr, contents + pos, sizeof(hdr));
+		len = GUINT32_FROM_LE(hdr.len);
+		key_len = GUINT16_FROM_LE(hdr.key_len);
+		data_len = len == JOURNAL_REMOVED ? 0 : len;
+
+		if (key_len == 0 || key_len > JOURNAL_MAX_KEY)
+			break;
+
+		if (data_len > JOURNAL_MAX_DATA)
+			break;
+
+		if (pos + entry_size(key_len, data_len) > length)
+			break;
+
+		crc = crc32_update(0, &hdr.ts, sizeof(hdr) - sizeof(hdr.crc));
+		crc = crc32_update(crc, key, key_len + data_len);
+
+		if (crc != GUINT32_FROM_LE(hdr.crc))
+			break;
+
+		if (memchr(key, '\0', key_len))
+			break;
+
+		keystr = g_strndup(key, key_len);
+
+		if (len == JOURNAL_REMOVED)
+			record_remove(journal, keystr, key_len);
+		else
+			record_set(journal, keystr, key_len,
+					(const unsigned char *) key + key_len,
+					len, (gint64) GUINT64_FROM_LE(hdr.ts));
+
+		g_free(keystr);
+		pos += entry_size(key_len, data_len);
+	}
+
+	return pos;
+}
+
+static int open_fresh(const char *path)
+{
+	int fd;
+
+	fd = TFR(open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC,
+				JOURNAL_MODE));
+	if (fd < 0)
+		return -1;
+
+	if (!write_all(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN)) {
+		TFR(close(fd));
+		return -1;
+	}
+
+	return fd;
+}
+
+static void journal_maybe_compact(struct journal *journal)
+{
+	if (journal->batch > 0)
+		return;
+
+	if (journal->file_size < JOURNAL_COMPACT_MIN)
+		return;
+
+	if (journal->file_size - JOURNAL_MAGIC_LEN < 2 * journal->live_size)
+		return;
+
+	journal_compact(journal);
+}
+
+static void journal_free(gpointer data)
+{
+	struct journal *journal = data;
+
+	if (journal->fd >= 0)
+		TFR(close(journal->fd));
+
+	if (journal->pending)
+		g_byte_array_free(journal->pending, TRUE);
+
+	g_hash_table_destroy(journal->records);
+	g_free(journal->path);
+	g_free(journal);
+}
+
+/*
+ * Opens the journal at path, creating it if needed.  Journals are shared,
+ * opening the same path again returns the already open journal with its
+ * reference count increased.
+ */
+struct journal *journal_open(const char *path)
+{
+	struct journal *journal;
+	gchar *contents = NULL;
+	gsize length = 0;
+	size_t valid;
+
+	if (journals == NULL)
+		journals = g_hash_table_new(g_str_hash, g_str_equal);
+
+	journal = g_hash_table_lookup(journals, path);
+	if (journal)
+		return journal_ref(journal);
+
+	if (create_dirs(path, JOURNAL_MODE | S_IXUSR) != 0)
+		return NULL;
+
+	journal = g_new0(struct journal, 1);
+	journal->ref_count = 1;
+	journal->path = g_strdup(path);
+	journal->records = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+
+	g_file_get_contents(path, &contents, &length, NULL);
+	valid = journal_replay(journal, contents, length);
+	g_free(contents);
+
+	if (valid == 0) {
+		journal->fd = open_fresh(path);
+		valid = JOURNAL_MAGIC_LEN;
+	} else {
+		journal->fd = TFR(open(path, O_WRONLY | O_APPEND));
+
+		/* Cut off a torn or corrupted tail */
+		if (journal->fd >= 0 && valid < length &&
+				ftruncate(journal->fd, valid) < 0) {
+			TFR(close(journal->fd));
+			journal->fd = -1;
+		}
+	}
+
+	if (journal->fd < 0) {
+		journal_free(journal);
+		return NULL;
+	}
+
+	journal->file_size = valid;
+	g_hash_table_insert(journals, journal->path, journal);
+
+	journal_maybe_compact(journal);
+
+	return journal;
+}
+
+struct journal *journal_ref(struct journal *journal)
+{
+	if (journal == NULL)
+		return NULL;
+
+	journal->ref_count += 1;
+
+	return journal;
+}
+
+void journal_unref(struct journal *journal)
+{
+	if (journal == NULL)
+		return;
+
+	if (--journal->ref_count > 0)
+		return;
+
+	/* Don't lose a batch left open by the last user */
+	if (journal->batch > 0) {
+		journal->batch = 1;
+		journal_commit(journal);
+	}
+
+	g_hash_table_remove(journals, journal->path);
+	journal_free(journal);
+}
+
+gboolean journal_put(struct journal *journal, const char *key,
+			const unsigned char *data, size_t len, time_t ts)
+{
+	size_t key_len = strlen(key);
+
+	if (key_len == 0 || key_len > JOURNAL_MAX_KEY)
+		return FALSE;
+
+	if (len > JOURNAL_MAX_DATA)
+		return FALSE;
+
+	if (!journal_write(journal, key, data, len, ts))
+		return FALSE;
+
+	journal->file_size += entry_size(key_len, len);
+	record_set(journal, key, key_len, data, len, ts);
+	journal_maybe_compact(journal);
+
+	return TRUE;
+}
+
+gboolean journal_remove(struct journal *journal, const char *key)
+{
+	size_t key_len = strlen(key);
+
+	if (g_hash_table_lookup(journal->records, key) == NULL)
+		return TRUE;
+
+	if (!journal_write(journal, key, NULL, JOURNAL_REMOVED, 0))
+		return FALSE;
+
+	journal->file_size += entry_size(key_len, 0);
+	record_remove(journal, key, key_len);
+	journal_maybe_compact(journal);
+
+	return TRUE;
+}
+
+/* Returns the data stored under @key, valid until the key is changed */
+const unsigned char *journal_get(struct journal *journal, const char *key,
+					size_t *len)
+{
+	struct journal_record *record;
+
+	record = g_hash_table_lookup(journal->records, key);
+	if (record == NULL)
+		return NULL;
+
+	if (len)
+		*len = record->len;
+
+	return record->data;
+}
+
+/*
+ * Starts collecting changes in memory, they are written out when the
+ * matching journal_commit() is reached.  Batches can be nested, only the
+ * outermost journal_commit() writes.  Reads see the changes right away.
+ */
+void journal_begin(struct journal *journal)
+{
+	if (journal->batch++ > 0)
+		return;
+
+	journal->pending = g_byte_array_new();
+	journal->batch_start = journal->file_size;
+}
+
+gboolean journal_commit(struct journal *journal)
+{
+	gboolean ret = TRUE;
+
+	if (journal->batch == 0 || --journal->batch > 0)
+		return TRUE;
+
+	if (journal->pending->len > 0 &&
+			(journal->fd < 0 ||
+			!write_all(journal->fd, journal->pending->data,
+					journal->pending->len))) {
+		/* The changes are then only kept in memory */
+		if (journal->fd >= 0)
+			journal_write_failed(journal, journal->batch_start);
+
+		ret = FALSE;
+	}
+
+	g_byte_array_free(journal->pending, TRUE);
+	journal->pending = NULL;
+
+	journal_maybe_compact(journal);
+
+	return ret;
+}
+
+static int compare_keys(gconstpointer a, gconstpointer b)
+{
+	const char *const *ka = a;
+	const char *const *kb = b;
+
+	return strverscmp(*ka, *kb);
+}
+
+/* Returns the keys starting with prefix, in version sort order */
+static GPtrArray *journal_keys(struct journal *journal, const char *prefix)
+{
+	GPtrArray *keys = g_ptr_array_new_with_free_func(g_free);
+	size_t prefix_len = prefix ? strlen(prefix) : 0;
+	GHashTableIter iter;
+	gpointer key;
+
+	g_hash_table_iter_init(&iter, journal->records);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (prefix_len && strncmp(key, prefix, prefix_len))
+			continue;
+
+		g_ptr_array_add(keys, g_strdup(key));
+	}
+
+	g_ptr_array_sort(keys, compare_keys);
+
+	return keys;
+}
+
+void journal_remove_prefix(struct journal *journal, const char *prefix)
+{
+	GPtrArray *keys = journal_keys(journal, prefix);
+	unsigned int i;
+
+	journal_begin(journal);
+
+	for (i = 0; i < keys->len; i++)
+		journal_remove(journal, g_ptr_array_index(keys, i));
+
+	journal_commit(journal);
+
+	g_ptr_array_free(keys, TRUE);
+}
+
+void journal_move_prefix(struct journal *journal, const char *prefix,
+				const char *new_prefix)
+{
+	GPtrArray *keys = journal_keys(journal, prefix);
+	size_t prefix_len = strlen(prefix);
+	unsigned int i;
+
+	journal_begin(journal);
+
+	for (i = 0; i < keys->len; i++) {
+		const char *key = g_ptr_array_index(keys, i);
+		struct journal_record *record;
+		char *new_key;
+
+		record = g_hash_table_lookup(journal->records, key);
+		new_key = g_strconcat(new_prefix, key + prefix_len, NULL);
+
+		if (journal_put(journal, new_key, record->data, record->len,
+					record->ts))
+			journal_remove(journal, key);
+
+		g_free(new_key);
+	}
+
+	journal_commit(journal);
+
+	g_ptr_array_free(keys, TRUE);
+}
+
+/*
+ * Calls func for every key starting with prefix, in version sort order so
+ * that numbered keys are visited in numerical order.  Keys added by func
+ * are not visited, keys it removes are skipped.
+ */
+void journal_foreach(struct journal *journal, const char *prefix,
+			journal_foreach_func_t func, void *user_data)
+{
+	GPtrArray *keys = journal_keys(journal, prefix);
+	unsigned int i;
+
+	for (i = 0; i < keys->len; i++) {
+		const char *key = g_ptr_array_index(keys, i);
+		struct journal_record *record;
+
+		record = g_hash_table_lookup(journal->records, key);
+		if (record == NULL)
+			continue;
+
+		func(key, record->data, record->len, record->ts, user_data);
+	}
+
+	g_ptr_array_free(keys, TRUE);
+}
+
+static int import_dir(struct journal *journal, const char *path,
+			const char *key_prefix)
+{
+	DIR *dir;
+	struct dirent *dent;
+	int count = 0;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+
+	while ((dent = readdir(dir))) {
+		char *file;
+		char *key;
+		struct stat st;
+		gchar *contents;
+		gsize length;
+
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+
+		file = g_strdup_printf("%s/%s", path, dent->d_name);
+		key = g_strdup_printf("%s/%s", key_prefix, dent->d_name);
+
+		if (lstat(file, &st) < 0)
+			goto next;
+
+		if (S_ISDIR(st.st_mode)) {
+			count += import_dir(journal, file, key);
+			rmdir(file);
+			goto next;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			goto next;
+
+		/* Leftover from an interrupted write_file() */
+		if (g_str_has_suffix(dent->d_name, ".tmp")) {
+			unlink(file);
+			goto next;
+		}
+
+		if (!g_file_get_contents(file, &contents, &length, NULL))
+			goto next;
+
+		if (journal_put(journal, key, (unsigned char *) contents,
+					length, st.st_mtime)) {
+			unlink(file);
+			count += 1;
+		}
+
+		g_free(contents);
+next:
+		g_free(key);
+		g_free(file);
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+/*
+ * Moves all files below dir into the journal, keyed by prefix followed by
+ * their path relative to dir.  Imported files are removed, as are the
+ * directories they leave empty.  Returns the number of files imported.
+ */
+int journal_import_dir(struct journal *journal, const char *dir,
+			const char *prefix)
+{
+	int count = import_dir(journal, dir, prefix);
+
+	rmdir(dir);
+
+	return count;
+}
+
+/*
+ * Rewrites the journal with only the live entries.  The new file is synced
+ * before it replaces the old one, so a crash leaves either one intact.
+ */
+gboolean journal_compact(struct journal *journal)
+{
+	char *tmp_path = g_strconcat(journal->path, ".tmp", NULL);
+	GHashTableIter iter;
+	gpointer key, value;
+	size_t size = JOURNAL_MAGIC_LEN;
+	int fd;
+
+	fd = open_fresh(tmp_path);
+	if (fd < 0)
+		goto error;
+
+	g_hash_table_iter_init(&iter, journal->records);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct journal_record *record = value;
+
+		if (!write_entry(fd, key, record->data, record->len,
+					record->ts))
+			goto error_write;
+
+		size += entry_size(strlen(key), record->len);
+	}
+
+	if (fsync(fd) < 0 || rename(tmp_path, journal->path) < 0)
+		goto error_write;
+
+	TFR(close(fd));
+	TFR(close(journal->fd));
+
+	journal->fd = TFR(open(journal->path, O_WRONLY | O_APPEND));
+	journal->file_size = size;
+
+	/* The batch so far is part of the records just written */
+	if (journal->pending) {
+		g_byte_array_set_size(journal->pending, 0);
+		journal->batch_start = size;
+	}
+
+	g_free(tmp_path);
+	return journal->fd >= 0;
+
+error_write:
+	TFR(close(fd));
+	unlink(tmp_path);
+error:
+	g_free(tmp_path);
+	return FALSE;
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <time.h>
+
+struct journal;
+
+typedef void (*journal_foreach_func_t)(const char *key,
+					const unsigned char *data, size_t len,
+					time_t ts, void *user_data);
+
+struct journal *journal_open(const char *path);
+struct journal *journal_ref(struct journal *journal);
+void journal_unref(struct journal *journal);
+
+gboolean journal_put(struct journal *journal, const char *key,
+			const unsigned char *data, size_t len, time_t ts);
+gboolean journal_remove(struct journal *journal, const char *key);
+const unsigned char *journal_get(struct journal *journal, const char *key,
+					size_t *len);
+void journal_remove_prefix(struct journal *journal, const char *prefix);
+void journal_move_prefix(struct journal *journal, const char *prefix,
+				const char *new_prefix);
+void journal_begin(struct journal *journal);
+gboolean journal_commit(struct journal *journal);
+void journal_foreach(struct journal *journal, const char *prefix,
+			journal_foreach_func_t func, void *user_data);
+
+int journal_import_dir(struct journal *journal, const char *dir,
+			const char *prefix);
+gboolean journal_compact(struct journal *journal);
@@ -117,6 +117,7 @@ struct ofono_sim {
 
 	struct sim_fs *simfs;
 	struct sim_fs *simfs_isim;
+	unsigned int max_pending_reads;
 	struct ofono_sim_context *context;
 	struct ofono_sim_context *early_context;
 	struct ofono_sim_context *isim_context;
@@ -140,6 +141,10 @@ struct ofono_sim {
 	bool sdn_ready : 1;
 	bool initialized : 1;
 	bool wait_initialized : 1;
+	bool languages_ready : 1;
+	bool snapshot_mismatch : 1;
+	unsigned char snapshot_checks;
+	char *snapshot_imsi;
 };
 
 struct msisdn_set_request {
@@ -174,6 +179,7 @@ static const char *const passwd_name[] = {
 };
 
 static void sim_own_numbers_update(struct ofono_sim *sim);
+static void sim_free_main_state(struct ofono_sim *sim);
 
 static GSList *g_drivers = NULL;
 
@@ -835,6 +841,199 @@ static DBusMessage *sim_change_pin(DBusConnection *conn, DBusMessage *msg,
 	return NULL;
 }
 
+/*
+ * The state derived from the SIM during initialization is kept per ICCID,
+ * so that a known card can be brought up without waiting for its EFs
+ */
+#define SIM_SNAPSHOT_STORE "simsnapshot"
+#define SIM_SNAPSHOT_VERSION 1
+
+static GKeyFile *sim_snapshot_open(struct ofono_sim *sim)
+{
+	GKeyFile *snapshot;
+
+	if (sim->iccid == NULL)
+		return NULL;
+
+	snapshot = storage_open(NULL, SIM_SNAPSHOT_STORE);
+	if (snapshot == NULL)
+		return NULL;
+
+	if (g_key_file_get_integer(snapshot, sim->iccid, "Version", NULL) !=
+						SIM_SNAPSHOT_VERSION) {
+		g_key_file_free(snapshot);
+		return NULL;
+	}
+
+	return snapshot;
+}
+
+static void sim_snapshot_set_ef(GKeyFile *snapshot, const char *group,
+				const char *key, const unsigned char *ef,
+				unsigned char length)
+{
+	char *hex;
+
+	if (ef == NULL) {
+		g_key_file_remove_key(snapshot, group, key, NULL);
+		return;
+	}
+
+	hex = encode_hex(ef, length, 0);
+	g_key_file_set_string(snapshot, group, key, hex);
+	g_free(hex);
+}
+
+static unsigned char *sim_snapshot_get_ef(GKeyFile *snapshot,
+						const char *group,
+						const char *key,
+						unsigned char *out_length)
+{
+	unsigned char *ef;
+	char *hex;
+	long length;
+
+	hex = g_key_file_get_string(snapshot, group, key, NULL);
+	if (hex == NULL)
+		return NULL;
+
+	ef = decode_hex(hex, -1, &length, 0);
+	g_free(hex);
+
+	if (ef == NULL)
+		return NULL;
+
+	if (length < 1 || length > 255) {
+		g_free(ef);
+		return NULL;
+	}
+
+	*out_length = length;
+
+	return ef;
+}
+
+static void sim_snapshot_save(struct ofono_sim *sim)
+{
+	GKeyFile *snapshot;
+	char *old_data;
+	char *new_data;
+	char **numbers;
+	GSList *l;
+	int i;
+
+	if (sim->iccid == NULL || sim->imsi == NULL)
+		return;
+
+	if (sim->state != OFONO_SIM_STATE_READY)
+		return;
+
+	snapshot = storage_open(NULL, SIM_SNAPSHOT_STORE);
+	if (snapshot == NULL)
+		return;
+
+	old_data = g_key_file_to_data(snapshot, NULL, NULL);
+
+	g_key_file_set_integer(snapshot, sim->iccid, "Version",
+					SIM_SNAPSHOT_VERSION);
+	g_key_file_set_string(snapshot, sim->iccid, "IMSI", sim->imsi);
+	g_key_file_set_integer(snapshot, sim->iccid, "Phase", sim->phase);
+	g_key_file_set_integer(snapshot, sim->iccid, "MncLength",
+					sim->mnc_length);
+	g_key_file_set_integer(snapshot, sim->iccid, "CphsPhase",
+					sim->cphs_phase);
+	sim_snapshot_set_ef(snapshot, sim->iccid, "CphsServiceTable",
+					sim->cphs_service_table, 2);
+	sim_snapshot_set_ef(snapshot, sim->iccid, "EFust",
+					sim->efust, sim->efust_length);
+	sim_snapshot_set_ef(snapshot, sim->iccid, "EFest",
+					sim->efest, sim->efest_length);
+	sim_snapshot_set_ef(snapshot, sim->iccid, "EFsst",
+					sim->efsst, sim->efsst_length);
+
+	if (sim->language_prefs)
+		g_key_file_set_string_list(snapshot, sim->iccid,
+				"PreferredLanguages",
+				(const char **) sim->language_prefs,
+				g_strv_length(sim->language_prefs));
+	else
+		g_key_file_remove_key(snapshot, sim->iccid,
+					"PreferredLanguages", NULL);
+
+	numbers = g_new0(char *, g_slist_length(sim->own_numbers) + 1);
+
+	for (l = sim->own_numbers, i = 0; l; l = l->next, i++) {
+		struct ofono_phone_number *ph = l->data;
+
+		numbers[i] = g_strdup_printf("%s,%d", ph->number, ph->type);
+	}
+
+	g_key_file_set_string_list(snapshot, sim->iccid, "SubscriberNumbers",
+					(const char **) numbers, i);
+	g_strfreev(numbers);
+
+	/* Most of the time nothing changed since the last boot */
+	new_data = g_key_file_to_data(snapshot, NULL, NULL);
+	storage_close(NULL, SIM_SNAPSHOT_STORE, snapshot,
+				g_strcmp0(old_data, new_data) != 0);
+
+	g_free(new_data);
+	g_free(old_data);
+}
+
+static void sim_snapshot_remove(struct ofono_sim *sim)
+{
+	GKeyFile *snapshot;
+
+	if (sim->iccid == NULL)
+		return;
+
+	snapshot = storage_open(NULL, SIM_SNAPSHOT_STORE);
+	if (snapshot == NULL)
+		return;
+
+	if (g_key_file_remove_group(snapshot, sim->iccid, NULL))
+		storage_close(NULL, SIM_SNAPSHOT_STORE, snapshot, TRUE);
+	else
+		storage_close(NULL, SIM_SNAPSHOT_STORE, snapshot, FALSE);
+}
+
+/*
+ * Publish the preferred languages of a known card right away and carry
+ * on with the PIN check, EFli and EFpl then only update them
+ */
+static void sim_snapshot_restore_languages(struct ofono_sim *sim)
+{
+	const char *path = __ofono_atom_get_path(sim->atom);
+	DBusConnection *conn = ofono_dbus_get_connection();
+	GKeyFile *snapshot;
+	char **languages;
+
+	if (sim->languages_ready || sim->language_prefs)
+		return;
+
+	snapshot = sim_snapshot_open(sim);
+	if (snapshot == NULL)
+		return;
+
+	languages = g_key_file_get_string_list(snapshot, sim->iccid,
+					"PreferredLanguages", NULL, NULL);
+	g_key_file_free(snapshot);
+
+	if (languages == NULL)
+		return;
+
+	sim->language_prefs = languages;
+	ofono_dbus_signal_array_property_changed(conn, path,
+						OFONO_SIM_MANAGER_INTERFACE,
+						"PreferredLanguages",
+						DBUS_TYPE_STRING,
+						&sim->language_prefs);
+
+	sim->languages_ready = true;
+	__ofono_sim_recheck_pin(sim);
+}
+
 static void sim_iccid_read_cb(int ok, int length, int record,
 							const unsigned char *data,
 							int record_length, void *userdata)
@@ -856,6 +1055,8 @@ ofono_dbus_signal_property_changed(conn, path,
 					"CardIdentifier",
 					DBUS_TYPE_STRING,
 					&sim->iccid);
+
+sim_snapshot_restore_languages(sim);
 }
 
 static void sim_enter_pin_cb(const struct ofono_error *error, void *data)
@@ -1275,6 +1476,8 @@ check:
 						DBUS_TYPE_STRING, &own_numbers);
 
 		g_strfreev(own_numbers);
+
+		sim_snapshot_save(sim);
 	} else {
 		g_slist_free_full(sim->new_numbers, g_free);
 	}
@@ -1499,6 +1702,7 @@ static void sim_set_ready(struct ofono_sim *sim)
 	sim->state = OFONO_SIM_STATE_READY;
 
 	sim_fs_check_version(sim->simfs);
+	sim_snapshot_save(sim);
 
 	call_state_watches(sim);
 }
@@ -1554,6 +1758,8 @@ static void discover_apps_cb(const struct ofono_error *error,
 			 * the FS structure so the ISIM EF's can be accessed.
 			 */
 			sim->simfs_isim = sim_fs_new(sim, sim->driver);
+			sim_fs_set_max_pending_reads(sim->simfs_isim,
+						sim->max_pending_reads);
 			sim->isim_context = ofono_sim_context_create_isim(
 					sim);
 			/* attempt to get the NAI from EFimpi */
@@ -1803,24 +2009,10 @@ out:
 	sim_retrieve_imsi(sim);
 }
 
-static void sim_efest_read_cb(int ok, int length, int record,
-				const unsigned char *data,
-				int record_length, void *userdata)
+static void sim_est_dialing_check(struct ofono_sim *sim)
 {
-	struct ofono_sim *sim = userdata;
 	gboolean available;
 
-	if (!ok)
-		goto out;
-
-	if (length < 1) {
-		ofono_error("EFest shall contain at least one byte");
-		goto out;
-	}
-
-	sim->efest = g_memdup(data, length);
-	sim->efest_length = length;
-
 	/*
 	 * Check if Fixed Dialing is enabled in the USIM-card
 	 * (TS 31.102, Section 5.3.2: FDN capability request).
@@ -1842,12 +2034,42 @@ static void sim_efest_read_cb(int ok, int length, int record,
 	if (available && sim_est_is_active(sim->efest, sim->efest_length,
 						SIM_EST_SERVICE_BDN))
 		sim_bdn_enabled(sim);
+}
+
+static void sim_efest_read_cb(int ok, int length, int record,
+				const unsigned char *data,
+				int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+
+	if (!ok)
+		goto out;
+
+	if (length < 1) {
+		ofono_error("EFest shall contain at least one byte");
+		goto out;
+	}
+
+	sim->efest = g_memdup(data, length);
+	sim->efest_length = length;
+
+	sim_est_dialing_check(sim);
 
 out:
 	if (!sim->fixed_dialing && !sim->barred_dialing)
 		sim_retrieve_imsi(sim);
 }
 
+static gboolean sim_efest_expected(struct ofono_sim *sim)
+{
+	return sim_ust_is_available(sim->efust, sim->efust_length,
+				SIM_UST_SERVICE_ENABLED_SERVICE_TABLE) ||
+			sim_ust_is_available(sim->efust, sim->efust_length,
+				SIM_UST_SERVICE_FDN) ||
+			sim_ust_is_available(sim->efust, sim->efust_length,
+				SIM_UST_SERVICE_BDN);
+}
+
 static void sim_efust_read_cb(int ok, int length, int record,
 				const unsigned char *data,
 				int record_length, void *userdata)
@@ -1873,12 +2095,7 @@ static void sim_efust_read_cb(int ok, int length, int record,
 	 * where EST is not available(FDN or BDN available), but EFest
 	 * is present
 	 */
-	if (sim_ust_is_available(sim->efust, sim->efust_length,
-				SIM_UST_SERVICE_ENABLED_SERVICE_TABLE) ||
-			sim_ust_is_available(sim->efust, sim->efust_length,
-				SIM_UST_SERVICE_FDN) ||
-			sim_ust_is_available(sim->efust, sim->efust_length,
-				SIM_UST_SERVICE_BDN)) {
+	if (sim_efest_expected(sim)) {
 		ofono_sim_read(sim->context, SIM_EFEST_FILEID,
 				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
 				sim_efest_read_cb, sim);
@@ -1969,8 +2186,352 @@ static void sim_efphase_read_cb(int ok, int length, int record,
 			sim_efsst_read_cb, sim);
 }
 
+static char *sim_snapshot_restore(struct ofono_sim *sim)
+{
+	GKeyFile *snapshot = sim_snapshot_open(sim);
+	unsigned char *table = NULL;
+	unsigned char table_length = 0;
+	unsigned char *efsst = NULL;
+	unsigned char efsst_length = 0;
+	char **numbers;
+	char *imsi;
+	int phase, mnc_length, cphs_phase;
+	int i;
+
+	if (snapshot == NULL)
+		return NULL;
+
+	imsi = g_key_file_get_string(snapshot, sim->iccid, "IMSI", NULL);
+	phase = g_key_file_get_integer(snapshot, sim->iccid, "Phase", NULL);
+	mnc_length = g_key_file_get_integer(snapshot, sim->iccid,
+						"MncLength", NULL);
+	cphs_phase = g_key_file_get_integer(snapshot, sim->iccid,
+						"CphsPhase", NULL);
+	table = sim_snapshot_get_ef(snapshot, sim->iccid, "CphsServiceTable",
+					&table_length);
+	efsst = sim_snapshot_get_ef(snapshot, sim->iccid, "EFsst",
+					&efsst_length);
+
+	if (imsi == NULL || strlen(imsi) < 6 || table_length != 2)
+		goto error;
+
+	if (phase < OFONO_SIM_PHASE_1G || phase > OFONO_SIM_PHASE_3G)
+		goto error;
+
+	if (mnc_length != 0 && mnc_length != 2 && mnc_length != 3)
+		goto error;
+
+	if (cphs_phase < OFONO_SIM_CPHS_PHASE_NONE ||
+			cphs_phase > OFONO_SIM_CPHS_PHASE_2G)
+		goto error;
+
+	/*
+	 * On 2G cards FDN is enabled by invalidating EFadn, which the
+	 * service table does not show, so those go the long way
+	 */
+	if (efsst && (sim_sst_is_active(efsst, efsst_length,
+						SIM_SST_SERVICE_FDN) ||
+			sim_sst_is_active(efsst, efsst_length,
+						SIM_SST_SERVICE_BDN)))
+		goto error;
+
+	sim->phase = phase;
+	sim->mnc_length = mnc_length;
+	sim->cphs_phase = cphs_phase;
+	memcpy(sim->cphs_service_table, table, 2);
+	g_free(table);
+
+	sim->efsst = efsst;
+	sim->efsst_length = efsst_length;
+	sim->efust = sim_snapshot_get_ef(snapshot, sim->iccid, "EFust",
+						&sim->efust_length);
+	sim->efest = sim_snapshot_get_ef(snapshot, sim->iccid, "EFest",
+						&sim->efest_length);
+
+	numbers = g_key_file_get_string_list(snapshot, sim->iccid,
+					"SubscriberNumbers", NULL, NULL);
+
+	for (i = 0; numbers && numbers[i]; i++) {
+		struct ofono_phone_number *own;
+		char *type = strrchr(numbers[i], ',');
+
+		if (type == NULL)
+			continue;
+
+		*type++ = '\0';
+
+		if (strlen(numbers[i]) > OFONO_MAX_PHONE_NUMBER_LENGTH)
+			continue;
+
+		own = g_new(struct ofono_phone_number, 1);
+		strcpy(own->number, numbers[i]);
+		own->type = atoi(type);
+		sim->own_numbers = g_slist_prepend(sim->own_numbers, own);
+	}
+
+	sim->own_numbers = g_slist_reverse(sim->own_numbers);
+	g_strfreev(numbers);
+
+	g_key_file_free(snapshot);
+
+	return imsi;
+
+error:
+	DBG("Ignoring unusable SIM state snapshot");
+
+	g_free(efsst);
+	g_free(table);
+	g_free(imsi);
+	g_key_file_free(snapshot);
+
+	return NULL;
+}
+
+/*
+ * The card is read again behind the snapshot, if anything differs the
+ * SIM is brought down and initialized from scratch
+ */
+static void sim_snapshot_check_done(struct ofono_sim *sim, gboolean match)
+{
+	struct ofono_modem *modem = __ofono_atom_get_modem(sim->atom);
+
+	if (sim->snapshot_checks == 0)
+		return;
+
+	if (!match)
+		sim->snapshot_mismatch = true;
+
+	if (--sim->snapshot_checks > 0)
+		return;
+
+	if (!sim->snapshot_mismatch) {
+		DBG("SIM state snapshot confirmed");
+		return;
+	}
+
+	ofono_info("SIM changed since its state snapshot, reinitializing");
+
+	sim_snapshot_remove(sim);
+
+	sim->state = OFONO_SIM_STATE_RESETTING;
+	__ofono_modem_sim_reset(modem);
+
+	sim_free_main_state(sim);
+	call_state_watches(sim);
+
+	sim->state = OFONO_SIM_STATE_INSERTED;
+	__ofono_sim_recheck_pin(sim);
+}
+
+static gboolean sim_snapshot_ef_equal(int ok, int length,
+					const unsigned char *data,
+					int min_length,
+					const unsigned char *ef,
+					unsigned char ef_length)
+{
+	if (!ok || length < min_length)
+		return ef == NULL;
+
+	return ef && ef_length == length && !memcmp(ef, data, length);
+}
+
+static void sim_snapshot_efphase_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+	enum ofono_sim_phase phase;
+
+	if (!ok || length != 1)
+		phase = OFONO_SIM_PHASE_3G;
+	else if (data[0] == 0)
+		phase = OFONO_SIM_PHASE_1G;
+	else if (data[0] == 2)
+		phase = OFONO_SIM_PHASE_2G;
+	else if (data[0] == 3)
+		phase = OFONO_SIM_PHASE_2G_PLUS;
+	else
+		phase = OFONO_SIM_PHASE_UNKNOWN;
+
+	sim_snapshot_check_done(sim, phase == sim->phase);
+}
+
+static void sim_snapshot_efad_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+	int mnc_length = 0;
+
+	if (ok && length >= 4) {
+		mnc_length = data[3] & 0xf;
+
+		if (mnc_length < 2 || mnc_length > 3)
+			mnc_length = 0;
+	}
+
+	sim_snapshot_check_done(sim, mnc_length == sim->mnc_length);
+}
+
+static void sim_snapshot_cphs_information_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+	enum ofono_sim_cphs_phase cphs_phase = OFONO_SIM_CPHS_PHASE_NONE;
+	unsigned char table[2] = { 0, 0 };
+
+	if (ok && length >= 3) {
+		if (data[0] == 0x01)
+			cphs_phase = OFONO_SIM_CPHS_PHASE_1G;
+		else if (data[0] >= 0x02)
+			cphs_phase = OFONO_SIM_CPHS_PHASE_2G;
+
+		memcpy(table, data + 1, 2);
+	}
+
+	sim_snapshot_check_done(sim, cphs_phase == sim->cphs_phase &&
+				!memcmp(table, sim->cphs_service_table, 2));
+}
+
+static void sim_snapshot_efsst_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+
+	sim_snapshot_check_done(sim, sim_snapshot_ef_equal(ok, length, data, 2,
+					sim->efsst, sim->efsst_length));
+}
+
+static void sim_snapshot_efust_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+
+	sim_snapshot_check_done(sim, sim_snapshot_ef_equal(ok, length, data, 1,
+					sim->efust, sim->efust_length));
+}
+
+static void sim_snapshot_efest_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+
+	sim_snapshot_check_done(sim, sim_snapshot_ef_equal(ok, length, data, 1,
+					sim->efest, sim->efest_length));
+}
+
+static void sim_snapshot_imsi_cb(const struct ofono_error *error,
+					const char *imsi, void *data)
+{
+	struct ofono_sim *sim = data;
+
+	sim_snapshot_check_done(sim, error->type == OFONO_ERROR_TYPE_NO_ERROR &&
+					sim->imsi && !strcmp(imsi, sim->imsi));
+}
+
+static void sim_snapshot_check(struct ofono_sim *sim)
+{
+	sim->snapshot_mismatch = false;
+	sim->snapshot_checks = 4;
+
+	ofono_sim_read(sim->context, SIM_EFPHASE_FILEID,
+			OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+			sim_snapshot_efphase_cb, sim);
+
+	ofono_sim_read(sim->context, SIM_EFAD_FILEID,
+			OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+			sim_snapshot_efad_cb, sim);
+
+	ofono_sim_read(sim->context, SIM_EF_CPHS_INFORMATION_FILEID,
+			OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+			sim_snapshot_cphs_information_cb, sim);
+
+	if (sim->phase != OFONO_SIM_PHASE_3G) {
+		ofono_sim_read(sim->context, SIM_EFSST_FILEID,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+				sim_snapshot_efsst_cb, sim);
+	} else {
+		ofono_sim_read(sim->context, SIM_EFUST_FILEID,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+				sim_snapshot_efust_cb, sim);
+
+		if (sim_efest_expected(sim)) {
+			sim->snapshot_checks += 1;
+			ofono_sim_read(sim->context, SIM_EFEST_FILEID,
+					OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+					sim_snapshot_efest_cb, sim);
+		}
+	}
+
+	if (sim->driver->read_imsi) {
+		sim->snapshot_checks += 1;
+		sim->driver->read_imsi(sim, sim_snapshot_imsi_cb, sim);
+	}
+}
+
+static void sim_snapshot_ready(struct ofono_sim *sim, const char *imsi)
+{
+	DBG("Warm start from SIM state snapshot");
+
+	sim_imsi_obtained(sim, imsi);
+
+	if (sim->state == OFONO_SIM_STATE_READY)
+		sim_snapshot_check(sim);
+}
+
+static void sim_snapshot_efest_read_cb(int ok, int length, int record,
+					const unsigned char *data,
+					int record_length, void *userdata)
+{
+	struct ofono_sim *sim = userdata;
+	char *imsi = sim->snapshot_imsi;
+
+	sim->snapshot_imsi = NULL;
+
+	if (ok && length >= 1) {
+		g_free(sim->efest);
+		sim->efest = g_memdup(data, length);
+		sim->efest_length = length;
+
+		sim_est_dialing_check(sim);
+	}
+
+	if (!sim->fixed_dialing && !sim->barred_dialing)
+		sim_snapshot_ready(sim, imsi);
+
+	g_free(imsi);
+}
+
+/* Takes over the IMSI restored from the snapshot */
+static void sim_snapshot_start(struct ofono_sim *sim, char *imsi)
+{
+	/*
+	 * FDN and BDN are switched on in EFest without the service table
+	 * changing, so it is read from the card before going any further
+	 */
+	if (sim_ust_is_available(sim->efust, sim->efust_length,
+					SIM_UST_SERVICE_FDN) ||
+			sim_ust_is_available(sim->efust, sim->efust_length,
+					SIM_UST_SERVICE_BDN)) {
+		sim->snapshot_imsi = imsi;
+		ofono_sim_read(sim->context, SIM_EFEST_FILEID,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+				sim_snapshot_efest_read_cb, sim);
+		return;
+	}
+
+	sim_snapshot_ready(sim, imsi);
+	g_free(imsi);
+}
+
 static void sim_initialize_after_pin(struct ofono_sim *sim)
 {
+	char *imsi;
+
 	sim->context = ofono_sim_context_create(sim);
 
 	/*
@@ -1979,6 +2540,16 @@ static void sim_initialize_after_pin(struct ofono_sim *sim)
 	if (sim->driver->list_apps)
 		sim->driver->list_apps(sim, discover_apps_cb, sim);
 
+	/*
+	 * A card seen before becomes ready straight from its snapshot,
+	 * the files are then checked against it in the background
+	 */
+	imsi = sim_snapshot_restore(sim);
+	if (imsi) {
+		sim_snapshot_start(sim, imsi);
+		return;
+	}
+
 	ofono_sim_read(sim->context, SIM_EFPHASE_FILEID,
 			OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
 			sim_efphase_read_cb, sim);
@@ -2109,6 +2680,18 @@ static char **concat_lang_prefs(GSList *a, GSList *b)
 	return ret;
 }
 
+static gboolean language_prefs_equal(char **a, char **b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	for (; *a && *b; a++, b++)
+		if (strcmp(*a, *b))
+			return FALSE;
+
+	return *a == *b;
+}
+
 static void sim_efpl_read_cb(int ok, int length, int record,
 				const unsigned char *data,
 				int record_length, void *userdata)
@@ -2119,6 +2702,7 @@ static void sim_efpl_read_cb(int ok, int length, int record,
 	gboolean efli_format = TRUE;
 	GSList *efli = NULL;
 	GSList *efpl = NULL;
+	char **old_prefs;
 
 	if (!ok || length < 2)
 		goto skip_efpl;
@@ -2126,6 +2710,10 @@ static void sim_efpl_read_cb(int ok, int length, int record,
 	efpl = parse_language_list(data, length);
 
 skip_efpl:
+	/* The snapshot may have published these already */
+	old_prefs = sim->language_prefs;
+	sim->language_prefs = NULL;
+
 	if (sim->efli && sim->efli_length > 0) {
 		efli_format = sim_efli_format(sim->efli, sim->efli_length);
 
@@ -2177,9 +2765,16 @@ skip_efpl:
 						DBUS_TYPE_STRING,
 						&sim->language_prefs);
 
+	if (!language_prefs_equal(old_prefs, sim->language_prefs))
+		sim_snapshot_save(sim);
+
+	g_strfreev(old_prefs);
+
 	/* Proceed with sim initialization if we're not merely updating */
-	if (!sim->language_prefs_update)
+	if (!sim->language_prefs_update && !sim->languages_ready) {
+		sim->languages_ready = true;
 		__ofono_sim_recheck_pin(sim);
+	}
 
 	sim->language_prefs_update = false;
 }
@@ -2515,6 +3110,8 @@ static void sim_free_early_state(struct ofono_sim *sim)
 		sim->language_prefs = NULL;
 	}
 
+	sim->languages_ready = false;
+
 	if (sim->early_context) {
 		ofono_sim_context_free(sim->early_context);
 		sim->early_context = NULL;
@@ -2618,6 +3215,11 @@ static void sim_free_main_state(struct ofono_sim *sim)
 
 	sim->fixed_dialing = false;
 	sim->barred_dialing = false;
+	sim->snapshot_checks = 0;
+	sim->snapshot_mismatch = false;
+
+	g_free(sim->snapshot_imsi);
+	sim->snapshot_imsi = NULL;
 
 	sim_spn_close(sim);
 
@@ -2631,8 +3233,10 @@ static void sim_free_main_state(struct ofono_sim *sim)
 		sim->isim_context = NULL;
 	}
 
-	if (sim->impi)
+	if (sim->impi) {
 		g_free(sim->impi);
+		sim->impi = NULL;
+	}
 
 	if (sim->aid_list) {
 		g_slist_free_full(sim->aid_list,
@@ -3320,6 +3924,7 @@ void ofono_sim_register(struct ofono_sim *sim)
 	sim->state_watches = __ofono_watchlist_new(g_free);
 	sim->spn_watches = __ofono_watchlist_new(g_free);
 	sim->simfs = sim_fs_new(sim, sim->driver);
+	sim_fs_set_max_pending_reads(sim->simfs, sim->max_pending_reads);
 
 	ofono_sim_add_state_watch(sim, sim_ready, sim, NULL);
 
@@ -3343,6 +3948,18 @@ void ofono_sim_set_data(struct ofono_sim *sim, void *data)
 	sim->driver_data = data;
 }
 
+void ofono_sim_set_max_pending_reads(struct ofono_sim *sim,
+					unsigned int count)
+{
+	sim->max_pending_reads = count;
+
+	if (sim->simfs)
+		sim_fs_set_max_pending_reads(sim->simfs, count);
+
+	if (sim->simfs_isim)
+		sim_fs_set_max_pending_reads(sim->simfs_isim, count);
+}
+
 void *ofono_sim_get_data(struct ofono_sim *sim)
 {
 	return sim->driver_data;
@@ -3493,6 +4110,9 @@ void __ofono_sim_refresh(struct ofono_sim *sim, GSList *file_list,
 	}
 
 	if (reinit_naa) {
+		/* The files the snapshot holds may be among those changed */
+		sim_snapshot_remove(sim);
+
 		sim->state = OFONO_SIM_STATE_RESETTING;
 		__ofono_modem_sim_reset(__ofono_atom_get_modem(sim->atom));
 
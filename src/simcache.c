@@ -0,0 +1,468 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "storage.h"
+#include "simcache.h"
+
+/*
+ * The cached EFs of a SIM are kept in a single file which is mapped into
+ * memory, so that looking up cached data needs no system calls.  The file
+ * starts with a header holding an index of SIM_CACHE_SLOTS entries, each
+ * giving the location of the data of one EF.
+ *
+ * Space is allocated at the end of the used part of the file, which is
+ * grown as needed.  Removing an EF only clears its index entry, the space
+ * is reclaimed by rewriting the file once more of it is unused than used.
+ */
+
+#define SIM_CACHE_MODE		0600
+#define SIM_CACHE_MAGIC		"OSC1"
+#define SIM_CACHE_MAGIC_LEN	4
+#define SIM_CACHE_SLOTS		256
+#define SIM_CACHE_MIN_SIZE	(16 * 1024)
+
+struct sim_cache_slot {
+	guint32 id;
+	guint32 offset;
+	guint32 len;		/* Zero for an unused slot */
+} __attribute__((packed));
+
+struct sim_cache_header {
+	char magic[SIM_CACHE_MAGIC_LEN];
+	guint32 end;		/* End of the used part of the file */
+	struct sim_cache_slot slots[SIM_CACHE_SLOTS];
+} __attribute__((packed));
+
+struct sim_cache {
+	int ref_count;
+	char *path;
+	int fd;
+	unsigned char *map;
+	size_t size;
+	size_t live;		/* Bytes taken by the EFs in the index */
+	GHashTable *index;	/* EF id to slot number + 1 */
+};
+
+static GHashTable *caches;
+
+static struct sim_cache_header *sim_cache_header(struct sim_cache *cache)
+{
+	return (struct sim_cache_header *) cache->map;
+}
+
+static size_t sim_cache_end(struct sim_cache *cache)
+{
+	return GUINT32_FROM_LE(sim_cache_header(cache)->end);
+}
+
+static gboolean sim_cache_map(struct sim_cache *cache, size_t size)
+{
+	void *map;
+
+	if (cache->map) {
+		munmap(cache->map, cache->size);
+		cache->map = NULL;
+		cache->size = 0;
+	}
+
+	/*
+	 * Touching a page of a sparse file that the file system has no room
+	 * for raises SIGBUS, so all of the space is allocated up front
+	 */
+	if (ftruncate(cache->fd, size) < 0 ||
+			posix_fallocate(cache->fd, 0, size) != 0)
+		return FALSE;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			cache->fd, 0);
+	if (map == MAP_FAILED)
+		return FALSE;
+
+	cache->map = map;
+	cache->size = size;
+
+	return TRUE;
+}
+
+/* Starts over with an empty file */
+static gboolean sim_cache_reset(struct sim_cache *cache)
+{
+	struct sim_cache_header *hdr;
+
+	g_hash_table_remove_all(cache->index);
+	cache->live = 0;
+
+	if (ftruncate(cache->fd, 0) < 0 ||
+			!sim_cache_map(cache, SIM_CACHE_MIN_SIZE))
+		return FALSE;
+
+	hdr = sim_cache_header(cache);
+	memcpy(hdr->magic, SIM_CACHE_MAGIC, SIM_CACHE_MAGIC_LEN);
+	hdr->end = GUINT32_TO_LE(sizeof(*hdr));
+
+	return TRUE;
+}
+
+/* Checks the index and loads it into the hash table */
+static gboolean sim_cache_load(struct sim_cache *cache)
+{
+	struct sim_cache_header *hdr = sim_cache_header(cache);
+	size_t end;
+	int i;
+
+	if (memcmp(hdr->magic, SIM_CACHE_MAGIC, SIM_CACHE_MAGIC_LEN))
+		return FALSE;
+
+	end = GUINT32_FROM_LE(hdr->end);
+	if (end < sizeof(*hdr) || end > cache->size)
+		return FALSE;
+
+	for (i = 0; i < SIM_CACHE_SLOTS; i++) {
+		struct sim_cache_slot *slot = &hdr->slots[i];
+		size_t offset = GUINT32_FROM_LE(slot->offset);
+		size_t len = GUINT32_FROM_LE(slot->len);
+		int id = GUINT32_FROM_LE(slot->id);
+
+		if (len == 0)
+			continue;
+
+		if (offset < sizeof(*hdr) || offset + len > end ||
+				g_hash_table_lookup(cache->index,
+							GINT_TO_POINTER(id)))
+			return FALSE;
+
+		g_hash_table_insert(cache->index, GINT_TO_POINTER(id),
+					GINT_TO_POINTER(i + 1));
+		cache->live += len;
+	}
+
+	return TRUE;
+}
+
+static void sim_cache_free(struct sim_cache *cache)
+{
+	if (cache->map)
+		munmap(cache->map, cache->size);
+
+	if (cache->fd >= 0)
+		TFR(close(cache->fd));
+
+	g_hash_table_destroy(cache->index);
+	g_free(cache->path);
+	g_free(cache);
+}
+
+/*
+ * Opens the cache file at path, creating it if needed.  As with journals,
+ * opening the same path again returns the already open cache.
+ */
+struct sim_cache *sim_cache_open(const char *path)
+{
+	struct sim_cache *cache;
+	struct stat st;
+
+	if (caches == NULL)
+		caches = g_hash_table_new(g_str_hash, g_str_equal);
+
+	cache = g_hash_table_lookup(caches, path);
+	if (cache)
+		return sim_cache_ref(cache);
+
+	if (create_dirs(path, SIM_CACHE_MODE | S_IXUSR) != 0)
+		return NULL;
+
+	cache = g_new0(struct sim_cache, 1);
+	cache->ref_count = 1;
+	cache->path = g_strdup(path);
+	cache->index = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	cache->fd = TFR(open(path, O_RDWR | O_CREAT, SIM_CACHE_MODE));
+	if (cache->fd < 0 || fstat(cache->fd, &st) < 0)
+		goto error;
+
+	if (st.st_size < (off_t) sizeof(struct sim_cache_header) ||
+			!sim_cache_map(cache, st.st_size) ||
+			!sim_cache_load(cache)) {
+		if (!sim_cache_reset(cache))
+			goto error;
+	}
+
+	g_hash_table_insert(caches, cache->path, cache);
+
+	return cache;
+
+error:
+	sim_cache_free(cache);
+	return NULL;
+}
+
+struct sim_cache *sim_cache_ref(struct sim_cache *cache)
+{
+	if (cache == NULL)
+		return NULL;
+
+	cache->ref_count += 1;
+
+	return cache;
+}
+
+void sim_cache_unref(struct sim_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	if (--cache->ref_count > 0)
+		return;
+
+	g_hash_table_remove(caches, cache->path);
+	sim_cache_free(cache);
+}
+
+const char *sim_cache_get_path(struct sim_cache *cache)
+{
+	return cache->path;
+}
+
+static struct sim_cache_slot *sim_cache_find(struct sim_cache *cache, int id)
+{
+	int slot = GPOINTER_TO_INT(g_hash_table_lookup(cache->index,
+							GINT_TO_POINTER(id)));
+
+	if (slot == 0)
+		return NULL;
+
+	return &sim_cache_header(cache)->slots[slot - 1];
+}
+
+unsigned char *sim_cache_lookup(struct sim_cache *cache, int id,
+					size_t *len)
+{
+	struct sim_cache_slot *slot = sim_cache_find(cache, id);
+
+	if (slot == NULL)
+		return NULL;
+
+	if (len)
+		*len = GUINT32_FROM_LE(slot->len);
+
+	return cache->map + GUINT32_FROM_LE(slot->offset);
+}
+
+void sim_cache_remove(struct sim_cache *cache, int id)
+{
+	struct sim_cache_slot *slot = sim_cache_find(cache, id);
+
+	if (slot == NULL)
+		return;
+
+	cache->live -= GUINT32_FROM_LE(slot->len);
+	slot->len = 0;
+
+	g_hash_table_remove(cache->index, GINT_TO_POINTER(id));
+}
+
+void sim_cache_clear(struct sim_cache *cache)
+{
+	sim_cache_reset(cache);
+}
+
+static int sim_cache_free_slot(struct sim_cache *cache)
+{
+	struct sim_cache_header *hdr = sim_cache_header(cache);
+	int i;
+
+	for (i = 0; i < SIM_CACHE_SLOTS; i++)
+		if (hdr->slots[i].len == 0)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Returns zeroed space for len bytes of data for the EF, replacing any data
+ * cached for it before
+ */
+unsigned char *sim_cache_alloc(struct sim_cache *cache, int id, size_t len)
+{
+	struct sim_cache_header *hdr;
+	struct sim_cache_slot *slot;
+	size_t end;
+	size_t size;
+	int i;
+
+	if (len == 0)
+		len = 1;
+
+	/* A failed reset or resize leaves nothing mapped */
+	if (cache->map == NULL && !sim_cache_reset(cache))
+		return NULL;
+
+	sim_cache_remove(cache, id);
+
+	i = sim_cache_free_slot(cache);
+	if (i < 0)
+		return NULL;
+
+	end = sim_cache_end(cache);
+
+	/* Reclaim the unused space before growing the file */
+	if (end + len > cache->size &&
+			end - sizeof(*hdr) - cache->live >= cache->live) {
+		if (!sim_cache_compact(cache))
+			return NULL;
+
+		end = sim_cache_end(cache);
+	}
+
+	if (end + len > cache->size) {
+		for (size = cache->size; size < end + len; size *= 2)
+			;
+
+		if (!sim_cache_map(cache, size)) {
+			sim_cache_reset(cache);
+			return NULL;
+		}
+	}
+
+	memset(cache->map + end, 0, len);
+
+	/* The index entry is written last, after the space is accounted */
+	hdr = sim_cache_header(cache);
+	hdr->end = GUINT32_TO_LE(end + len);
+
+	slot = &hdr->slots[i];
+	slot->id = GUINT32_TO_LE(id);
+	slot->offset = GUINT32_TO_LE(end);
+	slot->len = GUINT32_TO_LE(len);
+
+	g_hash_table_insert(cache->index, GINT_TO_POINTER(id),
+				GINT_TO_POINTER(i + 1));
+	cache->live += len;
+
+	return cache->map + end;
+}
+
+static gboolean write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len) {
+		ssize_t r = TFR(write(fd, p, len));
+
+		if (r <= 0)
+			return FALSE;
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Writes out the cached EFs without the unused space in between to a new
+ * file, which then replaces the old one
+ */
+gboolean sim_cache_compact(struct sim_cache *cache)
+{
+	char *tmp_path;
+	struct sim_cache_header *old = sim_cache_header(cache);
+	struct sim_cache_header *hdr;
+	unsigned char *buf;
+	size_t end = sizeof(*hdr);
+	size_t size;
+	int fd;
+	int i;
+
+	if (cache->map == NULL)
+		return FALSE;
+
+	tmp_path = g_strconcat(cache->path, ".tmp", NULL);
+	buf = g_malloc0(sizeof(*hdr) + cache->live);
+	hdr = (struct sim_cache_header *) buf;
+	memcpy(hdr->magic, SIM_CACHE_MAGIC, SIM_CACHE_MAGIC_LEN);
+
+	/* Slots keep their place, so the hash table stays valid */
+	for (i = 0; i < SIM_CACHE_SLOTS; i++) {
+		size_t len = GUINT32_FROM_LE(old->slots[i].len);
+
+		if (len == 0)
+			continue;
+
+		memcpy(buf + end,
+			cache->map + GUINT32_FROM_LE(old->slots[i].offset),
+			len);
+
+		hdr->slots[i].id = old->slots[i].id;
+		hdr->slots[i].offset = GUINT32_TO_LE(end);
+		hdr->slots[i].len = old->slots[i].len;
+		end += len;
+	}
+
+	hdr->end = GUINT32_TO_LE(end);
+
+	fd = TFR(open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, SIM_CACHE_MODE));
+	if (fd < 0)
+		goto error;
+
+	if (!write_all(fd, buf, end) || fsync(fd) < 0 ||
+			rename(tmp_path, cache->path) < 0) {
+		TFR(close(fd));
+		unlink(tmp_path);
+		goto error;
+	}
+
+	g_free(buf);
+	g_free(tmp_path);
+
+	munmap(cache->map, cache->size);
+	cache->map = NULL;
+	TFR(close(cache->fd));
+	cache->fd = fd;
+
+	for (size = SIM_CACHE_MIN_SIZE; size < end; size *= 2)
+		;
+
+	if (!sim_cache_map(cache, size)) {
+		sim_cache_reset(cache);
+		return FALSE;
+	}
+
+	return TRUE;
+
+error:
+	g_free(buf);
+	g_free(tmp_path);
+	return FALSE;
+}
@@ -0,0 +1,39 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct sim_cache;
+
+struct sim_cache *sim_cache_open(const char *path);
+struct sim_cache *sim_cache_ref(struct sim_cache *cache);
+void sim_cache_unref(struct sim_cache *cache);
+
+const char *sim_cache_get_path(struct sim_cache *cache);
+
+/*
+ * The returned pointers are into the mapped file and are only valid until
+ * the next call to sim_cache_alloc(), sim_cache_clear() or
+ * sim_cache_unref()
+ */
+unsigned char *sim_cache_lookup(struct sim_cache *cache, int id,
+					size_t *len);
+unsigned char *sim_cache_alloc(struct sim_cache *cache, int id, size_t len);
+
+void sim_cache_remove(struct sim_cache *cache, int id);
+void sim_cache_clear(struct sim_cache *cache);
+gboolean sim_cache_compact(struct sim_cache *cache);
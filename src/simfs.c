@@ -38,24 +38,33 @@
 #include "ofono.h"
 
 #include "simfs.h"
+#include "simcache.h"
 #include "simutil.h"
 #include "storage.h"
 
 #define SIM_CACHE_MODE 0600
 #define SIM_CACHE_BASEPATH STORAGEDIR "/%s-%i"
 #define SIM_CACHE_VERSION SIM_CACHE_BASEPATH "/version"
+#define SIM_CACHE_FILE SIM_CACHE_BASEPATH "/efcache"
 #define SIM_CACHE_PATH SIM_CACHE_BASEPATH "/%04x"
 #define SIM_CACHE_HEADER_SIZE 39
 #define SIM_FILE_INFO_SIZE 7
 #define SIM_IMAGE_CACHE_BASEPATH STORAGEDIR "/%s-%i/images"
 #define SIM_IMAGE_CACHE_PATH SIM_IMAGE_CACHE_BASEPATH "/%d.xpm"
 
-#define SIM_FS_VERSION 2
+#define SIM_FS_VERSION 3
 
 static gboolean sim_fs_op_next(gpointer user_data);
 static gboolean sim_fs_op_read_record(gpointer user);
 static gboolean sim_fs_op_read_block(gpointer user_data);
 
+/* A request for a file that is already queued, served by the same op */
+struct sim_fs_waiter {
+	gconstpointer cb;
+	void *userdata;
+	struct ofono_sim_context *context;
+};
+
 struct sim_fs_op {
 	int id;
 	unsigned char *buffer;
@@ -63,6 +72,7 @@ struct sim_fs_op {
 	unsigned short offset;
 	gboolean info_only;
 	int num_bytes;
+	int requested_bytes;
 	int length;
 	int record_length;
 	int current;
@@ -72,6 +82,14 @@ struct sim_fs_op {
 	gboolean is_read;
 	void *userdata;
 	struct ofono_sim_context *context;
+	struct sim_fs *fs;
+	gboolean cached;		/* The EF has space in the cache */
+	guint source;
+	GSList *waiters;
+	gboolean notified;		/* Called back, too late to join */
+	gboolean single_records;	/* Multi-record read not usable */
+	unsigned int requests;		/* Number of driver requests made */
+	gint64 start_time;
 };
 
 struct ofono_sim_context {
@@ -79,23 +97,49 @@ struct ofono_sim_context {
 	struct ofono_watchlist *file_watches;
 };
 
+/*
+ * Operations wait in op_q until they can be started, and are then moved
+ * to active until done.  Up to max_active reads of different files can
+ * be in progress at the same time, while writes and session based reads
+ * always run on their own.
+ */
 struct sim_fs {
 	GQueue *op_q;
+	GQueue *active;
+	unsigned int max_active;
 	gint op_source;
-	unsigned char bitmap[32];
-	int fd;
 	struct ofono_sim *sim;
 	const struct ofono_sim_driver *driver;
 	GSList *contexts;
 	struct ofono_sim_aid_session *session;
 	int session_id;
 	unsigned int watch_id;
+	struct sim_cache *cache;
 };
 
+static struct sim_fs_op *sim_fs_op_new(struct ofono_sim_context *context,
+					int id)
+{
+	struct sim_fs_op *op = g_try_new0(struct sim_fs_op, 1);
+
+	if (op == NULL)
+		return NULL;
+
+	op->id = id;
+	op->context = context;
+	op->fs = context->fs;
+
+	return op;
+}
+
 static void sim_fs_op_free(gpointer pointer)
 {
 	struct sim_fs_op *node = pointer;
 
+	if (node->source)
+		g_source_remove(node->source);
+
+	g_slist_free_full(node->waiters, g_free);
 	g_free(node->buffer);
 	g_free(node);
 }
@@ -114,10 +158,11 @@ void sim_fs_free(struct sim_fs *fs)
 	 * Note: users of sim_fs must not assume that the callback happens
 	 * for operations still in progress
 	 */
-	if (fs->op_q) {
-		g_queue_free_full(fs->op_q, sim_fs_op_free);
-		fs->op_q = NULL;
-	}
+	g_queue_free_full(fs->op_q, sim_fs_op_free);
+	fs->op_q = NULL;
+
+	g_queue_free_full(fs->active, sim_fs_op_free);
+	fs->active = NULL;
 
 	while (fs->contexts)
 		sim_fs_context_free(fs->contexts->data);
@@ -125,6 +170,8 @@ void sim_fs_free(struct sim_fs *fs)
 	if (fs->watch_id)
 		__ofono_sim_remove_session_watch(fs->session, fs->watch_id);
 
+	sim_cache_unref(fs->cache);
+
 	g_free(fs);
 }
 
@@ -144,11 +191,27 @@ struct sim_fs *sim_fs_new(struct ofono_sim *sim,
 
 	fs->sim = sim;
 	fs->driver = driver;
-	fs->fd = -1;
+	fs->op_q = g_queue_new();
+	fs->active = g_queue_new();
+	fs->max_active = 1;
 
 	return fs;
 }
 
+static void sim_fs_schedule(struct sim_fs *fs)
+{
+	if (fs->op_source == 0)
+		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+}
+
+void sim_fs_set_max_pending_reads(struct sim_fs *fs, unsigned int count)
+{
+	fs->max_active = count > 0 ? count : 1;
+
+	if (!g_queue_is_empty(fs->op_q))
+		sim_fs_schedule(fs);
+}
+
 struct ofono_sim_context *sim_fs_context_new(struct sim_fs *fs)
 {
 	struct ofono_sim_context *context =
@@ -180,29 +243,69 @@ struct ofono_sim_context *sim_fs_context_new_with_aid(struct sim_fs *fs,
 	return context;
 }
 
+static void sim_fs_op_forget_context(struct sim_fs_op *op,
+					struct ofono_sim_context *context)
+{
+	GSList *l;
+
+	if (op->context == context) {
+		op->cb = NULL;
+		op->context = NULL;
+	}
+
+	for (l = op->waiters; l; l = l->next) {
+		struct sim_fs_waiter *waiter = l->data;
+
+		if (waiter->context != context)
+			continue;
+
+		waiter->cb = NULL;
+		waiter->context = NULL;
+	}
+}
+
+/* Whether anybody still wants the result of the op */
+static gboolean sim_fs_op_wanted(const struct sim_fs_op *op)
+{
+	GSList *l;
+
+	if (op->cb)
+		return TRUE;
+
+	for (l = op->waiters; l; l = l->next) {
+		struct sim_fs_waiter *waiter = l->data;
+
+		if (waiter->cb)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 void sim_fs_context_free(struct ofono_sim_context *context)
 {
 	struct sim_fs *fs = context->fs;
-	int n = 0;
-	struct sim_fs_op *op;
+	GList *l;
+	GList *next;
+
+	/* Operations in progress run to completion, without calling back */
+	if (fs->active) {
+		for (l = fs->active->head; l; l = l->next)
+			sim_fs_op_forget_context(l->data, context);
+	}
 
 	if (fs->op_q) {
-		while ((op = g_queue_peek_nth(fs->op_q, n)) != NULL) {
-			if (op->context != context) {
-				n += 1;
-				continue;
-			}
+		for (l = fs->op_q->head; l; l = next) {
+			struct sim_fs_op *op = l->data;
 
-			if (n == 0) {
-				op->cb = NULL;
-				op->context = NULL;
+			next = l->next;
+			sim_fs_op_forget_context(op, context);
 
-				n += 1;
+			if (sim_fs_op_wanted(op))
 				continue;
-			}
 
 			sim_fs_op_free(op);
-			g_queue_remove(fs->op_q, op);
+			g_queue_delete_link(fs->op_q, l);
 		}
 	}
 
@@ -265,95 +368,165 @@ void sim_fs_notify_file_watches(struct sim_fs *fs, int id)
 
 }
 
-static void sim_fs_end_current(struct sim_fs *fs)
+static void sim_fs_op_end(struct sim_fs_op *op)
 {
-	struct sim_fs_op *op = g_queue_pop_head(fs->op_q);
+	struct sim_fs *fs = op->fs;
 
-	if (g_queue_get_length(fs->op_q) > 0)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
-	else if (fs->watch_id) /* release the session if no pending reads */
+	DBG("%04x done in %" G_GINT64_FORMAT " ms, %u request(s)", op->id,
+			(g_get_monotonic_time() - op->start_time) / 1000,
+			op->requests);
+
+	g_queue_remove(fs->active, op);
+	sim_fs_op_free(op);
+
+	if (!g_queue_is_empty(fs->op_q))
+		sim_fs_schedule(fs);
+	else if (g_queue_is_empty(fs->active) && fs->watch_id)
+		/* release the session if no pending reads */
 		__ofono_sim_remove_session_watch(fs->session, fs->watch_id);
+}
 
-	if (fs->fd != -1) {
-		TFR(close(fs->fd));
-		fs->fd = -1;
-	}
+static void sim_fs_op_read_notify(struct sim_fs_op *op, int ok, int length,
+					int record, const unsigned char *data,
+					int record_length)
+{
+	GSList *l;
 
-	memset(fs->bitmap, 0, sizeof(fs->bitmap));
+	op->notified = TRUE;
 
-	sim_fs_op_free(op);
+	if (op->cb)
+		((ofono_sim_file_read_cb_t) op->cb)(ok, length, record, data,
+						record_length, op->userdata);
+
+	for (l = op->waiters; l; l = l->next) {
+		struct sim_fs_waiter *waiter = l->data;
+
+		if (waiter->cb)
+			((ofono_sim_file_read_cb_t) waiter->cb)(ok, length,
+						record, data, record_length,
+						waiter->userdata);
+	}
 }
 
-static void sim_fs_op_error(struct sim_fs *fs)
+static void sim_fs_op_info_notify(struct sim_fs_op *op, int ok,
+					unsigned char file_status,
+					int length, int record_length)
 {
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	GSList *l;
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
-		return;
+	op->notified = TRUE;
+
+	if (op->cb)
+		((sim_fs_read_info_cb_t) op->cb)(ok, file_status, length,
+						record_length, op->userdata);
+
+	for (l = op->waiters; l; l = l->next) {
+		struct sim_fs_waiter *waiter = l->data;
+
+		if (waiter->cb)
+			((sim_fs_read_info_cb_t) waiter->cb)(ok, file_status,
+						length, record_length,
+						waiter->userdata);
 	}
+}
 
+static void sim_fs_op_error(struct sim_fs_op *op)
+{
 	if (op->info_only == TRUE)
-		((sim_fs_read_info_cb_t) op->cb)
-			(0, 0, 0, 0, op->userdata);
+		sim_fs_op_info_notify(op, 0, 0, 0, 0);
 	else if (op->is_read == TRUE)
-		((ofono_sim_file_read_cb_t) op->cb)
-			(0, 0, 0, 0, 0, op->userdata);
-	else
-		((ofono_sim_file_write_cb_t) op->cb)
-			(0, op->userdata);
+		sim_fs_op_read_notify(op, 0, 0, 0, 0, 0);
+	else if (op->cb)
+		((ofono_sim_file_write_cb_t) op->cb)(0, op->userdata);
 
-	sim_fs_end_current(fs);
+	sim_fs_op_end(op);
 }
 
-static gboolean cache_block(struct sim_fs *fs, int block, int block_len,
-				const unsigned char *data, int num_bytes)
+/*
+ * The cache keeps the EF data after SIM_CACHE_HEADER_SIZE bytes of file
+ * info and a bitmap of the blocks (or records) present
+ */
+static struct sim_cache *sim_fs_get_cache(struct sim_fs *fs)
 {
-	int offset;
-	int bit;
-	ssize_t r;
-	unsigned char b;
+	const char *imsi = ofono_sim_get_imsi(fs->sim);
+	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
+	char *path;
 
-	if (fs->fd == -1)
-		return FALSE;
+	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+		return NULL;
 
-	if (lseek(fs->fd, block * block_len +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
-		return FALSE;
+	path = g_strdup_printf(SIM_CACHE_FILE, imsi, phase);
 
-	r = TFR(write(fs->fd, data, num_bytes));
+	if (fs->cache == NULL ||
+			strcmp(sim_cache_get_path(fs->cache), path) != 0) {
+		sim_cache_unref(fs->cache);
+		fs->cache = sim_cache_open(path);
+	}
 
-	if (r != num_bytes)
-		return FALSE;
+	g_free(path);
 
-	/* update present bit for this block */
-	offset = block / 8;
-	bit = block % 8;
+	return fs->cache;
+}
+
+static unsigned char *sim_fs_op_cache_data(struct sim_fs_op *op,
+						size_t *len)
+{
+	if (op->cached == FALSE || op->fs->cache == NULL)
+		return NULL;
 
-	/* lseek to correct byte (skip file info) */
-	lseek(fs->fd, offset + SIM_FILE_INFO_SIZE, SEEK_SET);
+	return sim_cache_lookup(op->fs->cache, op->id, len);
+}
 
-	b = fs->bitmap[offset];
-	b |= 1 << bit;
+/* Returns len bytes from offset into the EF, if the block is cached */
+static const unsigned char *cached_block(struct sim_fs_op *op, int block,
+						int offset, int len)
+{
+	unsigned char *data;
+	size_t size;
 
-	r = TFR(write(fs->fd, &b, sizeof(b)));
+	data = sim_fs_op_cache_data(op, &size);
+	if (data == NULL)
+		return NULL;
+
+	if ((data[SIM_FILE_INFO_SIZE + block / 8] & (1 << block % 8)) == 0)
+		return NULL;
 
-	if (r != sizeof(b))
+	if (SIM_CACHE_HEADER_SIZE + offset + len > size)
+		return NULL;
+
+	return data + SIM_CACHE_HEADER_SIZE + offset;
+}
+
+static gboolean cache_block(struct sim_fs_op *op, int block, int block_len,
+				const unsigned char *data, int num_bytes)
+{
+	unsigned char *cached;
+	size_t offset;
+	size_t size;
+
+	cached = sim_fs_op_cache_data(op, &size);
+	if (cached == NULL)
 		return FALSE;
 
-	fs->bitmap[offset] = b;
+	offset = SIM_CACHE_HEADER_SIZE + block * block_len;
+	if (offset + num_bytes > size)
+		return FALSE;
+
+	memcpy(cached + offset, data, num_bytes);
+
+	/* update present bit for this block */
+	cached[SIM_FILE_INFO_SIZE + block / 8] |= 1 << block % 8;
 
 	return TRUE;
 }
 
 static void sim_fs_op_write_cb(const struct ofono_error *error, void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = data;
 	ofono_sim_file_write_cb_t cb = op->cb;
 
 	if (cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 		return;
 	}
 
@@ -362,15 +535,14 @@ static void sim_fs_op_write_cb(const struct ofono_error *error, void *data)
 	else
 		cb(0, op->userdata);
 
-	sim_fs_end_current(fs);
+	sim_fs_op_end(op);
 }
 
 static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 					const unsigned char *data, int len,
 					void *user)
 {
-	struct sim_fs *fs = user;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user;
 	int start_block;
 	int end_block;
 	int bufoff;
@@ -378,7 +550,7 @@ static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 	int tocopy;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
@@ -401,39 +573,37 @@ static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 				bufoff, dataoff, tocopy);
 
 	memcpy(op->buffer + bufoff, data + dataoff, tocopy);
-	cache_block(fs, op->current, 256, data, len);
+	cache_block(op, op->current, 256, data, len);
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+	if (!sim_fs_op_wanted(op)) {
+		sim_fs_op_end(op);
 		return;
 	}
 
 	op->current++;
 
 	if (op->current > end_block) {
-		ofono_sim_file_read_cb_t cb = op->cb;
-
-		cb(1, op->num_bytes, 0, op->buffer,
-				op->record_length, op->userdata);
+		sim_fs_op_read_notify(op, 1, op->num_bytes, 0, op->buffer,
+					op->record_length);
 
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 	} else {
-		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+		op->source = g_idle_add(sim_fs_op_read_block, op);
 	}
 }
 
 static gboolean sim_fs_op_read_block(gpointer user_data)
 {
-	struct sim_fs *fs = user_data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user_data;
+	struct sim_fs *fs = op->fs;
 	int start_block;
 	int end_block;
 	unsigned short read_bytes;
 
-	fs->op_source = 0;
+	op->source = 0;
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+	if (!sim_fs_op_wanted(op)) {
+		sim_fs_op_end(op);
 		return FALSE;
 	}
 
@@ -444,69 +614,62 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 		op->buffer = g_try_new0(unsigned char, op->num_bytes);
 
 		if (op->buffer == NULL) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return FALSE;
 		}
 	}
 
-	while (fs->fd != -1 && op->current <= end_block) {
-		int offset = op->current / 8;
-		int bit = 1 << op->current % 8;
+	while (op->current <= end_block) {
+		const unsigned char *cached;
 		int bufoff;
-		int seekoff;
+		int dataoff;
 		int toread;
 
-		if ((fs->bitmap[offset] & bit) == 0)
-			break;
-
 		if (op->current == start_block) {
 			bufoff = 0;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256 +
-				op->offset % 256;
+			dataoff = op->current * 256 + op->offset % 256;
 			toread = MIN(256 - op->offset % 256,
 					op->num_bytes - op->current * 256);
 		} else {
 			bufoff = (op->current - start_block - 1) * 256 +
 					op->offset % 256;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256;
+			dataoff = op->current * 256;
 			toread = MIN(256, op->num_bytes - op->current * 256);
 		}
 
-		DBG("bufoff: %d, seekoff: %d, toread: %d",
-				bufoff, seekoff, toread);
-
-		if (lseek(fs->fd, seekoff, SEEK_SET) == (off_t) -1)
+		cached = cached_block(op, op->current, dataoff, toread);
+		if (cached == NULL)
 			break;
 
-		if (TFR(read(fs->fd, op->buffer + bufoff, toread)) != toread)
-			break;
+		DBG("bufoff: %d, dataoff: %d, toread: %d",
+				bufoff, dataoff, toread);
 
+		memcpy(op->buffer + bufoff, cached, toread);
 		op->current += 1;
 	}
 
 	if (op->current > end_block) {
-		ofono_sim_file_read_cb_t cb = op->cb;
+		sim_fs_op_read_notify(op, 1, op->num_bytes, 0, op->buffer,
+					op->record_length);
 
-		cb(1, op->num_bytes, 0, op->buffer,
-				op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 
 		return FALSE;
 	}
 
 	if (fs->driver->read_file_transparent == NULL) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return FALSE;
 	}
 
 	read_bytes = MIN(op->length - op->current * 256, 256);
+	op->requests += 1;
 	fs->driver->read_file_transparent(fs->sim, op->id,
 						op->current * 256,
 						read_bytes,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_read_block_cb, fs);
+						sim_fs_op_read_block_cb, op);
 
 	return FALSE;
 }
@@ -515,99 +678,177 @@ static void sim_fs_op_retrieve_cb(const struct ofono_error *error,
 					const unsigned char *data, int len,
 					void *user)
 {
-	struct sim_fs *fs = user;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user;
 	int total = op->length / op->record_length;
-	ofono_sim_file_read_cb_t cb = op->cb;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	cache_block(fs, op->current - 1, op->record_length,
+	cache_block(op, op->current - 1, op->record_length,
 			data, op->record_length);
 
-	if (cb == NULL) {
-		sim_fs_end_current(fs);
+	if (!sim_fs_op_wanted(op)) {
+		sim_fs_op_end(op);
 		return;
 	}
 
-	cb(1, op->length, op->current, data, op->record_length, op->userdata);
+	sim_fs_op_read_notify(op, 1, op->length, op->current, data,
+				op->record_length);
 
 	if (op->current < total) {
 		op->current += 1;
-		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+		op->source = g_idle_add(sim_fs_op_read_record, op);
 	} else {
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
+	}
+}
+
+static void sim_fs_op_retrieve_multi_cb(const struct ofono_error *error,
+					const unsigned char *data, int len,
+					void *user)
+{
+	struct sim_fs_op *op = user;
+	int total = op->length / op->record_length;
+	int count;
+	int i;
+
+	count = len / op->record_length;
+
+	/* Go back to reading the records one by one, to find the bad one */
+	if (error->type != OFONO_ERROR_TYPE_NO_ERROR || count == 0 ||
+			len % op->record_length ||
+			op->current + count - 1 > total) {
+		DBG("%04x multi-record read failed", op->id);
+		op->single_records = TRUE;
+		op->source = g_idle_add(sim_fs_op_read_record, op);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		cache_block(op, op->current - 1 + i, op->record_length,
+				data + i * op->record_length,
+				op->record_length);
+
+	for (i = 0; i < count; i++) {
+		const unsigned char *record = data + i * op->record_length;
+
+		if (!sim_fs_op_wanted(op)) {
+			sim_fs_op_end(op);
+			return;
+		}
+
+		sim_fs_op_read_notify(op, 1, op->length, op->current, record,
+					op->record_length);
+
+		op->current += 1;
+	}
+
+	if (op->current <= total)
+		op->source = g_idle_add(sim_fs_op_read_record, op);
+	else
+		sim_fs_op_end(op);
+}
+
+/* The number of records from the current one on missing from the cache */
+static int sim_fs_op_uncached_records(struct sim_fs_op *op, int total)
+{
+	const unsigned char *bitmap = sim_fs_op_cache_data(op, NULL);
+	int record;
+
+	if (bitmap == NULL)
+		return total - op->current + 1;
+
+	bitmap += SIM_FILE_INFO_SIZE;
+
+	for (record = op->current; record <= total; record++) {
+		int offset = (record - 1) / 8;
+		int bit = 1 << ((record - 1) % 8);
+
+		if (bitmap[offset] & bit)
+			break;
 	}
+
+	return record - op->current;
 }
 
 static gboolean sim_fs_op_read_record(gpointer user)
 {
-	struct sim_fs *fs = user;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user;
+	struct sim_fs *fs = op->fs;
 	const struct ofono_sim_driver *driver = fs->driver;
 	int total = op->length / op->record_length;
 	unsigned char buf[256];
+	int count;
 
-	fs->op_source = 0;
+	op->source = 0;
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+	if (!sim_fs_op_wanted(op)) {
+		sim_fs_op_end(op);
 		return FALSE;
 	}
 
-	while (fs->fd != -1 && op->current <= total) {
-		int offset = (op->current - 1) / 8;
-		int bit = 1 << ((op->current - 1) % 8);
-		ofono_sim_file_read_cb_t cb = op->cb;
+	while (op->current <= total) {
+		const unsigned char *cached;
 
-		if ((fs->bitmap[offset] & bit) == 0)
+		cached = cached_block(op, op->current - 1,
+				(op->current - 1) * op->record_length,
+				op->record_length);
+		if (cached == NULL)
 			break;
 
-		if (lseek(fs->fd, (op->current - 1) * op->record_length +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
-			break;
-
-		if (TFR(read(fs->fd, buf, op->record_length)) !=
-				op->record_length)
-			break;
+		/* The callbacks might change the cache under us */
+		memcpy(buf, cached, op->record_length);
 
-		cb(1, op->length, op->current,
-				buf, op->record_length, op->userdata);
+		sim_fs_op_read_notify(op, 1, op->length, op->current,
+					buf, op->record_length);
 
 		op->current += 1;
 	}
 
 	if (op->current > total) {
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 
 		return FALSE;
 	}
 
 	switch (op->structure) {
 	case OFONO_SIM_FILE_STRUCTURE_FIXED:
+		count = sim_fs_op_uncached_records(op, total);
+
+		if (driver->read_file_linear_multi && !op->single_records &&
+				count > 1) {
+			op->requests += 1;
+			driver->read_file_linear_multi(fs->sim, op->id,
+					op->current, count,
+					op->record_length, NULL, 0,
+					sim_fs_op_retrieve_multi_cb, op);
+			break;
+		}
+
 		if (driver->read_file_linear == NULL) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return FALSE;
 		}
 
+		op->requests += 1;
 		driver->read_file_linear(fs->sim, op->id, op->current,
 						op->record_length,
 						NULL, 0,
-						sim_fs_op_retrieve_cb, fs);
+						sim_fs_op_retrieve_cb, op);
 		break;
 	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
 		if (driver->read_file_cyclic == NULL) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return FALSE;
 		}
 
+		op->requests += 1;
 		driver->read_file_cyclic(fs->sim, op->id, op->current,
 						op->record_length,
 						NULL, 0,
-						sim_fs_op_retrieve_cb, fs);
+						sim_fs_op_retrieve_cb, op);
 		break;
 	default:
 		ofono_error("Unrecognized file structure, this can't happen");
@@ -616,7 +857,7 @@ static gboolean sim_fs_op_read_record(gpointer user)
 	return FALSE;
 }
 
-static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
+static void sim_fs_op_cache_fileinfo(struct sim_fs_op *op,
 					const struct ofono_error *error,
 					int length,
 					enum ofono_sim_file_structure structure,
@@ -624,15 +865,11 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 					const unsigned char access[3],
 					unsigned char file_status)
 {
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
+	struct sim_cache *cache;
 	enum sim_file_access update;
 	enum sim_file_access invalidate;
 	enum sim_file_access rehabilitate;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
-	gboolean cache;
-	char *path;
+	unsigned char *fileinfo;
 
 	/* TS 11.11, Section 9.3 */
 	update = file_access_condition_decode(access[0] & 0xf);
@@ -640,17 +877,23 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 	invalidate = file_access_condition_decode(access[2] & 0xf);
 
 	/* Never cache card holder writable files */
-	cache = (update == SIM_FILE_ACCESS_ADM ||
-			update == SIM_FILE_ACCESS_NEVER) &&
-			(invalidate == SIM_FILE_ACCESS_ADM ||
-				invalidate == SIM_FILE_ACCESS_NEVER) &&
-			(rehabilitate == SIM_FILE_ACCESS_ADM ||
-				rehabilitate == SIM_FILE_ACCESS_NEVER);
-
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN || cache == FALSE)
+	if (!(update == SIM_FILE_ACCESS_ADM ||
+			update == SIM_FILE_ACCESS_NEVER) ||
+			!(invalidate == SIM_FILE_ACCESS_ADM ||
+				invalidate == SIM_FILE_ACCESS_NEVER) ||
+			!(rehabilitate == SIM_FILE_ACCESS_ADM ||
+				rehabilitate == SIM_FILE_ACCESS_NEVER))
+		return;
+
+	cache = sim_fs_get_cache(op->fs);
+	if (cache == NULL)
 		return;
 
-	memset(fileinfo, 0, SIM_CACHE_HEADER_SIZE);
+	/* Space for the whole EF, the bitmap starts out cleared */
+	fileinfo = sim_cache_alloc(cache, op->id,
+					SIM_CACHE_HEADER_SIZE + length);
+	if (fileinfo == NULL)
+		return;
 
 	fileinfo[0] = error->type;
 	fileinfo[1] = length >> 8;
@@ -660,19 +903,7 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 	fileinfo[5] = record_length & 0xff;
 	fileinfo[6] = file_status;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-	fs->fd = TFR(open(path, O_WRONLY | O_CREAT | O_TRUNC, SIM_CACHE_MODE));
-	g_free(path);
-
-	if (fs->fd == -1)
-		return;
-
-	if (TFR(write(fs->fd, fileinfo, SIM_CACHE_HEADER_SIZE)) ==
-			SIM_CACHE_HEADER_SIZE)
-		return;
-
-	TFR(close(fs->fd));
-	fs->fd = -1;
+	op->cached = TRUE;
 }
 
 static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
@@ -682,26 +913,25 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 				unsigned char file_status,
 				void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = data;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	sim_fs_op_cache_fileinfo(fs, error, length, structure, record_length,
+	sim_fs_op_cache_fileinfo(op, error, length, structure, record_length,
 					access, file_status);
 
 	if (structure != op->structure) {
 		ofono_error("Requested file structure differs from SIM: %x",
 				op->id);
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+	if (!sim_fs_op_wanted(op)) {
+		sim_fs_op_end(op);
 		return;
 	}
 
@@ -716,13 +946,13 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 		op->current = op->offset / 256;
 
 		if (op->info_only == FALSE)
-			fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+			op->source = g_idle_add(sim_fs_op_read_block, op);
 	} else {
 		op->record_length = record_length;
 		op->current = 1;
 
 		if (op->info_only == FALSE)
-			fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+			op->source = g_idle_add(sim_fs_op_read_record, op);
 	}
 
 	if (op->info_only == TRUE) {
@@ -730,53 +960,33 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 		 * It's an info-only request, so there is no need to request
 		 * actual contents of the EF. Just return the EF-info.
 		 */
-		sim_fs_read_info_cb_t cb = op->cb;
+		sim_fs_op_info_notify(op, 1, file_status, op->length,
+					op->record_length);
 
-		cb(1, file_status, op->length,
-			op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 	}
 }
 
-static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
+static gboolean sim_fs_op_check_cached(struct sim_fs_op *op)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	char *path;
-	int fd;
-	ssize_t len;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
+	struct sim_cache *cache;
+	const unsigned char *fileinfo;
+	size_t len;
 	int error_type;
 	int file_length;
 	enum ofono_sim_file_structure structure;
 	int record_length;
 	unsigned char file_status;
 
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+	cache = sim_fs_get_cache(op->fs);
+	if (cache == NULL)
 		return FALSE;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-
-	if (path == NULL)
+	fileinfo = sim_cache_lookup(cache, op->id, &len);
+	if (fileinfo == NULL)
 		return FALSE;
 
-	fd = TFR(open(path, O_RDWR));
-	g_free(path);
-
-	if (fd == -1) {
-		if (errno != ENOENT)
-			DBG("Error %i opening cache file for "
-					"fileid %04x, IMSI %s",
-					errno, op->id, imsi);
-
-		return FALSE;
-	}
-
-	len = TFR(read(fd, fileinfo, SIM_CACHE_HEADER_SIZE));
-
-	if (len != SIM_CACHE_HEADER_SIZE)
+	if (len < SIM_CACHE_HEADER_SIZE)
 		goto error;
 
 	error_type = fileinfo[0];
@@ -791,15 +1001,21 @@ static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 	if (record_length == 0 || file_length < record_length)
 		goto error;
 
+	if (len < (size_t) SIM_CACHE_HEADER_SIZE + file_length)
+		goto error;
+
+	/* Records are read into a buffer of 256 bytes */
+	if (structure != OFONO_SIM_FILE_STRUCTURE_TRANSPARENT &&
+			record_length > 255)
+		goto error;
+
 	op->length = file_length;
 	op->record_length = record_length;
-	memcpy(fs->bitmap, fileinfo + SIM_FILE_INFO_SIZE,
-			SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE);
-	fs->fd = fd;
+	op->cached = TRUE;
 
 	if (error_type != OFONO_ERROR_TYPE_NO_ERROR ||
 			structure != op->structure) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return TRUE;
 	}
 
@@ -808,46 +1024,41 @@ static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 		 * It's an info-only request, so there is no need to request
 		 * actual contents of the EF. Just return the EF-info.
 		 */
-		sim_fs_read_info_cb_t cb = op->cb;
+		sim_fs_op_info_notify(op, 1, file_status, op->length,
+					op->record_length);
 
-		cb(1, file_status, op->length,
-			op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 	} else if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
 		if (op->num_bytes == 0)
 			op->num_bytes = op->length;
 
 		op->current = op->offset / 256;
-		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+		op->source = g_idle_add(sim_fs_op_read_block, op);
 	} else {
 		op->current = 1;
-		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+		op->source = g_idle_add(sim_fs_op_read_record, op);
 	}
 
 	return TRUE;
 
 error:
-	TFR(close(fd));
+	sim_cache_remove(cache, op->id);
 	return FALSE;
 }
 
 static void sim_fs_read_session_cb(const struct ofono_error *error,
 		const unsigned char *sdata, int length, void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	ofono_sim_file_read_cb_t cb;
+	struct sim_fs_op *op = data;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	cb = op->cb;
-	cb(TRUE, length, 0, sdata, length, op->userdata);
+	sim_fs_op_read_notify(op, TRUE, length, 0, sdata, length);
 
-	sim_fs_end_current(fs);
+	sim_fs_op_end(op);
 }
 
 static void session_read_info_cb(const struct ofono_error *error,
@@ -858,44 +1069,45 @@ static void session_read_info_cb(const struct ofono_error *error,
 					unsigned char file_status,
 					void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = data;
+	struct sim_fs *fs = op->fs;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	sim_fs_op_cache_fileinfo(fs, error, filelength, structure, recordlength,
+	sim_fs_op_cache_fileinfo(op, error, filelength, structure, recordlength,
 			access, file_status);
 
 	if (op->info_only) {
-		sim_fs_read_info_cb_t cb = op->cb;
-
-		cb(1, file_status, filelength, recordlength, op->userdata);
+		sim_fs_op_info_notify(op, 1, file_status, filelength,
+					recordlength);
 
-		sim_fs_end_current(fs);
+		sim_fs_op_end(op);
 		return;
 	}
 
+	op->requests += 1;
+
 	if (op->structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
 		if (!fs->driver->session_read_binary) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return;
 		}
 
 		fs->driver->session_read_binary(fs->sim, fs->session_id,
 				op->id, op->offset, filelength, op->path,
-				op->path_len, sim_fs_read_session_cb, fs);
+				op->path_len, sim_fs_read_session_cb, op);
 	} else {
 		if (!fs->driver->session_read_record) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return;
 		}
 
 		fs->driver->session_read_record(fs->sim, fs->session_id,
 				op->id, op->offset, recordlength, op->path,
-				op->path_len, sim_fs_read_session_cb, fs);
+				op->path_len, sim_fs_read_session_cb, op);
 	}
 }
 
@@ -912,86 +1124,233 @@ static void get_session_cb(ofono_bool_t active, int session_id,
 	struct sim_fs *fs = data;
 	struct sim_fs_op *op;
 
+	/* Session based reads run one at a time */
+	op = g_queue_peek_head(fs->active);
+	if (op == NULL)
+		return;
+
 	if (!active) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	op = g_queue_peek_head(fs->op_q);
-
 	fs->session_id = session_id;
 
+	op->requests += 1;
 	fs->driver->session_read_info(fs->sim, session_id, op->id, op->path,
-			op->path_len, session_read_info_cb, fs);
+			op->path_len, session_read_info_cb, op);
 }
 
-static gboolean sim_fs_op_next(gpointer user_data)
+static void sim_fs_op_start(struct sim_fs_op *op)
 {
-	struct sim_fs *fs = user_data;
+	struct sim_fs *fs = op->fs;
 	const struct ofono_sim_driver *driver = fs->driver;
-	struct sim_fs_op *op;
-
-	fs->op_source = 0;
-
-	if (fs->op_q == NULL)
-		return FALSE;
+	unsigned char *buffer;
 
-	op = g_queue_peek_head(fs->op_q);
+	op->start_time = g_get_monotonic_time();
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
-		return FALSE;
+	if (!sim_fs_op_wanted(op)) {
+		sim_fs_op_end(op);
+		return;
 	}
 
 	if (op->is_read == TRUE) {
-		if (sim_fs_op_check_cached(fs))
-			return FALSE;
+		if (sim_fs_op_check_cached(op))
+			return;
 
 		if (!fs->session) {
+			op->requests += 1;
 			driver->read_file_info(fs->sim, op->id,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_info_cb, fs);
+						sim_fs_op_info_cb, op);
 		} else {
-			if (fs->watch_id)
+			if (fs->watch_id) {
+				op->requests += 1;
 				fs->driver->session_read_info(fs->sim,
 						fs->session_id, op->id,
 						op->path, op->path_len,
-						session_read_info_cb, fs);
-			else
+						session_read_info_cb, op);
+			} else
 				fs->watch_id = __ofono_sim_add_session_watch(
 						fs->session, get_session_cb,
 						fs, session_destroy_cb);
 		}
-	} else {
-		switch (op->structure) {
-		case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
-			driver->write_file_transparent(fs->sim, op->id, 0,
-					op->length, op->buffer,
-					NULL, 0, sim_fs_op_write_cb, fs);
-			break;
-		case OFONO_SIM_FILE_STRUCTURE_FIXED:
-			driver->write_file_linear(fs->sim, op->id, op->current,
-					op->length, op->buffer,
-					NULL, 0, sim_fs_op_write_cb, fs);
-			break;
-		case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
-			driver->write_file_cyclic(fs->sim, op->id,
-					op->length, op->buffer,
-					NULL, 0, sim_fs_op_write_cb, fs);
-			break;
-		default:
-			ofono_error("Unrecognized file structure, "
-					"this can't happen");
+
+		return;
+	}
+
+	/* The op may be gone by the time the driver returns */
+	buffer = op->buffer;
+	op->buffer = NULL;
+	op->requests += 1;
+
+	switch (op->structure) {
+	case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
+		driver->write_file_transparent(fs->sim, op->id, 0,
+				op->length, buffer,
+				NULL, 0, sim_fs_op_write_cb, op);
+		break;
+	case OFONO_SIM_FILE_STRUCTURE_FIXED:
+		driver->write_file_linear(fs->sim, op->id, op->current,
+				op->length, buffer,
+				NULL, 0, sim_fs_op_write_cb, op);
+		break;
+	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
+		driver->write_file_cyclic(fs->sim, op->id,
+				op->length, buffer,
+				NULL, 0, sim_fs_op_write_cb, op);
+		break;
+	default:
+		ofono_error("Unrecognized file structure, "
+				"this can't happen");
+	}
+
+	g_free(buffer);
+}
+
+static gboolean sim_fs_op_can_start(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	GList *l;
+
+	if (g_queue_is_empty(fs->active))
+		return TRUE;
+
+	/* Writes and session based reads have the SIM to themselves */
+	if (op->is_read == FALSE || fs->session)
+		return FALSE;
+
+	for (l = fs->active->head; l; l = l->next) {
+		struct sim_fs_op *active = l->data;
+
+		/* Reads of the same EF would share the cache file */
+		if (active->is_read == FALSE || active->id == op->id)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Keep the requests for an EF in order */
+static gboolean sim_fs_op_queued_behind(struct sim_fs *fs, GList *link)
+{
+	struct sim_fs_op *op = link->data;
+	GList *l;
+
+	for (l = fs->op_q->head; l != link; l = l->next) {
+		struct sim_fs_op *queued = l->data;
+
+		if (queued->id == op->id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean sim_fs_op_next(gpointer user_data)
+{
+	struct sim_fs *fs = user_data;
+	GList *l;
+
+	fs->op_source = 0;
+
+restart:
+	if (g_queue_get_length(fs->active) >= fs->max_active)
+		return FALSE;
+
+	for (l = fs->op_q->head; l; l = l->next) {
+		struct sim_fs_op *op = l->data;
+
+		if (!sim_fs_op_can_start(fs, op) ||
+				sim_fs_op_queued_behind(fs, l)) {
+			/* Nothing overtakes a write */
+			if (op->is_read == FALSE)
+				return FALSE;
+
+			continue;
 		}
 
-		g_free(op->buffer);
-		op->buffer = NULL;
+		g_queue_delete_link(fs->op_q, l);
+		g_queue_push_tail(fs->active, op);
+
+		/* This can call back right away and change the queue */
+		sim_fs_op_start(op);
+		goto restart;
 	}
 
 	return FALSE;
 }
 
+static gboolean sim_fs_op_same_read(const struct sim_fs_op *a,
+					const struct sim_fs_op *b)
+{
+	if (a->is_read == FALSE || b->is_read == FALSE)
+		return FALSE;
+
+	if (a->id != b->id || a->info_only != b->info_only)
+		return FALSE;
+
+	if (a->structure != b->structure || a->offset != b->offset)
+		return FALSE;
+
+	if (a->requested_bytes != b->requested_bytes)
+		return FALSE;
+
+	if (a->path_len != b->path_len)
+		return FALSE;
+
+	return memcmp(a->path, b->path, a->path_len) == 0;
+}
+
+static struct sim_fs_op *sim_fs_find_same_read(GQueue *queue,
+						const struct sim_fs_op *op)
+{
+	GList *l;
+
+	for (l = queue->head; l; l = l->next) {
+		struct sim_fs_op *other = l->data;
+
+		/* Too late to join once results started coming in */
+		if (other->notified)
+			continue;
+
+		if (sim_fs_op_same_read(other, op))
+			return other;
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues the op, unless the same read is already pending in which case the
+ * caller is called back along with it, saving another trip to the SIM.
+ */
+static void sim_fs_op_queue(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	struct sim_fs_op *other;
+	struct sim_fs_waiter *waiter;
+
+	other = sim_fs_find_same_read(fs->active, op);
+	if (other == NULL)
+		other = sim_fs_find_same_read(fs->op_q, op);
+
+	if (other == NULL) {
+		g_queue_push_tail(fs->op_q, op);
+		sim_fs_schedule(fs);
+		return;
+	}
+
+	DBG("%04x already pending", op->id);
+
+	waiter = g_new0(struct sim_fs_waiter, 1);
+	waiter->cb = op->cb;
+	waiter->userdata = op->userdata;
+	waiter->context = op->context;
+	other->waiters = g_slist_append(other->waiters, waiter);
+
+	sim_fs_op_free(op);
+}
+
 int sim_fs_read_info(struct ofono_sim_context *context, int id,
 			enum ofono_sim_file_structure expected_type,
 			sim_fs_read_info_cb_t cb, void *data)
@@ -1008,25 +1367,17 @@ int sim_fs_read_info(struct ofono_sim_context *context, int id,
 	if (fs->driver->read_file_info == NULL)
 		return -ENOSYS;
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
-	op = g_try_new0(struct sim_fs_op, 1);
+	op = sim_fs_op_new(context, id);
 	if (op == NULL)
 		return -ENOMEM;
 
-	op->id = id;
 	op->structure = expected_type;
 	op->cb = cb;
 	op->userdata = data;
 	op->is_read = TRUE;
 	op->info_only = TRUE;
-	op->context = context;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1059,29 +1410,22 @@ int sim_fs_read(struct ofono_sim_context *context, int id,
 		}
 	}
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
-	op = g_try_new0(struct sim_fs_op, 1);
+	op = sim_fs_op_new(context, id);
 	if (op == NULL)
 		return -ENOMEM;
 
-	op->id = id;
 	op->structure = expected_type;
 	op->cb = cb;
 	op->userdata = data;
 	op->is_read = TRUE;
 	op->offset = offset;
 	op->num_bytes = num_bytes;
+	op->requested_bytes = num_bytes;
 	op->info_only = FALSE;
-	op->context = context;
 	memcpy(op->path, path, path_len);
 	op->path_len = path_len;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1118,14 +1462,10 @@ int sim_fs_write(struct ofono_sim_context *context, int id,
 	if (fn == NULL)
 		return -ENOSYS;
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
-	op = g_try_new0(struct sim_fs_op, 1);
+	op = sim_fs_op_new(context, id);
 	if (op == NULL)
 		return -ENOMEM;
 
-	op->id = id;
 	op->cb = cb;
 	op->userdata = userdata;
 	op->is_read = FALSE;
@@ -1133,12 +1473,8 @@ int sim_fs_write(struct ofono_sim_context *context, int id,
 	op->structure = structure;
 	op->length = length;
 	op->current = record;
-	op->context = context;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1220,7 +1556,7 @@ static void remove_cachefile(const char *imsi, enum ofono_sim_phase phase,
 	int id;
 	char *path;
 
-	if (file->d_type != DT_REG)
+	if (file->d_type != DT_REG || strlen(file->d_name) != 4)
 		return;
 
 	if (sscanf(file->d_name, "%4x", &id) != 1)
@@ -1272,13 +1608,17 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 	const char *imsi = ofono_sim_get_imsi(fs->sim);
 	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
 	char *path = g_strdup_printf(SIM_CACHE_BASEPATH, imsi, phase);
+	struct sim_cache *cache = sim_fs_get_cache(fs);
 	struct dirent **entries;
 	int len = scandir(path, &entries, NULL, alphasort);
 
 	g_free(path);
 
+	if (cache)
+		sim_cache_clear(cache);
+
 	if (len > 0) {
-		/* Remove all file ids */
+		/* Remove the files of the former one file per EF cache */
 		while (len--) {
 			remove_cachefile(imsi, phase, entries[len]);
 			g_free(entries[len]);
@@ -1292,12 +1632,10 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 
 void sim_fs_cache_flush_file(struct sim_fs *fs, int id)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	char *path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, id);
+	struct sim_cache *cache = sim_fs_get_cache(fs);
 
-	remove(path);
-	g_free(path);
+	if (cache)
+		sim_cache_remove(cache, id);
 }
 
 void sim_fs_image_cache_flush(struct sim_fs *fs)
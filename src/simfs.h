@@ -29,6 +29,8 @@ struct sim_fs *sim_fs_new(struct ofono_sim *sim,
 				const struct ofono_sim_driver *driver);
 struct ofono_sim_context *sim_fs_context_new(struct sim_fs *fs);
 
+void sim_fs_set_max_pending_reads(struct sim_fs *fs, unsigned int count);
+
 struct ofono_sim_context *sim_fs_context_new_with_aid(struct sim_fs *fs,
 		unsigned char *aid);
 
@@ -36,6 +36,8 @@
 struct sim_eons {
 	struct sim_eons_operator_info *pnn_list;
 	GSList *opl_list;
+	GHashTable *opl_index;
+	GSList *opl_wildcard;
 	gboolean pnn_valid;
 	int pnn_max;
 };
@@ -51,6 +53,19 @@ struct opl_operator {
 	guint16 lac_tac_low;
 	guint16 lac_tac_high;
 	guint8 id;
+	int order;
+};
+
+/*
+ * OPL records of one exact MCC/MNC.  The LAC/TAC space is cut into
+ * segments, each one pointing to the first record that covers it.
+ */
+struct opl_bucket {
+	GSList *members;
+	const struct opl_operator *any;
+	unsigned int n_segments;
+	guint32 *starts;
+	const struct opl_operator **opers;
 };
 
 #define MF	1
@@ -1070,9 +1085,266 @@ void sim_eons_add_opl_record(struct sim_eons *eons,
 	eons->opl_list = g_slist_prepend(eons->opl_list, oper);
 }
 
+static gboolean opl_operator_match(const struct opl_operator *opl,
+					const char *mcc, const char *mnc,
+					gboolean have_lac, guint16 lac)
+{
+	int i;
+
+	for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
+		if (mcc[i] != opl->mcc[i] &&
+				!(opl->mcc[i] == 'b' && mcc[i]))
+			return FALSE;
+
+	for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
+		if (mnc[i] != opl->mnc[i] &&
+				!(opl->mnc[i] == 'b' && mnc[i]))
+			return FALSE;
+
+	if (opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe)
+		return TRUE;
+
+	if (have_lac == FALSE)
+		return FALSE;
+
+	return lac >= opl->lac_tac_low && lac <= opl->lac_tac_high;
+}
+
+/*
+ * Only plain decimal MCC/MNC pairs get a key.  The lowest bit tells two
+ * and three digit MNCs apart, so e.g. 001/01 and 001/001 do not collide.
+ */
+static int opl_mcc_mnc_key(const char *mcc, const char *mnc)
+{
+	int mcc_value = 0;
+	int mnc_value = 0;
+	int i;
+
+	for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++) {
+		if (!g_ascii_isdigit(mcc[i]))
+			return -1;
+
+		mcc_value = mcc_value * 10 + mcc[i] - '0';
+	}
+
+	for (i = 0; i < OFONO_MAX_MNC_LENGTH && mnc[i]; i++) {
+		if (!g_ascii_isdigit(mnc[i]))
+			return -1;
+
+		mnc_value = mnc_value * 10 + mnc[i] - '0';
+	}
+
+	if (i < 2)
+		return -1;
+
+	return (mcc_value * 1000 + mnc_value) * 2 + (i == 3);
+}
+
+/* The LAC/TAC values matched by a record, as [low, high + 1) */
+static gboolean opl_operator_range(const struct opl_operator *opl,
+					guint32 *low, guint32 *end)
+{
+	if (opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe) {
+		*low = 0;
+		*end = 0x10000;
+		return TRUE;
+	}
+
+	if (opl->lac_tac_low > opl->lac_tac_high)
+		return FALSE;
+
+	*low = opl->lac_tac_low;
+	*end = opl->lac_tac_high + 1;
+
+	return TRUE;
+}
+
+static int opl_bound_compare(const void *a, const void *b)
+{
+	guint32 ua = *(const guint32 *) a;
+	guint32 ub = *(const guint32 *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static unsigned int opl_segment_index(const guint32 *starts, unsigned int n,
+					guint32 value)
+{
+	unsigned int lo = 0;
+	unsigned int hi = n;
+
+	/* Last segment starting at or before value, starts[0] is 0 */
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (starts[mid] <= value)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static unsigned int opl_segment_unset(unsigned int *next, unsigned int i)
+{
+	unsigned int root = i;
+
+	while (next[root] != root)
+		root = next[root];
+
+	while (next[i] != root) {
+		unsigned int tmp = next[i];
+
+		next[i] = root;
+		i = tmp;
+	}
+
+	return root;
+}
+
+static void opl_bucket_build(struct opl_bucket *bucket)
+{
+	unsigned int n = g_slist_length(bucket->members);
+	guint32 *bounds = g_new(guint32, 2 * n + 1);
+	unsigned int *next;
+	unsigned int n_bounds = 0;
+	unsigned int i, j;
+	guint32 low, end;
+	GSList *l;
+
+	bucket->members = g_slist_reverse(bucket->members);
+
+	bounds[n_bounds++] = 0;
+
+	for (l = bucket->members; l; l = l->next) {
+		if (!opl_operator_range(l->data, &low, &end))
+			continue;
+
+		bounds[n_bounds++] = low;
+		bounds[n_bounds++] = end;
+	}
+
+	qsort(bounds, n_bounds, sizeof(guint32), opl_bound_compare);
+
+	for (i = 1, j = 1; i < n_bounds; i++) {
+		if (bounds[i] == bounds[j - 1] || bounds[i] > 0xffff)
+			continue;
+
+		bounds[j++] = bounds[i];
+	}
+
+	bucket->n_segments = j;
+	bucket->starts = bounds;
+	bucket->opers = g_new0(const struct opl_operator *, j);
+
+	/* Paint the segments in record order, earlier records win */
+	next = g_new(unsigned int, j + 1);
+
+	for (i = 0; i <= j; i++)
+		next[i] = i;
+
+	for (l = bucket->members; l; l = l->next) {
+		const struct opl_operator *opl = l->data;
+		unsigned int first, last;
+
+		if (!opl_operator_range(opl, &low, &end))
+			continue;
+
+		if (bucket->any == NULL && opl->lac_tac_low == 0 &&
+				opl->lac_tac_high == 0xfffe)
+			bucket->any = opl;
+
+		first = opl_segment_index(bucket->starts, j, low);
+		last = end > 0xffff ? j :
+			opl_segment_index(bucket->starts, j, end);
+
+		for (i = opl_segment_unset(next, first); i < last;
+				i = opl_segment_unset(next, i + 1)) {
+			bucket->opers[i] = opl;
+			next[i] = i + 1;
+		}
+	}
+
+	g_free(next);
+
+	g_slist_free(bucket->members);
+	bucket->members = NULL;
+}
+
+static void opl_bucket_free(gpointer data)
+{
+	struct opl_bucket *bucket = data;
+
+	g_slist_free(bucket->members);
+	g_free(bucket->starts);
+	g_free(bucket->opers);
+	g_free(bucket);
+}
+
+static const struct opl_operator *opl_bucket_lookup(
+						struct opl_bucket *bucket,
+						gboolean have_lac, guint16 lac)
+{
+	unsigned int i;
+
+	if (have_lac == FALSE)
+		return bucket->any;
+
+	i = opl_segment_index(bucket->starts, bucket->n_segments, lac);
+
+	return bucket->opers[i];
+}
+
 void sim_eons_optimize(struct sim_eons *eons)
 {
+	struct opl_bucket *bucket;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *l;
+	int order = 0;
+
 	eons->opl_list = g_slist_reverse(eons->opl_list);
+
+	if (eons->opl_index) {
+		g_hash_table_destroy(eons->opl_index);
+		g_slist_free(eons->opl_wildcard);
+		eons->opl_wildcard = NULL;
+	}
+
+	eons->opl_index = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, opl_bucket_free);
+
+	for (l = eons->opl_list; l; l = l->next) {
+		struct opl_operator *opl = l->data;
+		int key = opl_mcc_mnc_key(opl->mcc, opl->mnc);
+
+		opl->order = order++;
+
+		/* Wildcard records are few, those are still walked */
+		if (key < 0) {
+			eons->opl_wildcard = g_slist_prepend(eons->opl_wildcard,
+								opl);
+			continue;
+		}
+
+		bucket = g_hash_table_lookup(eons->opl_index,
+						GINT_TO_POINTER(key));
+		if (bucket == NULL) {
+			bucket = g_new0(struct opl_bucket, 1);
+			g_hash_table_insert(eons->opl_index,
+						GINT_TO_POINTER(key), bucket);
+		}
+
+		bucket->members = g_slist_prepend(bucket->members, opl);
+	}
+
+	eons->opl_wildcard = g_slist_reverse(eons->opl_wildcard);
+
+	g_hash_table_iter_init(&iter, eons->opl_index);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		opl_bucket_build(value);
 }
 
 void sim_eons_free(struct sim_eons *eons)
@@ -1087,6 +1359,10 @@ void sim_eons_free(struct sim_eons *eons)
 
 	g_free(eons->pnn_list);
 
+	if (eons->opl_index)
+		g_hash_table_destroy(eons->opl_index);
+
+	g_slist_free(eons->opl_wildcard);
 	g_slist_free_full(eons->opl_list, g_free);
 
 	g_free(eons);
@@ -1097,42 +1373,47 @@ static const struct sim_eons_operator_info *
 				const char *mcc, const char *mnc,
 				gboolean have_lac, guint16 lac)
 {
+	const struct opl_operator *opl = NULL;
+	struct opl_bucket *bucket;
 	GSList *l;
-	const struct opl_operator *opl;
-	int i;
-
-	for (l = eons->opl_list; l; l = l->next) {
-		opl = l->data;
+	int key;
 
-		for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
-			if (mcc[i] != opl->mcc[i] &&
-					!(opl->mcc[i] == 'b' && mcc[i]))
+	if (eons->opl_index == NULL) {
+		for (l = eons->opl_list; l; l = l->next)
+			if (opl_operator_match(l->data, mcc, mnc,
+							have_lac, lac))
 				break;
-		if (i < OFONO_MAX_MCC_LENGTH)
-			continue;
 
-		for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
-			if (mnc[i] != opl->mnc[i] &&
-					!(opl->mnc[i] == 'b' && mnc[i]))
-				break;
-		if (i < OFONO_MAX_MNC_LENGTH)
-			continue;
+		opl = l ? l->data : NULL;
+		goto done;
+	}
 
-		if (opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe)
-			break;
+	key = opl_mcc_mnc_key(mcc, mnc);
 
-		if (have_lac == FALSE)
-			continue;
+	if (key >= 0) {
+		bucket = g_hash_table_lookup(eons->opl_index,
+						GINT_TO_POINTER(key));
+		if (bucket)
+			opl = opl_bucket_lookup(bucket, have_lac, lac);
+	}
+
+	/* A wildcard record wins if it comes first in EFopl */
+	for (l = eons->opl_wildcard; l; l = l->next) {
+		const struct opl_operator *wildcard = l->data;
 
-		if ((lac >= opl->lac_tac_low) && (lac <= opl->lac_tac_high))
+		if (opl && wildcard->order > opl->order)
 			break;
+
+		if (opl_operator_match(wildcard, mcc, mnc, have_lac, lac)) {
+			opl = wildcard;
+			break;
+		}
 	}
 
-	if (l == NULL)
+done:
+	if (opl == NULL)
 		return NULL;
 
-	opl = l->data;
-
 	/* 0 is not a valid record id */
 	if (opl->id == 0)
 		return NULL;
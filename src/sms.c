@@ -99,6 +99,7 @@ struct tx_queue_entry {
 	struct pending_pdu *pdus;
 	unsigned char num_pdus;
 	unsigned char cur_pdu;
+	unsigned char first_seq;	/* Backup seq of pdus[0] */
 	struct sms_address receiver;
 	struct ofono_uuid uuid;
 	unsigned int retry;
@@ -654,7 +655,8 @@ static void sms_tx_queue_remove_entry(struct ofono_sms *sms, GList *entry_list,
 		struct message *m;
 
 		sms_tx_backup_free(sms->imsi, entry->id, entry->flags,
-					ofono_uuid_to_str(&entry->uuid));
+					ofono_uuid_to_str(&entry->uuid),
+					entry->first_seq, entry->num_pdus);
 
 		m = g_hash_table_lookup(sms->messages, &entry->uuid);
 
@@ -671,6 +673,61 @@ done:
 	tx_queue_entry_destroy(entry);
 }
 
+static gboolean tx_queue_entry_set_pdus(struct tx_queue_entry *entry,
+						GSList *msg_list)
+{
+	int i = 0;
+	GSList *l;
+
+	entry->num_pdus = g_slist_length(msg_list);
+
+	entry->pdus = g_try_new0(struct pending_pdu, entry->num_pdus);
+	if (entry->pdus == NULL)
+		return FALSE;
+
+	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_REQUEST_SR) {
+		struct sms *head = msg_list->data;
+
+		memcpy(&entry->receiver, &head->submit.daddr,
+				sizeof(entry->receiver));
+	}
+
+	for (l = msg_list; l; l = l->next) {
+		struct pending_pdu *pdu = &entry->pdus[i++];
+		struct sms *s = l->data;
+
+		sms_encode(s, &pdu->pdu_len, &pdu->tpdu_len, pdu->pdu);
+
+		DBG("pdu_len: %d, tpdu_len: %d",
+				pdu->pdu_len, pdu->tpdu_len);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Fetch the pdus of an entry restored by sms_restore_tx_queue(), only
+ * the pdus that were still pending when the backup was written are
+ * left in it.
+ */
+static gboolean tx_queue_entry_load(struct ofono_sms *sms,
+					struct tx_queue_entry *entry)
+{
+	GSList *msg_list;
+	gboolean ret;
+
+	msg_list = sms_tx_backup_load(sms->imsi, entry->id, entry->flags,
+					ofono_uuid_to_str(&entry->uuid),
+					entry->first_seq, entry->num_pdus);
+	if (msg_list == NULL)
+		return FALSE;
+
+	ret = tx_queue_entry_set_pdus(entry, msg_list);
+	g_slist_free_full(msg_list, g_free);
+
+	return ret;
+}
+
 static void tx_finished(const struct ofono_error *error, int mr, void *data)
 {
 	struct ofono_sms *sms = data;
@@ -714,8 +771,8 @@ static void tx_finished(const struct ofono_error *error, int mr, void *data)
 
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS)
 		sms_tx_backup_remove(sms->imsi, entry->id, entry->flags,
-						ofono_uuid_to_str(&entry->uuid),
-						entry->cur_pdu);
+					ofono_uuid_to_str(&entry->uuid),
+					entry->first_seq + entry->cur_pdu);
 
 	entry->cur_pdu += 1;
 	entry->retry = 0;
@@ -752,7 +809,7 @@ static gboolean tx_next(gpointer user_data)
 	struct ofono_sms *sms = user_data;
 	int send_mms = 0;
 	struct tx_queue_entry *entry = g_queue_peek_head(sms->txq);
-	struct pending_pdu *pdu = &entry->pdus[entry->cur_pdu];
+	struct pending_pdu *pdu;
 
 	DBG("tx_next: %p", entry);
 
@@ -761,6 +818,22 @@ static gboolean tx_next(gpointer user_data)
 	if (sms->registered == FALSE)
 		return FALSE;
 
+	/* Entries restored from the backup get their pdus on first use */
+	if (entry->pdus == NULL && tx_queue_entry_load(sms, entry) == FALSE) {
+		ofono_error("Unable to restore queued message %s",
+					ofono_uuid_to_str(&entry->uuid));
+
+		sms_tx_queue_remove_entry(sms, g_queue_peek_head_link(sms->txq),
+						MESSAGE_STATE_FAILED);
+
+		if (g_queue_peek_head(sms->txq))
+			sms->tx_source = g_timeout_add(0, tx_next, sms);
+
+		return FALSE;
+	}
+
+	pdu = &entry->pdus[entry->cur_pdu];
+
 	if (g_queue_get_length(sms->txq) > 1
 			|| (entry->num_pdus - entry->cur_pdu) > 1)
 		send_mms = 1;
@@ -870,37 +943,15 @@ static struct tx_queue_entry *tx_queue_entry_new(GSList *msg_list,
 							unsigned int flags)
 {
 	struct tx_queue_entry *entry;
-	int i = 0;
-	GSList *l;
 
 	entry = g_try_new0(struct tx_queue_entry, 1);
 	if (entry == NULL)
 		return NULL;
 
-	entry->num_pdus = g_slist_length(msg_list);
-
-	entry->pdus = g_try_new0(struct pending_pdu, entry->num_pdus);
-	if (entry->pdus == NULL)
-		goto error;
-
-	if (flags & OFONO_SMS_SUBMIT_FLAG_REQUEST_SR) {
-		struct sms *head = msg_list->data;
-
-		memcpy(&entry->receiver, &head->submit.daddr,
-				sizeof(entry->receiver));
-	}
-
 	entry->flags = flags;
 
-	for (l = msg_list; l; l = l->next) {
-		struct pending_pdu *pdu = &entry->pdus[i++];
-		struct sms *s = l->data;
-
-		sms_encode(s, &pdu->pdu_len, &pdu->tpdu_len, pdu->pdu);
-
-		DBG("pdu_len: %d, tpdu_len: %d",
-				pdu->pdu_len, pdu->tpdu_len);
-	}
+	if (tx_queue_entry_set_pdus(entry, msg_list) == FALSE)
+		goto error;
 
 	if (flags & OFONO_SMS_SUBMIT_FLAG_REUSE_UUID)
 		return entry;
@@ -1929,13 +1980,17 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 		struct message *m;
 		struct tx_queue_entry *txq_entry;
 
-		backup_entry->flags |= OFONO_SMS_SUBMIT_FLAG_REUSE_UUID;
-		txq_entry = tx_queue_entry_new(backup_entry->msg_list,
-							backup_entry->flags);
+		/*
+		 * Only the bookkeeping is restored here, the pdus are read
+		 * back by tx_next() once the entry reaches the queue head.
+		 */
+		txq_entry = g_try_new0(struct tx_queue_entry, 1);
 		if (txq_entry == NULL)
 			goto loop_out;
 
-		txq_entry->flags &= ~OFONO_SMS_SUBMIT_FLAG_REUSE_UUID;
+		txq_entry->flags = backup_entry->flags;
+		txq_entry->num_pdus = backup_entry->num_pdus;
+		txq_entry->first_seq = backup_entry->first_seq;
 		memcpy(&txq_entry->uuid.uuid, &backup_entry->uuid,
 								SMS_MSGID_LEN);
 
@@ -1955,11 +2010,14 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 		message_set_data(m, txq_entry);
 		g_hash_table_insert(sms->messages, &txq_entry->uuid, m);
 
-		txq_entry->id = sms->tx_counter++;
+		/* Keep the id the backup is stored under */
+		txq_entry->id = backup_entry->id;
+		if (txq_entry->id >= sms->tx_counter)
+			sms->tx_counter = txq_entry->id + 1;
+
 		g_queue_push_tail(sms->txq, txq_entry);
 
 loop_out:
-		g_slist_free_full(backup_entry->msg_list, g_free);
 		g_free(backup_entry);
 	}
 
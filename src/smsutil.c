@@ -27,30 +27,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
 
 #include <glib.h>
 
 #include "util.h"
-#include "storage.h"
+#include "journal.h"
 #include "smsutil.h"
 
 #define uninitialized_var(x) x = x
 
-#define SMS_BACKUP_MODE 0600
-#define SMS_BACKUP_PATH STORAGEDIR "/%s/sms_assembly"
-#define SMS_BACKUP_PATH_DIR SMS_BACKUP_PATH "/%s-%i-%i"
-#define SMS_BACKUP_PATH_FILE SMS_BACKUP_PATH_DIR "/%03i"
+#define SMS_JOURNAL_PATH STORAGEDIR "/%s/sms_journal"
+#define SMS_LEGACY_PATH STORAGEDIR "/%s/%s"
 
-#define SMS_SR_BACKUP_PATH STORAGEDIR "/%s/sms_sr"
-#define SMS_SR_BACKUP_PATH_FILE SMS_SR_BACKUP_PATH "/%s-%s"
+#define SMS_BACKUP_STORE "sms_assembly"
+#define SMS_BACKUP_KEY_DIR SMS_BACKUP_STORE "/%s-%i-%i"
+#define SMS_BACKUP_KEY_FILE SMS_BACKUP_KEY_DIR "/%03i"
 
-#define SMS_TX_BACKUP_PATH STORAGEDIR "/%s/tx_queue"
-#define SMS_TX_BACKUP_PATH_DIR SMS_TX_BACKUP_PATH "/%lu-%lu-%s"
-#define SMS_TX_BACKUP_PATH_FILE SMS_TX_BACKUP_PATH_DIR "/%03i"
+#define SMS_SR_BACKUP_STORE "sms_sr"
+#define SMS_SR_BACKUP_KEY SMS_SR_BACKUP_STORE "/%s-%s"
+
+#define SMS_TX_BACKUP_STORE "tx_queue"
+#define SMS_TX_BACKUP_KEY_DIR SMS_TX_BACKUP_STORE "/%lu-%lu-%s"
+#define SMS_TX_BACKUP_KEY_FILE SMS_TX_BACKUP_KEY_DIR "/%03i"
 
 #define SMS_ADDR_FMT "%24[0-9A-F]"
 #define SMS_MSGID_FMT "%40[0-9A-F]"
@@ -2396,79 +2395,56 @@ gboolean sms_address_to_hex_string(const struct sms_address *in, char *straddr)
 	return TRUE;
 }
 
-static void sms_assembly_load(struct sms_assembly *assembly,
-				const struct dirent *dir)
+/*
+ * All SMS backups of an IMSI live in a single journal, keyed by what used to
+ * be their path below the IMSI storage directory.  Backups of store still
+ * using the older layout of one file per entry are moved into the journal.
+ */
+static struct journal *sms_journal_open(const char *imsi, const char *store)
+{
+	struct journal *journal;
+	char *path;
+
+	path = g_strdup_printf(SMS_JOURNAL_PATH, imsi);
+	journal = journal_open(path);
+	g_free(path);
+
+	if (journal == NULL || store == NULL)
+		return journal;
+
+	path = g_strdup_printf(SMS_LEGACY_PATH, imsi, store);
+	journal_import_dir(journal, path, store);
+	g_free(path);
+
+	return journal;
+}
+
+static void sms_assembly_load(const char *key, const unsigned char *data,
+				size_t len, time_t ts, void *user_data)
 {
+	struct sms_assembly *assembly = user_data;
 	struct sms_address addr;
 	DECLARE_SMS_ADDR_STR(straddr);
 	guint16 ref;
 	guint8 max;
 	guint8 seq;
-	char *path;
-	int len;
-	struct stat segment_stat;
-	struct dirent **segments;
-	char *endp;
-	int r;
-	int i;
-	unsigned char buf[177];
+	char endc;
 	struct sms segment;
 
-	if (dir->d_type != DT_DIR)
-		return;
-
 	/* Max of SMS address size is 12 bytes, hex encoded */
-	if (sscanf(dir->d_name, SMS_ADDR_FMT "-%hi-%hhi",
-				straddr, &ref, &max) < 3)
+	if (sscanf(key, SMS_BACKUP_STORE "/" SMS_ADDR_FMT "-%hi-%hhi/%hhu%c",
+				straddr, &ref, &max, &seq, &endc) != 4)
 		return;
 
 	if (sms_assembly_extract_address(straddr, &addr) == FALSE)
 		return;
 
-	path = g_strdup_printf(SMS_BACKUP_PATH "/%s",
-			assembly->imsi, dir->d_name);
-	len = scandir(path, &segments, NULL, versionsort);
-	g_free(path);
-
-	if (len < 0)
+	if (!sms_deserialize(data, &segment, len))
 		return;
 
-	for (i = 0; i < len; i++) {
-		if (segments[i]->d_type != DT_REG)
-			continue;
-
-		seq = strtol(segments[i]->d_name, &endp, 10);
-		if (*endp != '\0')
-			continue;
-
-		r = read_file(buf, sizeof(buf), SMS_BACKUP_PATH "/%s/%s",
-				assembly->imsi,
-				dir->d_name, segments[i]->d_name);
-		if (r < 0)
-			continue;
-
-		if (!sms_deserialize(buf, &segment, r))
-			continue;
-
-		path = g_strdup_printf(SMS_BACKUP_PATH "/%s/%s",
-				assembly->imsi,
-				dir->d_name, segments[i]->d_name);
-		r = stat(path, &segment_stat);
-		g_free(path);
-
-		if (r != 0)
-			continue;
-
-		/* Errors cannot occur here */
-		sms_assembly_add_fragment_backup(assembly, &segment,
-						segment_stat.st_mtime,
+	/* Errors cannot occur here */
+	sms_assembly_add_fragment_backup(assembly, &segment, ts,
 						&addr, ref, max, seq, FALSE);
-	}
-
-	for (i = 0; i < len; i++)
-		free(segments[i]);
-
-	free(segments);
 }
 
 static gboolean sms_assembly_store(struct sms_assembly *assembly,
@@ -2478,8 +2454,10 @@ static gboolean sms_assembly_store(struct sms_assembly *assembly,
 	unsigned char buf[177];
 	int len;
 	DECLARE_SMS_ADDR_STR(straddr);
+	char *key;
+	gboolean ret;
 
-	if (assembly->imsi == NULL)
+	if (assembly->journal == NULL)
 		return FALSE;
 
 	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
@@ -2487,22 +2465,22 @@ static gboolean sms_assembly_store(struct sms_assembly *assembly,
 
 	len = sms_serialize(buf, sms);
 
-	if (write_file(buf, len, SMS_BACKUP_MODE,
-				SMS_BACKUP_PATH_FILE, assembly->imsi, straddr,
-				node->ref, node->max_fragments, seq) != len)
-		return FALSE;
+	key = g_strdup_printf(SMS_BACKUP_KEY_FILE, straddr, node->ref,
+				node->max_fragments, seq);
+	ret = journal_put(assembly->journal, key, buf, len, time(NULL));
+	g_free(key);
 
-	return TRUE;
+	return ret;
 }
 
 static void sms_assembly_backup_free(struct sms_assembly *assembly,
 					struct sms_assembly_node *node)
 {
-	char *path;
+	char *key;
 	int seq;
 	DECLARE_SMS_ADDR_STR(straddr);
 
-	if (assembly->imsi == NULL)
+	if (assembly->journal == NULL)
 		return;
 
 	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
@@ -2513,62 +2491,158 @@ static void sms_assembly_backup_free(struct sms_assembly *assembly,
 		int bit = 1 << (seq % 32);
 
 		if (node->bitmap[offset] & bit) {
-			path = g_strdup_printf(SMS_BACKUP_PATH_FILE,
-					assembly->imsi, straddr,
+			key = g_strdup_printf(SMS_BACKUP_KEY_FILE, straddr,
 					node->ref, node->max_fragments, seq);
-			unlink(path);
-			g_free(path);
+			journal_remove(assembly->journal, key);
+			g_free(key);
 		}
 	}
+}
 
-	path = g_strdup_printf(SMS_BACKUP_PATH_DIR, assembly->imsi, straddr,
-				node->ref, node->max_fragments);
-	rmdir(path);
-	g_free(path);
+static guint sms_assembly_node_hash(gconstpointer v)
+{
+	const struct sms_assembly_node *node = v;
+
+	return g_str_hash(node->addr.address) ^ (node->ref << 8) ^
+		(node->addr.number_type << 4) ^ node->addr.numbering_plan;
 }
 
-struct sms_assembly *sms_assembly_new(const char *imsi)
+static gboolean sms_assembly_node_equal(gconstpointer v1, gconstpointer v2)
 {
-	struct sms_assembly *ret = g_new0(struct sms_assembly, 1);
-	char *path;
-	struct dirent **entries;
-	int len;
+	const struct sms_assembly_node *a = v1;
+	const struct sms_assembly_node *b = v2;
 
-	if (imsi) {
-		ret->imsi = imsi;
+	if (a->ref != b->ref)
+		return FALSE;
+
+	if (a->addr.number_type != b->addr.number_type)
+		return FALSE;
+
+	if (a->addr.numbering_plan != b->addr.numbering_plan)
+		return FALSE;
+
+	return strcmp(a->addr.address, b->addr.address) == 0;
+}
+
+/*
+ * The expiry heap is a binary min-heap on the node timestamp.  Each node
+ * tracks its own heap_index so that completed messages can be taken out
+ * of the middle of the heap.
+ */
+static void expiry_heap_set(GPtrArray *heap, unsigned int index,
+				struct sms_assembly_node *node)
+{
+	heap->pdata[index] = node;
+	node->heap_index = index;
+}
+
+static void expiry_heap_sift_up(GPtrArray *heap, unsigned int index)
+{
+	struct sms_assembly_node *node = heap->pdata[index];
+
+	while (index > 0) {
+		unsigned int parent = (index - 1) / 2;
+		struct sms_assembly_node *p = heap->pdata[parent];
+
+		if (p->ts <= node->ts)
+			break;
+
+		expiry_heap_set(heap, index, p);
+		index = parent;
+	}
+
+	expiry_heap_set(heap, index, node);
+}
+
+static void expiry_heap_sift_down(GPtrArray *heap, unsigned int index)
+{
+	struct sms_assembly_node *node = heap->pdata[index];
+
+	while (TRUE) {
+		unsigned int child = index * 2 + 1;
+		struct sms_assembly_node *c;
 
-		/* Restore state from backup */
+		if (child >= heap->len)
+			break;
 
-		path = g_strdup_printf(SMS_BACKUP_PATH, imsi);
-		len = scandir(path, &entries, NULL, alphasort);
-		g_free(path);
+		c = heap->pdata[child];
 
-		if (len < 0)
-			return ret;
+		if (child + 1 < heap->len) {
+			struct sms_assembly_node *r = heap->pdata[child + 1];
 
-		while (len--) {
-			sms_assembly_load(ret, entries[len]);
-			free(entries[len]);
+			if (r->ts < c->ts) {
+				child += 1;
+				c = r;
+			}
 		}
 
-		free(entries);
+		if (node->ts <= c->ts)
+			break;
+
+		expiry_heap_set(heap, index, c);
+		index = child;
 	}
 
+	expiry_heap_set(heap, index, node);
+}
+
+static void expiry_heap_push(GPtrArray *heap, struct sms_assembly_node *node)
+{
+	g_ptr_array_add(heap, node);
+	expiry_heap_sift_up(heap, heap->len - 1);
+}
+
+static void expiry_heap_remove(GPtrArray *heap, struct sms_assembly_node *node)
+{
+	unsigned int index = node->heap_index;
+	struct sms_assembly_node *last = heap->pdata[heap->len - 1];
+
+	g_ptr_array_set_size(heap, heap->len - 1);
+
+	if (last == node)
+		return;
+
+	expiry_heap_set(heap, index, last);
+	expiry_heap_sift_up(heap, index);
+	expiry_heap_sift_down(heap, last->heap_index);
+}
+
+struct sms_assembly *sms_assembly_new(const char *imsi)
+{
+	struct sms_assembly *ret = g_new0(struct sms_assembly, 1);
+
+	ret->assembly_table = g_hash_table_new(sms_assembly_node_hash,
+						sms_assembly_node_equal);
+	ret->expiry_heap = g_ptr_array_new();
+
+	if (imsi) {
+		ret->imsi = imsi;
+		ret->journal = sms_journal_open(imsi, SMS_BACKUP_STORE);
+	}
+
+	/* Restore state from backup */
+	if (ret->journal)
+		journal_foreach(ret->journal, SMS_BACKUP_STORE "/",
+					sms_assembly_load, ret);
+
 	return ret;
 }
 
 void sms_assembly_free(struct sms_assembly *assembly)
 {
-	GSList *l;
+	unsigned int i;
 
-	for (l = assembly->assembly_list; l; l = l->next) {
-		struct sms_assembly_node *node = l->data;
+	for (i = 0; i < assembly->expiry_heap->len; i++) {
+		struct sms_assembly_node *node =
+			g_ptr_array_index(assembly->expiry_heap, i);
 
 		g_slist_free_full(node->fragment_list, g_free);
 		g_free(node);
 	}
 
-	g_slist_free(assembly->assembly_list);
+	g_ptr_array_free(assembly->expiry_heap, TRUE);
+	g_hash_table_destroy(assembly->assembly_table);
+	journal_unref(assembly->journal);
 	g_free(assembly);
 }
 
@@ -2581,6 +2655,13 @@ GSList *sms_assembly_add_fragment(struct sms_assembly *assembly,
 						ts, addr, ref, max, seq, TRUE);
 }
 
+static void sms_assembly_remove_node(struct sms_assembly *assembly,
+					struct sms_assembly_node *node)
+{
+	g_hash_table_remove(assembly->assembly_table, node);
+	expiry_heap_remove(assembly->expiry_heap, node);
+}
+
 static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 					const struct sms *sms, time_t ts,
 					const struct sms_address *addr,
@@ -2589,32 +2670,19 @@ static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 {
 	unsigned int offset = seq / 32;
 	unsigned int bit = 1 << (seq % 32);
-	GSList *l;
-	GSList *prev;
 	struct sms *newsms;
+	struct sms_assembly_node lookup;
 	struct sms_assembly_node *node;
 	GSList *completed;
 	unsigned int position;
 	unsigned int i;
-	unsigned int j;
-
-	prev = NULL;
-
-	for (l = assembly->assembly_list; l; prev = l, l = l->next) {
-		node = l->data;
 
-		if (node->addr.number_type != addr->number_type)
-			continue;
-
-		if (node->addr.numbering_plan != addr->numbering_plan)
-			continue;
+	memcpy(&lookup.addr, addr, sizeof(struct sms_address));
+	lookup.ref = ref;
 
-		if (strcmp(node->addr.address, addr->address))
-			continue;
-
-		if (ref != node->ref)
-			continue;
+	node = g_hash_table_lookup(assembly->assembly_table, &lookup);
 
+	if (node) {
 		/*
 		 * Message Reference and address the same, but max is not
 		 * ignore the SMS completely
@@ -2627,39 +2695,26 @@ static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 			return NULL;
 
 		/*
-		 * Iterate over the bitmap to find in which position
-		 * should the fragment be inserted -- basically we
-		 * walk each bit in the bitmap until the bit we care
-		 * about (offset:bit) and count which are stored --
-		 * that gives us in which position we have to insert.
+		 * The fragment is inserted after all the fragments with a
+		 * lower seq number, count the bits set below offset:bit
 		 */
-		position = 0;
+		position = __builtin_popcount(node->bitmap[offset] & (bit - 1));
+
 		for (i = 0; i < offset; i++)
-			for (j = 0; j < 32; j++)
-				if (node->bitmap[i] & (1 << j))
-					position += 1;
+			position += __builtin_popcount(node->bitmap[i]);
+	} else {
+		node = g_new0(struct sms_assembly_node, 1);
+		memcpy(&node->addr, addr, sizeof(struct sms_address));
+		node->ts = ts;
+		node->ref = ref;
+		node->max_fragments = max;
 
-		for (j = 1; j < bit; j = j << 1)
-			if (node->bitmap[offset] & j)
-				position += 1;
+		g_hash_table_insert(assembly->assembly_table, node, node);
+		expiry_heap_push(assembly->expiry_heap, node);
 
-		goto out;
+		position = 0;
 	}
 
-	node = g_new0(struct sms_assembly_node, 1);
-	memcpy(&node->addr, addr, sizeof(struct sms_address));
-	node->ts = ts;
-	node->ref = ref;
-	node->max_fragments = max;
-
-	assembly->assembly_list = g_slist_prepend(assembly->assembly_list,
-							node);
-
-	prev = NULL;
-	l = assembly->assembly_list;
-	position = 0;
-
-out:
 	newsms = g_new(struct sms, 1);
 
 	memcpy(newsms, sms, sizeof(struct sms));
@@ -2678,14 +2733,9 @@ out:
 	completed = node->fragment_list;
 
 	sms_assembly_backup_free(assembly, node);
-
-	if (prev)
-		prev->next = l->next;
-	else
-		assembly->assembly_list = l->next;
+	sms_assembly_remove_node(assembly, node);
 
 	g_free(node);
-	g_slist_free_1(l);
 	return completed;
 }
 
@@ -2696,35 +2746,19 @@ out:
  */
 void sms_assembly_expire(struct sms_assembly *assembly, time_t before)
 {
-	GSList *cur;
-	GSList *prev;
-	GSList *tmp;
+	GPtrArray *heap = assembly->expiry_heap;
 
-	prev = NULL;
-	cur = assembly->assembly_list;
+	while (heap->len > 0) {
+		struct sms_assembly_node *node = g_ptr_array_index(heap, 0);
 
-	while (cur) {
-		struct sms_assembly_node *node = cur->data;
-
-		if (node->ts > before) {
-			prev = cur;
-			cur = cur->next;
-			continue;
-		}
+		if (node->ts > before)
+			break;
 
 		sms_assembly_backup_free(assembly, node);
+		sms_assembly_remove_node(assembly, node);
 
 		g_slist_free_full(node->fragment_list, g_free);
 		g_free(node);
-
-		if (prev)
-			prev->next = cur->next;
-		else
-			assembly->assembly_list = cur->next;
-
-		tmp = cur;
-		cur = cur->next;
-		g_slist_free_1(tmp);
 	}
 }
 
@@ -2742,32 +2776,128 @@ static guint sha1_hash(gconstpointer v)
 	return h;
 }
 
-static void sr_assembly_load_backup(GHashTable *assembly_table,
-					const char *imsi,
-					const struct dirent *addr_dir)
+/*
+ * The mr index maps an address and message reference to the message it was
+ * sent for, which saves looking at every message sent to that address when
+ * a status report comes in.  The address is the key of the assembly_table
+ * and the msgid the key of the id_table holding the node.  Should a mr get
+ * reused while still outstanding the newest message wins.
+ */
+struct sr_mr_entry {
+	const char *addr;
+	unsigned char mr;
+	unsigned char *msgid;
+	struct id_table_node *node;
+};
+
+static guint sr_mr_entry_hash(gconstpointer v)
+{
+	const struct sr_mr_entry *entry = v;
+
+	return g_str_hash(entry->addr) * 31 + entry->mr;
+}
+
+static gboolean sr_mr_entry_equal(gconstpointer v1, gconstpointer v2)
 {
+	const struct sr_mr_entry *a = v1;
+	const struct sr_mr_entry *b = v2;
+
+	return a->mr == b->mr && g_str_equal(a->addr, b->addr);
+}
+
+static struct sr_mr_entry *sr_mr_index_lookup(
+					struct status_report_assembly *assembly,
+					const char *addr, unsigned char mr)
+{
+	struct sr_mr_entry lookup = { .addr = addr, .mr = mr };
+
+	return g_hash_table_lookup(assembly->mr_table, &lookup);
+}
+
+static void sr_mr_index_add(struct status_report_assembly *assembly,
+				const char *addr, unsigned char *msgid,
+				struct id_table_node *node, unsigned char mr)
+{
+	struct sr_mr_entry *entry = g_new(struct sr_mr_entry, 1);
+
+	entry->addr = addr;
+	entry->mr = mr;
+	entry->msgid = msgid;
+	entry->node = node;
+
+	g_hash_table_replace(assembly->mr_table, entry, entry);
+}
+
+/* Drops the entries of all mrs still outstanding for the node */
+static void sr_mr_index_remove_node(struct status_report_assembly *assembly,
+					const char *addr,
+					const struct id_table_node *node)
+{
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		unsigned int mrs = node->mrs[i];
+
+		while (mrs) {
+			int bit = __builtin_ctz(mrs);
+			struct sr_mr_entry *entry;
+
+			mrs &= mrs - 1;
+
+			entry = sr_mr_index_lookup(assembly, addr,
+							i * 32 + bit);
+			if (entry && entry->node == node)
+				g_hash_table_remove(assembly->mr_table, entry);
+		}
+	}
+}
+
+/* Adds the entries of all mrs outstanding for a freshly restored node */
+static void sr_mr_index_add_node(struct status_report_assembly *assembly,
+					const char *addr, unsigned char *msgid,
+					struct id_table_node *node)
+{
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		unsigned int mrs = node->mrs[i];
+
+		while (mrs) {
+			int bit = __builtin_ctz(mrs);
+
+			mrs &= mrs - 1;
+			sr_mr_index_add(assembly, addr, msgid, node,
+					i * 32 + bit);
+		}
+	}
+}
+
+static void sr_assembly_load_backup(const char *key,
+					const unsigned char *data, size_t len,
+					time_t ts, void *user_data)
+{
+	struct status_report_assembly *assembly = user_data;
+	GHashTable *assembly_table = assembly->assembly_table;
 	struct sms_address addr;
 	DECLARE_SMS_ADDR_STR(straddr);
 	struct id_table_node *node;
 	GHashTable *id_table;
-	int r;
 	char *assembly_table_key;
-	unsigned int *id_table_key;
+	unsigned char *id_table_key;
 	char msgid_str[SMS_MSGID_LEN * 2 + 1];
 	unsigned char msgid[SMS_MSGID_LEN];
 	char endc;
 
-	if (addr_dir->d_type != DT_REG)
+	if (len != sizeof(struct id_table_node))
 		return;
 
 	/*
-	 * All SMS-messages under the same IMSI-code are
-	 * included in the same directory.
-	 * So, SMS-address and message ID are included in the same file name
+	 * SMS-address and message ID are both included in the key
 	 * Max of SMS address size is 12 bytes, hex encoded
 	 * Max of SMS SHA1 hash is 20 bytes, hex encoded
 	 */
-	if (sscanf(addr_dir->d_name, SMS_ADDR_FMT "-" SMS_MSGID_FMT "%c",
+	if (sscanf(key, SMS_SR_BACKUP_STORE "/" SMS_ADDR_FMT "-"
+				SMS_MSGID_FMT "%c",
 				straddr, msgid_str, &endc) != 2)
 		return;
 
@@ -2781,23 +2911,13 @@ static void sr_assembly_load_backup(GHashTable *assembly_table,
 				NULL, 0, msgid) == NULL)
 		return;
 
-	node = g_new0(struct id_table_node, 1);
-
-	r = read_file((unsigned char *) node,
-			sizeof(struct id_table_node),
-			SMS_SR_BACKUP_PATH "/%s",
-			imsi, addr_dir->d_name);
-
-	if (r < 0) {
-		g_free(node);
-		return;
-	}
-
-	id_table = g_hash_table_lookup(assembly_table,
-					sms_address_to_string(&addr));
+	node = g_memdup(data, sizeof(struct id_table_node));
 
 	/* Create hashtable keyed by the to address if required */
-	if (id_table == NULL) {
+	if (g_hash_table_lookup_extended(assembly_table,
+					sms_address_to_string(&addr),
+					(gpointer *) &assembly_table_key,
+					(gpointer *) &id_table) == FALSE) {
 		id_table = g_hash_table_new_full(sha1_hash, sha1_equal,
 							g_free, g_free);
 
@@ -2810,58 +2930,44 @@ static void sr_assembly_load_backup(GHashTable *assembly_table,
 	id_table_key = g_memdup(msgid, SMS_MSGID_LEN);
 
 	g_hash_table_insert(id_table, id_table_key, node);
+	sr_mr_index_add_node(assembly, assembly_table_key, id_table_key, node);
 }
 
 struct status_report_assembly *status_report_assembly_new(const char *imsi)
 {
-	char *path;
-	int len;
-	struct dirent **addresses;
 	struct status_report_assembly *ret =
 				g_new0(struct status_report_assembly, 1);
 
 	ret->assembly_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 				g_free, (GDestroyNotify) g_hash_table_destroy);
+	ret->mr_table = g_hash_table_new_full(sr_mr_entry_hash,
+						sr_mr_entry_equal,
+						g_free, NULL);
 
 	if (imsi) {
 		ret->imsi = imsi;
-
-		/* Restore state from backup */
-		path = g_strdup_printf(SMS_SR_BACKUP_PATH, imsi);
-		len = scandir(path, &addresses, NULL, alphasort);
-
-		g_free(path);
-
-		if (len < 0)
-			return ret;
-
-		/*
-		 * Go through different addresses. Each address can relate to
-		 * 1-n msg_ids.
-		 */
-
-		while (len--) {
-			sr_assembly_load_backup(ret->assembly_table, imsi,
-								addresses[len]);
-			g_free(addresses[len]);
-		}
-
-		g_free(addresses);
+		ret->journal = sms_journal_open(imsi, SMS_SR_BACKUP_STORE);
 	}
 
+	/* Restore state from backup */
+	if (ret->journal)
+		journal_foreach(ret->journal, SMS_SR_BACKUP_STORE "/",
+				sr_assembly_load_backup, ret);
+
 	return ret;
 }
 
-static gboolean sr_assembly_add_fragment_backup(const char *imsi,
+static gboolean sr_assembly_add_fragment_backup(struct journal *journal,
 					const struct id_table_node *node,
 					const struct sms_address *addr,
 					const unsigned char *msgid)
 {
-	int len = sizeof(struct id_table_node);
 	DECLARE_SMS_ADDR_STR(straddr);
 	char msgid_str[SMS_MSGID_LEN * 2 + 1];
+	char *key;
+	gboolean ret;
 
-	if (imsi == NULL)
+	if (journal == NULL)
 		return FALSE;
 
 	if (sms_address_to_hex_string(addr, straddr) == FALSE)
@@ -2870,24 +2976,25 @@ static gboolean sr_assembly_add_fragment_backup(const char *imsi,
 	if (encode_hex_own_buf(msgid, SMS_MSGID_LEN, 0, msgid_str) == NULL)
 		return FALSE;
 
-	/* storagedir/%s/sms_sr/%s-%s */
-	if (write_file((unsigned char *) node, len, SMS_BACKUP_MODE,
-			SMS_SR_BACKUP_PATH_FILE, imsi,
-			straddr, msgid_str) != len)
-		return FALSE;
+	/* sms_sr/%s-%s */
+	key = g_strdup_printf(SMS_SR_BACKUP_KEY, straddr, msgid_str);
+	ret = journal_put(journal, key, (const unsigned char *) node,
+				sizeof(struct id_table_node), time(NULL));
+	g_free(key);
 
-	return TRUE;
+	return ret;
 }
 
-static gboolean sr_assembly_remove_fragment_backup(const char *imsi,
+static gboolean sr_assembly_remove_fragment_backup(struct journal *journal,
 					const struct sms_address *addr,
 					const unsigned char *sha1)
 {
-	char *path;
+	char *key;
 	DECLARE_SMS_ADDR_STR(straddr);
 	char msgid_str[SMS_MSGID_LEN * 2 + 1];
+	gboolean ret;
 
-	if (imsi == NULL)
+	if (journal == NULL)
 		return FALSE;
 
 	if (sms_address_to_hex_string(addr, straddr) == FALSE)
@@ -2896,18 +3003,18 @@ static gboolean sr_assembly_remove_fragment_backup(const char *imsi,
 	if (encode_hex_own_buf(sha1, SMS_MSGID_LEN, 0, msgid_str) == FALSE)
 		return FALSE;
 
-	path = g_strdup_printf(SMS_SR_BACKUP_PATH_FILE,
-					imsi, straddr, msgid_str);
-
-	unlink(path);
-	g_free(path);
+	key = g_strdup_printf(SMS_SR_BACKUP_KEY, straddr, msgid_str);
+	ret = journal_remove(journal, key);
+	g_free(key);
 
-	return TRUE;
+	return ret;
 }
 
 void status_report_assembly_free(struct status_report_assembly *assembly)
 {
+	g_hash_table_destroy(assembly->mr_table);
 	g_hash_table_destroy(assembly->assembly_table);
+	journal_unref(assembly->journal);
 	g_free(assembly);
 }
 
@@ -2932,32 +3039,6 @@ static gboolean sr_st_to_delivered(enum sms_st st, gboolean *delivered)
 	return FALSE;
 }
 
-static struct id_table_node *find_by_mr_and_mark(GHashTable *id_table,
-						unsigned char mr,
-						GHashTableIter *out_iter,
-						unsigned char **out_id)
-{
-	unsigned int offset = mr / 32;
-	unsigned int bit = 1 << (mr % 32);
-	gpointer key, value;
-	struct id_table_node *node;
-
-	g_hash_table_iter_init(out_iter, id_table);
-	while (g_hash_table_iter_next(out_iter, &key, &value)) {
-		node = value;
-
-		/* Address and MR matched */
-		if (node->mrs[offset] & bit) {
-			node->mrs[offset] ^= bit;
-			*out_id = key;
-
-			return node;
-		}
-	}
-
-	return NULL;
-}
-
 /*
  * Key (receiver address) does not exist in assembly. Some networks can change
  * address to international format, although address is sent in the national
@@ -2966,25 +3047,21 @@ static struct id_table_node *find_by_mr_and_mark(GHashTable *id_table,
  * addresses and received address. If address contains less than six digits,
  * compare only existing digits.
  */
-static struct id_table_node *fuzzy_lookup(struct status_report_assembly *assy,
-						const struct sms *sr,
-						const char **out_addr,
-						GHashTableIter *out_iter,
-						unsigned char **out_msgid)
+static struct sr_mr_entry *fuzzy_lookup(struct status_report_assembly *assy,
+						const struct sms *sr)
 {
 	GHashTableIter iter_addr;
-	gpointer key, value;
+	gpointer key;
 	const char *r_addr;
 
 	r_addr = sms_address_to_string(&sr->status_report.raddr);
 	g_hash_table_iter_init(&iter_addr, assy->assembly_table);
 
-	while (g_hash_table_iter_next(&iter_addr, &key, &value)) {
+	while (g_hash_table_iter_next(&iter_addr, &key, NULL)) {
 		const char *s_addr = key;
-		GHashTable *id_table = value;
 		unsigned int len, r_len, s_len;
 		unsigned int i;
-		struct id_table_node *node;
+		struct sr_mr_entry *entry;
 
 		if (r_addr[0] == '+' && s_addr[0] == '+')
 			continue;
@@ -3006,12 +3083,9 @@ static struct id_table_node *fuzzy_lookup(struct status_report_assembly *assy,
 			continue;
 
 		/* Address matched. Check message reference. */
-		node = find_by_mr_and_mark(id_table, sr->status_report.mr,
-						out_iter, out_msgid);
-		if (node != NULL) {
-			*out_addr = s_addr;
-			return node;
-		}
+		entry = sr_mr_index_lookup(assy, s_addr, sr->status_report.mr);
+		if (entry != NULL)
+			return entry;
 	}
 
 	return NULL;
@@ -3022,9 +3096,10 @@ gboolean status_report_assembly_report(struct status_report_assembly *assembly,
 					unsigned char *out_msgid,
 					gboolean *out_delivered)
 {
+	unsigned char mr = sr->status_report.mr;
 	const char *straddr;
 	GHashTable *id_table;
-	GHashTableIter iter;
+	struct sr_mr_entry *entry;
 	struct sms_address addr;
 	struct id_table_node *node;
 	gboolean delivered;
@@ -3037,18 +3112,23 @@ gboolean status_report_assembly_report(struct status_report_assembly *assembly,
 		return FALSE;
 
 	straddr = sms_address_to_string(&sr->status_report.raddr);
-	id_table = g_hash_table_lookup(assembly->assembly_table, straddr);
 
-	if (id_table != NULL)
-		node = find_by_mr_and_mark(id_table, sr->status_report.mr,
-						&iter, &msgid);
+	if (g_hash_table_lookup(assembly->assembly_table, straddr) != NULL)
+		entry = sr_mr_index_lookup(assembly, straddr, mr);
 	else
-		node = fuzzy_lookup(assembly, sr, &straddr, &iter, &msgid);
+		entry = fuzzy_lookup(assembly, sr);
 
 	/* Unable to find a message reference belonging to this address */
-	if (node == NULL)
+	if (entry == NULL)
 		return FALSE;
 
+	/* Address and MR matched, the report for this mr is in */
+	straddr = entry->addr;
+	msgid = entry->msgid;
+	node = entry->node;
+	g_hash_table_remove(assembly->mr_table, entry);
+
+	node->mrs[mr / 32] &= ~(1 << (mr % 32));
 	node->deliverable = node->deliverable && delivered;
 
 	/* If we haven't sent the entire message yet, wait until sent */
@@ -3071,7 +3151,7 @@ gboolean status_report_assembly_report(struct status_report_assembly *assembly,
 		 * More status reports expected, and already received
 		 * reports completed. Update backup file.
 		 */
-		sr_assembly_add_fragment_backup(assembly->imsi, node,
+		sr_assembly_add_fragment_backup(assembly->journal, node,
 						&addr, msgid);
 
 		return FALSE;
@@ -3083,9 +3163,11 @@ gboolean status_report_assembly_report(struct status_report_assembly *assembly,
 	if (out_msgid)
 		memcpy(out_msgid, msgid, SMS_MSGID_LEN);
 
-	sr_assembly_remove_fragment_backup(assembly->imsi, &addr, msgid);
-	id_table = g_hash_table_iter_get_hash_table(&iter);
-	g_hash_table_iter_remove(&iter);
+	sr_assembly_remove_fragment_backup(assembly->journal, &addr, msgid);
+	sr_mr_index_remove_node(assembly, straddr, node);
+
+	id_table = g_hash_table_lookup(assembly->assembly_table, straddr);
+	g_hash_table_remove(id_table, msgid);
 
 	if (g_hash_table_size(id_table) == 0)
 		g_hash_table_remove(assembly->assembly_table, straddr);
@@ -3104,24 +3186,25 @@ void status_report_assembly_add_fragment(
 	unsigned int bit = 1 << (mr % 32);
 	GHashTable *id_table;
 	struct id_table_node *node;
+	char *assembly_table_key;
 	unsigned char *id_table_key;
 
-	id_table = g_hash_table_lookup(assembly->assembly_table,
-					sms_address_to_string(to));
-
 	/* Create hashtable keyed by the to address if required */
-	if (id_table == NULL) {
+	if (g_hash_table_lookup_extended(assembly->assembly_table,
+					sms_address_to_string(to),
+					(gpointer *) &assembly_table_key,
+					(gpointer *) &id_table) == FALSE) {
 		id_table = g_hash_table_new_full(sha1_hash, sha1_equal,
 								g_free, g_free);
+		assembly_table_key = g_strdup(sms_address_to_string(to));
 		g_hash_table_insert(assembly->assembly_table,
-					g_strdup(sms_address_to_string(to)),
-					id_table);
+					assembly_table_key, id_table);
 	}
 
-	node = g_hash_table_lookup(id_table, msgid);
-
 	/* Create node in the message id hashtable if required */
-	if (node == NULL) {
+	if (g_hash_table_lookup_extended(id_table, msgid,
+					(gpointer *) &id_table_key,
+					(gpointer *) &node) == FALSE) {
 		id_table_key = g_memdup(msgid, SMS_MSGID_LEN);
 
 		node = g_new0(struct id_table_node, 1);
@@ -3135,7 +3218,8 @@ void status_report_assembly_add_fragment(
 	node->mrs[offset] |= bit;
 	node->expiration = expiration;
 	node->sent_mrs++;
-	sr_assembly_add_fragment_backup(assembly->imsi, node, to, msgid);
+	sr_mr_index_add(assembly, assembly_table_key, id_table_key, node, mr);
+	sr_assembly_add_fragment_backup(assembly->journal, node, to, msgid);
 }
 
 void status_report_assembly_expire(struct status_report_assembly *assembly,
@@ -3148,6 +3232,9 @@ void status_report_assembly_expire(struct status_report_assembly *assembly,
 	gpointer key;
 	struct id_table_node *node;
 
+	if (assembly->journal)
+		journal_begin(assembly->journal);
+
 	g_hash_table_iter_init(&iter_addr, assembly->assembly_table);
 
 	/*
@@ -3168,12 +3255,13 @@ void status_report_assembly_expire(struct status_report_assembly *assembly,
 			 * hash-table and remove the backup-file
 			 */
 			if (node->expiration <= before) {
-				g_hash_table_iter_remove(&iter_node);
-
+				sr_mr_index_remove_node(assembly, straddr,
+							node);
 				sr_assembly_remove_fragment_backup(
-								assembly->imsi,
-								&addr,
-								key);
+							assembly->journal,
+							&addr, key);
+
+				g_hash_table_iter_remove(&iter_node);
 			}
 		}
 
@@ -3184,154 +3272,137 @@ void status_report_assembly_expire(struct status_report_assembly *assembly,
 		if (g_hash_table_size(id_table) == 0)
 			g_hash_table_iter_remove(&iter_addr);
 	}
-}
-
-static int sms_tx_load_filter(const struct dirent *dent)
-{
-	char *endp;
-	guint8 seq __attribute__ ((unused));
-
-	if (dent->d_type != DT_REG)
-		return 0;
 
-	seq = strtol(dent->d_name, &endp, 10);
-	if (*endp != '\0')
-		return 0;
-
-	return 1;
+	/* Write out all expired messages at once */
+	if (assembly->journal)
+		journal_commit(assembly->journal);
 }
 
+struct sms_tx_load_data {
+	GQueue *queue;
+	char *dir;		/* Key prefix of the last entry */
+};
+
 /*
- * Each directory contains a file per pdu.
+ * Each entry has a key per pdu, with the keys of an entry sharing the
+ * same directory like prefix.  Only the keys are looked at here, the
+ * pdus are left in the journal until sms_tx_backup_load() asks for them.
+ * The pdus already sent were removed in order, so what is left is the
+ * range of seqs from first_seq on; a gap makes the entry fail to load.
  */
-static GSList *sms_tx_load(const char *imsi, const struct dirent *dir)
+static void sms_tx_load(const char *key, const unsigned char *data,
+			size_t len, time_t ts, void *user_data)
 {
-	GSList *list = NULL;
-	struct dirent **pdus;
-	char *path;
-	int len, r;
-	unsigned char buf[177];
-	struct sms s;
-
-	if (dir->d_type != DT_DIR)
-		return NULL;
+	struct sms_tx_load_data *load = user_data;
+	struct txq_backup_entry *entry = g_queue_peek_tail(load->queue);
+	char uuid[SMS_MSGID_LEN * 2 + 1];
+	unsigned long id;
+	unsigned long flags;
+	guint8 seq;
+	char endc;
+	size_t dir_len;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH "/%s", imsi, dir->d_name);
-	len = scandir(path, &pdus, sms_tx_load_filter, versionsort);
-	g_free(path);
+	if (sscanf(key, SMS_TX_BACKUP_STORE "/%lu-%lu-" SMS_MSGID_FMT
+				"/%hhu%c", &id, &flags, uuid, &seq, &endc) != 4)
+		return;
 
-	if (len < 0)
-		return NULL;
+	if (strlen(uuid) != 2 * SMS_MSGID_LEN)
+		return;
 
-	while (len--) {
-		r = read_file(buf, sizeof(buf), SMS_TX_BACKUP_PATH "/%s/%s",
-					imsi, dir->d_name, pdus[len]->d_name);
+	if (len < 2 || len > 177)
+		return;
 
-		if (r < 0)
-			goto free_pdu;
+	dir_len = strrchr(key, '/') - key + 1;
 
-		if (sms_deserialize_outgoing(buf, &s, r) == FALSE)
-			goto free_pdu;
+	if (entry == NULL || strncmp(key, load->dir, dir_len) ||
+			load->dir[dir_len] != '\0') {
+		entry = g_new0(struct txq_backup_entry, 1);
+		entry->id = id;
+		entry->flags = flags;
+		entry->first_seq = seq;
+		decode_hex_own_buf(uuid, -1, NULL, 0, entry->uuid);
 
-		list = g_slist_prepend(list, g_memdup(&s, sizeof(s)));
+		g_queue_push_tail(load->queue, entry);
 
-free_pdu:
-		g_free(pdus[len]);
+		g_free(load->dir);
+		load->dir = g_strndup(key, dir_len);
 	}
 
-	g_free(pdus);
-
-	return list;
-}
-
-static int sms_tx_queue_filter(const struct dirent *dirent)
-{
-	if (dirent->d_type != DT_DIR)
-		return 0;
-
-	if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
-		return 0;
-
-	return 1;
+	/* The keys of an entry are visited with their seqs ascending */
+	entry->num_pdus = seq - entry->first_seq + 1;
 }
 
 /*
  * populate the queue with tx_backup_entry from stored backup
- * data.
+ * data.  The entries keep the id they were stored with, so nothing
+ * needs to be rewritten on startup.
  */
 GQueue *sms_tx_queue_load(const char *imsi)
 {
-	GQueue *retq = 0;
-	char *path;
-	struct dirent **entries;
-	int len;
-	int i;
-	unsigned long id;
+	struct sms_tx_load_data load;
+	struct journal *journal;
 
 	if (imsi == NULL)
 		return NULL;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH, imsi);
-
-	len = scandir(path, &entries, sms_tx_queue_filter, versionsort);
-	if (len < 0)
-		goto nodir_exit;
+	journal = sms_journal_open(imsi, SMS_TX_BACKUP_STORE);
+	if (journal == NULL)
+		return NULL;
 
-	retq = g_queue_new();
+	load.queue = g_queue_new();
+	load.dir = NULL;
 
-	for (i = 0, id = 0; i < len; i++) {
-		char uuid[SMS_MSGID_LEN * 2 + 1];
-		GSList *msg_list;
-		unsigned long oldid;
-		unsigned long flags;
-		char *oldpath, *newpath;
-		struct txq_backup_entry *entry;
-		struct dirent *dir = entries[i];
-		char endc;
+	journal_foreach(journal, SMS_TX_BACKUP_STORE "/", sms_tx_load, &load);
 
-		if (sscanf(dir->d_name, "%lu-%lu-" SMS_MSGID_FMT "%c",
-					&oldid, &flags, uuid, &endc) != 3)
-			continue;
+	g_free(load.dir);
+	journal_unref(journal);
 
-		if (strlen(uuid) !=  2 * SMS_MSGID_LEN)
-			continue;
+	return load.queue;
+}
 
-		msg_list = sms_tx_load(imsi, dir);
-		if (msg_list == NULL)
-			continue;
+/*
+ * Read back the pdus of a single entry returned by sms_tx_queue_load(),
+ * in the order they are to be sent.  Fails unless every pdu from
+ * first_seq on is there.
+ */
+GSList *sms_tx_backup_load(const char *imsi, unsigned long id,
+				unsigned long flags, const char *uuid,
+				guint8 first_seq, unsigned int num_pdus)
+{
+	struct journal *journal;
+	GSList *msg_list = NULL;
+	unsigned int i;
 
-		entry = g_new0(struct txq_backup_entry, 1);
-		entry->msg_list = msg_list;
-		entry->flags = flags;
-		decode_hex_own_buf(uuid, -1, NULL, 0, entry->uuid);
+	if (!imsi)
+		return NULL;
 
-		g_queue_push_tail(retq, entry);
+	journal = sms_journal_open(imsi, NULL);
+	if (journal == NULL)
+		return NULL;
 
-		/* Don't bother re-shuffling the ids if they are the same */
-		if (oldid == id) {
-			id++;
-			continue;
-		}
+	for (i = 0; i < num_pdus; i++) {
+		const unsigned char *data;
+		size_t len;
+		struct sms s;
+		char *key;
 
-		oldpath = g_strdup_printf("%s/%s", path, dir->d_name);
-		newpath = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-						imsi, id++, flags, uuid);
+		key = g_strdup_printf(SMS_TX_BACKUP_KEY_FILE, id, flags, uuid,
+					first_seq + i);
+		data = journal_get(journal, key, &len);
+		g_free(key);
 
-		/* rename directory to reflect new position in queue */
-		rename(oldpath, newpath);
+		if (data == NULL || !sms_deserialize_outgoing(data, &s, len)) {
+			g_slist_free_full(msg_list, g_free);
+			msg_list = NULL;
+			break;
+		}
 
-		g_free(newpath);
-		g_free(oldpath);
+		msg_list = g_slist_prepend(msg_list, g_memdup(&s, sizeof(s)));
 	}
 
-	for (i = 0; i < len; i++)
-		g_free(entries[i]);
-
-	g_free(entries);
+	journal_unref(journal);
 
-nodir_exit:
-	g_free(path);
-	return retq;
+	return g_slist_reverse(msg_list);
 }
 
 gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
@@ -3340,72 +3411,82 @@ gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
 				int pdu_len, int tpdu_len)
 {
 	unsigned char buf[177];
+	struct journal *journal;
+	char *key;
+	gboolean ret;
 	int len;
 
 	if (!imsi)
 		return FALSE;
 
+	journal = sms_journal_open(imsi, NULL);
+	if (journal == NULL)
+		return FALSE;
+
 	memcpy(buf + 1, pdu, pdu_len);
 	buf[0] = tpdu_len;
 	len = pdu_len + 1;
 
 	/*
-	 * file name is: imsi/tx_queue/order-flags-uuid/pdu
+	 * key is: tx_queue/order-flags-uuid/pdu
 	 */
-	if (write_file(buf, len, SMS_BACKUP_MODE, SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq) != len)
-		return FALSE;
+	key = g_strdup_printf(SMS_TX_BACKUP_KEY_FILE, id, flags, uuid, seq);
+	ret = journal_put(journal, key, buf, len, time(NULL));
+	g_free(key);
 
-	return TRUE;
+	journal_unref(journal);
+
+	return ret;
 }
 
 void sms_tx_backup_free(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid)
+				unsigned long flags, const char *uuid,
+				guint8 first_seq, unsigned int num_pdus)
 {
-	char *path;
-	struct dirent **entries;
-	int len;
-
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-					imsi, id, flags, uuid);
+	struct journal *journal;
+	unsigned int i;
 
-	len = scandir(path, &entries, NULL, versionsort);
+	if (!imsi)
+		return;
 
-	if (len < 0)
-		goto nodir_exit;
+	journal = sms_journal_open(imsi, NULL);
+	if (journal == NULL)
+		return;
 
-	/* skip '..' and '.' entries */
-	while (len-- > 2) {
-		struct dirent *dir = entries[len];
-		char *file = g_strdup_printf("%s/%s", path, dir->d_name);
+	journal_begin(journal);
 
-		unlink(file);
-		g_free(file);
+	for (i = 0; i < num_pdus; i++) {
+		char *key;
 
-		g_free(entries[len]);
+		key = g_strdup_printf(SMS_TX_BACKUP_KEY_FILE, id, flags, uuid,
+					first_seq + i);
+		journal_remove(journal, key);
+		g_free(key);
 	}
 
-	g_free(entries[1]);
-	g_free(entries[0]);
-	g_free(entries);
-
-	rmdir(path);
-
-nodir_exit:
-	g_free(path);
+	journal_commit(journal);
+	journal_unref(journal);
 }
 
 void sms_tx_backup_remove(const char *imsi, unsigned long id,
 				unsigned long flags, const char *uuid,
 				guint8 seq)
 {
-	char *path;
+	struct journal *journal;
+	char *key;
+
+	if (!imsi)
+		return;
+
+	journal = sms_journal_open(imsi, NULL);
+	if (journal == NULL)
+		return;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq);
-	unlink(path);
+	key = g_strdup_printf(SMS_TX_BACKUP_KEY_FILE, id, flags, uuid, seq);
+	journal_remove(journal, key);
+	g_free(key);
 
-	g_free(path);
+	journal_unref(journal);
 }
 
 static inline GSList *sms_list_append(GSList *l, const struct sms *in)
@@ -3545,6 +3626,51 @@ GSList *sms_datagram_prepare(const char *to,
 	return r;
 }
 
+/* Size of the UDH, if any, needed to signal the national shift tables */
+static int sms_text_shift_ie_size(enum gsm_dialect locking,
+					enum gsm_dialect single)
+{
+	int size = 0;
+
+	if (single != GSM_DIALECT_DEFAULT)
+		size += 3;
+
+	if (locking != GSM_DIALECT_DEFAULT)
+		size += 3;
+
+	return size ? size + 1 : 0;
+}
+
+/*
+ * Number of messages sms_text_prepare_with_alphabet splits a text of len
+ * septets (octets for UCS2) into, when offset octets of UDH are needed
+ * before concatenation is accounted for.  Fragments shortened so as not
+ * to split an escape sequence are not accounted for.
+ */
+static int sms_text_segments(long len, int offset, gboolean gsm,
+				gboolean use_16bit)
+{
+	long chunk;
+
+	if (gsm && len <= sms_text_capacity_gsm(160, offset))
+		return 1;
+
+	if (!gsm && len <= 140 - offset)
+		return 1;
+
+	if (!offset)
+		offset = 1;
+
+	offset += use_16bit ? 6 : 5;
+
+	if (gsm)
+		chunk = sms_text_capacity_gsm(160, offset);
+	else
+		chunk = (140 - offset) & ~0x1;
+
+	return (len + chunk - 1) / chunk;
+}
+
 /*
  * Prepares the text for transmission.  Breaks up into fragments if
  * necessary using ref as the concatenated message reference number.
@@ -3566,8 +3692,16 @@ GSList *sms_text_prepare_with_alphabet(const char *to, const char *utf8,
 	long left;
 	guint8 seq;
 	GSList *r = NULL;
-	enum gsm_dialect used_locking;
-	enum gsm_dialect used_single;
+	enum gsm_dialect locking[GSM_MAX_CANDIDATES];
+	enum gsm_dialect single[GSM_MAX_CANDIDATES];
+	long septets[GSM_MAX_CANDIDATES];
+	enum gsm_dialect used_locking = GSM_DIALECT_DEFAULT;
+	enum gsm_dialect used_single = GSM_DIALECT_DEFAULT;
+	long nchars;
+	int best_segments = 0;
+	int best = -1;
+	int n;
+	int i;
 
 	memset(&template, 0, sizeof(struct sms));
 	template.type = SMS_TYPE_SUBMIT;
@@ -3582,11 +3716,45 @@ GSList *sms_text_prepare_with_alphabet(const char *to, const char *utf8,
 	/*
 	 * UDHI, UDL, UD and DCS actually depend on the contents of
 	 * the text, and also on the GSM dialect we use to encode it.
+	 * Size up every candidate encoding in one pass over the text and
+	 * go with the one needing the fewest messages.  Ties go to the
+	 * candidate using fewer national tables, and to GSM over UCS2.
 	 */
-	gsm_encoded = convert_utf8_to_gsm_best_lang(utf8, -1, NULL, &written, 0,
-							alphabet, &used_locking,
-							&used_single);
-	if (gsm_encoded == NULL) {
+	n = gsm_dialect_candidates((enum gsm_dialect) alphabet,
+					locking, single);
+	nchars = utf8_to_gsm_septets(utf8, -1, locking, single, n, septets);
+	if (nchars < 0)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		int segments;
+
+		if (septets[i] < 0)
+			continue;
+
+		segments = sms_text_segments(septets[i],
+					sms_text_shift_ie_size(locking[i],
+								single[i]),
+					TRUE, use_16bit);
+
+		if (best < 0 || segments < best_segments) {
+			best = i;
+			best_segments = segments;
+		}
+	}
+
+	if (best >= 0 && sms_text_segments(nchars * 2, 0, FALSE,
+						use_16bit) < best_segments)
+		best = -1;
+
+	if (best >= 0) {
+		used_locking = locking[best];
+		used_single = single[best];
+		gsm_encoded = convert_utf8_to_gsm_with_lang(utf8, -1, NULL,
+							&written, 0,
+							used_locking,
+							used_single);
+	} else {
 		gsize converted;
 
 		ucs2_encoded = g_convert(utf8, -1, "UCS-2BE//TRANSLIT", "UTF-8",
@@ -4222,103 +4390,134 @@ static inline gboolean cbs_is_update_newer(unsigned int n, unsigned int o)
 	return FALSE;
 }
 
-struct cbs_assembly *cbs_assembly_new(void)
+static void cbs_assembly_node_free(gpointer data)
 {
-	return g_new0(struct cbs_assembly, 1);
+	struct cbs_assembly_node *node = data;
+
+	g_slist_free_full(node->pages, g_free);
+	g_free(node);
 }
 
-void cbs_assembly_free(struct cbs_assembly *assembly)
+struct cbs_assembly *cbs_assembly_new(void)
 {
-	GSList *l;
+	struct cbs_assembly *assembly = g_new0(struct cbs_assembly, 1);
 
-	for (l = assembly->assembly_list; l; l = l->next) {
-		struct cbs_assembly_node *node = l->data;
+	assembly->assembly_table = g_hash_table_new_full(g_direct_hash,
+						g_direct_equal, NULL,
+						cbs_assembly_node_free);
+	assembly->recv_plmn = g_hash_table_new(g_direct_hash, g_direct_equal);
+	assembly->recv_loc = g_hash_table_new(g_direct_hash, g_direct_equal);
+	assembly->recv_cell = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-		g_slist_free_full(node->pages, g_free);
-		g_free(node);
-	}
+	return assembly;
+}
 
-	g_slist_free(assembly->assembly_list);
-	g_slist_free(assembly->recv_plmn);
-	g_slist_free(assembly->recv_loc);
-	g_slist_free(assembly->recv_cell);
+void cbs_assembly_free(struct cbs_assembly *assembly)
+{
+	g_hash_table_destroy(assembly->assembly_table);
+	g_hash_table_destroy(assembly->recv_plmn);
+	g_hash_table_destroy(assembly->recv_loc);
+	g_hash_table_destroy(assembly->recv_cell);
 
 	g_free(assembly);
 }
 
-static gint cbs_compare_node_by_gs(gconstpointer a, gconstpointer b)
+static gboolean cbs_node_in_gs(gpointer key, gpointer value,
+				gpointer user_data)
 {
-	const struct cbs_assembly_node *node = a;
-	unsigned int gs = GPOINTER_TO_UINT(b);
+	const struct cbs_assembly_node *node = value;
+	unsigned int gs = GPOINTER_TO_UINT(user_data);
 
-	if (((node->serial >> 14) & 0x3) == gs)
-		return 0;
-
-	return 1;
+	return ((node->serial >> 14) & 0x3) == gs;
 }
 
-static gint cbs_compare_node_by_update(gconstpointer a, gconstpointer b)
+static gboolean cbs_node_outdated(gpointer key, gpointer value,
+					gpointer user_data)
 {
-	const struct cbs_assembly_node *node = a;
-	unsigned int serial = GPOINTER_TO_UINT(b);
+	const struct cbs_assembly_node *node = value;
+	unsigned int serial = GPOINTER_TO_UINT(user_data);
 
 	if ((serial & (~0xf)) != (node->serial & (~0xf)))
-		return 1;
+		return FALSE;
 
-	if (cbs_is_update_newer(node->serial, serial))
-		return 1;
+	return !cbs_is_update_newer(node->serial, serial);
+}
 
-	return 0;
+/*
+ * The serial of a page identifies the message it belongs to, the update
+ * number being in the lowest 4 bits.  The received tables are keyed by
+ * the serial without the update number, and hold the last update received.
+ */
+static inline guint32 cbs_serial(enum cbs_geo_scope gs, guint16 message_code,
+					guint8 update_number,
+					guint16 message_identifier)
+{
+	return (guint32) message_identifier << 16 | gs << 14 |
+		message_code << 4 | update_number;
 }
 
-static gint cbs_compare_recv_by_serial(gconstpointer a, gconstpointer b)
+static GHashTable *cbs_assembly_recv_table(struct cbs_assembly *assembly,
+						enum cbs_geo_scope gs)
 {
-	unsigned int old_serial = GPOINTER_TO_UINT(a);
-	unsigned int new_serial = GPOINTER_TO_UINT(b);
+	if (gs == CBS_GEO_SCOPE_PLMN)
+		return assembly->recv_plmn;
 
-	if ((old_serial & (~0xf)) == (new_serial & (~0xf)))
-		return 0;
+	if (gs == CBS_GEO_SCOPE_SERVICE_AREA)
+		return assembly->recv_loc;
 
-	return 1;
+	return assembly->recv_cell;
 }
 
-static void cbs_assembly_expire(struct cbs_assembly *assembly,
-				GCompareFunc func, gconstpointer *userdata)
+static gboolean cbs_assembly_seen(struct cbs_assembly *assembly,
+					GHashTable *recv, guint32 serial,
+					guint8 page)
 {
-	GSList *l;
-	GSList *prev;
-	GSList *tmp;
+	gpointer old_serial;
+	struct cbs_assembly_node *node;
 
-	/*
-	 * Take care of the case where several updates are being
-	 * reassembled at the same time. If the newer one is assembled
-	 * first, then the subsequent old update is discarded, make
-	 * sure that we're also discarding the assembly node for the
-	 * partially assembled ones
-	 */
-	prev = NULL;
-	l = assembly->assembly_list;
+	/* Have we seen this message before, and if so is this one newer? */
+	if (g_hash_table_lookup_extended(recv,
+					GUINT_TO_POINTER(serial & ~0xf),
+					NULL, &old_serial) &&
+			!cbs_is_update_newer(serial,
+					GPOINTER_TO_UINT(old_serial)))
+		return TRUE;
 
-	while (l) {
-		struct cbs_assembly_node *node = l->data;
+	/* Or is the page already part of a message being assembled? */
+	node = g_hash_table_lookup(assembly->assembly_table,
+					GUINT_TO_POINTER(serial));
 
-		if (func(node, userdata) != 0) {
-			prev = l;
-			l = l->next;
-			continue;
-		}
+	return node && (node->bitmap & (1 << page));
+}
 
-		if (prev)
-			prev->next = l->next;
-		else
-			assembly->assembly_list = l->next;
+/*
+ * Checks whether the raw CBS pdu is a repetition of a page already handed
+ * to cbs_assembly_add_page(), which is what most pages received are while
+ * a message is being broadcast.  Such pages can be dropped without being
+ * decoded.
+ */
+gboolean cbs_assembly_is_duplicate(struct cbs_assembly *assembly,
+					const unsigned char *pdu, int len)
+{
+	guint32 serial;
+	guint8 page;
 
-		g_slist_free_full(node->pages, g_free);
-		g_free(node->pages);
-		tmp = l;
-		l = l->next;
-		g_slist_free_1(tmp);
-	}
+	if (len != 88)
+		return FALSE;
+
+	serial = cbs_serial((pdu[0] >> 6) & 0x03,
+				((pdu[0] & 0x3f) << 4) | ((pdu[1] >> 4) & 0xf),
+				pdu[1] & 0xf, (pdu[2] << 8) | pdu[3]);
+
+	/* As done by cbs_decode() */
+	page = (pdu[5] >> 4) & 0xf;
+	if ((pdu[5] & 0xf) == 0 || page == 0)
+		page = 1;
+
+	return cbs_assembly_seen(assembly,
+				cbs_assembly_recv_table(assembly,
+							(pdu[0] >> 6) & 0x03),
+				serial, page);
 }
 
 void cbs_assembly_location_changed(struct cbs_assembly *assembly, gboolean plmn,
@@ -4341,29 +4540,30 @@ void cbs_assembly_location_changed(struct cbs_assembly *assembly, gboolean plmn,
 
 	if (plmn) {
 		lac = TRUE;
-		g_slist_free(assembly->recv_plmn);
-		assembly->recv_plmn = NULL;
+		g_hash_table_remove_all(assembly->recv_plmn);
 
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
+		g_hash_table_foreach_remove(assembly->assembly_table,
+				cbs_node_in_gs,
 				GUINT_TO_POINTER(CBS_GEO_SCOPE_PLMN));
 	}
 
 	if (lac) {
 		/* If LAC changed, then cell id has changed */
 		ci = TRUE;
-		g_slist_free(assembly->recv_loc);
-		assembly->recv_loc = NULL;
+		g_hash_table_remove_all(assembly->recv_loc);
 
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
+		g_hash_table_foreach_remove(assembly->assembly_table,
+				cbs_node_in_gs,
 				GUINT_TO_POINTER(CBS_GEO_SCOPE_SERVICE_AREA));
 	}
 
 	if (ci) {
-		g_slist_free(assembly->recv_cell);
-		assembly->recv_cell = NULL;
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
+		g_hash_table_remove_all(assembly->recv_cell);
+		g_hash_table_foreach_remove(assembly->assembly_table,
+				cbs_node_in_gs,
 				GUINT_TO_POINTER(CBS_GEO_SCOPE_CELL_IMMEDIATE));
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
+		g_hash_table_foreach_remove(assembly->assembly_table,
+				cbs_node_in_gs,
 				GUINT_TO_POINTER(CBS_GEO_SCOPE_CELL_NORMAL));
 	}
 }
@@ -4375,38 +4575,20 @@ GSList *cbs_assembly_add_page(struct cbs_assembly *assembly,
 	struct cbs_assembly_node *node;
 	GSList *completed;
 	unsigned int new_serial;
-	GSList **recv;
-	GSList *l;
-	GSList *prev;
+	GHashTable *recv;
 	int position;
 
-	new_serial = cbs->gs << 14;
-	new_serial |= cbs->message_code << 4;
-	new_serial |= cbs->update_number;
-	new_serial |= cbs->message_identifier << 16;
-
-	if (cbs->gs == CBS_GEO_SCOPE_PLMN)
-		recv = &assembly->recv_plmn;
-	else if (cbs->gs == CBS_GEO_SCOPE_SERVICE_AREA)
-		recv = &assembly->recv_loc;
-	else
-		recv = &assembly->recv_cell;
-
-	/* Have we seen this message before? */
-	l = g_slist_find_custom(*recv, GUINT_TO_POINTER(new_serial),
-				cbs_compare_recv_by_serial);
+	new_serial = cbs_serial(cbs->gs, cbs->message_code,
+				cbs->update_number, cbs->message_identifier);
+	recv = cbs_assembly_recv_table(assembly, cbs->gs);
 
-	/* If we have, is the message newer? */
-	if (l && !cbs_is_update_newer(new_serial, GPOINTER_TO_UINT(l->data)))
+	if (cbs_assembly_seen(assembly, recv, new_serial, cbs->page))
 		return NULL;
 
 	/* Easy case first, page 1 of 1 */
 	if (cbs->max_pages == 1 && cbs->page == 1) {
-		if (l)
-			l->data = GUINT_TO_POINTER(new_serial);
-		else
-			*recv = g_slist_prepend(*recv,
-						GUINT_TO_POINTER(new_serial));
+		g_hash_table_replace(recv, GUINT_TO_POINTER(new_serial & ~0xf),
+					GUINT_TO_POINTER(new_serial));
 
 		newcbs = g_new(struct cbs, 1);
 		memcpy(newcbs, cbs, sizeof(struct cbs));
@@ -4415,37 +4597,20 @@ GSList *cbs_assembly_add_page(struct cbs_assembly *assembly,
 		return completed;
 	}
 
-	prev = NULL;
-	position = 0;
-
-	for (l = assembly->assembly_list; l; prev = l, l = l->next) {
-		int j;
-		node = l->data;
-
-		if (new_serial != node->serial)
-			continue;
+	node = g_hash_table_lookup(assembly->assembly_table,
+					GUINT_TO_POINTER(new_serial));
 
-		if (node->bitmap & (1 << cbs->page))
-			return NULL;
-
-		for (j = 1; j < cbs->page; j++)
-			if (node->bitmap & (1 << j))
-				position += 1;
+	if (node == NULL) {
+		node = g_new0(struct cbs_assembly_node, 1);
+		node->serial = new_serial;
 
-		goto out;
+		g_hash_table_insert(assembly->assembly_table,
+					GUINT_TO_POINTER(new_serial), node);
 	}
 
-	node = g_new0(struct cbs_assembly_node, 1);
-	node->serial = new_serial;
-
-	assembly->assembly_list = g_slist_prepend(assembly->assembly_list,
-							node);
-
-	prev = NULL;
-	l = assembly->assembly_list;
-	position = 0;
+	/* Pages are kept in order, count the ones before this page */
+	position = __builtin_popcount(node->bitmap & ((1 << cbs->page) - 1));
 
-out:
 	newcbs = g_new(struct cbs, 1);
 	memcpy(newcbs, cbs, sizeof(struct cbs));
 	node->pages = g_slist_insert(node->pages, newcbs, position);
@@ -4456,17 +4621,22 @@ out:
 
 	completed = node->pages;
 
-	if (prev)
-		prev->next = l->next;
-	else
-		assembly->assembly_list = l->next;
-
+	g_hash_table_steal(assembly->assembly_table,
+				GUINT_TO_POINTER(new_serial));
 	g_free(node);
-	g_slist_free_1(l);
 
-	cbs_assembly_expire(assembly, cbs_compare_node_by_update,
+	/*
+	 * Take care of the case where several updates are being
+	 * reassembled at the same time. If the newer one is assembled
+	 * first, then the subsequent old update is discarded, make
+	 * sure that we're also discarding the assembly node for the
+	 * partially assembled ones
+	 */
+	g_hash_table_foreach_remove(assembly->assembly_table,
+					cbs_node_outdated,
+					GUINT_TO_POINTER(new_serial));
+	g_hash_table_replace(recv, GUINT_TO_POINTER(new_serial & ~0xf),
 				GUINT_TO_POINTER(new_serial));
-	*recv = g_slist_prepend(*recv, GUINT_TO_POINTER(new_serial));
 
 	return completed;
 }
@@ -4534,56 +4704,106 @@ out:
 	return TRUE;
 }
 
-GSList *cbs_optimize_ranges(GSList *ranges)
+static void cbs_topic_bitmap_set(struct cbs_topic_bitmap *bitmap,
+					unsigned int min, unsigned int max)
 {
-	struct cbs_topic_range *range;
-	unsigned char bitmap[125];
-	GSList *l;
-	unsigned short i;
-	GSList *ret = NULL;
+	unsigned int first = min / 32;
+	unsigned int last = max / 32;
+	guint32 first_mask = ~0U << (min % 32);
+	guint32 last_mask = ~0U >> (31 - max % 32);
+	unsigned int i;
 
-	memset(bitmap, 0, sizeof(bitmap));
+	if (first == last) {
+		bitmap->bits[first] |= first_mask & last_mask;
+		return;
+	}
 
-	for (l = ranges; l; l = l->next) {
-		range = l->data;
+	bitmap->bits[first] |= first_mask;
 
-		for (i = range->min; i <= range->max; i++) {
-			int byte_offset = i / 8;
-			int bit = i % 8;
+	for (i = first + 1; i < last; i++)
+		bitmap->bits[i] = ~0U;
 
-			bitmap[byte_offset] |= 1 << bit;
-		}
+	bitmap->bits[last] |= last_mask;
+}
+
+/* Returns the first topic from on which is (not) set, or 65536 if none */
+static unsigned int cbs_topic_bitmap_find(const struct cbs_topic_bitmap *bitmap,
+						unsigned int from, gboolean set)
+{
+	unsigned int i = from / 32;
+	guint32 word;
+
+	if (from > 65535)
+		return 65536;
+
+	word = set ? bitmap->bits[i] : ~bitmap->bits[i];
+	word &= ~0U << (from % 32);
+
+	while (word == 0) {
+		if (++i == G_N_ELEMENTS(bitmap->bits))
+			return 65536;
+
+		word = set ? bitmap->bits[i] : ~bitmap->bits[i];
 	}
 
-	range = NULL;
+	return i * 32 + __builtin_ctz(word);
+}
 
-	for (i = 0; i <= 999; i++) {
-		int byte_offset = i / 8;
-		int bit = i % 8;
+void cbs_topic_bitmap_add(struct cbs_topic_bitmap *bitmap, GSList *ranges)
+{
+	GSList *l;
 
-		if (is_bit_set(bitmap[byte_offset], bit) == FALSE) {
-			if (range) {
-				ret = g_slist_prepend(ret, range);
-				range = NULL;
-			}
+	for (l = ranges; l; l = l->next) {
+		const struct cbs_topic_range *range = l->data;
 
-			continue;
-		}
+		if (range->min <= range->max)
+			cbs_topic_bitmap_set(bitmap, range->min, range->max);
+	}
+}
 
-		if (range) {
-			range->max = i;
-			continue;
-		}
+/*
+ * Builds the bitmap of the topics covered by ranges, which then answers
+ * whether a topic is in one of the ranges with cbs_topic_bitmap_test().
+ */
+struct cbs_topic_bitmap *cbs_topic_bitmap_new(GSList *ranges)
+{
+	struct cbs_topic_bitmap *bitmap = g_new0(struct cbs_topic_bitmap, 1);
+
+	cbs_topic_bitmap_add(bitmap, ranges);
+
+	return bitmap;
+}
+
+/* Returns the sorted, non overlapping ranges of the topics up to max */
+GSList *cbs_topic_bitmap_to_ranges(const struct cbs_topic_bitmap *bitmap,
+					unsigned short max)
+{
+	struct cbs_topic_range *range;
+	GSList *ret = NULL;
+	unsigned int min;
+	unsigned int end;
+
+	for (min = cbs_topic_bitmap_find(bitmap, 0, TRUE); min <= max;
+			min = cbs_topic_bitmap_find(bitmap, end, TRUE)) {
+		end = cbs_topic_bitmap_find(bitmap, min, FALSE);
 
 		range = g_new0(struct cbs_topic_range, 1);
-		range->min = i;
-		range->max = i;
-	}
+		range->min = min;
+		range->max = MIN(end - 1, max);
 
-	if (range != NULL)
 		ret = g_slist_prepend(ret, range);
+	}
+
+	return g_slist_reverse(ret);
+}
 
-	ret = g_slist_reverse(ret);
+GSList *cbs_optimize_ranges(GSList *ranges)
+{
+	struct cbs_topic_bitmap *bitmap = cbs_topic_bitmap_new(ranges);
+	GSList *ret;
+
+	ret = cbs_topic_bitmap_to_ranges(bitmap, 999);
+	g_free(bitmap);
 
 	return ret;
 }
@@ -4691,26 +4911,6 @@ char *cbs_topic_ranges_to_string(GSList *ranges)
 	return ret;
 }
 
-static gint cbs_topic_compare(gconstpointer a, gconstpointer b)
-{
-	const struct cbs_topic_range *range = a;
-	unsigned short topic = GPOINTER_TO_UINT(b);
-
-	if (topic >= range->min && topic <= range->max)
-		return 0;
-
-	return 1;
-}
-
-gboolean cbs_topic_in_range(unsigned int topic, GSList *ranges)
-{
-	if (ranges == NULL)
-		return FALSE;
-
-	return g_slist_find_custom(ranges, GUINT_TO_POINTER(topic),
-					cbs_topic_compare) != NULL;
-}
-
 char *ussd_decode(int dcs, int len, const unsigned char *data)
 {
 	gboolean udhi;
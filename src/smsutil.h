@@ -370,11 +370,16 @@ struct sms_assembly_node {
 	guint8 max_fragments;
 	guint8 num_fragments;
 	unsigned int bitmap[8];
+	unsigned int heap_index;
 };
 
+struct journal;
+
 struct sms_assembly {
 	const char *imsi;
-	GSList *assembly_list;
+	struct journal *journal;
+	GHashTable *assembly_table;	/* Nodes by address and reference */
+	GPtrArray *expiry_heap;		/* Nodes by ts, oldest first */
 };
 
 struct id_table_node {
@@ -387,7 +392,9 @@ struct id_table_node {
 
 struct status_report_assembly {
 	const char *imsi;
+	struct journal *journal;
 	GHashTable *assembly_table;
+	GHashTable *mr_table;		/* Outstanding mrs by address and mr */
 };
 
 struct cbs {
@@ -408,10 +415,10 @@ struct cbs_assembly_node {
 };
 
 struct cbs_assembly {
-	GSList *assembly_list;
-	GSList *recv_plmn;
-	GSList *recv_loc;
-	GSList *recv_cell;
+	GHashTable *assembly_table;	/* Nodes by serial */
+	GHashTable *recv_plmn;
+	GHashTable *recv_loc;
+	GHashTable *recv_cell;
 };
 
 struct cbs_topic_range {
@@ -419,10 +426,17 @@ struct cbs_topic_range {
 	unsigned short max;
 };
 
+/* Membership of all 65536 CBS message identifiers */
+struct cbs_topic_bitmap {
+	guint32 bits[65536 / 32];
+};
+
 struct txq_backup_entry {
-	GSList *msg_list;
+	unsigned long id;
 	unsigned char uuid[SMS_MSGID_LEN];
 	unsigned long flags;
+	unsigned int num_pdus;
+	guint8 first_seq;
 };
 
 static inline gboolean is_bit_set(unsigned char oct, int bit)
@@ -431,6 +445,13 @@ static inline gboolean is_bit_set(unsigned char oct, int bit)
 	return oct & mask ? TRUE : FALSE;
 }
 
+static inline gboolean cbs_topic_bitmap_test(
+					const struct cbs_topic_bitmap *bitmap,
+					unsigned short topic)
+{
+	return (bitmap->bits[topic / 32] >> (topic % 32)) & 1;
+}
+
 static inline unsigned char bit_field(unsigned char oct, int start, int num)
 {
 	unsigned char mask = (1 << num) - 1;
@@ -542,8 +563,12 @@ void sms_tx_backup_remove(const char *imsi, unsigned long id,
 				unsigned long flags, const char *uuid,
 				guint8 seq);
 void sms_tx_backup_free(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid);
+				unsigned long flags, const char *uuid,
+				guint8 first_seq, unsigned int num_pdus);
 GQueue *sms_tx_queue_load(const char *imsi);
+GSList *sms_tx_backup_load(const char *imsi, unsigned long id,
+				unsigned long flags, const char *uuid,
+				guint8 first_seq, unsigned int num_pdus);
 
 GSList *sms_text_prepare(const char *to, const char *utf8, guint16 ref,
 				gboolean use_16bit,
@@ -577,13 +602,18 @@ struct cbs_assembly *cbs_assembly_new(void);
 void cbs_assembly_free(struct cbs_assembly *assembly);
 GSList *cbs_assembly_add_page(struct cbs_assembly *assembly,
 				const struct cbs *cbs);
+gboolean cbs_assembly_is_duplicate(struct cbs_assembly *assembly,
+					const unsigned char *pdu, int len);
 void cbs_assembly_location_changed(struct cbs_assembly *assembly, gboolean plmn,
 					gboolean lac, gboolean ci);
 
 char *cbs_topic_ranges_to_string(GSList *ranges);
 GSList *cbs_extract_topic_ranges(const char *ranges);
 GSList *cbs_optimize_ranges(GSList *ranges);
-gboolean cbs_topic_in_range(unsigned int topic, GSList *ranges);
+struct cbs_topic_bitmap *cbs_topic_bitmap_new(GSList *ranges);
+void cbs_topic_bitmap_add(struct cbs_topic_bitmap *bitmap, GSList *ranges);
+GSList *cbs_topic_bitmap_to_ranges(const struct cbs_topic_bitmap *bitmap,
+					unsigned short max);
 
 char *ussd_decode(int dcs, int len, const unsigned char *data);
 gboolean ussd_encode(const char *str, long *items_written, unsigned char *pdu);
@@ -26,11 +26,19 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
 
 #include <glib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
 #include "util.h"
 
 /*
@@ -73,7 +81,7 @@ struct codepoint {
 	unsigned short to;
 };
 
-struct conversion_table {
+struct codepoint_tables {
 	/* To unicode locking shift table */
 	const struct codepoint *locking_u;
 	unsigned int locking_len_u;
@@ -90,6 +98,36 @@ struct conversion_table {
 	unsigned int single_len_g;
 };
 
+/*
+ * Direct index table over the BMP, split in 256 pages of 256 code points.
+ * Pages without any mapping all point to the same page filled with GUND.
+ */
+struct unicode_map {
+	const unsigned short *page[256];
+};
+
+/* Lookup tables of one dialect, built from the codepoint tables */
+struct dialect_tables {
+	const unsigned short *locking_g;
+	unsigned short single_g[128];
+	struct unicode_map locking_u;
+	struct unicode_map single_u;
+};
+
+struct conversion_table {
+	/* To GSM locking shift table, fixed size */
+	const struct unicode_map *locking_u;
+
+	/* To GSM single shift table */
+	const struct unicode_map *single_u;
+
+	/* To unicode locking shift table, fixed size */
+	const unsigned short *locking_g;
+
+	/* To unicode single shift table, fixed size */
+	const unsigned short *single_g;
+};
+
 /* GSM to Unicode extension table, for GSM sequences starting with 0x1B */
 static const struct codepoint def_ext_gsm[] = {
 	{ 0x0A, 0x000C },		/* See NOTE 3 in 23.038 */
@@ -454,26 +492,6 @@ static const struct codepoint por_unicode[] = {
 	{ 0x00FC, 0x7E }, { 0x0394, 0x10 }, { 0x20AC, 0x18 }, { 0x221E, 0x15 }
 };
 
-static int compare_codepoints(const void *a, const void *b)
-{
-	const struct codepoint *ca = (const struct codepoint *) a;
-	const struct codepoint *cb = (const struct codepoint *) b;
-
-	return (ca->from > cb->from) - (ca->from < cb->from);
-}
-
-static unsigned short codepoint_lookup(struct codepoint *key,
-					const struct codepoint *table,
-					unsigned int len)
-{
-	struct codepoint *result = NULL;
-
-	result = bsearch(key, table, len, sizeof(struct codepoint),
-				compare_codepoints);
-
-	return result ? result->to : GUND;
-}
-
 static unsigned short gsm_locking_shift_lookup(struct conversion_table *t,
 						unsigned char k)
 {
@@ -483,25 +501,22 @@ static unsigned short gsm_locking_shift_lookup(struct conversion_table *t,
 static unsigned short gsm_single_shift_lookup(struct conversion_table *t,
 						unsigned char k)
 {
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->single_g, t->single_len_g);
+	return t->single_g[k];
 }
 
 static unsigned short unicode_locking_shift_lookup(struct conversion_table *t,
 							unsigned short k)
 {
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->locking_u, t->locking_len_u);
+	return t->locking_u->page[k >> 8][k & 0xff];
 }
 
 static unsigned short unicode_single_shift_lookup(struct conversion_table *t,
 							unsigned short k)
 {
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->single_u, t->single_len_u);
+	return t->single_u->page[k >> 8][k & 0xff];
 }
 
-static gboolean populate_locking_shift(struct conversion_table *t,
+static gboolean populate_locking_shift(struct codepoint_tables *t,
 					enum gsm_dialect lang)
 {
 	switch (lang) {
@@ -528,7 +543,7 @@ static gboolean populate_locking_shift(struct conversion_table *t,
 	return FALSE;
 }
 
-static gboolean populate_single_shift(struct conversion_table *t,
+static gboolean populate_single_shift(struct codepoint_tables *t,
 					enum gsm_dialect lang)
 {
 	switch (lang) {
@@ -564,14 +579,90 @@ static gboolean populate_single_shift(struct conversion_table *t,
 	return FALSE;
 }
 
+#define NUM_DIALECTS (GSM_DIALECT_PORTUGUESE + 1)
+
+static struct dialect_tables dialects[NUM_DIALECTS];
+static unsigned short unmapped_page[256];
+
+static void unicode_map_init(struct unicode_map *map,
+				const struct codepoint *table,
+				unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(map->page); i++)
+		map->page[i] = unmapped_page;
+
+	for (i = 0; i < len; i++) {
+		unsigned int hi = table[i].from >> 8;
+		unsigned short *page = (unsigned short *) map->page[hi];
+
+		if (page == unmapped_page) {
+			page = g_memdup(unmapped_page, sizeof(unmapped_page));
+			map->page[hi] = page;
+		}
+
+		page[table[i].from & 0xff] = table[i].to;
+	}
+}
+
+/*
+ * Expands the codepoint tables of every dialect into direct index tables
+ * the first time a conversion is done.  These are never freed.
+ */
+static void dialect_tables_init(void)
+{
+	static gboolean initialized = FALSE;
+	struct codepoint_tables src;
+	unsigned int lang;
+	unsigned int i;
+
+	if (initialized)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS(unmapped_page); i++)
+		unmapped_page[i] = GUND;
+
+	for (lang = 0; lang < NUM_DIALECTS; lang++) {
+		struct dialect_tables *d = &dialects[lang];
+
+		memset(&src, 0, sizeof(src));
+		populate_locking_shift(&src, lang);
+		populate_single_shift(&src, lang);
+
+		d->locking_g = src.locking_g;
+		unicode_map_init(&d->locking_u, src.locking_u,
+					src.locking_len_u);
+
+		for (i = 0; i < G_N_ELEMENTS(d->single_g); i++)
+			d->single_g[i] = GUND;
+
+		for (i = 0; i < src.single_len_g; i++)
+			d->single_g[src.single_g[i].from] = src.single_g[i].to;
+
+		unicode_map_init(&d->single_u, src.single_u,
+					src.single_len_u);
+	}
+
+	initialized = TRUE;
+}
+
 static gboolean conversion_table_init(struct conversion_table *t,
 					enum gsm_dialect locking,
 					enum gsm_dialect single)
 {
-	memset(t, 0, sizeof(struct conversion_table));
+	if ((unsigned int) locking >= NUM_DIALECTS ||
+			(unsigned int) single >= NUM_DIALECTS)
+		return FALSE;
+
+	dialect_tables_init();
+
+	t->locking_g = dialects[locking].locking_g;
+	t->locking_u = &dialects[locking].locking_u;
+	t->single_g = dialects[single].single_g;
+	t->single_u = &dialects[single].single_u;
 
-	return populate_locking_shift(t, locking) &&
-			populate_single_shift(t, single);
+	return TRUE;
 }
 
 /*!
@@ -623,7 +714,7 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 
 		if (text[i] == 0x1b) {
 			++i;
-			if (i >= len)
+			if (i >= len || text[i] > 0x7f)
 				goto error;
 
 			c = gsm_single_shift_lookup(&t, text[i]);
@@ -803,6 +894,103 @@ unsigned char *convert_utf8_to_gsm(const char *text, long len,
 						GSM_DIALECT_DEFAULT);
 }
 
+/*!
+ * Fills in the locking shift and single shift table pairs worth trying for
+ * the given dialect, in order of preference: default tables only, then the
+ * single shift table of the dialect, then both of its tables.  Returns the
+ * number of pairs, at most 3.
+ */
+int gsm_dialect_candidates(enum gsm_dialect hint, enum gsm_dialect *locking,
+				enum gsm_dialect *single)
+{
+	int n = 0;
+
+	locking[n] = GSM_DIALECT_DEFAULT;
+	single[n++] = GSM_DIALECT_DEFAULT;
+
+	if (hint == GSM_DIALECT_DEFAULT)
+		return n;
+
+	locking[n] = GSM_DIALECT_DEFAULT;
+	single[n++] = hint;
+
+	/* Spanish dialect uses the default locking shift table */
+	if (hint == GSM_DIALECT_SPANISH)
+		return n;
+
+	locking[n] = hint;
+	single[n++] = hint;
+
+	return n;
+}
+
+/*!
+ * Computes, with a single pass over the UTF-8 text, how many septets it
+ * takes to encode it using each of the n locking shift and single shift
+ * table pairs given.  septets[i] is set to -1 for the pairs that cannot
+ * encode the text.
+ *
+ * Returns the number of characters in the text, or -1 if it is not valid
+ * UTF-8 or n is out of range.
+ */
+long utf8_to_gsm_septets(const char *utf8, long len,
+				const enum gsm_dialect *locking,
+				const enum gsm_dialect *single,
+				int n, long *septets)
+{
+	struct conversion_table t[GSM_MAX_CANDIDATES];
+	const char *in = utf8;
+	long nchars = 0;
+	int i;
+
+	if (n < 1 || n > GSM_MAX_CANDIDATES)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (conversion_table_init(&t[i], locking[i], single[i]))
+			septets[i] = 0;
+		else
+			septets[i] = -1;
+	}
+
+	while ((len < 0 || utf8 + len - in > 0) && *in) {
+		long max = len < 0 ? 6 : utf8 + len - in;
+		gunichar c = g_utf8_get_char_validated(in, max);
+
+		if (c & 0x80000000)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			unsigned short converted;
+
+			if (septets[i] < 0)
+				continue;
+
+			if (c > 0xffff) {
+				septets[i] = -1;
+				continue;
+			}
+
+			converted = unicode_locking_shift_lookup(&t[i], c);
+
+			if (converted == GUND)
+				converted = unicode_single_shift_lookup(&t[i], c);
+
+			if (converted == GUND)
+				septets[i] = -1;
+			else if (converted & 0x1b00)
+				septets[i] += 2;
+			else
+				septets[i] += 1;
+		}
+
+		in = g_utf8_next_char(in);
+		nchars += 1;
+	}
+
+	return nchars;
+}
+
 /*!
  * Converts UTF-8 encoded text to GSM alphabet. It finds an encoding
  * that uses the minimum set of GSM dialects based on the hint given.
@@ -810,7 +998,8 @@ unsigned char *convert_utf8_to_gsm(const char *text, long len,
  * It first attempts to use the default dialect's single shift and
  * locking shift tables. It then tries with only the single shift
  * table of the hinted dialect, and finally with both the single shift
- * and locking shift tables of the hinted dialect.
+ * and locking shift tables of the hinted dialect.  All of them are
+ * checked with a single pass over the text, which is then encoded once.
  *
  * Returns the encoded data or NULL if no suitable encoding could be
  * found. The data must be freed by the caller. If items_read is not
@@ -826,48 +1015,192 @@ unsigned char *convert_utf8_to_gsm_best_lang(const char *utf8, long len,
 					enum gsm_dialect *used_locking,
 					enum gsm_dialect *used_single)
 {
-	enum gsm_dialect locking = GSM_DIALECT_DEFAULT;
-	enum gsm_dialect single = GSM_DIALECT_DEFAULT;
+	enum gsm_dialect locking[GSM_MAX_CANDIDATES];
+	enum gsm_dialect single[GSM_MAX_CANDIDATES];
+	long septets[GSM_MAX_CANDIDATES];
 	unsigned char *encoded;
+	long nchars;
+	int n;
+	int i;
 
-	encoded = convert_utf8_to_gsm_with_lang(utf8, len, items_read,
-						items_written, terminator,
-						locking, single);
-	if (encoded != NULL)
-		goto out;
-
-	if (hint == GSM_DIALECT_DEFAULT)
-		return NULL;
-
-	single = hint;
-	encoded = convert_utf8_to_gsm_with_lang(utf8, len, items_read,
-						items_written, terminator,
-						locking, single);
-	if (encoded != NULL)
-		goto out;
+	n = gsm_dialect_candidates(hint, locking, single);
+	nchars = utf8_to_gsm_septets(utf8, len, locking, single, n, septets);
 
-	/* Spanish dialect uses the default locking shift table */
-	if (hint == GSM_DIALECT_SPANISH)
-		return NULL;
+	for (i = 0; i < n - 1; i++) {
+		if (nchars >= 0 && septets[i] >= 0)
+			break;
+	}
 
-	locking = hint;
+	/*
+	 * If nothing can encode the text, this fails the same way as
+	 * the last candidate, with items_read set accordingly
+	 */
 	encoded = convert_utf8_to_gsm_with_lang(utf8, len, items_read,
 						items_written, terminator,
-						locking, single);
-
+						locking[i], single[i]);
 	if (encoded == NULL)
 		return NULL;
 
-out:
 	if (used_locking != NULL)
-		*used_locking = locking;
+		*used_locking = locking[i];
 
 	if (used_single != NULL)
-		*used_single = single;
+		*used_single = single[i];
 
 	return encoded;
 }
 
+/*
+ * Value of each hexadecimal digit with HEX_DIGIT_VALID set, 0 for all other
+ * characters, so that a pair of digits is validated with a single test.
+ */
+#define HEX_DIGIT_VALID 0x10
+
+static const unsigned char hex_digit_table[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13,
+	['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17,
+	['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c,
+	['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c,
+	['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+};
+
+/*
+ * Decodes n blocks of 32 hex digits into 16 octets each.  Returns the number
+ * of blocks decoded, which is less than n if the vector path is not
+ * available, or -1 if an invalid digit was found.  The output may overlap
+ * the input as long as it does not start after it.
+ */
+static long hex_decode_blocks(const char *in, long n, unsigned char *out)
+{
+	long i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_set1_epi8('0' - 1);
+	const __m128i nine = _mm_set1_epi8('9' + 1);
+	const __m128i a = _mm_set1_epi8('a' - 1);
+	const __m128i f = _mm_set1_epi8('f' + 1);
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i low_byte = _mm_set1_epi16(0x00ff);
+	__m128i v[2];
+	int k;
+
+	for (; i < n; i++, in += 32, out += 16) {
+		v[0] = _mm_loadu_si128((const __m128i *) in);
+		v[1] = _mm_loadu_si128((const __m128i *) (in + 16));
+
+		for (k = 0; k < 2; k++) {
+			__m128i c = v[k];
+			__m128i l = _mm_or_si128(c, lower);
+			__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, zero),
+						_mm_cmpgt_epi8(nine, c));
+			__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(l, a),
+						_mm_cmpgt_epi8(f, l));
+
+			if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) !=
+					0xffff)
+				return -1;
+
+			c = _mm_or_si128(
+				_mm_and_si128(digit,
+					_mm_sub_epi8(c, _mm_set1_epi8('0'))),
+				_mm_and_si128(letter,
+					_mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+
+			/* Each 16 bit lane holds the high nibble first */
+			v[k] = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(c, 4),
+						_mm_srli_epi16(c, 8)), low_byte);
+		}
+
+		_mm_storeu_si128((__m128i *) out, _mm_packus_epi16(v[0], v[1]));
+	}
+#elif defined(USE_NEON)
+	for (; i < n; i++, in += 32, out += 16) {
+		uint8x16x2_t v = vld2q_u8((const uint8_t *) in);
+		uint8x16_t nibble[2];
+		uint64x2_t valid;
+		int k;
+
+		for (k = 0; k < 2; k++) {
+			uint8x16_t c = v.val[k];
+			uint8x16_t l = vorrq_u8(c, vdupq_n_u8(0x20));
+			uint8x16_t digit = vandq_u8(vcgeq_u8(c, vdupq_n_u8('0')),
+						vcleq_u8(c, vdupq_n_u8('9')));
+			uint8x16_t letter = vandq_u8(vcgeq_u8(l, vdupq_n_u8('a')),
+						vcleq_u8(l, vdupq_n_u8('f')));
+
+			valid = vreinterpretq_u64_u8(vorrq_u8(digit, letter));
+			if ((vgetq_lane_u64(valid, 0) &
+					vgetq_lane_u64(valid, 1)) != ~0ULL)
+				return -1;
+
+			nibble[k] = vbslq_u8(digit,
+					vsubq_u8(c, vdupq_n_u8('0')),
+					vsubq_u8(l, vdupq_n_u8('a' - 10)));
+		}
+
+		vst1q_u8(out, vorrq_u8(vshlq_n_u8(nibble[0], 4), nibble[1]));
+	}
+#endif
+
+	return i;
+}
+
+/*
+ * Encodes n blocks of 16 octets into 32 upper case hex digits each.  Returns
+ * the number of blocks encoded, which is less than n if the vector path is
+ * not available.
+ */
+static long hex_encode_blocks(const unsigned char *in, long n, char *out)
+{
+	long i = 0;
+
+#if defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i gap = _mm_set1_epi8('A' - '0' - 10);
+
+	for (; i < n; i++, in += 16, out += 32) {
+		__m128i v = _mm_loadu_si128((const __m128i *) in);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i lo = _mm_and_si128(v, mask);
+		__m128i c[2];
+		int k;
+
+		c[0] = _mm_unpacklo_epi8(hi, lo);
+		c[1] = _mm_unpackhi_epi8(hi, lo);
+
+		for (k = 0; k < 2; k++)
+			c[k] = _mm_add_epi8(_mm_add_epi8(c[k], zero),
+					_mm_and_si128(_mm_cmpgt_epi8(c[k], nine),
+							gap));
+
+		_mm_storeu_si128((__m128i *) out, c[0]);
+		_mm_storeu_si128((__m128i *) (out + 16), c[1]);
+	}
+#elif defined(USE_NEON)
+	for (; i < n; i++, in += 16, out += 32) {
+		uint8x16_t v = vld1q_u8(in);
+		uint8x16x2_t c;
+		int k;
+
+		c.val[0] = vshrq_n_u8(v, 4);
+		c.val[1] = vandq_u8(v, vdupq_n_u8(0x0f));
+
+		for (k = 0; k < 2; k++)
+			c.val[k] = vaddq_u8(vaddq_u8(c.val[k], vdupq_n_u8('0')),
+					vandq_u8(vcgtq_u8(c.val[k], vdupq_n_u8(9)),
+						vdupq_n_u8('A' - '0' - 10)));
+
+		vst2q_u8((uint8_t *) out, c);
+	}
+#endif
+
+	return i;
+}
+
 /*!
  * Decodes the hex encoded data and converts to a byte array.  If terminator
  * is not 0, the terminator character is appended to the end of the result.
@@ -883,36 +1216,25 @@ unsigned char *decode_hex_own_buf(const char *in, long len, long *items_written,
 					unsigned char *buf)
 {
 	long i, j;
-	char c;
-	unsigned char b;
+	unsigned char hi, lo;
 
 	if (len < 0)
 		len = strlen(in);
 
 	len &= ~0x1;
 
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = toupper(in[i]);
-
-		if (c >= '0' && c <= '9')
-			b = c - '0';
-		else if (c >= 'A' && c <= 'F')
-			b = 10 + c - 'A';
-		else
-			return NULL;
-
-		i += 1;
+	i = hex_decode_blocks(in, len / 32, buf);
+	if (i < 0)
+		return NULL;
 
-		c = toupper(in[i]);
+	for (i *= 32, j = i / 2; i < len; i += 2, j++) {
+		hi = hex_digit_table[(unsigned char) in[i]];
+		lo = hex_digit_table[(unsigned char) in[i + 1]];
 
-		if (c >= '0' && c <= '9')
-			b = b * 16 + c - '0';
-		else if (c >= 'A' && c <= 'F')
-			b = b * 16 + 10 + c - 'A';
-		else
+		if (!(hi & lo & HEX_DIGIT_VALID))
 			return NULL;
 
-		buf[j] = b;
+		buf[j] = (hi << 4) | (lo & 0xf);
 	}
 
 	if (terminator)
@@ -927,8 +1249,6 @@ unsigned char *decode_hex_own_buf(const char *in, long len, long *items_written,
 unsigned char *decode_hex(const char *in, long len, long *items_written,
 				unsigned char terminator)
 {
-	long i;
-	char c;
 	unsigned char *buf;
 
 	if (len < 0)
@@ -936,18 +1256,14 @@ unsigned char *decode_hex(const char *in, long len, long *items_written,
 
 	len &= ~0x1;
 
-	for (i = 0; i < len; i++) {
-		c = toupper(in[i]);
-
-		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))
-			continue;
+	buf = g_new(unsigned char, (len >> 1) + (terminator ? 1 : 0));
 
+	if (decode_hex_own_buf(in, len, items_written, terminator, buf) == NULL) {
+		g_free(buf);
 		return NULL;
 	}
 
-	buf = g_new(unsigned char, (len >> 1) + (terminator ? 1 : 0));
-
-	return decode_hex_own_buf(in, len, items_written, terminator, buf);
+	return buf;
 }
 
 /*!
@@ -959,8 +1275,8 @@ unsigned char *decode_hex(const char *in, long len, long *items_written,
 char *encode_hex_own_buf(const unsigned char *in, long len,
 				unsigned char terminator, char *buf)
 {
+	static const char hexdigits[] = "0123456789ABCDEF";
 	long i, j;
-	char c;
 
 	if (len < 0) {
 		i = 0;
@@ -971,22 +1287,11 @@ char *encode_hex_own_buf(const unsigned char *in, long len,
 		len = i;
 	}
 
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = (in[i] >> 4) & 0xf;
-
-		if (c <= 9)
-			buf[j] = '0' + c;
-		else
-			buf[j] = 'A' + c - 10;
-
-		j += 1;
+	i = hex_encode_blocks(in, len / 16, buf) * 16;
 
-		c = (in[i]) & 0xf;
-
-		if (c <= 9)
-			buf[j] = '0' + c;
-		else
-			buf[j] = 'A' + c - 10;
+	for (j = i * 2; i < len; i++) {
+		buf[j++] = hexdigits[in[i] >> 4];
+		buf[j++] = hexdigits[in[i] & 0xf];
 	}
 
 	buf[j] = '\0';
@@ -1013,6 +1318,156 @@ char *encode_hex(const unsigned char *in, long len, unsigned char terminator)
 	return encode_hex_own_buf(in, len, terminator, buf);
 }
 
+/*
+ * 7 octets of packed GSM data hold exactly 8 septets, the first one in the
+ * least significant bits.  Read as a little endian 56 bit word, septet k
+ * sits at bit 7k.  Spreading these out to one septet per octet and back
+ * takes three shift and mask steps each, halving the lane size every step.
+ */
+#define SPREAD_STEP(w, lo, hi, shift)	(((w) & (lo)) | (((w) & (hi)) << (shift)))
+#define GATHER_STEP(w, lo, hi, shift)	(((w) & (lo)) | (((w) & (hi)) >> (shift)))
+
+static inline guint64 septets_spread(guint64 w)
+{
+	w = SPREAD_STEP(w, 0x000000000FFFFFFFULL, 0x00FFFFFFF0000000ULL, 4);
+	w = SPREAD_STEP(w, 0x00003FFF00003FFFULL, 0x0FFFC0000FFFC000ULL, 2);
+	w = SPREAD_STEP(w, 0x007F007F007F007FULL, 0x3F803F803F803F80ULL, 1);
+
+	return w;
+}
+
+/*
+ * The top bit of each octet is not masked off but ORed into the following
+ * septet, the same thing the bit at a time packing does with such input
+ */
+static inline guint64 septets_gather(guint64 w)
+{
+	w = GATHER_STEP(w, 0x00FF00FF00FF00FFULL, 0xFF00FF00FF00FF00ULL, 1);
+	w = GATHER_STEP(w, 0x0000FFFF0000FFFFULL, 0xFFFF0000FFFF0000ULL, 2);
+	w = GATHER_STEP(w, 0x00000000FFFFFFFFULL, 0xFFFFFFFF00000000ULL, 4);
+
+	return w;
+}
+
+/* Unpacks n groups of 7 octets into 8 septets each */
+static void unpack_7bit_blocks(const unsigned char *in, unsigned char *out,
+				long n)
+{
+	guint64 w;
+
+#if defined(__SSE2__)
+	for (; n >= 2; n -= 2, in += 14, out += 16) {
+		guint64 w1 = 0;
+		__m128i v;
+
+		w = 0;
+		memcpy(&w, in, 7);
+		memcpy(&w1, in + 7, 7);
+		v = _mm_set_epi64x(w1, w);
+
+		v = _mm_or_si128(_mm_and_si128(v,
+				_mm_set1_epi64x(0x000000000FFFFFFFULL)),
+			_mm_slli_epi64(_mm_and_si128(v,
+				_mm_set1_epi64x(0x00FFFFFFF0000000ULL)), 4));
+		v = _mm_or_si128(_mm_and_si128(v,
+				_mm_set1_epi64x(0x00003FFF00003FFFULL)),
+			_mm_slli_epi64(_mm_and_si128(v,
+				_mm_set1_epi64x(0x0FFFC0000FFFC000ULL)), 2));
+		v = _mm_or_si128(_mm_and_si128(v,
+				_mm_set1_epi64x(0x007F007F007F007FULL)),
+			_mm_slli_epi64(_mm_and_si128(v,
+				_mm_set1_epi64x(0x3F803F803F803F80ULL)), 1));
+
+		_mm_storeu_si128((__m128i *) out, v);
+	}
+#elif defined(USE_NEON)
+	for (; n >= 2; n -= 2, in += 14, out += 16) {
+		guint64 w1 = 0;
+		uint64x2_t v;
+
+		w = 0;
+		memcpy(&w, in, 7);
+		memcpy(&w1, in + 7, 7);
+		v = vcombine_u64(vcreate_u64(w), vcreate_u64(w1));
+
+		v = vorrq_u64(vandq_u64(v, vdupq_n_u64(0x000000000FFFFFFFULL)),
+			vshlq_n_u64(vandq_u64(v,
+				vdupq_n_u64(0x00FFFFFFF0000000ULL)), 4));
+		v = vorrq_u64(vandq_u64(v, vdupq_n_u64(0x00003FFF00003FFFULL)),
+			vshlq_n_u64(vandq_u64(v,
+				vdupq_n_u64(0x0FFFC0000FFFC000ULL)), 2));
+		v = vorrq_u64(vandq_u64(v, vdupq_n_u64(0x007F007F007F007FULL)),
+			vshlq_n_u64(vandq_u64(v,
+				vdupq_n_u64(0x3F803F803F803F80ULL)), 1));
+
+		vst1q_u8(out, vreinterpretq_u8_u64(v));
+	}
+#endif
+
+	for (; n > 0; n--, in += 7, out += 8) {
+		w = 0;
+		memcpy(&w, in, 7);
+		w = GUINT64_TO_LE(septets_spread(GUINT64_FROM_LE(w)));
+		memcpy(out, &w, 8);
+	}
+}
+
+/* Packs n groups of 8 septets into 7 octets each */
+static void pack_7bit_blocks(const unsigned char *in, unsigned char *out,
+				long n)
+{
+	guint64 w;
+
+#if defined(__SSE2__)
+	for (; n >= 2; n -= 2, in += 16, out += 14) {
+		__m128i v = _mm_loadu_si128((const __m128i *) in);
+
+		v = _mm_or_si128(_mm_and_si128(v,
+				_mm_set1_epi64x(0x00FF00FF00FF00FFULL)),
+			_mm_srli_epi64(_mm_and_si128(v,
+				_mm_set1_epi64x(0xFF00FF00FF00FF00ULL)), 1));
+		v = _mm_or_si128(_mm_and_si128(v,
+				_mm_set1_epi64x(0x0000FFFF0000FFFFULL)),
+			_mm_srli_epi64(_mm_and_si128(v,
+				_mm_set1_epi64x(0xFFFF0000FFFF0000ULL)), 2));
+		v = _mm_or_si128(_mm_and_si128(v,
+				_mm_set1_epi64x(0x00000000FFFFFFFFULL)),
+			_mm_srli_epi64(_mm_and_si128(v,
+				_mm_set1_epi64x(0xFFFFFFFF00000000ULL)), 4));
+
+		_mm_storel_epi64((__m128i *) &w, v);
+		memcpy(out, &w, 7);
+		_mm_storel_epi64((__m128i *) &w, _mm_unpackhi_epi64(v, v));
+		memcpy(out + 7, &w, 7);
+	}
+#elif defined(USE_NEON)
+	for (; n >= 2; n -= 2, in += 16, out += 14) {
+		uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(in));
+
+		v = vorrq_u64(vandq_u64(v, vdupq_n_u64(0x00FF00FF00FF00FFULL)),
+			vshrq_n_u64(vandq_u64(v,
+				vdupq_n_u64(0xFF00FF00FF00FF00ULL)), 1));
+		v = vorrq_u64(vandq_u64(v, vdupq_n_u64(0x0000FFFF0000FFFFULL)),
+			vshrq_n_u64(vandq_u64(v,
+				vdupq_n_u64(0xFFFF0000FFFF0000ULL)), 2));
+		v = vorrq_u64(vandq_u64(v, vdupq_n_u64(0x00000000FFFFFFFFULL)),
+			vshrq_n_u64(vandq_u64(v,
+				vdupq_n_u64(0xFFFFFFFF00000000ULL)), 4));
+
+		w = vgetq_lane_u64(v, 0);
+		memcpy(out, &w, 7);
+		w = vgetq_lane_u64(v, 1);
+		memcpy(out + 7, &w, 7);
+	}
+#endif
+
+	for (; n > 0; n--, in += 8, out += 7) {
+		memcpy(&w, in, 8);
+		w = GUINT64_TO_LE(septets_gather(GUINT64_FROM_LE(w)));
+		memcpy(out, &w, 7);
+	}
+}
+
 unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 					int byte_offset, gboolean ussd,
 					long max_to_unpack, long *items_written,
@@ -1032,6 +1487,18 @@ unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 		max_to_unpack = len * 8 / 7;
 
 	for (i = 0; (i < len) && ((out-buf) < max_to_unpack); i++) {
+		/* Septet aligned, unpack whole groups of 7 octets at once */
+		if (bits == 7 && len - i >= 7 &&
+				max_to_unpack - (out - buf) >= 8) {
+			long n = MIN((len - i) / 7,
+					(max_to_unpack - (out - buf)) / 8);
+
+			unpack_7bit_blocks(in + i, out, n);
+			out += n * 8;
+			i += n * 7 - 1;
+			continue;
+		}
+
 		/* Grab what we have in the current octet */
 		*out = (in[i] & ((1 << bits) - 1)) << (7 - bits);
 
@@ -1134,6 +1601,16 @@ unsigned char *pack_7bit_own_buf(const unsigned char *in, long len,
 	}
 
 	for (i = 0; i < len; i++) {
+		/* Octet aligned, pack whole groups of 8 septets at once */
+		if (bits == 7 && len - i >= 8) {
+			long n = (len - i) / 8;
+
+			pack_7bit_blocks(in + i, out, n);
+			out += n * 7;
+			i += n * 8 - 1;
+			continue;
+		}
+
 		if (bits != 7) {
 			*out |= (in[i] & ((1 << (7 - bits)) - 1)) <<
 					(bits + 1);
@@ -26,6 +26,9 @@ enum gsm_dialect {
 	GSM_DIALECT_PORTUGUESE,
 };
 
+/* Most table pairs utf8_to_gsm_septets can check in one pass */
+#define GSM_MAX_CANDIDATES 8
+
 char *convert_gsm_to_utf8(const unsigned char *text, long len, long *items_read,
 				long *items_written, unsigned char terminator);
 
@@ -44,6 +47,14 @@ unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
 					enum gsm_dialect locking_shift_lang,
 					enum gsm_dialect single_shift_lang);
 
+int gsm_dialect_candidates(enum gsm_dialect hint, enum gsm_dialect *locking,
+				enum gsm_dialect *single);
+
+long utf8_to_gsm_septets(const char *utf8, long len,
+				const enum gsm_dialect *locking,
+				const enum gsm_dialect *single,
+				int n, long *septets);
+
 unsigned char *convert_utf8_to_gsm_best_lang(const char *utf8, long len,
 					long *items_read, long *items_written,
 					unsigned char terminator,
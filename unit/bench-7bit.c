@@ -0,0 +1,114 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "util.h"
+
+#define NUM_ROUNDS	200000
+
+struct bench_payload {
+	const char *name;
+	long septets;
+	int byte_offset;
+	gboolean ussd;
+};
+
+static const struct bench_payload payloads[] = {
+	{ "sms",	160,	0,	FALSE },
+	{ "sms-udh",	153,	6,	FALSE },
+	{ "cbs",	93,	0,	TRUE },
+	{ "ussd",	182,	0,	TRUE },
+};
+
+static volatile unsigned char sink;
+
+static void bench_payload(gconstpointer data)
+{
+	const struct bench_payload *payload = data;
+	unsigned char septets[200];
+	unsigned char packed[200];
+	unsigned char unpacked[240];
+	long packed_len;
+	long written;
+	GTimer *timer;
+	double pack_time;
+	double unpack_time;
+	int i;
+
+	for (i = 0; i < payload->septets; i++)
+		septets[i] = (i * 37 + 11) & 0x7f;
+
+	timer = g_timer_new();
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		pack_7bit_own_buf(septets, payload->septets,
+					payload->byte_offset, payload->ussd,
+					&packed_len, 0, packed);
+		sink = packed[i % packed_len];
+	}
+
+	pack_time = g_timer_elapsed(timer, NULL);
+	g_timer_start(timer);
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		unpack_7bit_own_buf(packed, packed_len, payload->byte_offset,
+					payload->ussd, payload->septets,
+					&written, 0, unpacked);
+		sink = unpacked[i % written];
+	}
+
+	unpack_time = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	g_assert(written == payload->septets);
+	g_assert(memcmp(septets, unpacked, written) == 0);
+
+	g_print("%-8s %3ld septets: pack %.1f ns, unpack %.1f ns, "
+			"%.0f MB/s packed\n",
+			payload->name, payload->septets,
+			pack_time * 1e9 / NUM_ROUNDS,
+			unpack_time * 1e9 / NUM_ROUNDS,
+			(double) packed_len * NUM_ROUNDS /
+				(pack_time + unpack_time) / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	g_test_init(&argc, &argv, NULL);
+
+	for (i = 0; i < G_N_ELEMENTS(payloads); i++) {
+		char *path = g_strdup_printf("/bench7bit/%s",
+						payloads[i].name);
+
+		g_test_add_data_func(path, &payloads[i], bench_payload);
+		g_free(path);
+	}
+
+	return g_test_run();
+}
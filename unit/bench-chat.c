@@ -0,0 +1,279 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "gatchat.h"
+#include "gatio.h"
+
+/*
+ * Count heap allocations by interposing the libc allocator, this works as
+ * long as the C library is glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long num_allocs;
+
+void *malloc(size_t size)
+{
+	num_allocs += 1;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	num_allocs += 1;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	num_allocs += 1;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+#define NUM_LINES	1000
+#define NUM_ROUNDS	20
+#define PDU_LENGTH	140
+
+enum bench_mode {
+	BENCH_RESPONSE,
+	BENCH_LISTING,
+	BENCH_PDU_LISTING,
+};
+
+static const char *mode_names[] = { "response", "listing", "pdu" };
+
+struct bench_chat {
+	GAtChat *chat;
+	int modem;
+	gboolean done;
+	int lines;
+};
+
+static void listing_cb(GAtResult *result, gpointer user_data)
+{
+	struct bench_chat *bench = user_data;
+
+	bench->lines += 1;
+}
+
+static void response_cb(gboolean ok, GAtResult *result, gpointer user_data)
+{
+	struct bench_chat *bench = user_data;
+
+	g_assert(ok);
+
+	bench->lines += g_at_result_num_response_lines(result);
+	bench->done = TRUE;
+}
+
+static void bench_chat_init(struct bench_chat *bench)
+{
+	GIOChannel *io;
+	GAtSyntax *syntax;
+	int sv[2];
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	syntax = g_at_syntax_new_gsm_permissive();
+	bench->chat = g_at_chat_new(io, syntax);
+	g_at_syntax_unref(syntax);
+	g_io_channel_unref(io);
+
+	g_assert(bench->chat != NULL);
+
+	g_at_io_set_fd(g_at_chat_get_io(bench->chat), sv[0]);
+
+	bench->modem = sv[1];
+	fcntl(bench->modem, F_SETFL, O_NONBLOCK);
+}
+
+static void bench_chat_free(struct bench_chat *bench)
+{
+	g_at_chat_unref(bench->chat);
+	close(bench->modem);
+}
+
+static GString *build_response(const char *prefix, enum bench_mode mode)
+{
+	GString *response = g_string_sized_new(NUM_LINES * PDU_LENGTH * 3);
+	int i, j;
+
+	for (i = 1; i <= NUM_LINES; i++) {
+		if (mode != BENCH_PDU_LISTING) {
+			g_string_append_printf(response,
+				"\r\n%s %d,\"+4912345%04d\",145,\"Contact %d\"",
+				prefix, i, i, i);
+			continue;
+		}
+
+		g_string_append_printf(response, "\r\n%s %d,1,,%d\r\n",
+					prefix, i, PDU_LENGTH);
+
+		for (j = 0; j < PDU_LENGTH; j++)
+			g_string_append_printf(response, "%02X", (i + j) & 0xff);
+	}
+
+	g_string_append(response, "\r\n\r\nOK\r\n");
+
+	return response;
+}
+
+static void run_command(struct bench_chat *bench, const char *cmd,
+			const char *prefix, enum bench_mode mode,
+			const GString *response)
+{
+	const char *prefixes[] = { prefix, NULL };
+	char buf[64];
+	ssize_t n = 0;
+	gsize written = 0;
+
+	bench->done = FALSE;
+	bench->lines = 0;
+
+	switch (mode) {
+	case BENCH_RESPONSE:
+		g_at_chat_send(bench->chat, cmd, prefixes, response_cb,
+					bench, NULL);
+		break;
+	case BENCH_LISTING:
+		g_at_chat_send_listing(bench->chat, cmd, prefixes, listing_cb,
+					response_cb, bench, NULL);
+		break;
+	case BENCH_PDU_LISTING:
+		g_at_chat_send_pdu_listing(bench->chat, cmd, prefixes,
+					listing_cb, response_cb, bench, NULL);
+		break;
+	}
+
+	/* Wait until the whole command got written to the modem */
+	while (n <= 0 || memchr(buf, '\r', n) == NULL) {
+		g_main_context_iteration(NULL, FALSE);
+		n = read(bench->modem, buf, sizeof(buf));
+	}
+
+	while (bench->done == FALSE) {
+		if (written < response->len) {
+			n = write(bench->modem, response->str + written,
+					MIN(response->len - written, 4096));
+			if (n > 0)
+				written += n;
+		}
+
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	g_assert(bench->lines == NUM_LINES);
+}
+
+static void bench_response(const char *cmd, const char *prefix,
+				enum bench_mode mode)
+{
+	struct bench_chat bench;
+	GString *response = build_response(prefix, mode);
+	GAtIO *io;
+	GAtIOStats start, end;
+	unsigned long allocs;
+	guint64 syscalls;
+	GTimer *timer;
+	int i;
+
+	bench_chat_init(&bench);
+
+	/* Warm up the buffers */
+	run_command(&bench, cmd, prefix, mode, response);
+
+	io = g_at_chat_get_io(bench.chat);
+	g_at_io_get_stats(io, &start);
+
+	timer = g_timer_new();
+	allocs = num_allocs;
+
+	for (i = 0; i < NUM_ROUNDS; i++)
+		run_command(&bench, cmd, prefix, mode, response);
+
+	allocs = num_allocs - allocs;
+	g_timer_stop(timer);
+
+	g_at_io_get_stats(io, &end);
+	syscalls = end.read_calls - start.read_calls +
+			end.write_calls - start.write_calls;
+
+	g_print("%-10s %d lines: %.2f allocations/line, %.1f us/line, "
+			"%.2f syscalls/KB\n",
+			mode_names[mode], NUM_LINES,
+			(double) allocs / (NUM_ROUNDS * NUM_LINES),
+			g_timer_elapsed(timer, NULL) * 1000000 /
+						(NUM_ROUNDS * NUM_LINES),
+			(double) syscalls * 1024 /
+				(end.bytes_read - start.bytes_read));
+
+	g_timer_destroy(timer);
+	g_string_free(response, TRUE);
+	bench_chat_free(&bench);
+}
+
+static void bench_response_lines(void)
+{
+	bench_response("AT+CPBR=1,1000", "+CPBR:", BENCH_RESPONSE);
+}
+
+static void bench_listing_lines(void)
+{
+	bench_response("AT+CPBR=1,1000", "+CPBR:", BENCH_LISTING);
+}
+
+static void bench_pdu_listing(void)
+{
+	bench_response("AT+CMGL=4", "+CMGL:", BENCH_PDU_LISTING);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/benchchat/response", bench_response_lines);
+	g_test_add_func("/benchchat/listing", bench_listing_lines);
+	g_test_add_func("/benchchat/pdu_listing", bench_pdu_listing);
+
+	return g_test_run();
+}
@@ -0,0 +1,508 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "crc-ccitt.h"
+#include "ringbuffer.h"
+#include "gatio.h"
+#include "gathdlc.h"
+
+#define NUM_FRAMES	2000
+#define NUM_ROUNDS	10
+#define MAX_FRAME	1500
+#define BUFFER_SIZE	(2 * 2048)
+
+#define HDLC_FLAG	0x7e
+#define HDLC_ESCAPE	0x7d
+#define HDLC_TRANS	0x20
+#define HDLC_INITFCS	0xffff
+#define HDLC_GOODFCS	0xf0b8
+
+#define NEED_ESCAPE(xmit_accm, c) xmit_accm[c >> 5] & (1 << (c & 0x1f))
+
+/*
+ * The byte at a time HDLC encoder and decoder GAtHDLC used before, kept
+ * here as the reference to measure the current implementation against
+ */
+struct ref_hdlc {
+	GAtIO *io;
+	struct ring_buffer *write_buffer;
+	guint32 xmit_accm[8];
+	guint32 recv_accm;
+	unsigned char decode_buffer[BUFFER_SIZE];
+	guint decode_offset;
+	guint16 decode_fcs;
+	gboolean decode_escape;
+	gboolean wakeup_sent;
+	unsigned int frames;
+};
+
+static void ref_new_bytes(struct ring_buffer *rbuf, gpointer user_data)
+{
+	struct ref_hdlc *hdlc = user_data;
+	unsigned int len = ring_buffer_len(rbuf);
+	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
+	unsigned char *buf = ring_buffer_read_ptr(rbuf, 0);
+	unsigned int pos = 0;
+
+	while (pos < len) {
+		if (hdlc->decode_escape == TRUE) {
+			unsigned char val = *buf ^ HDLC_TRANS;
+
+			hdlc->decode_buffer[hdlc->decode_offset++] = val;
+			hdlc->decode_fcs = crc_ccitt_byte(hdlc->decode_fcs, val);
+
+			hdlc->decode_escape = FALSE;
+		} else if (*buf == HDLC_ESCAPE) {
+			hdlc->decode_escape = TRUE;
+		} else if (*buf == HDLC_FLAG) {
+			if (hdlc->decode_offset > 2 &&
+					hdlc->decode_fcs == HDLC_GOODFCS)
+				hdlc->frames += 1;
+
+			hdlc->decode_fcs = HDLC_INITFCS;
+			hdlc->decode_offset = 0;
+		} else if (*buf >= 0x20 ||
+					(hdlc->recv_accm & (1 << *buf)) == 0) {
+			hdlc->decode_buffer[hdlc->decode_offset++] = *buf;
+			hdlc->decode_fcs = crc_ccitt_byte(hdlc->decode_fcs,
+								*buf);
+		}
+
+		buf++;
+		pos++;
+
+		if (pos == wrap)
+			buf = ring_buffer_read_ptr(rbuf, pos);
+	}
+
+	ring_buffer_drain(rbuf, pos);
+}
+
+static gboolean ref_send(struct ref_hdlc *hdlc, struct ring_buffer *rbuf,
+				const unsigned char *data, gsize size)
+{
+	unsigned int avail = ring_buffer_avail(rbuf);
+	unsigned int wrap = ring_buffer_avail_no_wrap(rbuf);
+	unsigned char *buf = ring_buffer_write_ptr(rbuf, 0);
+	unsigned char tail[2];
+	unsigned int i = 0;
+	guint16 fcs = HDLC_INITFCS;
+	gboolean escape = FALSE;
+	gsize pos = 0;
+
+	if (avail < size * 2 + 8)
+		return FALSE;
+
+	if (hdlc->wakeup_sent == FALSE) {
+		*buf++ = HDLC_FLAG;
+		pos++;
+
+		hdlc->wakeup_sent = TRUE;
+	}
+
+	while (i < size) {
+		if (escape == TRUE) {
+			fcs = crc_ccitt_byte(fcs, data[i]);
+			*buf = data[i++] ^ HDLC_TRANS;
+			escape = FALSE;
+		} else if (NEED_ESCAPE(hdlc->xmit_accm, data[i])) {
+			*buf = HDLC_ESCAPE;
+			escape = TRUE;
+		} else {
+			fcs = crc_ccitt_byte(fcs, data[i]);
+			*buf = data[i++];
+		}
+
+		buf++;
+		pos++;
+
+		if (pos == wrap)
+			buf = ring_buffer_write_ptr(rbuf, pos);
+	}
+
+	fcs ^= HDLC_INITFCS;
+	tail[0] = fcs & 0xff;
+	tail[1] = fcs >> 8;
+
+	i = 0;
+
+	while (i < sizeof(tail)) {
+		if (escape == TRUE) {
+			*buf = tail[i++] ^ HDLC_TRANS;
+			escape = FALSE;
+		} else if (NEED_ESCAPE(hdlc->xmit_accm, tail[i])) {
+			*buf = HDLC_ESCAPE;
+			escape = TRUE;
+		} else {
+			*buf = tail[i++];
+		}
+
+		buf++;
+		pos++;
+
+		if (pos == wrap)
+			buf = ring_buffer_write_ptr(rbuf, pos);
+	}
+
+	*buf = HDLC_FLAG;
+	pos++;
+
+	ring_buffer_write_advance(rbuf, pos);
+
+	return TRUE;
+}
+
+static gboolean ref_can_write(gpointer user_data)
+{
+	struct ref_hdlc *hdlc = user_data;
+
+	g_at_io_write_ring_buffer(hdlc->io, hdlc->write_buffer);
+
+	return ring_buffer_len(hdlc->write_buffer) > 0;
+}
+
+struct bench_hdlc {
+	unsigned char *frames[NUM_FRAMES];
+	gsize frame_len[NUM_FRAMES];
+	unsigned char *stream;
+	gsize stream_len;
+	guint16 stream_fcs;
+	unsigned int received;
+	int sv[2];
+	GIOChannel *channel;
+};
+
+static void bench_init(struct bench_hdlc *bench)
+{
+	struct ref_hdlc ref;
+	struct ring_buffer *rbuf;
+	GByteArray *stream = g_byte_array_new();
+	GRand *rand = g_rand_new_with_seed(1);
+	unsigned int len;
+	int i, j;
+
+	memset(&ref, 0, sizeof(ref));
+	ref.xmit_accm[3] = 0x60000000;
+
+	rbuf = ring_buffer_new(BUFFER_SIZE);
+	g_assert(rbuf != NULL);
+
+	/* Random payloads, so about one byte in 128 needs to be escaped */
+	for (i = 0; i < NUM_FRAMES; i++) {
+		bench->frame_len[i] = g_rand_int_range(rand, 40, MAX_FRAME);
+		bench->frames[i] = g_malloc(bench->frame_len[i]);
+
+		for (j = 0; j < (int) bench->frame_len[i]; j++)
+			bench->frames[i][j] = g_rand_int_range(rand, 0, 256);
+
+		g_assert(ref_send(&ref, rbuf, bench->frames[i],
+						bench->frame_len[i]));
+
+		len = ring_buffer_len(rbuf);
+		g_byte_array_set_size(stream, stream->len + len);
+		ring_buffer_read(rbuf, stream->data + stream->len - len, len);
+	}
+
+	bench->stream_len = stream->len;
+	bench->stream = g_byte_array_free(stream, FALSE);
+	bench->stream_fcs = crc_ccitt_update(HDLC_INITFCS, bench->stream,
+							bench->stream_len);
+
+	ring_buffer_free(rbuf);
+	g_rand_free(rand);
+}
+
+static void bench_free(struct bench_hdlc *bench)
+{
+	int i;
+
+	for (i = 0; i < NUM_FRAMES; i++)
+		g_free(bench->frames[i]);
+
+	g_free(bench->stream);
+}
+
+static void bench_connect(struct bench_hdlc *bench)
+{
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, bench->sv) == 0);
+	fcntl(bench->sv[1], F_SETFL, O_NONBLOCK);
+
+	bench->channel = g_io_channel_unix_new(bench->sv[0]);
+	g_io_channel_set_close_on_unref(bench->channel, TRUE);
+}
+
+static void bench_disconnect(struct bench_hdlc *bench)
+{
+	g_io_channel_unref(bench->channel);
+	close(bench->sv[1]);
+}
+
+/* Writes the encoded stream to the far end until all frames got decoded */
+static void pump_stream(struct bench_hdlc *bench, unsigned int *frames)
+{
+	gsize written = 0;
+	ssize_t n;
+
+	*frames = 0;
+
+	while (*frames < NUM_FRAMES) {
+		if (written < bench->stream_len) {
+			n = write(bench->sv[1], bench->stream + written,
+					MIN(bench->stream_len - written, 8192));
+			if (n > 0)
+				written += n;
+		}
+
+		g_main_context_iteration(NULL, FALSE);
+	}
+}
+
+/* Reads what the far end has received so far */
+static void drain_some(struct bench_hdlc *bench, gsize *len, guint16 *fcs)
+{
+	unsigned char buf[8192];
+	ssize_t n;
+
+	n = read(bench->sv[1], buf, sizeof(buf));
+	if (n > 0) {
+		*fcs = crc_ccitt_update(*fcs, buf, n);
+		*len += n;
+	}
+
+	g_main_context_iteration(NULL, FALSE);
+}
+
+/* Reads the far end until a whole encoded stream has been received */
+static void drain_stream(struct bench_hdlc *bench, gsize *len, guint16 *fcs)
+{
+	while (*len < bench->stream_len)
+		drain_some(bench, len, fcs);
+}
+
+static void receive_cb(const unsigned char *data, gsize size,
+							gpointer user_data)
+{
+	struct bench_hdlc *bench = user_data;
+
+	g_assert(size == bench->frame_len[bench->received]);
+	g_assert(memcmp(data, bench->frames[bench->received], size) == 0);
+
+	bench->received += 1;
+}
+
+static void print_result(const char *what, struct bench_hdlc *bench,
+				GTimer *reference, GTimer *timer)
+{
+	double mb = (double) bench->stream_len * NUM_ROUNDS / 1000000;
+
+	g_print("%s %.1f MB/s (byte at a time %.1f MB/s)\n", what,
+			mb / g_timer_elapsed(timer, NULL),
+			mb / g_timer_elapsed(reference, NULL));
+}
+
+static void bench_decode(void)
+{
+	struct bench_hdlc bench;
+	struct ref_hdlc *ref = g_new0(struct ref_hdlc, 1);
+	GTimer *reference, *timer;
+	GAtHDLC *hdlc;
+	GAtIO *io;
+	int i;
+
+	bench_init(&bench);
+
+	bench_connect(&bench);
+	io = g_at_io_new(bench.channel);
+	g_at_io_set_fd(io, bench.sv[0]);
+	ref->decode_fcs = HDLC_INITFCS;
+	g_at_io_set_read_handler(io, ref_new_bytes, ref);
+
+	reference = g_timer_new();
+
+	for (i = 0; i < NUM_ROUNDS; i++)
+		pump_stream(&bench, &ref->frames);
+
+	g_timer_stop(reference);
+
+	g_at_io_unref(io);
+	bench_disconnect(&bench);
+
+	bench_connect(&bench);
+	hdlc = g_at_hdlc_new(bench.channel);
+	g_at_io_set_fd(g_at_hdlc_get_io(hdlc), bench.sv[0]);
+	g_at_hdlc_set_recv_accm(hdlc, 0);
+	g_at_hdlc_set_receive(hdlc, receive_cb, &bench);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		bench.received = 0;
+		pump_stream(&bench, &bench.received);
+	}
+
+	g_timer_stop(timer);
+
+	g_at_hdlc_unref(hdlc);
+	bench_disconnect(&bench);
+
+	print_result("decode", &bench, reference, timer);
+
+	g_timer_destroy(reference);
+	g_timer_destroy(timer);
+	g_free(ref);
+	bench_free(&bench);
+}
+
+static void bench_encode(void)
+{
+	struct bench_hdlc bench;
+	struct ref_hdlc *ref = g_new0(struct ref_hdlc, 1);
+	GTimer *reference, *timer;
+	GAtHDLC *hdlc;
+	gsize len;
+	guint16 fcs;
+	int i, j;
+
+	bench_init(&bench);
+
+	bench_connect(&bench);
+	ref->io = g_at_io_new(bench.channel);
+	g_at_io_set_fd(ref->io, bench.sv[0]);
+	ref->write_buffer = ring_buffer_new(BUFFER_SIZE * 16);
+	ref->xmit_accm[3] = 0x60000000;
+
+	reference = g_timer_new();
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		len = 0;
+		fcs = HDLC_INITFCS;
+		ref->wakeup_sent = FALSE;
+
+		for (j = 0; j < NUM_FRAMES; j++) {
+			while (ref_send(ref, ref->write_buffer,
+						bench.frames[j],
+						bench.frame_len[j]) == FALSE)
+				drain_some(&bench, &len, &fcs);
+
+			g_at_io_set_write_handler(ref->io, ref_can_write, ref);
+		}
+
+		drain_stream(&bench, &len, &fcs);
+		g_assert(fcs == bench.stream_fcs);
+	}
+
+	g_timer_stop(reference);
+
+	g_at_io_unref(ref->io);
+	ring_buffer_free(ref->write_buffer);
+	bench_disconnect(&bench);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		/* A new GAtHDLC sends the leading flag again */
+		bench_connect(&bench);
+		hdlc = g_at_hdlc_new(bench.channel);
+		g_at_io_set_fd(g_at_hdlc_get_io(hdlc), bench.sv[0]);
+		g_at_hdlc_set_xmit_accm(hdlc, 0);
+
+		len = 0;
+		fcs = HDLC_INITFCS;
+
+		for (j = 0; j < NUM_FRAMES; j++)
+			while (g_at_hdlc_send(hdlc, bench.frames[j],
+						bench.frame_len[j]) == FALSE)
+				drain_some(&bench, &len, &fcs);
+
+		drain_stream(&bench, &len, &fcs);
+		g_assert(fcs == bench.stream_fcs);
+
+		g_at_hdlc_unref(hdlc);
+		bench_disconnect(&bench);
+	}
+
+	g_timer_stop(timer);
+
+	print_result("encode", &bench, reference, timer);
+
+	g_timer_destroy(reference);
+	g_timer_destroy(timer);
+	g_free(ref);
+	bench_free(&bench);
+}
+
+static void bench_crc(void)
+{
+	unsigned char buf[MAX_FRAME];
+	GTimer *reference, *timer;
+	guint16 fcs = HDLC_INITFCS;
+	guint16 check = HDLC_INITFCS;
+	double mb = (double) sizeof(buf) * NUM_FRAMES * NUM_ROUNDS / 1000000;
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7;
+
+	reference = g_timer_new();
+
+	for (i = 0; i < NUM_FRAMES * NUM_ROUNDS; i++)
+		for (j = 0; j < sizeof(buf); j++)
+			fcs = crc_ccitt_byte(fcs, buf[j]);
+
+	g_timer_stop(reference);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < NUM_FRAMES * NUM_ROUNDS; i++)
+		check = crc_ccitt_update(check, buf, sizeof(buf));
+
+	g_timer_stop(timer);
+
+	g_assert(fcs == check);
+
+	g_print("crc %.1f MB/s (byte at a time %.1f MB/s)\n",
+			mb / g_timer_elapsed(timer, NULL),
+			mb / g_timer_elapsed(reference, NULL));
+
+	g_timer_destroy(reference);
+	g_timer_destroy(timer);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/benchhdlc/crc", bench_crc);
+	g_test_add_func("/benchhdlc/decode", bench_decode);
+	g_test_add_func("/benchhdlc/encode", bench_encode);
+
+	return g_test_run();
+}
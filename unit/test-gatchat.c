@@ -0,0 +1,572 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "ringbuffer.h"
+#include "gatio.h"
+#include "gatchat.h"
+
+static const char *cpin_prefix[] = { "+CPIN:", NULL };
+static const char *csq_prefix[] = { "+CSQ:", NULL };
+static const char *cops_prefix[] = { "+COPS:", NULL };
+static const char *none_prefix[] = { NULL };
+
+struct chat_test {
+	GAtChat *chat;
+	int modem;
+};
+
+struct cmd_result {
+	int calls;
+	gboolean ok;
+	char *line;
+};
+
+static void chat_test_init(struct chat_test *test, guint concat_length)
+{
+	GIOChannel *io;
+	GAtSyntax *syntax;
+	int sv[2];
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	test->modem = sv[1];
+	fcntl(test->modem, F_SETFL, O_NONBLOCK);
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	syntax = g_at_syntax_new_gsm_permissive();
+	test->chat = g_at_chat_new(io, syntax);
+	g_at_syntax_unref(syntax);
+	g_io_channel_unref(io);
+
+	g_assert(test->chat);
+	g_assert(g_at_chat_set_concat_length(test->chat, concat_length));
+}
+
+static void chat_test_cleanup(struct chat_test *test)
+{
+	g_at_chat_unref(test->chat);
+	close(test->modem);
+}
+
+static void chat_test_iterate(void)
+{
+	int i;
+
+	for (i = 0; i < 20; i++)
+		g_main_context_iteration(NULL, FALSE);
+}
+
+/* Checks that exactly the given command line was written to the modem */
+static void modem_expect(struct chat_test *test, const char *expected)
+{
+	size_t len = strlen(expected);
+	char buf[256];
+	size_t got = 0;
+	int i;
+
+	for (i = 0; i < 1000 && got < len; i++) {
+		ssize_t r;
+
+		g_main_context_iteration(NULL, FALSE);
+
+		r = read(test->modem, buf + got, len - got);
+		if (r > 0)
+			got += r;
+	}
+
+	buf[got] = '\0';
+	g_assert_cmpstr(buf, ==, expected);
+
+	chat_test_iterate();
+	g_assert(read(test->modem, buf, sizeof(buf)) < 0);
+}
+
+static void modem_reply(struct chat_test *test, const char *reply)
+{
+	g_assert(write(test->modem, reply, strlen(reply)) ==
+						(ssize_t) strlen(reply));
+	chat_test_iterate();
+}
+
+static void cmd_result_cb(gboolean ok, GAtResult *result, gpointer user_data)
+{
+	struct cmd_result *res = user_data;
+
+	res->calls += 1;
+	res->ok = ok;
+	g_free(res->line);
+	res->line = result->lines ? g_strdup(result->lines->data) : NULL;
+}
+
+static void cmd_result_check(struct cmd_result *res, gboolean ok,
+				const char *line)
+{
+	g_assert(res->calls == 1);
+	g_assert(res->ok == ok);
+	g_assert_cmpstr(res->line, ==, line);
+
+	g_free(res->line);
+	memset(res, 0, sizeof(*res));
+}
+
+static void send_queries(struct chat_test *test, struct cmd_result *res)
+{
+	g_assert(g_at_chat_send(test->chat, "AT+CPIN?", cpin_prefix,
+					cmd_result_cb, &res[0], NULL));
+	g_assert(g_at_chat_send(test->chat, "AT+CSQ=?", csq_prefix,
+					cmd_result_cb, &res[1], NULL));
+	g_assert(g_at_chat_send(test->chat, "AT+COPS?", cops_prefix,
+					cmd_result_cb, &res[2], NULL));
+}
+
+static void test_concat_length(void)
+{
+	struct chat_test test;
+	struct cmd_result res[4];
+
+	memset(res, 0, sizeof(res));
+	chat_test_init(&test, 20);
+
+	send_queries(&test, res);
+
+	/* Set commands are never concatenated */
+	g_assert(g_at_chat_send(test.chat, "AT+CMEE=1", none_prefix,
+					cmd_result_cb, &res[3], NULL));
+
+	/* The third query does not fit in 20 characters */
+	modem_expect(&test, "AT+CPIN?;+CSQ=?\r");
+	modem_reply(&test, "\r\n+CPIN: READY\r\n\r\n+CSQ: (0-31),(99)\r\n"
+				"\r\nOK\r\n");
+
+	cmd_result_check(&res[0], TRUE, "+CPIN: READY");
+	cmd_result_check(&res[1], TRUE, "+CSQ: (0-31),(99)");
+	g_assert(res[2].calls == 0);
+
+	modem_expect(&test, "AT+COPS?\r");
+	modem_reply(&test, "\r\n+COPS: 0\r\n\r\nOK\r\n");
+	cmd_result_check(&res[2], TRUE, "+COPS: 0");
+
+	modem_expect(&test, "AT+CMEE=1\r");
+	modem_reply(&test, "\r\nOK\r\n");
+	cmd_result_check(&res[3], TRUE, NULL);
+
+	chat_test_cleanup(&test);
+}
+
+static void test_concat_split(void)
+{
+	struct chat_test test;
+	struct cmd_result res[3];
+
+	memset(res, 0, sizeof(res));
+	chat_test_init(&test, 40);
+
+	send_queries(&test, res);
+
+	modem_expect(&test, "AT+CPIN?;+CSQ=?;+COPS?\r");
+
+	/* +CSQ=? had started responding, so +CPIN? must have completed */
+	modem_reply(&test, "\r\n+CPIN: READY\r\n\r\n+CSQ: (0-31),(99)\r\n"
+				"\r\nERROR\r\n");
+
+	cmd_result_check(&res[0], TRUE, "+CPIN: READY");
+	g_assert(res[1].calls == 0);
+	g_assert(res[2].calls == 0);
+
+	/* The rest is sent again, one at a time */
+	modem_expect(&test, "AT+CSQ=?\r");
+	modem_reply(&test, "\r\nERROR\r\n");
+	cmd_result_check(&res[1], FALSE, NULL);
+
+	modem_expect(&test, "AT+COPS?\r");
+	modem_reply(&test, "\r\n+COPS: 0\r\n\r\nOK\r\n");
+	cmd_result_check(&res[2], TRUE, "+COPS: 0");
+
+	chat_test_cleanup(&test);
+}
+
+static void test_concat_fallback(void)
+{
+	struct chat_test test;
+	struct cmd_result res[3];
+
+	memset(res, 0, sizeof(res));
+	chat_test_init(&test, 40);
+
+	send_queries(&test, res);
+
+	/* The modem rejects the whole line */
+	modem_expect(&test, "AT+CPIN?;+CSQ=?;+COPS?\r");
+	modem_reply(&test, "\r\nERROR\r\n");
+
+	g_assert(res[0].calls == 0);
+	g_assert(res[1].calls == 0);
+	g_assert(res[2].calls == 0);
+
+	modem_expect(&test, "AT+CPIN?\r");
+	modem_reply(&test, "\r\n+CPIN: READY\r\n\r\nOK\r\n");
+	cmd_result_check(&res[0], TRUE, "+CPIN: READY");
+
+	modem_expect(&test, "AT+CSQ=?\r");
+	modem_reply(&test, "\r\n+CSQ: (0-31),(99)\r\n\r\nOK\r\n");
+	cmd_result_check(&res[1], TRUE, "+CSQ: (0-31),(99)");
+
+	modem_expect(&test, "AT+COPS?\r");
+	modem_reply(&test, "\r\nERROR\r\n");
+	cmd_result_check(&res[2], FALSE, NULL);
+
+	chat_test_cleanup(&test);
+}
+
+static void test_concat_shared_prefix(void)
+{
+	struct chat_test test;
+	struct cmd_result res[4];
+
+	memset(res, 0, sizeof(res));
+	chat_test_init(&test, 60);
+
+	g_assert(g_at_chat_send(test.chat, "AT+CPIN?", cpin_prefix,
+					cmd_result_cb, &res[0], NULL));
+	g_assert(g_at_chat_send(test.chat, "AT+COPS?", cops_prefix,
+					cmd_result_cb, &res[1], NULL));
+	g_assert(g_at_chat_send(test.chat, "AT+COPS=?", cops_prefix,
+					cmd_result_cb, &res[2], NULL));
+	g_assert(g_at_chat_send(test.chat, "AT+CSQ=?", csq_prefix,
+					cmd_result_cb, &res[3], NULL));
+
+	/* Both +COPS lines would go to the first +COPS command */
+	modem_expect(&test, "AT+CPIN?;+COPS?\r");
+	modem_reply(&test, "\r\n+CPIN: READY\r\n\r\n+COPS: 0\r\n"
+				"\r\nOK\r\n");
+	cmd_result_check(&res[0], TRUE, "+CPIN: READY");
+	cmd_result_check(&res[1], TRUE, "+COPS: 0");
+
+	modem_expect(&test, "AT+COPS=?;+CSQ=?\r");
+	modem_reply(&test, "\r\n+COPS: (2,\"Op\",\"Op\",\"00101\")\r\n"
+				"\r\n+CSQ: (0-31),(99)\r\n\r\nOK\r\n");
+	cmd_result_check(&res[2], TRUE, "+COPS: (2,\"Op\",\"Op\",\"00101\")");
+	cmd_result_check(&res[3], TRUE, "+CSQ: (0-31),(99)");
+
+	chat_test_cleanup(&test);
+}
+
+struct reentrant_test {
+	GAtChat *chat;
+	int notified;
+	gboolean checked;
+};
+
+static void reentrant_notify_cb(GAtResult *result, gpointer user_data)
+{
+	struct reentrant_test *test = user_data;
+
+	test->notified += 1;
+}
+
+static void reentrant_cmd_cb(gboolean ok, GAtResult *result,
+				gpointer user_data)
+{
+	struct reentrant_test *test = user_data;
+
+	g_assert(ok);
+
+	/* Has the rest of the buffered data read from within the callback */
+	g_at_chat_suspend(test->chat);
+	g_at_chat_resume(test->chat);
+
+	g_assert(test->notified == 1);
+
+	/* The lines handed to the callback are still intact */
+	g_assert_cmpstr(result->lines->data, ==, "+CPIN: READY");
+	g_assert(result->lines->next == NULL);
+	g_assert_cmpstr(result->final_or_pdu, ==, "OK");
+
+	test->checked = TRUE;
+}
+
+static void test_reentrant_read(void)
+{
+	struct chat_test test;
+	struct reentrant_test rt;
+	char reply[1024];
+	char ring[600];
+
+	memset(&rt, 0, sizeof(rt));
+	chat_test_init(&test, 0);
+	rt.chat = test.chat;
+
+	g_assert(g_at_chat_register(test.chat, "+CRING:", reentrant_notify_cb,
+					FALSE, &rt, NULL));
+	g_assert(g_at_chat_send(test.chat, "AT+CPIN?", cpin_prefix,
+					reentrant_cmd_cb, &rt, NULL));
+
+	modem_expect(&test, "AT+CPIN?\r");
+
+	/* Long enough for the chat to need more room for the line */
+	memset(ring, 'X', sizeof(ring) - 1);
+	ring[sizeof(ring) - 1] = '\0';
+
+	snprintf(reply, sizeof(reply), "\r\n+CPIN: READY\r\n\r\nOK\r\n"
+			"\r\n+CRING: %s\r\n", ring);
+	modem_reply(&test, reply);
+
+	g_assert(rt.checked);
+	g_assert(rt.notified == 1);
+
+	chat_test_cleanup(&test);
+}
+
+struct io_test {
+	GAtIO *io;
+	int peer;
+	gboolean disconnected;
+	gsize received;
+	struct ring_buffer *out;
+	int write_calls;
+};
+
+static void io_disconnect_cb(gpointer user_data)
+{
+	struct io_test *test = user_data;
+
+	test->disconnected = TRUE;
+}
+
+static void io_read_cb(struct ring_buffer *rbuf, gpointer user_data)
+{
+	struct io_test *test = user_data;
+	int len = ring_buffer_len(rbuf);
+
+	test->received += len;
+	ring_buffer_drain(rbuf, len);
+}
+
+/* Writes until the channel is full and then gives up */
+static gboolean io_write_cb(gpointer user_data)
+{
+	struct io_test *test = user_data;
+
+	test->write_calls += 1;
+
+	while (ring_buffer_len(test->out) > 0)
+		if (g_at_io_write_ring_buffer(test->io, test->out) == 0)
+			break;
+
+	return FALSE;
+}
+
+/* With direct set the fd gets used as is, else the GIOChannel functions */
+static void io_test_init(struct io_test *test, int type, gboolean direct)
+{
+	GIOChannel *channel;
+	int sndbuf = 4096;
+	int sv[2];
+
+	memset(test, 0, sizeof(*test));
+
+	g_assert(socketpair(AF_UNIX, type, 0, sv) == 0);
+	g_assert(setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF,
+					&sndbuf, sizeof(sndbuf)) == 0);
+
+	test->peer = sv[1];
+	fcntl(test->peer, F_SETFL, O_NONBLOCK);
+
+	channel = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+
+	test->io = g_at_io_new(channel);
+	g_io_channel_unref(channel);
+
+	g_assert(test->io);
+
+	if (direct)
+		g_assert(g_at_io_set_fd(test->io, sv[0]));
+
+	g_at_io_set_disconnect_function(test->io, io_disconnect_cb, test);
+	g_at_io_set_read_handler(test->io, io_read_cb, test);
+}
+
+static void io_test_cleanup(struct io_test *test)
+{
+	g_at_io_unref(test->io);
+	close(test->peer);
+}
+
+/* Reads everything the peer has pending, checking the byte pattern */
+static gsize io_test_drain_peer(struct io_test *test, gsize offset)
+{
+	unsigned char buf[4096];
+	gsize total = 0;
+	ssize_t r;
+	ssize_t i;
+
+	while ((r = read(test->peer, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < r; i++)
+			g_assert(buf[i] == ((offset + total + i) & 0xff));
+
+		total += r;
+	}
+
+	g_assert(r < 0 && errno == EAGAIN);
+
+	return total;
+}
+
+static void io_write_blocked(gboolean direct)
+{
+	struct io_test test;
+	char chunk[4096 + 256];
+	unsigned char pattern[65536];
+	gsize filled = 0;
+	gsize written;
+	gsize total;
+	int i;
+
+	io_test_init(&test, SOCK_STREAM, direct);
+
+	for (i = 0; i < (int) sizeof(chunk); i++)
+		chunk[i] = i & 0xff;
+
+	/* Fill the socket until it would block */
+	for (i = 0; i < 1000; i++) {
+		written = g_at_io_write(test.io, chunk + filled % 256, 4096);
+		if (written == 0)
+			break;
+
+		filled += written;
+	}
+
+	g_assert(i < 1000);
+
+	/* A full socket is not a hangup, the channel still reads */
+	g_assert(write(test.peer, "OK", 2) == 2);
+	chat_test_iterate();
+
+	g_assert(test.disconnected == FALSE);
+	g_assert(test.received == 2);
+
+	g_assert(io_test_drain_peer(&test, 0) == filled);
+
+	/* More than the socket can take goes out partially */
+	for (i = 0; i < (int) sizeof(pattern); i++)
+		pattern[i] = i & 0xff;
+
+	test.out = ring_buffer_new(sizeof(pattern));
+	g_assert(ring_buffer_write(test.out, pattern, sizeof(pattern)) ==
+						(int) sizeof(pattern));
+
+	written = g_at_io_write_ring_buffer(test.io, test.out);
+	g_assert(written > 0 && written < sizeof(pattern));
+	g_assert(ring_buffer_len(test.out) ==
+					(int) (sizeof(pattern) - written));
+
+	/*
+	 * The write handler finds the socket full and gives up, it still
+	 * gets called again once the peer makes room
+	 */
+	g_assert(g_at_io_set_write_handler(test.io, io_write_cb, &test));
+
+	total = 0;
+
+	for (i = 0; i < 1000 && total < sizeof(pattern); i++) {
+		total += io_test_drain_peer(&test, total);
+		g_main_context_iteration(NULL, FALSE);
+	}
+
+	g_assert(total == sizeof(pattern));
+	g_assert(ring_buffer_len(test.out) == 0);
+	g_assert(test.write_calls > 1);
+	g_assert(test.disconnected == FALSE);
+
+	ring_buffer_free(test.out);
+	io_test_cleanup(&test);
+}
+
+static void test_io_write_blocked(void)
+{
+	io_write_blocked(TRUE);
+}
+
+static void test_io_write_blocked_channel(void)
+{
+	io_write_blocked(FALSE);
+}
+
+static void test_io_read_datagrams(void)
+{
+	struct io_test test;
+	char packet[1500];
+	int i;
+
+	io_test_init(&test, SOCK_SEQPACKET, TRUE);
+
+	g_at_io_set_max_read_attempts(test.io, 16);
+	g_at_io_set_min_read_space(test.io, sizeof(packet));
+
+	memset(packet, 0x45, sizeof(packet));
+
+	/* More than fits into the read buffer in one wakeup */
+	for (i = 0; i < 8; i++)
+		g_assert(write(test.peer, packet, sizeof(packet)) ==
+						(ssize_t) sizeof(packet));
+
+	chat_test_iterate();
+
+	/* None of the datagrams got truncated */
+	g_assert(test.received == 8 * sizeof(packet));
+	g_assert(test.disconnected == FALSE);
+
+	io_test_cleanup(&test);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testgatchat/concat_length", test_concat_length);
+	g_test_add_func("/testgatchat/concat_split", test_concat_split);
+	g_test_add_func("/testgatchat/concat_fallback", test_concat_fallback);
+	g_test_add_func("/testgatchat/concat_shared_prefix",
+						test_concat_shared_prefix);
+	g_test_add_func("/testgatchat/reentrant_read", test_reentrant_read);
+	g_test_add_func("/testgatchat/io_write_blocked",
+						test_io_write_blocked);
+	g_test_add_func("/testgatchat/io_write_blocked_channel",
+					test_io_write_blocked_channel);
+	g_test_add_func("/testgatchat/io_read_datagrams",
+						test_io_read_datagrams);
+
+	return g_test_run();
+}
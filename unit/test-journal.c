@@ -0,0 +1,405 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "journal.h"
+
+struct collect {
+	GString *keys;
+	time_t ts;
+};
+
+static void collect_key(const char *key, const unsigned char *data,
+			size_t len, time_t ts, void *user_data)
+{
+	struct collect *collect = user_data;
+
+	g_assert(len > 0 && data[len - 1] == '\0');
+
+	/* The data is the key it was first stored with */
+	if (strcmp(key, (const char *) data))
+		g_string_append_printf(collect->keys, "%s=%s;", key, data);
+	else
+		g_string_append_printf(collect->keys, "%s;", key);
+
+	collect->ts = ts;
+}
+
+static char *journal_keys(struct journal *journal, const char *prefix)
+{
+	struct collect collect;
+
+	collect.keys = g_string_new(NULL);
+	journal_foreach(journal, prefix, collect_key, &collect);
+
+	return g_string_free(collect.keys, FALSE);
+}
+
+static gboolean put_key(struct journal *journal, const char *key, time_t ts)
+{
+	return journal_put(journal, key, (const unsigned char *) key,
+				strlen(key) + 1, ts);
+}
+
+static off_t file_size(const char *path)
+{
+	struct stat st;
+
+	g_assert(stat(path, &st) == 0);
+
+	return st.st_size;
+}
+
+static void test_replay(void)
+{
+	char *dir = g_dir_make_tmp("journal-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "sub", "journal", NULL);
+	struct journal *journal;
+	char *keys;
+	size_t len;
+
+	journal = journal_open(path);
+	g_assert(journal);
+
+	/* The same path gives the same journal */
+	g_assert(journal_open(path) == journal);
+	journal_unref(journal);
+
+	g_assert(put_key(journal, "a/2", 10));
+	g_assert(put_key(journal, "a/10", 11));
+	g_assert(put_key(journal, "a/1", 12));
+	g_assert(put_key(journal, "b/1", 13));
+	g_assert(put_key(journal, "a/3", 14));
+	g_assert(journal_remove(journal, "a/3"));
+	g_assert(journal_remove(journal, "a/4"));
+
+	keys = journal_keys(journal, "a/");
+	g_assert_cmpstr(keys, ==, "a/1;a/2;a/10;");
+	g_free(keys);
+
+	g_assert(journal_get(journal, "a/3", NULL) == NULL);
+	g_assert(journal_get(journal, "a/", NULL) == NULL);
+	g_assert_cmpstr((const char *) journal_get(journal, "a/10", &len),
+			==, "a/10");
+	g_assert_cmpint(len, ==, 5);
+
+	journal_unref(journal);
+
+	journal = journal_open(path);
+	g_assert(journal);
+
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "a/1;a/2;a/10;b/1;");
+	g_free(keys);
+
+	journal_move_prefix(journal, "a/", "c/");
+	journal_remove_prefix(journal, "b/");
+	journal_unref(journal);
+
+	journal = journal_open(path);
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "c/1=a/1;c/2=a/2;c/10=a/10;");
+	g_free(keys);
+	journal_unref(journal);
+
+	g_assert(g_unlink(path) == 0);
+	g_free(path);
+
+	path = g_build_filename(dir, "sub", NULL);
+	g_assert(g_rmdir(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+static void test_torn_write(void)
+{
+	char *dir = g_dir_make_tmp("journal-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "journal", NULL);
+	struct journal *journal;
+	off_t size;
+	char *keys;
+	FILE *f;
+
+	journal = journal_open(path);
+	g_assert(put_key(journal, "one", 1));
+	size = file_size(path);
+	g_assert(put_key(journal, "two", 2));
+	journal_unref(journal);
+
+	/* Cut the last entry short */
+	g_assert(truncate(path, file_size(path) - 3) == 0);
+
+	journal = journal_open(path);
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "one;");
+	g_free(keys);
+	g_assert(file_size(path) == size);
+
+	g_assert(put_key(journal, "three", 3));
+	journal_unref(journal);
+
+	/* Flip a bit in the last entry */
+	f = fopen(path, "r+");
+	g_assert(f);
+	fseek(f, -2, SEEK_END);
+	fputc('X', f);
+	fclose(f);
+
+	journal = journal_open(path);
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "one;");
+	g_free(keys);
+	g_assert(file_size(path) == size);
+	journal_unref(journal);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+/* Makes writes stop short once the file reaches limit bytes */
+static void limit_file_size(rlim_t limit, struct rlimit *old)
+{
+	struct rlimit rl;
+
+	g_assert(getrlimit(RLIMIT_FSIZE, old) == 0);
+
+	rl.rlim_cur = limit;
+	rl.rlim_max = old->rlim_max;
+	g_assert(setrlimit(RLIMIT_FSIZE, &rl) == 0);
+}
+
+static void test_short_write(void)
+{
+	char *dir = g_dir_make_tmp("journal-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "journal", NULL);
+	struct journal *journal;
+	struct rlimit old;
+	off_t size;
+	char *keys;
+
+	signal(SIGXFSZ, SIG_IGN);
+
+	journal = journal_open(path);
+	g_assert(put_key(journal, "one", 1));
+	size = file_size(path);
+
+	/* Only part of the entry makes it to the file */
+	limit_file_size(size + 5, &old);
+	g_assert(!put_key(journal, "two", 2));
+	g_assert(setrlimit(RLIMIT_FSIZE, &old) == 0);
+
+	g_assert(file_size(path) == size);
+
+	/* The same within a batch */
+	journal_begin(journal);
+	g_assert(put_key(journal, "three", 3));
+	limit_file_size(size + 5, &old);
+	g_assert(!journal_commit(journal));
+	g_assert(setrlimit(RLIMIT_FSIZE, &old) == 0);
+
+	g_assert(file_size(path) == size);
+
+	/* Later entries still follow the last complete one */
+	g_assert(put_key(journal, "four", 4));
+	g_assert(journal_remove(journal, "one"));
+	journal_unref(journal);
+
+	journal = journal_open(path);
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "four;");
+	g_free(keys);
+	journal_unref(journal);
+
+	signal(SIGXFSZ, SIG_DFL);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+static void test_compact(void)
+{
+	char *dir = g_dir_make_tmp("journal-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "journal", NULL);
+	struct journal *journal;
+	off_t max_size = 0;
+	char key[32];
+	char *keys;
+	int i;
+
+	journal = journal_open(path);
+
+	/* Keep rewriting the same few keys, the file must not keep growing */
+	for (i = 0; i < 10000; i++) {
+		sprintf(key, "key/%d", i % 4);
+		g_assert(put_key(journal, key, i));
+
+		if (file_size(path) > max_size)
+			max_size = file_size(path);
+	}
+
+	g_assert(max_size < 64 * 1024);
+
+	journal_unref(journal);
+
+	journal = journal_open(path);
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "key/0;key/1;key/2;key/3;");
+	g_free(keys);
+
+	g_assert(journal_compact(journal));
+	g_assert(file_size(path) < 256);
+
+	journal_unref(journal);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+static void test_batch(void)
+{
+	char *dir = g_dir_make_tmp("journal-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "journal", NULL);
+	struct journal *journal;
+	off_t size;
+	char *keys;
+
+	journal = journal_open(path);
+	g_assert(put_key(journal, "a", 1));
+	size = file_size(path);
+
+	journal_begin(journal);
+	g_assert(put_key(journal, "b", 2));
+
+	journal_begin(journal);
+	g_assert(put_key(journal, "c", 3));
+	g_assert(journal_remove(journal, "a"));
+	g_assert(journal_commit(journal));
+
+	/* Nothing hits the file before the outermost commit */
+	g_assert(file_size(path) == size);
+
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "b;c;");
+	g_free(keys);
+
+	g_assert(journal_commit(journal));
+	g_assert(file_size(path) > size);
+
+	journal_unref(journal);
+
+	journal = journal_open(path);
+	keys = journal_keys(journal, NULL);
+	g_assert_cmpstr(keys, ==, "b;c;");
+	g_free(keys);
+	journal_unref(journal);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+static void write_legacy(const char *dir, const char *name,
+				const char *key, time_t mtime)
+{
+	char *path = g_build_filename(dir, name, NULL);
+	struct utimbuf times = { mtime, mtime };
+
+	/* Store the key the file is expected to be imported as */
+	g_assert(g_file_set_contents(path, key, strlen(key) + 1, NULL));
+	g_assert(g_utime(path, &times) == 0);
+
+	g_free(path);
+}
+
+static void test_import(void)
+{
+	char *dir = g_dir_make_tmp("journal-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "journal", NULL);
+	char *legacy = g_build_filename(dir, "store", NULL);
+	char *sub = g_build_filename(legacy, "msg", NULL);
+	struct journal *journal;
+	struct collect collect;
+
+	g_assert(g_mkdir_with_parents(sub, 0700) == 0);
+
+	write_legacy(legacy, "top", "store/top", 1000);
+	write_legacy(sub, "001", "store/msg/001", 2000);
+	write_legacy(sub, "002.ABCDEF.tmp", "store/msg/002", 3000);
+
+	journal = journal_open(path);
+	g_assert(journal_import_dir(journal, legacy, "store") == 2);
+
+	/* Everything got moved, the temporary file is dropped */
+	g_assert(!g_file_test(legacy, G_FILE_TEST_EXISTS));
+
+	journal_unref(journal);
+
+	journal = journal_open(path);
+
+	collect.keys = g_string_new(NULL);
+	journal_foreach(journal, "store/msg/", collect_key, &collect);
+	g_assert_cmpstr(collect.keys->str, ==, "store/msg/001;");
+	g_assert(collect.ts == 2000);
+	g_string_free(collect.keys, TRUE);
+
+	journal_unref(journal);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(sub);
+	g_free(legacy);
+	g_free(path);
+	g_free(dir);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testjournal/replay", test_replay);
+	g_test_add_func("/testjournal/torn_write", test_torn_write);
+	g_test_add_func("/testjournal/short_write", test_short_write);
+	g_test_add_func("/testjournal/compact", test_compact);
+	g_test_add_func("/testjournal/batch", test_batch);
+	g_test_add_func("/testjournal/import", test_import);
+
+	return g_test_run();
+}
@@ -24,6 +24,7 @@
 #endif
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -36,6 +37,7 @@
 #include <glib/gprintf.h>
 
 #include "gatmux.h"
+#include "gatutil.h"
 #include "gsm0710.h"
 
 static int do_connect(const char *address, unsigned short port)
@@ -556,6 +558,304 @@ static void test_extract_advanced(void)
 	g_assert(total == sizeof(advanced_input2) - 1);
 }
 
+#define SCHED_WARMUP 64
+#define SCHED_TIMEOUT 1000
+
+static const char sched_command[] = "AT+CGMI\r";
+
+struct sched_test {
+	int modem;
+	GByteArray *rx;
+	gboolean queued;
+	gboolean received;
+	gsize data_total;
+	gsize data_ahead;
+};
+
+static gboolean sched_data_writer(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	guint8 buf[512];
+	gsize written;
+
+	memset(buf, 0x55, sizeof(buf));
+
+	/* Keep the data DLC saturated, fill up whatever room it has */
+	do {
+		written = 0;
+		g_io_channel_write_chars(channel, (gchar *) buf, sizeof(buf),
+						&written, NULL);
+	} while (written == sizeof(buf));
+
+	return TRUE;
+}
+
+static void sched_modem_read(struct sched_test *test)
+{
+	guint8 buf[4096];
+	ssize_t n;
+	int pos = 0;
+
+	while ((n = read(test->modem, buf, sizeof(buf))) > 0)
+		g_byte_array_append(test->rx, buf, n);
+
+	while (TRUE) {
+		guint8 dlc;
+		guint8 ctrl;
+		guint8 *frame = NULL;
+		int frame_size;
+		int nread;
+
+		nread = gsm0710_basic_extract_frame(test->rx->data + pos,
+							test->rx->len - pos,
+							&dlc, &ctrl,
+							&frame, &frame_size);
+		pos += nread;
+
+		if (frame == NULL) {
+			if (nread > 0)
+				continue;
+
+			break;
+		}
+
+		if (ctrl != GSM0710_DATA)
+			continue;
+
+		if (dlc == 2) {
+			test->data_total += frame_size;
+
+			if (test->queued && !test->received)
+				test->data_ahead += frame_size;
+		} else if (dlc == 1) {
+			g_assert(frame_size == sizeof(sched_command) - 1);
+			g_assert(memcmp(frame, sched_command, frame_size) == 0);
+			test->received = TRUE;
+		}
+	}
+
+	g_byte_array_remove_range(test->rx, 0, pos);
+}
+
+/*
+ * Saturates DLC 2 and measures how much of its data the modem receives
+ * between an AT command being written to DLC 1 and the command itself
+ */
+static gsize sched_data_ahead(GAtMuxScheduler scheduler, guint data_weight)
+{
+	struct sched_test test;
+	GIOChannel *io;
+	GIOChannel *control;
+	GIOChannel *data;
+	GAtMux *m;
+	gsize written;
+	int sv[2];
+	int i;
+
+	memset(&test, 0, sizeof(test));
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	test.modem = sv[1];
+	test.rx = g_byte_array_new();
+	fcntl(test.modem, F_SETFL, O_NONBLOCK);
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_at_util_setup_io(io, 0);
+
+	m = g_at_mux_new_gsm0710_basic(io, 31);
+	g_io_channel_unref(io);
+
+	g_assert(g_at_mux_set_scheduler(m, scheduler));
+	g_assert(g_at_mux_start(m));
+
+	control = g_at_mux_create_channel(m);
+	data = g_at_mux_create_channel(m);
+	g_at_util_setup_io(control, 0);
+	g_at_util_setup_io(data, 0);
+
+	g_assert(g_at_mux_set_channel_control(m, control, TRUE));
+	g_assert(g_at_mux_set_channel_weight(m, data, data_weight));
+
+	g_io_add_watch(data, G_IO_OUT, sched_data_writer, NULL);
+
+	for (i = 0; i < SCHED_WARMUP; i++) {
+		g_main_context_iteration(NULL, FALSE);
+		sched_modem_read(&test);
+	}
+
+	g_assert(test.data_total > 0);
+
+	g_io_channel_write_chars(control, sched_command,
+					sizeof(sched_command) - 1,
+					&written, NULL);
+	g_assert(written == sizeof(sched_command) - 1);
+	test.queued = TRUE;
+
+	for (i = 0; i < SCHED_TIMEOUT && !test.received; i++) {
+		g_main_context_iteration(NULL, FALSE);
+		sched_modem_read(&test);
+	}
+
+	g_assert(test.received);
+
+	g_io_channel_unref(control);
+	g_io_channel_unref(data);
+	g_at_mux_unref(m);
+
+	g_byte_array_free(test.rx, TRUE);
+	close(test.modem);
+
+	return test.data_ahead;
+}
+
+static void test_scheduler_priority(void)
+{
+	gsize ahead = sched_data_ahead(G_AT_MUX_SCHEDULER_PRIORITY, 1);
+
+	g_print("data ahead of command: %zu bytes\n", ahead);
+
+	/* The control DLC always goes first */
+	g_assert(ahead == 0);
+}
+
+static void test_scheduler_round_robin(void)
+{
+	gsize ahead = sched_data_ahead(G_AT_MUX_SCHEDULER_ROUND_ROBIN, 3);
+
+	g_print("data ahead of command: %zu bytes\n", ahead);
+
+	/* At most one round worth of the data DLC, 128 bytes per weight */
+	g_assert(ahead <= 3 * 128);
+}
+
+#define RECV_FRAMES 2000
+#define RECV_CHUNK 333
+
+struct recv_test {
+	GByteArray *received[2];
+	GByteArray *expected[2];
+};
+
+static gboolean recv_reader(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	GByteArray *received = user_data;
+	char buf[512];
+	gsize bytes_read;
+
+	while (g_io_channel_read_chars(channel, buf, sizeof(buf),
+				&bytes_read, NULL) == G_IO_STATUS_NORMAL)
+		g_byte_array_append(received, (guint8 *) buf, bytes_read);
+
+	return TRUE;
+}
+
+/*
+ * Feeds a long stream of frames of varying size for two DLCs through the
+ * mux in odd sized chunks, so frames end up wrapping around the receive
+ * buffer, and checks both DLCs get their data back in order
+ */
+static void receive_stream(gboolean advanced)
+{
+	struct recv_test test;
+	GByteArray *wire = g_byte_array_new();
+	GIOChannel *io;
+	GIOChannel *dlcs[2];
+	GAtMux *m;
+	int frame_size = advanced ? 64 : 31;
+	guint8 payload[64];
+	guint8 frame[64 * 2 + 7];
+	gsize sent = 0;
+	int sv[2];
+	int i, j;
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_at_util_setup_io(io, 0);
+
+	if (advanced)
+		m = g_at_mux_new_gsm0710_advanced(io, frame_size);
+	else
+		m = g_at_mux_new_gsm0710_basic(io, frame_size);
+
+	g_io_channel_unref(io);
+
+	g_assert(g_at_mux_start(m));
+
+	for (i = 0; i < 2; i++) {
+		test.received[i] = g_byte_array_new();
+		test.expected[i] = g_byte_array_new();
+
+		dlcs[i] = g_at_mux_create_channel(m);
+		g_at_util_setup_io(dlcs[i], 0);
+		g_io_add_watch(dlcs[i], G_IO_IN, recv_reader,
+						test.received[i]);
+	}
+
+	for (i = 0; i < RECV_FRAMES; i++) {
+		int dlc = i % 3 == 0 ? 2 : 1;
+		int len = 1 + (i * 7) % frame_size;
+		int n;
+
+		for (j = 0; j < len; j++)
+			payload[j] = i + j;
+
+		g_byte_array_append(test.expected[dlc - 1], payload, len);
+
+		if (advanced)
+			n = gsm0710_advanced_fill_frame(frame, dlc,
+						GSM0710_DATA, payload, len);
+		else
+			n = gsm0710_basic_fill_frame(frame, dlc,
+						GSM0710_DATA, payload, len);
+
+		g_byte_array_append(wire, frame, n);
+	}
+
+	for (i = 0; i < 100000; i++) {
+		if (sent < wire->len) {
+			ssize_t n = write(sv[1], wire->data + sent,
+					MIN(wire->len - sent, RECV_CHUNK));
+
+			if (n > 0)
+				sent += n;
+		}
+
+		g_main_context_iteration(NULL, FALSE);
+
+		if (test.received[0]->len == test.expected[0]->len &&
+			test.received[1]->len == test.expected[1]->len)
+			break;
+	}
+
+	for (i = 0; i < 2; i++) {
+		g_assert(test.received[i]->len == test.expected[i]->len);
+		g_assert(memcmp(test.received[i]->data,
+					test.expected[i]->data,
+					test.expected[i]->len) == 0);
+
+		g_io_channel_unref(dlcs[i]);
+		g_byte_array_free(test.received[i], TRUE);
+		g_byte_array_free(test.expected[i], TRUE);
+	}
+
+	g_at_mux_unref(m);
+	g_byte_array_free(wire, TRUE);
+	close(sv[1]);
+}
+
+static void test_receive_basic(void)
+{
+	receive_stream(FALSE);
+}
+
+static void test_receive_advanced(void)
+{
+	receive_stream(TRUE);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
@@ -564,6 +864,12 @@ int main(int argc, char **argv)
 	g_test_add_func("/testmux/fill_advanced", test_fill_advanced);
 	g_test_add_func("/testmux/extract_basic", test_extract_basic);
 	g_test_add_func("/testmux/extract_advanced", test_extract_advanced);
+	g_test_add_func("/testmux/receive_basic", test_receive_basic);
+	g_test_add_func("/testmux/receive_advanced", test_receive_advanced);
+	g_test_add_func("/testmux/scheduler_priority",
+						test_scheduler_priority);
+	g_test_add_func("/testmux/scheduler_round_robin",
+						test_scheduler_round_robin);
 	g_test_add_func("/testmux/basic", test_basic);
 
 	return g_test_run();
@@ -0,0 +1,215 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "simcache.h"
+
+static off_t file_size(const char *path)
+{
+	struct stat st;
+
+	g_assert(stat(path, &st) == 0);
+
+	return st.st_size;
+}
+
+/* The file must not be sparse, see sim_cache_map() */
+static void check_allocated(const char *path)
+{
+	struct stat st;
+
+	g_assert(stat(path, &st) == 0);
+	g_assert((off_t) st.st_blocks * 512 >= st.st_size);
+}
+
+static void put_ef(struct sim_cache *cache, int id, size_t len)
+{
+	unsigned char *data = sim_cache_alloc(cache, id, len);
+	size_t i;
+
+	g_assert(data);
+
+	for (i = 0; i < len; i++)
+		g_assert(data[i] == 0);
+
+	for (i = 0; i < len; i++)
+		data[i] = (id + i) & 0xff;
+}
+
+static void check_ef(struct sim_cache *cache, int id, size_t len)
+{
+	const unsigned char *data;
+	size_t data_len;
+	size_t i;
+
+	data = sim_cache_lookup(cache, id, &data_len);
+	g_assert(data);
+	g_assert(data_len == len);
+
+	for (i = 0; i < len; i++)
+		g_assert(data[i] == ((id + i) & 0xff));
+}
+
+static void test_persist(void)
+{
+	char *dir = g_dir_make_tmp("simcache-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "sub", "efcache", NULL);
+	struct sim_cache *cache;
+
+	cache = sim_cache_open(path);
+	g_assert(cache);
+
+	/* The same path gives the same cache */
+	g_assert(sim_cache_open(path) == cache);
+	sim_cache_unref(cache);
+
+	put_ef(cache, 0x6f07, 9);
+	put_ef(cache, 0x6fc5, 300);
+	put_ef(cache, 0x6f46, 17);
+	sim_cache_remove(cache, 0x6f46);
+	sim_cache_remove(cache, 0x6f38);
+
+	/* Replacing an EF gives it fresh space */
+	put_ef(cache, 0x6f07, 12);
+
+	sim_cache_unref(cache);
+
+	cache = sim_cache_open(path);
+	g_assert(cache);
+
+	check_ef(cache, 0x6f07, 12);
+	check_ef(cache, 0x6fc5, 300);
+	g_assert(sim_cache_lookup(cache, 0x6f46, NULL) == NULL);
+
+	sim_cache_clear(cache);
+	g_assert(sim_cache_lookup(cache, 0x6f07, NULL) == NULL);
+	sim_cache_unref(cache);
+
+	cache = sim_cache_open(path);
+	g_assert(sim_cache_lookup(cache, 0x6fc5, NULL) == NULL);
+	sim_cache_unref(cache);
+
+	g_assert(g_unlink(path) == 0);
+	g_free(path);
+
+	path = g_build_filename(dir, "sub", NULL);
+	g_assert(g_rmdir(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+static void test_compact(void)
+{
+	char *dir = g_dir_make_tmp("simcache-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "efcache", NULL);
+	struct sim_cache *cache;
+	int i;
+
+	cache = sim_cache_open(path);
+
+	/* Keep replacing the same few EFs, the file must not keep growing */
+	for (i = 0; i < 10000; i++)
+		put_ef(cache, 0x6f00 + i % 4, 1000);
+
+	g_assert(file_size(path) <= 32 * 1024);
+
+	for (i = 0; i < 4; i++)
+		check_ef(cache, 0x6f00 + i, 1000);
+
+	/* Large files make it grow */
+	put_ef(cache, 0x4f30, 40000);
+	g_assert(file_size(path) >= 40000);
+	check_allocated(path);
+
+	sim_cache_remove(cache, 0x4f30);
+	g_assert(sim_cache_compact(cache));
+	g_assert(file_size(path) <= 16 * 1024);
+	check_allocated(path);
+
+	sim_cache_unref(cache);
+
+	cache = sim_cache_open(path);
+
+	for (i = 0; i < 4; i++)
+		check_ef(cache, 0x6f00 + i, 1000);
+
+	sim_cache_unref(cache);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+static void test_corrupt(void)
+{
+	char *dir = g_dir_make_tmp("simcache-XXXXXX", NULL);
+	char *path = g_build_filename(dir, "efcache", NULL);
+	struct sim_cache *cache;
+	FILE *f;
+
+	cache = sim_cache_open(path);
+	put_ef(cache, 0x6f07, 9);
+	sim_cache_unref(cache);
+
+	/* Point the used part of the file past its end */
+	f = fopen(path, "r+");
+	g_assert(f);
+	fseek(f, 4, SEEK_SET);
+	fputc(0xff, f);
+	fputc(0xff, f);
+	fputc(0xff, f);
+	fclose(f);
+
+	cache = sim_cache_open(path);
+	g_assert(cache);
+	g_assert(sim_cache_lookup(cache, 0x6f07, NULL) == NULL);
+
+	put_ef(cache, 0x6f07, 9);
+	check_ef(cache, 0x6f07, 9);
+	sim_cache_unref(cache);
+
+	g_assert(g_unlink(path) == 0);
+	g_assert(g_rmdir(dir) == 0);
+	g_free(path);
+	g_free(dir);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testsimcache/persist", test_persist);
+	g_test_add_func("/testsimcache/compact", test_compact);
+	g_test_add_func("/testsimcache/corrupt", test_corrupt);
+
+	return g_test_run();
+}
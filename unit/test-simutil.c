@@ -385,6 +385,250 @@ static void test_eons(void)
 	sim_eons_free(eons_info);
 }
 
+struct test_opl {
+	char mcc[4];
+	char mnc[4];
+	guint16 low;
+	guint16 high;
+	guint8 id;
+};
+
+static guint8 test_opl_digit(char c)
+{
+	if (c == 'b')
+		return 0xd;
+
+	if (c == '\0')
+		return 0xf;
+
+	return c - '0';
+}
+
+static void test_opl_encode(const struct test_opl *opl, guint8 *record)
+{
+	record[0] = test_opl_digit(opl->mcc[1]) << 4 |
+			test_opl_digit(opl->mcc[0]);
+	record[1] = test_opl_digit(opl->mnc[2]) << 4 |
+			test_opl_digit(opl->mcc[2]);
+	record[2] = test_opl_digit(opl->mnc[1]) << 4 |
+			test_opl_digit(opl->mnc[0]);
+	record[3] = opl->low >> 8;
+	record[4] = opl->low & 0xff;
+	record[5] = opl->high >> 8;
+	record[6] = opl->high & 0xff;
+	record[7] = opl->id;
+}
+
+/* The plain walk over EFopl in file order */
+static int test_opl_lookup(const struct test_opl *opls, int n,
+				const char *mcc, const char *mnc,
+				gboolean have_lac, guint16 lac)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		const struct test_opl *opl = &opls[i];
+
+		for (j = 0; j < OFONO_MAX_MCC_LENGTH; j++)
+			if (mcc[j] != opl->mcc[j] &&
+					!(opl->mcc[j] == 'b' && mcc[j]))
+				break;
+		if (j < OFONO_MAX_MCC_LENGTH)
+			continue;
+
+		for (j = 0; j < OFONO_MAX_MNC_LENGTH; j++)
+			if (mnc[j] != opl->mnc[j] &&
+					!(opl->mnc[j] == 'b' && mnc[j]))
+				break;
+		if (j < OFONO_MAX_MNC_LENGTH)
+			continue;
+
+		if (opl->low == 0 && opl->high == 0xfffe)
+			return opl->id;
+
+		if (have_lac && lac >= opl->low && lac <= opl->high)
+			return opl->id;
+	}
+
+	return 0;
+}
+
+static const char *const test_opl_mnc[] = {
+	"10", "15", "20", "030", "1b", "b0",
+};
+
+#define TEST_OPL_PNN 40
+
+static struct sim_eons *test_opl_build(struct test_opl *opls, int n,
+					gboolean optimize)
+{
+	struct sim_eons *eons = sim_eons_new(TEST_OPL_PNN);
+	guint8 record[8];
+	int i;
+
+	/* Record 1 under its own MCC locates the PNN table */
+	memset(&opls[0], 0, sizeof(opls[0]));
+	strcpy(opls[0].mcc, "999");
+	strcpy(opls[0].mnc, "99");
+	opls[0].high = 0xfffe;
+	opls[0].id = 1;
+
+	for (i = 1; i < n; i++) {
+		struct test_opl *opl = &opls[i];
+		guint16 a = g_random_int_range(0, 0x10000);
+		guint16 b = g_random_int_range(0, 0x10000);
+
+		strcpy(opl->mcc, i % 17 ? "234" : "23b");
+		strcpy(opl->mnc, test_opl_mnc[g_random_int_range(0,
+						G_N_ELEMENTS(test_opl_mnc))]);
+
+		switch (g_random_int_range(0, 8)) {
+		case 0:
+			opl->low = 0;
+			opl->high = 0xfffe;
+			break;
+		case 1:
+			/* Inverted ranges never match */
+			opl->low = MAX(a, b);
+			opl->high = MIN(a, b);
+			break;
+		case 2:
+			opl->low = a;
+			opl->high = a;
+			break;
+		default:
+			opl->low = MIN(a, b);
+			opl->high = MAX(a, b);
+			break;
+		}
+
+		opl->id = g_random_int_range(0, TEST_OPL_PNN + 1);
+	}
+
+	for (i = 0; i < n; i++) {
+		test_opl_encode(&opls[i], record);
+		sim_eons_add_opl_record(eons, record, sizeof(record));
+	}
+
+	if (optimize)
+		sim_eons_optimize(eons);
+
+	return eons;
+}
+
+static void test_eons_index(void)
+{
+	static const char *const mncs[] = {
+		"10", "15", "20", "030", "12", "30", "99", "100",
+	};
+	struct test_opl opls[300];
+	struct sim_eons *eons;
+	const struct sim_eons_operator_info *base;
+	const struct sim_eons_operator_info *info;
+	unsigned int i, j;
+	int id;
+
+	g_random_set_seed(25);
+
+	eons = test_opl_build(opls, G_N_ELEMENTS(opls), TRUE);
+
+	base = sim_eons_lookup(eons, "999", "99");
+	g_assert(base);
+
+	for (i = 0; i < 20000; i++) {
+		const char *mcc = i % 13 ? "234" : "235";
+		const char *mnc = mncs[i % G_N_ELEMENTS(mncs)];
+		guint16 lac;
+
+		/* Hit the edges of the ranges as well as random spots */
+		j = g_random_int_range(1, G_N_ELEMENTS(opls));
+
+		switch (i % 4) {
+		case 0:
+			lac = opls[j].low;
+			break;
+		case 1:
+			lac = opls[j].high + 1;
+			break;
+		default:
+			lac = g_random_int_range(0, 0x10000);
+			break;
+		}
+
+		id = test_opl_lookup(opls, G_N_ELEMENTS(opls), mcc, mnc,
+					TRUE, lac);
+		info = sim_eons_lookup_with_lac(eons, mcc, mnc, lac);
+		g_assert(info == (id ? base + id - 1 : NULL));
+
+		id = test_opl_lookup(opls, G_N_ELEMENTS(opls), mcc, mnc,
+					FALSE, 0);
+		info = sim_eons_lookup(eons, mcc, mnc);
+		g_assert(info == (id ? base + id - 1 : NULL));
+	}
+
+	sim_eons_free(eons);
+}
+
+static void test_eons_index_keys(void)
+{
+	/* Pairs that read the same once the digits are strung together */
+	struct test_opl opls[] = {
+		{ "999", "99", 0, 0xfffe, 1 },
+		{ "001", "100", 0, 0xfffe, 2 },
+		{ "011", "00", 0, 0xfffe, 3 },
+		{ "010", "10", 0, 0xfffe, 4 },
+		{ "001", "010", 0, 0xfffe, 5 },
+	};
+	struct sim_eons *eons = sim_eons_new(TEST_OPL_PNN);
+	const struct sim_eons_operator_info *base;
+	guint8 record[8];
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(opls); i++) {
+		test_opl_encode(&opls[i], record);
+		sim_eons_add_opl_record(eons, record, sizeof(record));
+	}
+
+	sim_eons_optimize(eons);
+
+	base = sim_eons_lookup(eons, "999", "99");
+	g_assert(base);
+
+	for (i = 1; i < G_N_ELEMENTS(opls); i++)
+		g_assert(sim_eons_lookup(eons, opls[i].mcc, opls[i].mnc) ==
+						base + opls[i].id - 1);
+
+	sim_eons_free(eons);
+}
+
+static void test_eons_lookup_speed(void)
+{
+	struct test_opl opls[500];
+	struct sim_eons *eons;
+	gboolean optimize;
+	unsigned int i;
+	double elapsed;
+
+	for (optimize = FALSE; optimize <= TRUE; optimize++) {
+		g_random_set_seed(25);
+		eons = test_opl_build(opls, G_N_ELEMENTS(opls), optimize);
+
+		g_test_timer_start();
+
+		for (i = 0; i < 200000; i++)
+			sim_eons_lookup_with_lac(eons, "234", "030",
+							i & 0xffff);
+
+		elapsed = g_test_timer_elapsed();
+
+		g_test_message("%s EFopl: %.1f ns per lookup",
+				optimize ? "indexed" : "linear",
+				elapsed * 1e9 / 200000);
+
+		sim_eons_free(eons);
+	}
+}
+
 static void test_ef_db(void)
 {
 	struct sim_ef_info *info;
@@ -616,6 +860,13 @@ int main(int argc, char **argv)
 	g_test_add_func("/testsimutil/ber tlv encode 3G Status response",
 			test_ber_tlv_builder_3g_status);
 	g_test_add_func("/testsimutil/EONS Handling", test_eons);
+	g_test_add_func("/testsimutil/EONS index", test_eons_index);
+	g_test_add_func("/testsimutil/EONS index keys", test_eons_index_keys);
+
+	if (g_test_perf())
+		g_test_add_func("/testsimutil/EONS lookup speed",
+				test_eons_lookup_speed);
+
 	g_test_add_func("/testsimutil/Elementary File DB", test_ef_db);
 	g_test_add_func("/testsimutil/3G Status response", test_3g_status_data);
 	g_test_add_func("/testsimutil/Application entries decoding",
@@ -88,7 +88,7 @@ static void test_serialize_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -115,12 +115,78 @@ static void test_serialize_assembly(void)
 	sms_assembly_free(assembly);
 }
 
+static void test_tx_backup(void)
+{
+	const char *uuid = "00112233445566778899AABBCCDDEEFF00112233";
+	unsigned char pdus[3][176];
+	int pdu_len, tpdu_len;
+	struct txq_backup_entry *entry;
+	GQueue *queue;
+	GSList *sms_list;
+	GSList *l;
+	char text[401];
+	int i;
+
+	memset(text, 'a', sizeof(text) - 1);
+	text[sizeof(text) - 1] = '\0';
+
+	sms_list = sms_text_prepare("+1234", text, 7, FALSE, FALSE);
+
+	g_assert(g_slist_length(sms_list) == 3);
+
+	for (l = sms_list, i = 0; l; l = l->next, i++) {
+		sms_encode(l->data, &pdu_len, &tpdu_len, pdus[i]);
+		g_assert(sms_tx_backup_store("5678", 4, 1, uuid, i, pdus[i],
+						pdu_len, tpdu_len));
+	}
+
+	g_slist_free_full(sms_list, g_free);
+
+	/* The first pdu went out, the rest is to be restored */
+	sms_tx_backup_remove("5678", 4, 1, uuid, 0);
+
+	queue = sms_tx_queue_load("5678");
+	g_assert(g_queue_get_length(queue) == 1);
+
+	entry = g_queue_pop_head(queue);
+	g_assert(entry->id == 4);
+	g_assert(entry->flags == 1);
+	g_assert(entry->first_seq == 1);
+	g_assert(entry->num_pdus == 2);
+	g_queue_free(queue);
+
+	sms_list = sms_tx_backup_load("5678", 4, 1, uuid, entry->first_seq,
+					entry->num_pdus);
+	g_assert(g_slist_length(sms_list) == 2);
+
+	for (l = sms_list, i = 1; l; l = l->next, i++) {
+		unsigned char pdu[176];
+
+		sms_encode(l->data, &pdu_len, &tpdu_len, pdu);
+		g_assert(memcmp(pdu, pdus[i], pdu_len) == 0);
+	}
+
+	g_slist_free_full(sms_list, g_free);
+
+	/* A pdu missing in the middle fails the whole entry */
+	g_assert(sms_tx_backup_load("5678", 4, 1, uuid, 0, 3) == NULL);
+
+	sms_tx_backup_free("5678", 4, 1, uuid, entry->first_seq,
+				entry->num_pdus);
+	g_free(entry);
+
+	queue = sms_tx_queue_load("5678");
+	g_assert(g_queue_get_length(queue) == 0);
+	g_queue_free(queue);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/testsms/Test SMS Assembly Serialize",
 			test_serialize_assembly);
+	g_test_add_func("/testsms/Test SMS TX Backup", test_tx_backup);
 
 	return g_test_run();
 }
@@ -1100,17 +1100,17 @@ static void test_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	sms_assembly_expire(assembly, time(NULL) + 40);
 
-	g_assert(g_slist_length(assembly->assembly_list) == 0);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
 
 	sms_extract_concatenation(&sms, &ref, &max, &seq);
 	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
 					&sms.deliver.oaddr, ref, max, seq);
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -1156,6 +1156,94 @@ static void test_assembly(void)
 	g_free(reencoded);
 }
 
+static void test_assembly_many(void)
+{
+	static const guint8 order[] = { 3, 1, 4, 2 };
+	struct sms_assembly *assembly = sms_assembly_new(NULL);
+	struct sms_address addr;
+	struct sms sms;
+	GSList *l, *c;
+	int i, j, k;
+
+	memset(&addr, 0, sizeof(addr));
+	memset(&sms, 0, sizeof(sms));
+	addr.number_type = SMS_NUMBER_TYPE_INTERNATIONAL;
+	addr.numbering_plan = SMS_NUMBERING_PLAN_ISDN;
+	sms.type = SMS_TYPE_DELIVER;
+
+	/*
+	 * Interleave the fragments of 200 messages from 100 senders, each
+	 * sender uses references 0 and 1, newest messages are added first
+	 */
+	for (j = 0; j < 3; j++) {
+		for (i = 199; i >= 0; i--) {
+			sprintf(addr.address, "49123%04d", i / 2);
+			sms.deliver.ud[0] = order[j];
+
+			l = sms_assembly_add_fragment(assembly, &sms, 1000 + i,
+						&addr, i % 2, 4, order[j]);
+			g_assert(l == NULL);
+
+			/* Duplicates and a different max are dropped */
+			l = sms_assembly_add_fragment(assembly, &sms, 1000 + i,
+						&addr, i % 2, 4, order[j]);
+			g_assert(l == NULL);
+			l = sms_assembly_add_fragment(assembly, &sms, 1000 + i,
+						&addr, i % 2, 5, 5);
+			g_assert(l == NULL);
+		}
+	}
+
+	g_assert(g_hash_table_size(assembly->assembly_table) == 200);
+
+	/* Complete every fourth message */
+	for (i = 0; i < 200; i += 4) {
+		sprintf(addr.address, "49123%04d", i / 2);
+		sms.deliver.ud[0] = order[3];
+
+		l = sms_assembly_add_fragment(assembly, &sms, 1000 + i,
+						&addr, i % 2, 4, order[3]);
+		g_assert(g_slist_length(l) == 4);
+
+		for (c = l, k = 1; c; c = c->next, k++) {
+			struct sms *fragment = c->data;
+
+			g_assert(fragment->deliver.ud[0] == k);
+		}
+
+		g_slist_free_full(l, g_free);
+	}
+
+	g_assert(g_hash_table_size(assembly->assembly_table) == 150);
+
+	/* Messages with ts 1000 to 1099 expire, except the completed ones */
+	sms_assembly_expire(assembly, 1099);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 75);
+
+	sms_assembly_expire(assembly, 1099);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 75);
+
+	/* Message 101, ref 1 from 491230050, is still around */
+	sprintf(addr.address, "49123%04d", 50);
+	sms.deliver.ud[0] = order[3];
+	l = sms_assembly_add_fragment(assembly, &sms, 2000, &addr, 1, 4,
+					order[3]);
+	g_assert(g_slist_length(l) == 4);
+	g_slist_free_full(l, g_free);
+
+	/* Message 98 has expired, so this starts a new one */
+	sprintf(addr.address, "49123%04d", 49);
+	l = sms_assembly_add_fragment(assembly, &sms, 2000, &addr, 0, 4,
+					order[3]);
+	g_assert(l == NULL);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 75);
+
+	sms_assembly_expire(assembly, 2000);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+
+	sms_assembly_free(assembly);
+}
+
 static const char *test_no_fragmentation_7bit = "This is testing !";
 static const char *expected_no_fragmentation_7bit = "079153485002020911000C915"
 			"348870420140000A71154747A0E4ACF41F4F29C9E769F4121";
@@ -1372,6 +1460,71 @@ static void test_prepare_limits(void)
 	test_limit(ucs2, target_size, FALSE);
 }
 
+static void test_prepare_alphabet(void)
+{
+	GString *utf8 = g_string_new(NULL);
+	struct sms_udh_iter iter;
+	gboolean locking = FALSE;
+	gboolean single = FALSE;
+	struct sms *sms;
+	char *decoded;
+	GSList *l;
+	int i;
+
+	/*
+	 * With only the Turkish single shift table each of these takes two
+	 * septets and the text needs two messages, with the locking shift
+	 * table as well it fits in one
+	 */
+	for (i = 0; i < 100; i++)
+		g_string_append_unichar(utf8, 0x015F);
+
+	l = sms_text_prepare_with_alphabet("555", utf8->str, 0, FALSE, FALSE,
+						SMS_ALPHABET_TURKISH);
+	g_assert(l);
+	g_assert(g_slist_length(l) == 1);
+
+	sms = l->data;
+	g_assert(sms->submit.dcs == 0x00);
+	g_assert(sms_udh_iter_init(sms, &iter));
+
+	do {
+		switch (sms_udh_iter_get_ie_type(&iter)) {
+		case SMS_IEI_NATIONAL_LANGUAGE_SINGLE_SHIFT:
+			single = TRUE;
+			break;
+		case SMS_IEI_NATIONAL_LANGUAGE_LOCKING_SHIFT:
+			locking = TRUE;
+			break;
+		default:
+			break;
+		}
+	} while (sms_udh_iter_next(&iter));
+
+	g_assert(single && locking);
+
+	decoded = sms_decode_text(l);
+	g_assert(g_str_equal(decoded, utf8->str));
+
+	g_free(decoded);
+	g_slist_free_full(l, g_free);
+
+	/* Short text, the single shift table alone is enough */
+	l = sms_text_prepare_with_alphabet("555", "\xc5\x9f", 0, FALSE, FALSE,
+						SMS_ALPHABET_TURKISH);
+	g_assert(l);
+	g_assert(g_slist_length(l) == 1);
+
+	sms = l->data;
+	g_assert(sms_udh_iter_init(sms, &iter));
+	g_assert(sms_udh_iter_get_ie_type(&iter) ==
+				SMS_IEI_NATIONAL_LANGUAGE_SINGLE_SHIFT);
+	g_assert(sms_udh_iter_next(&iter) == FALSE);
+
+	g_slist_free_full(l, g_free);
+	g_string_free(utf8, TRUE);
+}
+
 static const char *cbs1 = "011000320111C2327BFC76BBCBEE46A3D168341A8D46A3D1683"
 	"41A8D46A3D168341A8D46A3D168341A8D46A3D168341A8D46A3D168341A8D46A3D168"
 	"341A8D46A3D168341A8D46A3D168341A8D46A3D168341A8D46A3D100";
@@ -1475,14 +1628,14 @@ static void test_cbs_assembly(void)
 	/* Add an initial page to the assembly */
 	l = cbs_assembly_add_page(assembly, &dec1);
 	g_assert(l);
-	g_assert(g_slist_length(assembly->recv_cell) == 1);
+	g_assert(g_hash_table_size(assembly->recv_cell) == 1);
 	g_slist_free_full(l, g_free);
 
 	/* Can we receive new updates ? */
 	dec1.update_number = 8;
 	l = cbs_assembly_add_page(assembly, &dec1);
 	g_assert(l);
-	g_assert(g_slist_length(assembly->recv_cell) == 1);
+	g_assert(g_hash_table_size(assembly->recv_cell) == 1);
 	g_slist_free_full(l, g_free);
 
 	/* Do we ignore old pages ? */
@@ -1495,7 +1648,7 @@ static void test_cbs_assembly(void)
 	g_assert(l == NULL);
 
 	cbs_assembly_location_changed(assembly, TRUE, TRUE, TRUE);
-	g_assert(assembly->recv_cell == NULL);
+	g_assert(g_hash_table_size(assembly->recv_cell) == 0);
 
 	dec1.update_number = 9;
 	dec1.page = 3;
@@ -1534,6 +1687,70 @@ static void test_cbs_assembly(void)
 	cbs_assembly_free(assembly);
 }
 
+static void test_cbs_assembly_duplicates(void)
+{
+	unsigned char *decoded_pdu;
+	unsigned char pdu[88];
+	long pdu_len;
+	struct cbs dec;
+	struct cbs_assembly *assembly;
+	GSList *l;
+	int i;
+
+	assembly = cbs_assembly_new();
+
+	decoded_pdu = decode_hex(cbs1, -1, &pdu_len, 0);
+	cbs_decode(decoded_pdu, pdu_len, &dec);
+	g_free(decoded_pdu);
+
+	dec.max_pages = 3;
+
+	for (i = 1; i <= 3; i++) {
+		dec.page = i;
+		cbs_encode(&dec, NULL, pdu);
+		g_assert(!cbs_assembly_is_duplicate(assembly, pdu, 88));
+	}
+
+	/* A page being assembled is a duplicate, the others are not */
+	dec.page = 2;
+	g_assert(cbs_assembly_add_page(assembly, &dec) == NULL);
+
+	cbs_encode(&dec, NULL, pdu);
+	g_assert(cbs_assembly_is_duplicate(assembly, pdu, 88));
+
+	dec.page = 1;
+	cbs_encode(&dec, NULL, pdu);
+	g_assert(!cbs_assembly_is_duplicate(assembly, pdu, 88));
+
+	g_assert(cbs_assembly_add_page(assembly, &dec) == NULL);
+	dec.page = 3;
+	l = cbs_assembly_add_page(assembly, &dec);
+	g_assert(g_slist_length(l) == 3);
+	g_slist_free_full(l, g_free);
+
+	/* Once received, all pages of the message are duplicates */
+	for (i = 1; i <= 3; i++) {
+		dec.page = i;
+		cbs_encode(&dec, NULL, pdu);
+		g_assert(cbs_assembly_is_duplicate(assembly, pdu, 88));
+	}
+
+	/* Unless they are a newer update */
+	dec.update_number = (dec.update_number + 1) % 16;
+	cbs_encode(&dec, NULL, pdu);
+	g_assert(!cbs_assembly_is_duplicate(assembly, pdu, 88));
+
+	dec.update_number = (dec.update_number + 15) % 16;
+	cbs_encode(&dec, NULL, pdu);
+	g_assert(cbs_assembly_is_duplicate(assembly, pdu, 88));
+
+	/* Or were received in another cell */
+	cbs_assembly_location_changed(assembly, FALSE, FALSE, TRUE);
+	g_assert(!cbs_assembly_is_duplicate(assembly, pdu, 88));
+
+	cbs_assembly_free(assembly);
+}
+
 static void test_cbs_padding_character(void)
 {
 	unsigned char *decoded_pdu;
@@ -1624,6 +1841,50 @@ static void test_range_minimizer(void)
 	}
 }
 
+static void test_topic_bitmap(void)
+{
+	struct cbs_topic_range r[] = { { 0, 0 }, { 31, 64 }, { 990, 1500 },
+					{ 40, 50 }, { 65535, 65535 } };
+	struct cbs_topic_bitmap *bitmap;
+	GSList *ranges = NULL;
+	GSList *l;
+	char *str;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(r); i++)
+		ranges = g_slist_append(ranges, &r[i]);
+
+	bitmap = cbs_topic_bitmap_new(ranges);
+
+	g_assert(cbs_topic_bitmap_test(bitmap, 0));
+	g_assert(!cbs_topic_bitmap_test(bitmap, 1));
+	g_assert(!cbs_topic_bitmap_test(bitmap, 30));
+	g_assert(cbs_topic_bitmap_test(bitmap, 31));
+	g_assert(cbs_topic_bitmap_test(bitmap, 64));
+	g_assert(!cbs_topic_bitmap_test(bitmap, 65));
+	g_assert(cbs_topic_bitmap_test(bitmap, 1500));
+	g_assert(!cbs_topic_bitmap_test(bitmap, 1501));
+	g_assert(!cbs_topic_bitmap_test(bitmap, 65534));
+	g_assert(cbs_topic_bitmap_test(bitmap, 65535));
+
+	l = cbs_topic_bitmap_to_ranges(bitmap, 65535);
+	str = cbs_topic_ranges_to_string(l);
+	g_assert_cmpstr(str, ==, "0,31-64,990-1500,65535");
+	g_free(str);
+	g_slist_free_full(l, g_free);
+
+	g_free(bitmap);
+
+	/* User topics stop at 999 */
+	l = cbs_optimize_ranges(ranges);
+	str = cbs_topic_ranges_to_string(l);
+	g_assert_cmpstr(str, ==, "0,31-64,990-999");
+	g_free(str);
+	g_slist_free_full(l, g_free);
+
+	g_slist_free(ranges);
+}
+
 static void test_sr_assembly(void)
 {
 	const char *sr_pdu1 = "06040D91945152991136F00160124130340A0160124130"
@@ -1722,6 +1983,65 @@ static void test_sr_assembly(void)
 	status_report_assembly_free(sra);
 }
 
+static void test_sr_assembly_many(void)
+{
+	struct status_report_assembly *sra;
+	unsigned char sha1[SMS_MSGID_LEN];
+	unsigned char id[SMS_MSGID_LEN];
+	struct sms_address addr;
+	gboolean delivered;
+	struct sms sr;
+	int i;
+
+	sms_address_from_string(&addr, "+4915259911630");
+
+	memset(&sr, 0, sizeof(sr));
+	sr.type = SMS_TYPE_STATUS_REPORT;
+	sr.status_report.raddr = addr;
+	sr.status_report.st = SMS_ST_COMPLETED_RECEIVED;
+
+	sra = status_report_assembly_new(NULL);
+
+	/* A single mr per message, all outstanding for the same address */
+	for (i = 0; i < 200; i++) {
+		memset(sha1, i, SMS_MSGID_LEN);
+		status_report_assembly_add_fragment(sra, sha1, &addr, i,
+							time(NULL), 1);
+	}
+
+	g_assert(g_hash_table_size(sra->mr_table) == 200);
+
+	for (i = 199; i >= 0; i--) {
+		sr.status_report.mr = i;
+
+		g_assert(status_report_assembly_report(sra, &sr, id,
+							&delivered));
+		g_assert(id[0] == i && id[SMS_MSGID_LEN - 1] == i);
+		g_assert(delivered == TRUE);
+	}
+
+	g_assert(g_hash_table_size(sra->mr_table) == 0);
+	g_assert(g_hash_table_size(sra->assembly_table) == 0);
+
+	/* A reused mr belongs to the message it was last sent for */
+	memset(sha1, 1, SMS_MSGID_LEN);
+	status_report_assembly_add_fragment(sra, sha1, &addr, 7, time(NULL), 1);
+	memset(sha1, 2, SMS_MSGID_LEN);
+	status_report_assembly_add_fragment(sra, sha1, &addr, 7, time(NULL), 1);
+
+	sr.status_report.mr = 7;
+	g_assert(status_report_assembly_report(sra, &sr, id, &delivered));
+	g_assert(id[0] == 2);
+	g_assert(!status_report_assembly_report(sra, &sr, id, &delivered));
+
+	/* The older message is left to expire */
+	status_report_assembly_expire(sra, time(NULL) + 40);
+	g_assert(g_hash_table_size(sra->mr_table) == 0);
+	g_assert(g_hash_table_size(sra->assembly_table) == 0);
+
+	status_report_assembly_free(sra);
+}
+
 struct wap_push_data {
 	const char *pdu;
 	int len;
@@ -1853,6 +2173,7 @@ int main(int argc, char **argv)
 			&ems_udh_test_2, test_ems_udh);
 
 	g_test_add_func("/testsms/Test Assembly", test_assembly);
+	g_test_add_func("/testsms/Test Assembly Many", test_assembly_many);
 	g_test_add_func("/testsms/Test Prepare 7Bit", test_prepare_7bit);
 
 	g_test_add_data_func("/testsms/Test Prepare Concat",
@@ -1871,17 +2192,24 @@ int main(int argc, char **argv)
 			&long_string_test, test_prepare_concat);
 
 	g_test_add_func("/testsms/Test Prepare Limits", test_prepare_limits);
+	g_test_add_func("/testsms/Test Prepare Alphabet",
+			test_prepare_alphabet);
 
 	g_test_add_func("/testsms/Test CBS Encode / Decode",
 			test_cbs_encode_decode);
 	g_test_add_func("/testsms/Test CBS Assembly", test_cbs_assembly);
+	g_test_add_func("/testsms/Test CBS Assembly Duplicates",
+					test_cbs_assembly_duplicates);
 
 	g_test_add_func("/testsms/Test CBS Padding Character",
 			test_cbs_padding_character);
 
 	g_test_add_func("/testsms/Range minimizer", test_range_minimizer);
+	g_test_add_func("/testsms/Topic bitmap", test_topic_bitmap);
 
 	g_test_add_func("/testsms/Status Report Assembly", test_sr_assembly);
+	g_test_add_func("/testsms/Status Report Assembly Many",
+					test_sr_assembly_many);
 
 	g_test_add_data_func("/testsms/Test WAP Push 1", &wap_push_1,
 				test_wap_push);
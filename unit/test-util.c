@@ -629,6 +629,271 @@ static void test_decode_encode(void)
 	g_free(hex_packed);
 }
 
+/*
+ * The bit at a time 7 bit packing and unpacking used before, kept here as
+ * the reference for the block based implementation
+ */
+static unsigned char *ref_unpack_7bit(const unsigned char *in, long len,
+					int byte_offset, gboolean ussd,
+					long max_to_unpack, long *items_written,
+					unsigned char terminator,
+					unsigned char *buf)
+{
+	unsigned char rest = 0;
+	unsigned char *out = buf;
+	int bits = 7 - (byte_offset % 7);
+	long i;
+
+	if (len <= 0)
+		return NULL;
+
+	/* In the case of CB, unpack as much as possible */
+	if (ussd == TRUE)
+		max_to_unpack = len * 8 / 7;
+
+	for (i = 0; (i < len) && ((out-buf) < max_to_unpack); i++) {
+		/* Grab what we have in the current octet */
+		*out = (in[i] & ((1 << bits) - 1)) << (7 - bits);
+
+		/* Append what we have from the previous octet, if any */
+		*out |= rest;
+
+		/* Figure out the remainder */
+		rest = (in[i] >> bits) & ((1 << (8-bits)) - 1);
+
+		/*
+		 * We have the entire character, here we don't increate
+		 * out if this is we started at an offset.  Instead
+		 * we effectively populate variable rest
+		 */
+		if (i != 0 || bits == 7)
+			out++;
+
+		if ((out-buf) == max_to_unpack)
+			break;
+
+		/*
+		 * We expected only 1 bit from this octet, means there's 7
+		 * left, take care of them here
+		 */
+		if (bits == 1) {
+			*out = rest;
+			out++;
+			bits = 7;
+			rest = 0;
+		} else {
+			bits = bits - 1;
+		}
+	}
+
+	/*
+	 * According to 23.038 6.1.2.3.1, last paragraph:
+	 * "If the total number of characters to be sent equals (8n-1)
+	 * where n=1,2,3 etc. then there are 7 spare bits at the end
+	 * of the message. To avoid the situation where the receiving
+	 * entity confuses 7 binary zero pad bits as the @ character,
+	 * the carriage return or <CR> character shall be used for
+	 * padding in this situation, just as for Cell Broadcast."
+	 *
+	 * "The receiving entity shall remove the final <CR> character where
+	 * the message ends on an octet boundary with <CR> as the last
+	 * character.
+	 */
+	if (ussd && (((out - buf) % 8) == 0) && (*(out - 1) == '\r'))
+		out = out - 1;
+
+	if (terminator)
+		*out = terminator;
+
+	if (items_written)
+		*items_written = out - buf;
+
+	return buf;
+}
+
+static unsigned char *ref_pack_7bit(const unsigned char *in, long len,
+					int byte_offset, gboolean ussd,
+					long *items_written,
+					unsigned char terminator,
+					unsigned char *buf)
+{
+	int bits = 7 - (byte_offset % 7);
+	unsigned char *out = buf;
+	long i;
+	long total_bits;
+
+	if (len == 0)
+		return NULL;
+
+	if (len < 0) {
+		i = 0;
+
+		while (in[i] != terminator)
+			i++;
+
+		len = i;
+	}
+
+	total_bits = len * 7;
+
+	if (bits != 7) {
+		total_bits += bits;
+		bits = bits - 1;
+		*out = 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (bits != 7) {
+			*out |= (in[i] & ((1 << (7 - bits)) - 1)) <<
+					(bits + 1);
+			out++;
+		}
+
+		/* This is a no op when bits == 0, lets keep valgrind happy */
+		if (bits != 0)
+			*out = in[i] >> (7 - bits);
+
+		if (bits == 0)
+			bits = 7;
+		else
+			bits = bits - 1;
+	}
+
+	/*
+	 * If <CR> is intended to be the last character and the message
+	 * (including the wanted <CR>) ends on an octet boundary, then
+	 * another <CR> must be added together with a padding bit 0. The
+	 * receiving entity will perform the carriage return function twice,
+	 * but this will not result in misoperation as the definition of
+	 * <CR> in clause 6.1.1 is identical to the definition of <CR><CR>.
+	 */
+	if (ussd && ((total_bits % 8) == 1))
+		*out |= '\r' << 1;
+
+	if (bits != 7)
+		out++;
+
+	if (ussd && ((total_bits % 8) == 0) && (in[len - 1] == '\r')) {
+		*out = '\r';
+		out++;
+	}
+
+	if (items_written)
+		*items_written = out - buf;
+
+	return buf;
+}
+
+static void test_7bit_blocks(void)
+{
+	GRand *rand = g_rand_new_with_seed(7);
+	unsigned char in[200];
+	unsigned char out1[240];
+	unsigned char out2[240];
+	long written1, written2;
+	int offset, ussd, round;
+	long len, max;
+	long i;
+
+	for (offset = 0; offset < 7; offset++)
+	for (ussd = 0; ussd < 2; ussd++)
+	for (len = 1; len <= 180; len++)
+	for (round = 0; round < 4; round++) {
+		/* Septets with the top bit set are packed the same way too */
+		for (i = 0; i < len; i++)
+			in[i] = g_rand_int_range(rand, 0, round & 1 ? 256 : 128);
+
+		if (round == 2 && len >= 1)
+			in[len - 1] = '\r';
+
+		memset(out1, 0xaa, sizeof(out1));
+		memset(out2, 0xaa, sizeof(out2));
+		written1 = written2 = 0;
+
+		ref_pack_7bit(in, len, offset, ussd, &written1, 0, out1);
+		pack_7bit_own_buf(in, len, offset, ussd, &written2, 0, out2);
+
+		g_assert(written1 == written2);
+		g_assert(memcmp(out1, out2, sizeof(out1)) == 0);
+	}
+
+	for (offset = 0; offset < 7; offset++)
+	for (ussd = 0; ussd < 2; ussd++)
+	for (len = 1; len <= 160; len++)
+	for (round = 0; round < 4; round++) {
+		for (i = 0; i < len; i++)
+			in[i] = g_rand_int_range(rand, 0, 256);
+
+		if (round == 0)
+			max = len * 8 / 7;
+		else
+			max = g_rand_int_range(rand, 1, len * 8 / 7 + 2);
+
+		memset(out1, 0xaa, sizeof(out1));
+		memset(out2, 0xaa, sizeof(out2));
+		written1 = written2 = 0;
+
+		ref_unpack_7bit(in, len, offset, ussd, max, &written1, 0, out1);
+		unpack_7bit_own_buf(in, len, offset, ussd, max, &written2, 0,
+					out2);
+
+		g_assert(written1 == written2);
+		g_assert(memcmp(out1, out2, sizeof(out1)) == 0);
+	}
+
+	g_rand_free(rand);
+}
+
+static void test_hex(void)
+{
+	static const char invalid[] = { 'G', 'g', ' ', '/', ':', '@', '`',
+					0x10, 0x19, (char) 0x80, (char) 0xc1 };
+	GRand *rand = g_rand_new_with_seed(0x4845);
+	unsigned char in[100], out[101];
+	char hex[201], ref[201], *lower;
+	long len, written, i;
+	int round;
+
+	for (round = 0; round < 2000; round++) {
+		len = g_rand_int_range(rand, 0, sizeof(in) + 1);
+
+		for (i = 0; i < len; i++) {
+			in[i] = g_rand_int_range(rand, 0, 256);
+			sprintf(ref + i * 2, "%02X", in[i]);
+		}
+
+		ref[len * 2] = '\0';
+
+		g_assert(encode_hex_own_buf(in, len, 0, hex) == hex);
+		g_assert(strcmp(hex, ref) == 0);
+
+		memset(out, 0, sizeof(out));
+		g_assert(decode_hex_own_buf(hex, -1, &written, 0xff, out));
+		g_assert(written == len);
+		g_assert(memcmp(in, out, len) == 0);
+		g_assert(out[len] == 0xff);
+
+		/* Lower case digits and a trailing odd digit are accepted */
+		lower = g_ascii_strdown(hex, -1);
+		g_assert(decode_hex_own_buf(lower, len * 2 + 1, &written, 0,
+						out));
+		g_assert(written == len);
+		g_assert(memcmp(in, out, len) == 0);
+		g_free(lower);
+
+		if (len == 0)
+			continue;
+
+		hex[g_rand_int_range(rand, 0, len * 2)] =
+			invalid[g_rand_int_range(rand, 0, sizeof(invalid))];
+
+		g_assert(decode_hex_own_buf(hex, len * 2, NULL, 0, out) == NULL);
+		g_assert(decode_hex(hex, len * 2, NULL, 0) == NULL);
+	}
+
+	g_rand_free(rand);
+}
+
 static void test_pack_size(void)
 {
 	unsigned char c1[] = { 'a' };
@@ -1012,6 +1277,52 @@ static void test_unicode_to_gsm(void)
 	}
 }
 
+static void test_gsm_septets(void)
+{
+	static const char turkish[] = "A\xc4\x9f" "a\xc3\xa7 \xc5\x9f" "i\xc5\x9f" "e";
+	enum gsm_dialect locking[GSM_MAX_CANDIDATES];
+	enum gsm_dialect single[GSM_MAX_CANDIDATES];
+	long septets[GSM_MAX_CANDIDATES];
+	enum gsm_dialect used_locking;
+	enum gsm_dialect used_single;
+	unsigned char *res;
+	long nwritten;
+	int n;
+
+	n = gsm_dialect_candidates(GSM_DIALECT_TURKISH, locking, single);
+	g_assert(n == 3);
+
+	/* Escaped characters take two septets */
+	g_assert(utf8_to_gsm_septets("Hello {x}", -1, locking, single,
+					n, septets) == 9);
+	g_assert(septets[0] == 11 && septets[1] == 11 && septets[2] == 11);
+
+	/* Only in the Turkish tables, single shifted or not */
+	g_assert(utf8_to_gsm_septets(turkish, -1, locking, single,
+					n, septets) == 9);
+	g_assert(septets[0] == -1 && septets[1] == 13 && septets[2] == 9);
+
+	g_assert(utf8_to_gsm_septets("\xe6\x97\xa5", -1, locking, single,
+					n, septets) == 1);
+	g_assert(septets[0] == -1 && septets[1] == -1 && septets[2] == -1);
+
+	g_assert(utf8_to_gsm_septets("\xff", -1, locking, single,
+					n, septets) == -1);
+
+	n = gsm_dialect_candidates(GSM_DIALECT_SPANISH, locking, single);
+	g_assert(n == 2);
+
+	/* The first candidate that can encode the text is picked */
+	res = convert_utf8_to_gsm_best_lang("\xc5\x9f", -1, NULL, &nwritten,
+						0, GSM_DIALECT_TURKISH,
+						&used_locking, &used_single);
+	g_assert(res);
+	g_assert(nwritten == 2);
+	g_assert(used_locking == GSM_DIALECT_DEFAULT);
+	g_assert(used_single == GSM_DIALECT_TURKISH);
+	g_free(res);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
@@ -1022,12 +1333,15 @@ int main(int argc, char **argv)
 			test_valid_turkish);
 	g_test_add_func("/testutil/Decode Encode", test_decode_encode);
 	g_test_add_func("/testutil/Pack Size", test_pack_size);
+	g_test_add_func("/testutil/7bit Blocks", test_7bit_blocks);
+	g_test_add_func("/testutil/Hex Encode Decode", test_hex);
 	g_test_add_func("/testutil/CBS CR Handling", test_cr_handling);
 	g_test_add_func("/testutil/SMS Handling", test_sms_handling);
 	g_test_add_func("/testutil/Offset Handling", test_offset_handling);
 	g_test_add_func("/testutil/SIM conversions", test_sim);
 	g_test_add_func("/testutil/Valid Unicode to GSM Conversion",
 			test_unicode_to_gsm);
+	g_test_add_func("/testutil/GSM Septet Count", test_gsm_septets);
 
 	return g_test_run();
 }